@@ -82,6 +82,8 @@ public enum DebugEventType {
   EVT_STORAGE_FULL(0x0E000000L),
   /// <summary>Storage failed.</summary>
   EVT_STORAGE_FAILED(0x0E000001L),
+  /// <summary>Storage backpressure.</summary>
+  EVT_STORAGE_BACKPRESSURE(0x0E000002L),
 
   /// <summary>Ticket Expired</summary>
   EVT_TICKET_EXPIRED(0x0F000000L),
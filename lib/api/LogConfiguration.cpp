@@ -19,8 +19,20 @@ namespace MAT_NS_BEGIN {
         { CFG_BOOL_ENABLE_ANALYTICS,        false },
         { CFG_INT_CACHE_FILE_SIZE,          3145728 },
         { CFG_INT_RAM_QUEUE_SIZE,           524288 },
+        { CFG_INT_RAM_COMPRESSED_SIZE,      0 },
+        { CFG_BOOL_ENABLE_SHUTDOWN_SPILL,   false },
+        { CFG_BOOL_ENABLE_RAM_QUEUE_JOURNAL, false },
+        { CFG_INT_RAM_QUEUE_FLUSH_TARGET_MS, 0 },
         { CFG_BOOL_ENABLE_MULTITENANT,      true },
         { CFG_BOOL_ENABLE_DB_DROP_IF_FULL,  false },
+        { CFG_INT_DB_TRIM_PAGE_BUDGET,      256 },
+        { CFG_INT_TENANT_QUOTA_PCT,         0 },
+        { CFG_INT_DB_DELETE_BATCH_SIZE,     0 },
+        { CFG_INT_DB_DELETE_BATCH_INTERVAL, 1000 },
+        { CFG_BOOL_ENABLE_DB_COMPRESS,      false },
+        { CFG_INT_DB_COMPRESSION_LEVEL,     1 },
+        { CFG_BOOL_ENABLE_DB_READER_CONNECTION, false },
+        { CFG_BOOL_ENABLE_FAIR_PACKING,     false },
         { CFG_INT_MAX_TEARDOWN_TIME,        0 },
         { CFG_INT_MAX_PENDING_REQ,          4 },
         { CFG_INT_RAM_QUEUE_BUFFERS,        3 },
@@ -81,6 +81,7 @@ namespace MAT_NS_BEGIN
         ContextFieldsProvider& parentContext,
         IRuntimeConfig& runtimeConfig) :
         m_tenantToken(tenantToken),
+        m_tenantHandle(internTenantToken(tenantToken)),
         m_source(source),
         // TODO: scope parameter can be used to rewire the logger to alternate context.
         // Scope must uniquely identify the "shared context" instance id.
@@ -567,7 +568,7 @@ namespace MAT_NS_BEGIN
         }
 
         // TODO: [MG] - check if optimization is possible in generateUuidString
-        IncomingEventContext event(PAL::generateUuidString(), m_tenantToken, latency, persistence, &record);
+        IncomingEventContext event(PAL::generateUuidString(), m_tenantToken, m_tenantHandle, latency, persistence, &record);
         event.policyBitFlags = policyBitFlags;
 
         m_logManager.sendEvent(&event);
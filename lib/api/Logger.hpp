@@ -240,6 +240,7 @@ namespace MAT_NS_BEGIN
         std::mutex m_lock;
 
         std::string m_tenantToken;
+        TenantTokenHandle m_tenantHandle;
         std::string m_iKey;
         std::string m_source;
 
@@ -0,0 +1,215 @@
+//
+// Copyright (c) 2015-2020 Microsoft Corporation and Contributors.
+// SPDX-License-Identifier: Apache-2.0
+//
+#ifndef BANDWIDTHCONTROLLER_TOKENBUCKET_HPP
+#define BANDWIDTHCONTROLLER_TOKENBUCKET_HPP
+
+#include "IBandwidthController.hpp"
+#include "pal/PAL.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace MAT_NS_BEGIN {
+
+    /// <summary>
+    /// Portable token-bucket upload rate limiter. The bucket fills at the configured rate up to
+    /// the burst size, and every upload takes its size from it. An upload larger than what the
+    /// bucket holds still goes out and leaves the bucket in debt, so the next one waits until
+    /// the debt is repaid and the long-term rate never exceeds the limit. Tenants may have their
+    /// own bucket in addition to the global one.
+    /// </summary>
+    /// <remarks>
+    /// Times are monotonic milliseconds, passed in so that the pacing can be tested.
+    /// </remarks>
+    class BandwidthController_TokenBucket : public IBandwidthController
+    {
+    public:
+        BandwidthController_TokenBucket() = default;
+
+        BandwidthController_TokenBucket(unsigned rateBps, unsigned burstBytes)
+        {
+            Configure(rateBps, burstBytes);
+        }
+
+        /// <summary>
+        /// Set the global limit and drop the tenant limits. A rate of 0 disables the limiter,
+        /// a burst of 0 allows one second worth of bytes.
+        /// </summary>
+        void Configure(unsigned rateBps, unsigned burstBytes, uint64_t now = PAL::getMonotonicTimeMs())
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_global = Bucket(rateBps, burstBytes, now);
+            m_tenants.clear();
+        }
+
+        /// <summary>
+        /// Limit the upload rate of one tenant below the global limit. A rate of 0 removes it.
+        /// </summary>
+        void SetTenantLimit(std::string const& tenantToken, unsigned rateBps, unsigned burstBytes, uint64_t now = PAL::getMonotonicTimeMs())
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (rateBps == 0)
+            {
+                m_tenants.erase(tenantToken);
+                return;
+            }
+            m_tenants[tenantToken] = Bucket(rateBps, burstBytes, now);
+        }
+
+        bool IsEnabled() const
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return (m_global.rate != 0) || !m_tenants.empty();
+        }
+
+        /// <summary>
+        /// The configured rate while the global bucket holds tokens, 0 while it is in debt,
+        /// and no limit at all when the limiter is disabled.
+        /// </summary>
+        virtual unsigned GetProposedBandwidthBps() override
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (m_global.rate == 0)
+            {
+                return std::numeric_limits<unsigned>::max();
+            }
+            m_global.refill(PAL::getMonotonicTimeMs());
+            return (m_global.tokens > 0) ? m_global.rate : 0;
+        }
+
+        /// <summary>
+        /// Time to wait before the next upload.
+        /// </summary>
+        uint64_t GetDelayMs(uint64_t now = PAL::getMonotonicTimeMs())
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_global.delayMs(now);
+        }
+
+        /// <summary>
+        /// Time to wait before the next upload for the tenant, 0 for tenants without a limit.
+        /// </summary>
+        uint64_t GetTenantDelayMs(std::string const& tenantToken, uint64_t now = PAL::getMonotonicTimeMs())
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            auto it = m_tenants.find(tenantToken);
+            return (it != m_tenants.end()) ? it->second.delayMs(now) : 0;
+        }
+
+        /// <summary>
+        /// Tenants whose bucket is in debt. Their events should not be packaged until
+        /// GetTenantDelayMs() elapsed.
+        /// </summary>
+        std::vector<std::string> GetDeferredTenants(uint64_t now = PAL::getMonotonicTimeMs())
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            std::vector<std::string> result;
+            for (auto& item : m_tenants)
+            {
+                if (item.second.delayMs(now) != 0)
+                {
+                    result.push_back(item.first);
+                }
+            }
+            return result;
+        }
+
+        /// <summary>
+        /// Take the bytes of an upload from the global bucket.
+        /// </summary>
+        void OnBytesSent(size_t bytes, uint64_t now = PAL::getMonotonicTimeMs())
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_global.take(bytes, now);
+        }
+
+        /// <summary>
+        /// Take the bytes a tenant contributed to an upload from its bucket.
+        /// </summary>
+        void OnTenantBytesSent(std::string const& tenantToken, size_t bytes, uint64_t now = PAL::getMonotonicTimeMs())
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            auto it = m_tenants.find(tenantToken);
+            if (it != m_tenants.end())
+            {
+                it->second.take(bytes, now);
+            }
+        }
+
+    protected:
+        static constexpr uint64_t kMaxElapsedMs = 86400000;
+
+        struct Bucket
+        {
+            unsigned rate {};
+            int64_t  burst {};
+            int64_t  tokens {};
+            uint64_t time {};
+
+            Bucket() = default;
+
+            Bucket(unsigned rateBps, unsigned burstBytes, uint64_t now) :
+                rate(rateBps),
+                burst((burstBytes != 0) ? burstBytes : rateBps),
+                tokens(burst),
+                time(now)
+            {
+            }
+
+            void refill(uint64_t now)
+            {
+                if ((rate == 0) || (now <= time))
+                {
+                    return;
+                }
+                // Only whole bytes are added, the remainder of the interval carries over.
+                // A day is longer than any bucket takes to fill and keeps the product in range.
+                uint64_t elapsed = (now - time > kMaxElapsedMs) ? kMaxElapsedMs : (now - time);
+                uint64_t added = (elapsed * rate) / 1000;
+                if (added >= static_cast<uint64_t>(burst - tokens))
+                {
+                    tokens = burst;
+                    time = now;
+                }
+                else if (added != 0)
+                {
+                    tokens += static_cast<int64_t>(added);
+                    time += (added * 1000) / rate;
+                }
+            }
+
+            uint64_t delayMs(uint64_t now)
+            {
+                refill(now);
+                if ((rate == 0) || (tokens > 0))
+                {
+                    return 0;
+                }
+                return (static_cast<uint64_t>(1 - tokens) * 1000 + rate - 1) / rate;
+            }
+
+            void take(size_t bytes, uint64_t now)
+            {
+                if (rate != 0)
+                {
+                    refill(now);
+                    tokens -= static_cast<int64_t>(bytes);
+                }
+            }
+        };
+
+        mutable std::mutex              m_lock;
+        Bucket                          m_global;
+        std::map<std::string, Bucket>   m_tenants;
+    };
+
+} MAT_NS_END
+
+#endif
@@ -32,7 +32,7 @@ namespace MAT_NS_BEGIN {
     {
         UNREFERENCED_PARAMETER(ctx);
 #ifdef HAVE_MAT_ZLIB
-        if (!m_config.IsHttpRequestCompressionEnabled()) {
+        if (!m_config.IsHttpRequestCompressionEnabled() || ctx->fromRetryCache) {
             return true;
         }
 
@@ -26,33 +26,56 @@ namespace MAT_NS_BEGIN {
     {
     public:
         CurlHttpRequest() : SimpleHttpRequest(NextReqId()) { }
+    };
 
-        void SetOperation(const std::shared_ptr<CurlHttpOperation>& curlOperation)
-        {
-            m_curlOperation = curlOperation;
-        }
-
-        void Cancel()
-        {
-            if (m_curlOperation != nullptr) {
-                m_curlOperation->Abort();
-            }
-        }
+    // Idle easy handles kept for reuse, and connections kept open by the multi handle
+    static constexpr size_t kMaxIdleHandles = 8;
+    static constexpr long   kMaxConnections = 8;
 
-    private:
-        std::shared_ptr<CurlHttpOperation> m_curlOperation;
-    };
+    // How long the I/O thread sleeps when it cannot be woken up
+#if LIBCURL_VERSION_NUM >= 0x074400
+    static constexpr int    kPollTimeoutMs  = 1000;
+#else
+    static constexpr int    kPollTimeoutMs  = 50;
+#endif
 
     HttpClient_Curl::HttpClient_Curl()
     {
         /* In windows, this will init the winsock stuff */
         TRACE("Initializing HttpClient_Curl...\n");
         curl_global_init(CURL_GLOBAL_ALL);
-        TRACE("libcurl version = %s\n", curl_version_info(CURLVERSION_NOW)->version);
+        curl_version_info_data* info = curl_version_info(CURLVERSION_NOW);
+        TRACE("libcurl version = %s\n", info->version);
+
+        m_multi = curl_multi_init();
+        curl_multi_setopt(m_multi, CURLMOPT_MAXCONNECTS, kMaxConnections);
+#if LIBCURL_VERSION_NUM >= 0x072F00
+        // Multiplex requests over one HTTP/2 connection when libcurl was built with it
+        m_multiplex = (info->features & CURL_VERSION_HTTP2) != 0;
+        curl_multi_setopt(m_multi, CURLMOPT_PIPELINING, m_multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+#endif
+        m_thread = std::thread(&HttpClient_Curl::Run, this);
     }
 
     HttpClient_Curl::~HttpClient_Curl()
     {
+        CancelAllRequests();
+        {
+            std::lock_guard<std::mutex> lock(m_requestsMtx);
+            m_shutdown = true;
+        }
+        Wakeup();
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+
+        for (CURL* curl : m_idleHandles)
+        {
+            curl_easy_cleanup(curl);
+        }
+        m_idleHandles.clear();
+        curl_multi_cleanup(m_multi);
         curl_global_cleanup();
         TRACE("Destroyed HttpClient_Curl.\n");
     };
@@ -65,76 +88,224 @@ namespace MAT_NS_BEGIN {
     void HttpClient_Curl::SendRequestAsync(IHttpRequest* request, IHttpResponseCallback* callback)
     {
         // Note: 'request' is never owned by IHttpClient and gets deleted in EventsUploadContext.clear()
-        AddRequest(request);
         auto curlRequest = static_cast<CurlHttpRequest*>(request);
+        auto operation = new CurlHttpOperation(*curlRequest, callback, AcquireHandle());
+        {
+            std::lock_guard<std::mutex> lock(m_requestsMtx);
+            m_requests[operation->GetId()] = operation;
+            m_pending.push_back(operation);
+        }
+        Wakeup();
+    }
 
-        std::string requestId = curlRequest->GetId();
-        std::map<std::string, std::string> requestHeaders;
-        for (const auto& header : curlRequest->m_headers) {
-            requestHeaders[header.first] = header.second;
+    void HttpClient_Curl::CancelRequestAsync(std::string const& id)
+    {
+        {
+            // The I/O thread aborts the transfer and completes the request
+            std::lock_guard<std::mutex> lock(m_requestsMtx);
+            auto it = m_requests.find(id);
+            if (it == m_requests.end()) {
+                return;
+            }
+            LOG_TRACE("HTTP request=%p id=%s being aborted...", it->second, id.c_str());
+            it->second->cancelled = true;
+            m_cancelled.push_back(it->second);
+            m_requests.erase(it);
         }
+        Wakeup();
+    }
 
-        auto curlOperation = std::make_shared<CurlHttpOperation>(curlRequest->m_method, curlRequest->m_url, callback, requestHeaders, curlRequest->m_body);
-        curlRequest->SetOperation(curlOperation);
-        
-        // The lifetime of curlOperation is guarnteed by the call to result.wait() in the d'tor.  
-        curlOperation->SendAsync([this, callback, requestId](CurlHttpOperation& operation) {
-            this->EraseRequest(requestId);
-
-            auto response = std::unique_ptr<SimpleHttpResponse>(new SimpleHttpResponse(requestId));
-            response->m_result = HttpResult_OK;
-
-            response->m_statusCode = operation.GetResponseCode();
-            if (response->m_statusCode == CURLE_FAILED_INIT) {
-                // There was an error in CURL stack while trying to create request
-                response->m_result = HttpResult_LocalFailure;
-            } else if ((CURLE_OK < response->m_statusCode) && (response->m_statusCode <= CURL_LAST)) {
-                if (operation.WasAborted()) {
-                    // Operation was manually aborted
-                    response->m_result = HttpResult_Aborted;
-                } else {
-                    // There was an error in CURL stack while trying to connect
-                    response->m_result = HttpResult_NetworkFailure;
+    void HttpClient_Curl::CancelAllRequests()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_requestsMtx);
+            for (auto& kv : m_requests) {
+                kv.second->cancelled = true;
+                m_cancelled.push_back(kv.second);
+            }
+            m_requests.clear();
+        }
+        Wakeup();
+    }
+
+    void HttpClient_Curl::Wakeup()
+    {
+#if LIBCURL_VERSION_NUM >= 0x074400
+        curl_multi_wakeup(m_multi);
+#endif
+    }
+
+    void HttpClient_Curl::Run()
+    {
+        std::vector<CurlHttpOperation*> pending;
+        std::vector<CurlHttpOperation*> cancelled;
+        for (;;)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_requestsMtx);
+                if (m_shutdown && m_pending.empty() && m_cancelled.empty() && (m_activeCount == 0))
+                {
+                    break;
+                }
+                pending.swap(m_pending);
+                cancelled.swap(m_cancelled);
+                // Requests cancelled before they started are only completed
+                pending.erase(std::remove_if(pending.begin(), pending.end(),
+                    [](CurlHttpOperation* operation) { return operation->cancelled; }), pending.end());
+            }
+
+            for (auto operation : pending)
+            {
+                StartOperation(operation);
+            }
+            pending.clear();
+
+            for (auto operation : cancelled)
+            {
+                if (operation->active)
+                {
+                    curl_multi_remove_handle(m_multi, operation->GetHandle());
+                    operation->active = false;
+                    m_activeCount--;
                 }
+                CompleteOperation(operation, CURLE_ABORTED_BY_CALLBACK, true);
             }
+            cancelled.clear();
+
+            int running = 0;
+            curl_multi_perform(m_multi, &running);
 
-            auto responseHeaders = operation.GetResponseHeaders();
-            response->m_headers.insert(responseHeaders.begin(), responseHeaders.end());
-            response->m_body = operation.GetResponseBody();
-            
-            // 'response' is no longer owned by IHttpClient and gets deleted in EventsUploadContext.clear()
-            callback->OnHttpResponse(response.release());
-        });
+            CURLMsg* msg;
+            int left = 0;
+            while ((msg = curl_multi_info_read(m_multi, &left)) != nullptr)
+            {
+                if (msg->msg != CURLMSG_DONE)
+                {
+                    continue;
+                }
+                // 'msg' is invalidated by removing its handle
+                CURL* curl = msg->easy_handle;
+                CURLcode code = msg->data.result;
+                CurlHttpOperation* operation = nullptr;
+                curl_easy_getinfo(curl, CURLINFO_PRIVATE, &operation);
+                curl_multi_remove_handle(m_multi, curl);
+                operation->active = false;
+                m_activeCount--;
+                CompleteOperation(operation, code, false);
+            }
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+            curl_multi_poll(m_multi, nullptr, 0, kPollTimeoutMs, nullptr);
+#else
+            curl_multi_wait(m_multi, nullptr, 0, kPollTimeoutMs, nullptr);
+#endif
+        }
     }
 
-    void HttpClient_Curl::CancelRequestAsync(std::string const& id)
+    void HttpClient_Curl::StartOperation(CurlHttpOperation* operation)
     {
-        CurlHttpRequest* request = nullptr;
+        CURLcode code = operation->Prepare(m_multiplex);
+        if (code == CURLE_OK)
+        {
+            operation->DispatchEvent(OnSending);
+            if (curl_multi_add_handle(m_multi, operation->GetHandle()) == CURLM_OK)
+            {
+                operation->active = true;
+                m_activeCount++;
+                return;
+            }
+            code = CURLE_FAILED_INIT;
+        }
+        CompleteOperation(operation, code, false);
+    }
+
+    void HttpClient_Curl::CompleteOperation(CurlHttpOperation* operation, CURLcode code, bool aborted)
+    {
+        if (!aborted)
         {
-            // Hold the lock only while iterating over the list of requests
             std::lock_guard<std::mutex> lock(m_requestsMtx);
-            if (m_requests.find(id) != m_requests.cend()) {
-                request = static_cast<CurlHttpRequest*>(m_requests[id]);
-                LOG_TRACE("HTTP request=%p id=%s being aborted...", request, id.c_str());
-                m_requests.erase(id);
+            if (operation->cancelled)
+            {
+                // Completed as aborted once the cancellation is processed
+                return;
             }
+            m_requests.erase(operation->GetId());
         }
 
-        if (request != nullptr) {
-            request->Cancel();
+        CURL* curl = operation->GetHandle();
+        auto response = std::unique_ptr<SimpleHttpResponse>(new SimpleHttpResponse(operation->GetId()));
+        response->m_result = HttpResult_OK;
+        response->m_statusCode = code;
+        if (aborted) {
+            // Operation was manually aborted
+            response->m_result = HttpResult_Aborted;
+        } else if ((code == CURLE_FAILED_INIT) || (code == CURLE_UNSUPPORTED_PROTOCOL) || (code == CURLE_URL_MALFORMAT)) {
+            // There was an error in CURL stack while trying to create request
+            response->m_result = HttpResult_LocalFailure;
+            operation->DispatchEvent(OnSendFailed);
+        } else if (code != CURLE_OK) {
+            // There was an error in CURL stack while trying to connect or send
+            response->m_result = HttpResult_NetworkFailure;
+            bool connectFailed = (code == CURLE_COULDNT_RESOLVE_HOST) || (code == CURLE_COULDNT_RESOLVE_PROXY) || (code == CURLE_COULDNT_CONNECT);
+            operation->DispatchEvent(connectFailed ? OnConnectFailed : OnSendFailed);
+        } else {
+            long statusCode = 0;
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &statusCode);
+            TRACE("HTTP response code %ld\n", statusCode);
+            response->m_statusCode = static_cast<unsigned>(statusCode);
+            response->m_headers = operation->TakeResponseHeaders();
+            response->m_body = operation->TakeResponseBody();
+            operation->DispatchEvent(OnResponse);
         }
+
+        if (curl != nullptr)
+        {
+            long connects = 0;
+            curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+            m_connectionCount += static_cast<size_t>(connects);
+        }
+
+        // The callback may delete itself and the request once it has the response
+        IHttpResponseCallback* callback = operation->GetCallback();
+        operation->DispatchEvent(OnDestroy);
+        delete operation;
+        ReleaseHandle(curl);
+
+        // 'response' is no longer owned by IHttpClient and gets deleted in EventsUploadContext.clear()
+        callback->OnHttpResponse(response.release());
     }
 
-    void HttpClient_Curl::EraseRequest(std::string const& id)
+    CURL* HttpClient_Curl::AcquireHandle()
     {
-        std::lock_guard<std::mutex> lock(m_requestsMtx);
-        m_requests.erase(id);
+        {
+            std::lock_guard<std::mutex> lock(m_requestsMtx);
+            if (!m_idleHandles.empty())
+            {
+                CURL* curl = m_idleHandles.back();
+                m_idleHandles.pop_back();
+                return curl;
+            }
+        }
+        return curl_easy_init();
     }
 
-    void HttpClient_Curl::AddRequest(IHttpRequest* request)
+    void HttpClient_Curl::ReleaseHandle(CURL* curl)
     {
-        std::lock_guard<std::mutex> lock(m_requestsMtx);
-        m_requests[request->GetId()] = request;
+        if (curl == nullptr)
+        {
+            return;
+        }
+        // Resetting keeps the connection cache, DNS cache and TLS session IDs
+        curl_easy_reset(curl);
+        {
+            std::lock_guard<std::mutex> lock(m_requestsMtx);
+            if (m_idleHandles.size() < kMaxIdleHandles)
+            {
+                m_idleHandles.push_back(curl);
+                return;
+            }
+        }
+        curl_easy_cleanup(curl);
     }
 
 } MAT_NS_END
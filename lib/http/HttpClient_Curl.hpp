@@ -11,36 +11,39 @@
 #include <cstdlib>
 #include <cstdint>
 #include <string.h>
-#include <regex>
 
 #include <string>
-#include <sstream>
 #include <vector>
 #include <iterator>
 
 #include <algorithm>
 #include <numeric>
-#include <future>
 #include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
 
 #include <curl/curl.h>
 
-#include <unistd.h>
-
 #include "IHttpClient.hpp"
 #include "pal/PAL.hpp"
 
 #define HTTP_CONN_TIMEOUT       5L
-#define HTTP_STATUS_REGEXP		"HTTP\\/\\d\\.\\d (\\d+)\\ .*"
-#define HTTP_HEADER_REGEXP      "(.*)\\: (.*)\\n*"
 
 #undef TRACE
 #define TRACE(...)	// printf
 
 namespace MAT_NS_BEGIN {
 
+class CurlHttpOperation;
+
 /**
  * Curl-based HTTP client
+ *
+ * All transfers run on a single I/O thread driving one curl multi handle. The multi
+ * handle owns the connection cache, so keep-alive connections (and HTTP/2 streams,
+ * when libcurl supports HTTP/2) are reused across requests to the same collector.
+ * Easy handles are recycled for subsequent requests.
  */
 class HttpClient_Curl : public IHttpClient {
 public:
@@ -50,461 +53,267 @@ public:
     virtual IHttpRequest* CreateRequest() override;
     virtual void SendRequestAsync(IHttpRequest* request, IHttpResponseCallback* callback) override;
     virtual void CancelRequestAsync(std::string const& id) override;
+    virtual void CancelAllRequests() override;
 
-private:
-    void EraseRequest(std::string const& id);
-    void AddRequest(IHttpRequest* request);
+    /**
+     * Number of connections opened so far. Lower than the number of requests sent
+     * whenever connections are reused.
+     */
+    size_t GetConnectionCount() const
+    {
+        return m_connectionCount;
+    }
 
+protected:
+    void Run();
+    void Wakeup();
+    void StartOperation(CurlHttpOperation* operation);
+    void CompleteOperation(CurlHttpOperation* operation, CURLcode code, bool aborted);
+    CURL* AcquireHandle();
+    void ReleaseHandle(CURL* curl);
+
+    // Guards everything shared with the I/O thread
     std::mutex m_requestsMtx;
-    std::map<std::string, IHttpRequest*> m_requests;
+    std::map<std::string, CurlHttpOperation*> m_requests;
+    std::vector<CurlHttpOperation*> m_pending;
+    std::vector<CurlHttpOperation*> m_cancelled;
+    std::vector<CURL*> m_idleHandles;
+    bool m_shutdown = false;
+
+    // Owned by the I/O thread
+    CURLM* m_multi = nullptr;
+    size_t m_activeCount = 0;
+    bool m_multiplex = false;
+
+    std::atomic<size_t> m_connectionCount { 0 };
+    std::thread m_thread;
 };
 
+/**
+ * A single request on the I/O thread of HttpClient_Curl
+ */
 class CurlHttpOperation {
 public:
 
-    void DispatchEvent(HttpStateEvent type)
-    {
-        if(m_callback != nullptr)
-            m_callback->OnHttpStateEvent(type, static_cast<void*>(curl), 0);
-    }
-
-    std::atomic<bool>   isAborted;      // Set to 'true' when async callback is aborted
-
     /**
-     * Create local CURL instance for url and body
+     * Bind the request to a (fresh or reset) curl easy handle
      *
-     * @param url
-     * @param body
-     * @param httpConnTimeout   HTTP connection timeout in seconds
-     * @param httpReadTimeout   HTTP read timeout in seconds
+     * @param request   Request to send, lives until the callback gets its response
+     * @param callback  Callback receiving the response
+     * @param curl      Easy handle, may be null if libcurl failed to create one
      */
-    CurlHttpOperation(
-            std::string method,
-            std::string url,
-            IHttpResponseCallback* callback,
-            // Default empty headers and empty request body
-            const std::map<std::string, std::string>& requestHeaders = std::map<std::string, std::string>(),
-            const std::vector<uint8_t>& requestBody                  = std::vector<uint8_t>(),
-            // Default connectivity and response size options
-            bool rawResponse                                         = false,
-            size_t httpConnTimeout                                   = HTTP_CONN_TIMEOUT) :
-
-            //
-            m_method(method),
-            m_url(url),
-            m_callback(callback),
-
-            // Local vars
-            requestHeaders(requestHeaders),
-            requestBody(requestBody),
-            // Optional connection params
-            rawResponse(rawResponse),
-            httpConnTimeout(httpConnTimeout),
-            // Result
-            res(CURLE_OK),
-            sockfd(0),
-            isAborted(false),
-            nread(0)
+    CurlHttpOperation(SimpleHttpRequest& request, IHttpResponseCallback* callback, CURL* curl) :
+        m_id(request.GetId()),
+        m_request(request),
+        m_callback(callback),
+        curl(curl)
     {
         TRACE("--------------------------------------------------------------------------------------------------\n");
-        response.memory = nullptr;
-        response.size = 0;
-
-        /* get a curl handle */
-        curl = curl_easy_init();
-        if(!curl)
-        {
-            TRACE("libcurl failed to init!\n");
-            res = CURLE_FAILED_INIT;
-            DispatchEvent(OnCreateFailed);
-            return;
-        }
-
-#if 0
-        // Be verbose
-        curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-#else
-        curl_easy_setopt(curl, CURLOPT_VERBOSE, 0);
-#endif
-
-        // Specify target URL
-        curl_easy_setopt(curl, CURLOPT_URL, m_url.c_str());
-
-        // TODO: expose SSL cert verification opts via ILogConfiguration
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);      // 1L
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);      // 2L
-
-        // Specify our custom headers
-        for(auto &kv : this->requestHeaders)
-        {
-            std::string header = kv.first.c_str();
-            header += ": ";
-            header += kv.second.c_str();
-            m_headersChunk = curl_slist_append(m_headersChunk, header.c_str());
-        }
-
-        if(m_headersChunk != nullptr)
-        {
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, m_headersChunk);
-        }
-        TRACE("method=%s, url=%s\n", this->m_method.c_str(), this->m_url.c_str());
-
-        DispatchEvent(OnCreated);
+        DispatchEvent((curl != nullptr) ? OnCreated : OnCreateFailed);
     }
 
     /**
-     * Destroy CURL instance
+     * Release request headers. The easy handle is recycled by the client.
      */
     virtual ~CurlHttpOperation()
     {
-        // Given the request has not been aborted we should wait for completion here
-        // This guarantees the lifetime of this request.
-        if (result.valid())
-        {
-            result.wait();
-        }
-        DispatchEvent(OnDestroy);
-        res = CURLE_OK;
-        curl_easy_cleanup(curl);
         curl_slist_free_all(m_headersChunk);
-        ReleaseResponse();
+    }
+
+    void DispatchEvent(HttpStateEvent type)
+    {
+        if(m_callback != nullptr)
+            m_callback->OnHttpStateEvent(type, static_cast<void*>(curl), 0);
     }
 
     /**
-     * Send request synchronously
+     * Set request options on the easy handle
+     *
+     * @param multiplex Prefer HTTP/2 and wait for a connection able to multiplex
+     * @return CURLE_OK if the request can be started
      */
-    long Send()
+    CURLcode Prepare(bool multiplex)
     {
-        TRACE("method=%s\n", this->m_method.c_str());
-
-        ReleaseResponse();
-        // Request buffer
-        const void *request  = (requestBody.empty())?NULL:&requestBody[0];
-        const size_t reqSize = requestBody.size();
-
+        TRACE("method=%s, url=%s\n", m_request.m_method.c_str(), m_request.m_url.c_str());
         if(!curl)
         {
-            res = CURLE_FAILED_INIT;
-            DispatchEvent(OnSendFailed);
-            goto cleanup;
+            TRACE("libcurl failed to init!\n");
+            return CURLE_FAILED_INIT;
         }
 
-        // TODO: should we control what local source port we use?
-        // curl_easy_setopt(curl, CURLOPT_LOCALPORT, dcf_port);
+        curl_easy_setopt(curl, CURLOPT_PRIVATE, this);
+        curl_easy_setopt(curl, CURLOPT_VERBOSE, 0L);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
 
-        // Perform initial connect, handling the timeout if needed
-        curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1L);
-        DispatchEvent(OnConnecting);
-        res = curl_easy_perform(curl);
-        if(CURLE_OK != res)
-        {
-            DispatchEvent(OnConnectFailed);     // couldn't connect - stage 1
-            TRACE("Error #1: %s\n", curl_easy_strerror(res));
-            goto cleanup;
-        }
+        // Specify target URL
+        curl_easy_setopt(curl, CURLOPT_URL, m_request.m_url.c_str());
 
-        /* Extract the socket from the curl handle - we'll need it for waiting.
-         * Note that this API takes a pointer to a 'long' while we use
-         * curl_socket_t for sockets otherwise.
-         */
-        res = curl_easy_getinfo(curl, CURLINFO_LASTSOCKET, &sockextr);
-        if(CURLE_OK != res)
+        // TODO: expose SSL cert verification opts via ILogConfiguration
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);      // 1L
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);      // 2L
+
+        // Keep idle connections in the pool alive between uploads
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, HTTP_CONN_TIMEOUT);
+#if LIBCURL_VERSION_NUM >= 0x072F00
+        if (multiplex)
         {
-            DispatchEvent(OnConnectFailed);     // couldn't connect - stage 2
-            TRACE("Error #2: %s\n", curl_easy_strerror(res));
-            goto cleanup;
+            curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+            curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
         }
+#else
+        UNREFERENCED_PARAMETER(multiplex);
+#endif
 
-        /* wait for the socket to become ready for sending */
-        sockfd = sockextr;
-        if( !WaitOnSocket(sockfd, 0, HTTP_CONN_TIMEOUT * 1000L) || isAborted)
+        // Specify our custom headers
+        for(auto &kv : m_request.m_headers)
         {
-            TRACE("Error #3: timeout, aborted=%u\n", isAborted.load() );
-            res = CURLE_OPERATION_TIMEDOUT;
-            DispatchEvent(OnConnectFailed);     // couldn't connect - stage 3
-            goto cleanup;
+            std::string header = kv.first;
+            header += ": ";
+            header += kv.second;
+            m_headersChunk = curl_slist_append(m_headersChunk, header.c_str());
         }
-
-        // once connection is there - switch back to easy perform for HTTP post
-        curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 0);
-
-        // send all data to our callback function
-        if (rawResponse)
+        if(m_headersChunk != nullptr)
         {
-            curl_easy_setopt(curl, CURLOPT_HEADER,        true);
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, (void *)&WriteMemoryCallback);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA,     (void *)&response);
-        } else {
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, (void *)&WriteVectorCallback);
-            curl_easy_setopt(curl, CURLOPT_HEADERDATA,    (void *)&respHeaders);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA,     (void *)&respBody);
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, m_headersChunk);
         }
 
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &WriteVectorCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA,     (void *)&respBody);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &WriteHeaderCallback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA,    (void *)&respHeaders);
+
         // TODO: only two methods supported for now - POST and GET
-        if (m_method.compare("POST") == 0)
+        if (m_request.m_method.compare("POST") == 0)
         {
             // POST
-            curl_easy_setopt(curl, CURLOPT_POST, true);
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, (const char *)request);
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, reqSize);
+            const char *body = (m_request.m_body.empty()) ? "" : (const char *)&m_request.m_body[0];
+            curl_easy_setopt(curl, CURLOPT_POST, 1L);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)m_request.m_body.size());
         } else
-        if (m_method.compare("GET") == 0)
+        if (m_request.m_method.compare("GET") == 0)
         {
             // GET
+            curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
         } else
         {
-            TRACE("Error #4: unsupported method %s\n", m_method.c_str());
-            res = CURLE_UNSUPPORTED_PROTOCOL;
-            goto cleanup;
+            TRACE("Error: unsupported method %s\n", m_request.m_method.c_str());
+            return CURLE_UNSUPPORTED_PROTOCOL;
         }
 
         curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30L);
-        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 4096);
-        DispatchEvent(OnSending);
-        res = curl_easy_perform(curl);
-        if(CURLE_OK != res)
-        {
-            DispatchEvent(OnSendFailed);
-            TRACE("Error: %s\n", curl_easy_strerror(res));
-            goto cleanup;
-        }
-
-        /* Code snippet to parse raw HTTP response. This might come in handy
-         * if we ever consider to handle the raw upload instead of curl_easy_perform
-       ...
-       std::string resp((const char *)response);
-       std::regex http_status_regex(HTTP_STATUS_REGEXP);
-       std::smatch match;
-       if(std::regex_search(resp, match, http_status_regex))
-         http_code = std::stol(match[1]);
-       ...
-         */
-
-        /* libcurl is nice enough to parse the response code itself: */
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &res);
-        // We got some response from server. Dump the contents.
-        TRACE("HTTP response code %d\n", res);
-        DispatchEvent(OnResponse);
-
-cleanup:
-
-        // This function returns:
-        // - on success: HTTP status code.
-        // - on failure: CURL error code.
-        // The two sets of enums (CURLE, HTTP codes) - do not intersect, so we collapse them in one set.
-        return res;
-    }
-
-    std::future<long> & SendAsync(std::function<void(CurlHttpOperation &)> callback = nullptr) {
-        result = std::async(std::launch::async, [this, callback] {
-            long result = Send();
-            if (callback!=nullptr)
-                callback(*this);
-            return result;
-        });
-        return result;
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 4096L);
+        return CURLE_OK;
     }
 
-    /**
-     * Get HTTP response code. This function returns CURL error code if HTTP response code is invalid.
-     */
-    long GetResponseCode()
+    std::string const& GetId() const
     {
-        return res;
+        return m_id;
     }
 
-    /**
-     * Get whether or not response was programmatically aborted
-     */
-    bool WasAborted()
+    CURL *GetHandle()
     {
-        return isAborted.load();
+        return curl;
     }
 
-    /**
-     * Return a copy of resposne headers
-     *
-     * @return
-     */
-    std::map<std::string, std::string> GetResponseHeaders()
+    IHttpResponseCallback* GetCallback()
     {
-        std::map<std::string, std::string> result;
-        if (respHeaders.size() == 0)
-            return result;
-
-        std::stringstream ss;
-        std::string headers((const char *)&respHeaders[0], respHeaders.size());
-        ss.str(headers);
-
-        std::string header;
-        while (std::getline(ss, header, '\n')) {
-            std::smatch match;
-            std::regex http_headers_regex(HTTP_HEADER_REGEXP);
-            if (std::regex_search(header, match, http_headers_regex))
-                result[match[1]] = match[2];    // Key: value
-        }
-        return result;
+        return m_callback;
     }
 
     /**
-     * Return a copy of response body
+     * Move the response headers out of the operation
      *
      * @return
      */
-    std::vector<uint8_t> GetResponseBody()
+    HttpHeaders TakeResponseHeaders()
     {
-        return respBody;
+        return std::move(respHeaders);
     }
 
     /**
-     * Return a raw copy of response headers+body
+     * Move the response body out of the operation
      *
      * @return
      */
-    std::vector<uint8_t> GetRawResponse()
-    {
-        std::vector<uint8_t> result;
-        if ((response.memory!=nullptr)&&(response.size!=0))
-            result.insert(result.end(), (const char *)response.memory, ((const char *)response.memory) + response.size);
-        return result;
-    }
-
-    /**
-     * Release memory allocated for response
-     */
-    void ReleaseResponse()
-    {
-        if (response.memory!=nullptr) {
-            free(response.memory);
-            response.memory = nullptr;
-            response.size = 0;
-        }
-        respHeaders.clear();
-        respBody.clear();
-    }
-
-    /**
-     * Abort request in connecting or reading state.
-     */
-    void Abort()
+    std::vector<uint8_t> TakeResponseBody()
     {
-        isAborted = true;
-        if (curl!=nullptr)
-        {
-            // Simply close the socket - connection reset by peer.. Ha-ha-ha-ha-ha!
-            if (sockfd) {
-                ::close(sockfd);
-                sockfd = 0;
-            }
-        }
+        return std::move(respBody);
     }
 
-    CURL *GetHandle()
-    {
-        return curl;
-    }
+    bool active    = false;    // Added to the multi handle, I/O thread only
+    bool cancelled = false;    // Guarded by the client requests lock
 
 protected:
-    const bool   rawResponse;       // Do not split response headers from response body
-    const size_t httpConnTimeout;   // Timeout for connect.  Default: 5s
-
-    CURL *curl;                     // Local curl instance
-    CURLcode res;                   // Curl result OR HTTP status code if successful
-    
+    std::string m_id;
+    SimpleHttpRequest& m_request;
     IHttpResponseCallback* m_callback = nullptr;
 
-    // Request values
-    std::string m_method;
-    std::string m_url;
-    const std::map<std::string, std::string>& requestHeaders;
-    const std::vector<uint8_t>& requestBody;
+    CURL *curl;                     // Easy handle owned by the client
     struct curl_slist *m_headersChunk = nullptr;
 
     // Processed response headers and body
-    std::vector<uint8_t>        respHeaders;
+    HttpHeaders                 respHeaders;
     std::vector<uint8_t>        respBody;
 
-    // Socket parameters
-    curl_socket_t sockfd;
-
-    long sockextr   = 0;
-
-    curl_off_t nread;
-    size_t sendlen  = 0;        // # bytes sent by client
-    size_t acklen   = 0;        // # bytes ack by server
-
-    std::future<long>       result;
-
+public:
     /**
-     * Helper routine to wait for data on socket
+     * Parse one response header line into headers. A status line starts a new
+     * response (e.g. after "100 Continue" or a redirect) and drops the headers
+     * collected so far. Lines without a colon are ignored.
      *
-     * @param sockfd
-     * @param for_recv
-     * @param timeout_ms
-     * @return
+     * @param line      Header line, with or without the trailing CRLF
+     * @param length    Length of the line
+     * @param headers   Headers to add the name and value to
      */
-    static int WaitOnSocket(curl_socket_t sockfd, int for_recv, long timeout_ms)
+    static void ParseHeaderLine(const char* line, size_t length, HttpHeaders& headers)
     {
-        struct timeval tv;
-        fd_set infd, outfd, errfd;
-        int res;
-
-        tv.tv_sec = timeout_ms / 1000;
-        tv.tv_usec = (timeout_ms % 1000) * 1000;
-
-        FD_ZERO(&infd);
-        FD_ZERO(&outfd);
-        FD_ZERO(&errfd);
-
-        FD_SET(sockfd, &errfd); /* always check for error */
-
-        if(for_recv) {
-            FD_SET(sockfd, &infd);
-        } else {
-            FD_SET(sockfd, &outfd);
+        const char* end = line + length;
+        while ((end > line) && ((end[-1] == '\n') || (end[-1] == '\r')))
+            end--;
+        if ((end - line >= 5) && (memcmp(line, "HTTP/", 5) == 0)) {
+            headers.clear();
+            return;
         }
 
-        /* select() returns the number of signalled sockets or -1 */
-        res = select((int)sockfd + 1, &infd, &outfd, &errfd, &tv);
-        return res;
-    }
+        const char* colon = static_cast<const char*>(memchr(line, ':', end - line));
+        if ((colon == nullptr) || (colon == line))
+            return;
 
-    // Raw response buffer
-    struct MemoryStruct {
-      char *memory;
-      size_t size;
-    } response;
+        const char* nameEnd = colon;
+        while ((nameEnd > line) && ((nameEnd[-1] == ' ') || (nameEnd[-1] == '\t')))
+            nameEnd--;
+        const char* value = colon + 1;
+        while ((value < end) && ((*value == ' ') || (*value == '\t')))
+            value++;
+        const char* valueEnd = end;
+        while ((valueEnd > value) && ((valueEnd[-1] == ' ') || (valueEnd[-1] == '\t')))
+            valueEnd--;
+
+        headers.emplace(std::string(line, nameEnd), std::string(value, valueEnd));
+    }
 
+protected:
     /**
-     * Old-school memory allocator
+     * Response header callback, libcurl passes one complete header line per call
      *
-     * @param contents
+     * @param ptr
      * @param size
      * @param nmemb
-     * @param userp
+     * @param headers
      * @return
      */
-    static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
+    static size_t WriteHeaderCallback(char *ptr, size_t size, size_t nmemb, HttpHeaders* headers)
     {
-        size_t realsize = size * nmemb;
-        struct MemoryStruct *mem = (struct MemoryStruct *)userp;
-
-        mem->memory = (char *)(realloc(mem->memory, mem->size + realsize + 1));
-        if(mem->memory == NULL) {
-          /* out of memory! */
-          TRACE("not enough memory (realloc returned NULL)\n");
-          return 0;
+        if (headers!=nullptr) {
+            ParseHeaderLine(ptr, size * nmemb, *headers);
         }
-
-        memcpy(&(mem->memory[mem->size]), contents, realsize);
-        mem->size += realsize;
-        mem->memory[mem->size] = 0;
-
-        return realsize;
+        return size * nmemb;
     }
 
     /**
-     * C++ STL std::string allocator
+     * C++ STL std::vector allocator
      *
      * @param ptr
      * @param size
@@ -529,4 +338,3 @@ protected:
 #endif // HAVE_MAT_DEFAULT_HTTP_CLIENT
 
 #endif // HTTPCLIENTCURL_HPP
-
@@ -7,6 +7,8 @@
 #include "utils/StringUtils.hpp"
 #include "pal/PAL.hpp"
 
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <string>
 
@@ -35,53 +37,86 @@ namespace MAT_NS_BEGIN {
         m_system.getLogManager().GetDataViewerCollection().DispatchDataViewerEvent(dataPacket);
     }
 
-    bool HttpRequestEncoder::handleEncode(EventsUploadContextPtr const& ctx)
+    /// <summary>
+    /// Hash of the device and user tokens, combined boost style, to tell whether they changed
+    /// without keeping a copy of them.
+    /// </summary>
+    static size_t hashAuthTokens(IAuthTokensController* tokens)
     {
-        ctx->httpRequest = m_httpClient.CreateRequest();
-        ctx->httpRequestId = ctx->httpRequest->GetId();
-
-        ctx->httpRequest->SetMethod("POST");
+        size_t seed = 0;
+        auto combine = [&seed](size_t value) { seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2); };
+        std::hash<std::string> hashString;
+        for (auto const& token : tokens->GetDeviceTokens())
+        {
+            combine(static_cast<size_t>(token.first));
+            combine(hashString(token.second));
+        }
+        combine(0);
+        for (auto const& token : tokens->GetUserTokens())
+        {
+            combine(static_cast<size_t>(token.first));
+            combine(hashString(token.second));
+        }
+        return seed;
+    }
 
-        ctx->httpRequest->SetUrl(m_config.GetCollectorUrl());
+    bool HttpRequestEncoder::isHeaderTemplateCurrent(IAuthTokensController* tokens) const
+    {
+        if (!m_headerTemplateValid)
+        {
+            return false;
+        }
+        if (tokens == nullptr)
+        {
+            return (m_deviceTokenCount == 0) && (m_userTokenCount == 0) && !m_strictMode;
+        }
+        return (tokens->GetDeviceTokens().size() == m_deviceTokenCount) &&
+            (tokens->GetUserTokens().size() == m_userTokenCount) &&
+            (tokens->GetStrictMode() == m_strictMode) &&
+            (hashAuthTokens(tokens) == m_tokensHash);
+    }
 
-        ctx->httpRequest->GetHeaders().set("Expect", "100-continue");
-        ctx->httpRequest->GetHeaders().set("SDK-Version", PAL::getSdkVersion());
-        ctx->httpRequest->GetHeaders().set("Client-Id", "NO_AUTH");
-        ctx->httpRequest->GetHeaders().set("Content-Type", "application/bond-compact-binary");
-        ctx->httpRequest->GetHeaders().set("Upload-Time", toString(PAL::getUtcSystemTimeMs()));
+    void HttpRequestEncoder::buildHeaderTemplate(IAuthTokensController* tokens)
+    {
+        m_headerTemplate.clear();
+        auto add = [this](std::string const& name, std::string const& value) { m_headerTemplate.emplace_back(name, value); };
 
+        add("Expect", "100-continue");
+        add("SDK-Version", PAL::getSdkVersion());
+        add("Client-Id", "NO_AUTH");
+        add("Content-Type", "application/bond-compact-binary");
 
-        if (GetAuthTokensController() != nullptr && GetAuthTokensController()->GetDeviceTokens().size() > 0)
+        if (tokens != nullptr && tokens->GetDeviceTokens().size() > 0)
         {
-            std::map<TicketType, std::string>& map = GetAuthTokensController()->GetDeviceTokens();
+            std::map<TicketType, std::string>& map = tokens->GetDeviceTokens();
             if (map.end() != map.find(TicketType::TicketType_MSA_Device))
             {
-                ctx->httpRequest->GetHeaders().set("AuthMsaDeviceTicket", map[TicketType::TicketType_MSA_Device]);
+                add("AuthMsaDeviceTicket", map[TicketType::TicketType_MSA_Device]);
             }
 
             if (map.end() != map.find(TicketType::TicketType_XAuth_Device))
             {
-                ctx->httpRequest->GetHeaders().set("AuthXToken", map[TicketType::TicketType_XAuth_Device]);
+                add("AuthXToken", map[TicketType::TicketType_XAuth_Device]);
             }
 
             if (map.end() != map.find(TicketType::TicketType_AAD))
             {
-                ctx->httpRequest->GetHeaders().set("Aad-Token", map[TicketType::TicketType_AAD]);
+                add("Aad-Token", map[TicketType::TicketType_AAD]);
             }
 
             if (map.end() != map.find(TicketType::TicketType_AAD_JWT))
             {
-                ctx->httpRequest->GetHeaders().set("Aad-Jwt-Token", map[TicketType::TicketType_AAD_JWT]);
+                add("Aad-Jwt-Token", map[TicketType::TicketType_AAD_JWT]);
             }
         }
 
-        if (GetAuthTokensController() != nullptr && GetAuthTokensController()->GetUserTokens().size() > 0)
+        if (tokens != nullptr && tokens->GetUserTokens().size() > 0)
         {  //create Ticket header
-            std::map<TicketType, std::string>& map = GetAuthTokensController()->GetUserTokens();
+            std::map<TicketType, std::string>& map = tokens->GetUserTokens();
 
             std::string ticketHeader;
             // We know that each ticket is about 1kb in size, so pre-reserve space for the appends
-            ticketHeader.reserve(GetAuthTokensController()->GetUserTokens().size() * 1024);//
+            ticketHeader.reserve(tokens->GetUserTokens().size() * 1024);//
 
             if (map.end() != map.find(TicketType::TicketType_MSA_User))
             {
@@ -121,14 +156,64 @@ namespace MAT_NS_BEGIN {
 
             if (!ticketHeader.empty())
             {
-                ctx->httpRequest->GetHeaders().set("Tickets", ticketHeader);
+                add("Tickets", ticketHeader);
             }
         }
         //strict mode
-        if (GetAuthTokensController() != nullptr && true == GetAuthTokensController()->GetStrictMode())
+        if (tokens != nullptr && true == tokens->GetStrictMode())
+        {
+            add("Strict", "true");
+        }
+
+        // Sorted like HttpHeaders, so a new request takes them with hinted inserts
+        std::sort(m_headerTemplate.begin(), m_headerTemplate.end());
+
+        m_deviceTokenCount = 0;
+        m_userTokenCount = 0;
+        m_tokensHash = 0;
+        m_strictMode = false;
+        if (tokens != nullptr)
         {
-            ctx->httpRequest->GetHeaders().set("Strict", "true");
+            m_deviceTokenCount = tokens->GetDeviceTokens().size();
+            m_userTokenCount = tokens->GetUserTokens().size();
+            m_tokensHash = hashAuthTokens(tokens);
+            m_strictMode = tokens->GetStrictMode();
         }
+        m_headerTemplateValid = true;
+    }
+
+    bool HttpRequestEncoder::handleEncode(EventsUploadContextPtr const& ctx)
+    {
+        ctx->httpRequest = m_httpClient.CreateRequest();
+        ctx->httpRequestId = ctx->httpRequest->GetId();
+
+        ctx->httpRequest->SetMethod("POST");
+
+        ctx->httpRequest->SetUrl(m_config.GetCollectorUrl());
+
+        {
+            // Static and auth headers come from the template, rebuilt only when tokens change
+            LOCKGUARD(m_headerTemplateLock);
+            IAuthTokensController* tokens = GetAuthTokensController();
+            if (!isHeaderTemplateCurrent(tokens))
+            {
+                buildHeaderTemplate(tokens);
+            }
+            HttpHeaders& headers = ctx->httpRequest->GetHeaders();
+            bool fresh = headers.empty();
+            for (auto const& header : m_headerTemplate)
+            {
+                if (fresh)
+                {
+                    headers.emplace_hint(headers.end(), header.first, header.second);
+                }
+                else
+                {
+                    headers.set(header.first, header.second);
+                }
+            }
+        }
+        ctx->httpRequest->GetHeaders().set("Upload-Time", toString(PAL::getUtcSystemTimeMs()));
 
         std::string tenantTokens;
         tenantTokens.reserve(ctx->packageIds.size() * 75); // Tenants tokens are usually 74 chars long.
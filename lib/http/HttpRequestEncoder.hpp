@@ -14,6 +14,11 @@
 
 #include "IAuthTokensController.hpp"
 
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
 namespace MAT_NS_BEGIN {
 
     class HttpRequestEncoder {
@@ -30,12 +35,28 @@ namespace MAT_NS_BEGIN {
         IHttpClient &           m_httpClient;
         IRuntimeConfig&         m_config;
 
-        IAuthTokensController* GetAuthTokensController()
+        virtual IAuthTokensController* GetAuthTokensController()
         {
             return m_system.getLogManager().GetAuthTokensController();
         }
 
         virtual void DispatchDataViewerEvent(const StorageBlob& dataPacket);
+
+        bool isHeaderTemplateCurrent(IAuthTokensController* tokens) const;
+        void buildHeaderTemplate(IAuthTokensController* tokens);
+
+        /// <summary>
+        /// Headers that are the same for every request until the auth tokens change, sorted
+        /// by name, and a fingerprint of the tokens they were built from: the map sizes, the
+        /// strict mode and a hash of the tokens. Guarded by m_headerTemplateLock.
+        /// </summary>
+        std::mutex                                       m_headerTemplateLock;
+        std::vector<std::pair<std::string, std::string>> m_headerTemplate;
+        bool                                             m_headerTemplateValid = false;
+        size_t                                           m_deviceTokenCount = 0;
+        size_t                                           m_userTokenCount = 0;
+        size_t                                           m_tokensHash = 0;
+        bool                                             m_strictMode = false;
     };
 
 
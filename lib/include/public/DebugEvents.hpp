@@ -123,6 +123,8 @@ namespace MAT_NS_BEGIN
         EVT_STORAGE_FULL        = 0x0E000000,
         /// <summary>Storage failed.</summary>
         EVT_STORAGE_FAILED      = 0x0E000001,
+        /// <summary>Storage backpressure: param1 is 1 while events arrive faster than the RAM queue is flushed to disk, 0 once flushing has caught up.</summary>
+        EVT_STORAGE_BACKPRESSURE = 0x0E000002,
 
         /// <summary>Ticket Expired</summary>
         EVT_TICKET_EXPIRED      = 0x0F000000,
@@ -90,10 +90,52 @@ namespace MAT_NS_BEGIN
     static constexpr const char* const CFG_BOOL_ENABLE_DB_DROP_IF_FULL = "enableDbDropIfFull";
 
     /// <summary>
-    /// Enable database compression.
+    /// Maximum number of database pages freed by a single trim step when the DB file exceeds its limit.
+    /// </summary>
+    static constexpr const char* const CFG_INT_DB_TRIM_PAGE_BUDGET = "dbTrimPageBudget";
+
+    /// <summary>
+    /// Share of the storage size limit, in percent, that a single tenant may use before its events are trimmed first.
+    /// </summary>
+    static constexpr const char* const CFG_INT_TENANT_QUOTA_PCT = "tenantQuotaPercentage";
+
+    /// <summary>
+    /// Number of acknowledged events buffered before they are deleted from the database in one batch. 0 deletes them right away.
+    /// </summary>
+    static constexpr const char* const CFG_INT_DB_DELETE_BATCH_SIZE = "dbDeleteBatchSize";
+
+    /// <summary>
+    /// Maximum time, in milliseconds, that acknowledged events are buffered when CFG_INT_DB_DELETE_BATCH_SIZE is set.
+    /// </summary>
+    static constexpr const char* const CFG_INT_DB_DELETE_BATCH_INTERVAL = "dbDeleteBatchIntervalMs";
+
+    /// <summary>
+    /// Enable deflate compression of event payloads stored in the offline storage database.
     /// </summary>
     static constexpr const char* const CFG_BOOL_ENABLE_DB_COMPRESS = "enableDBCompression";
 
+    /// <summary>
+    /// zlib compression level (1..9) used when CFG_BOOL_ENABLE_DB_COMPRESS is set.
+    /// </summary>
+    static constexpr const char* const CFG_INT_DB_COMPRESSION_LEVEL = "dbCompressionLevel";
+
+    /// <summary>
+    /// Scan events for upload on a second, read-only SQLite connection so that the scan does not block inserts.
+    /// </summary>
+    static constexpr const char* const CFG_BOOL_ENABLE_DB_READER_CONNECTION = "enableDBReaderConnection";
+
+    /// <summary>
+    /// Interleave the events of different tenants of the same latency when they are retrieved for upload.
+    /// With SQLite storage every retrieval ranks all unreserved events of the requested latencies,
+    /// which costs a sort of the whole table instead of an index range scan.
+    /// </summary>
+    static constexpr const char* const CFG_BOOL_ENABLE_FAIR_PACKING = "enableFairPacking";
+
+    /// <summary>
+    /// Map of tenant tokens to their relative share of every upload when CFG_BOOL_ENABLE_FAIR_PACKING is set. Default is 1.
+    /// </summary>
+    static constexpr const char* const CFG_MAP_TENANT_UPLOAD_WEIGHTS = "tenantUploadWeights";
+
     /// <summary>
     /// Enable WAL journal.
     /// </summary>
@@ -139,6 +181,26 @@ namespace MAT_NS_BEGIN
     /// </summary>
     static constexpr const char* const CFG_INT_RAM_QUEUE_SIZE = "cacheMemorySizeLimitInBytes";
 
+    /// <summary>
+    /// The size limit in bytes of the compressed in-memory tier between the RAM queue and the cache file.
+    /// </summary>
+    static constexpr const char* const CFG_INT_RAM_COMPRESSED_SIZE = "cacheCompressedMemorySizeLimitInBytes";
+
+    /// <summary>
+    /// Spill the RAM queue to a sequential file on shutdown, to be imported into the cache file on next start.
+    /// </summary>
+    static constexpr const char* const CFG_BOOL_ENABLE_SHUTDOWN_SPILL = "enableShutdownSpill";
+
+    /// <summary>
+    /// Journal critical events entering the RAM queue to an append-only file, replayed after a crash.
+    /// </summary>
+    static constexpr const char* const CFG_BOOL_ENABLE_RAM_QUEUE_JOURNAL = "enableRamQueueJournal";
+
+    /// <summary>
+    /// Target duration, in milliseconds, of one RAM queue flush to disk. When set, the flush threshold adapts to the measured disk throughput and backpressure is reported.
+    /// </summary>
+    static constexpr const char* const CFG_INT_RAM_QUEUE_FLUSH_TARGET_MS = "cacheMemoryFlushTargetMs";
+
     /// <summary>
     /// The size of the RAM queue buffers, in bytes.
     /// </summary>
@@ -261,6 +323,11 @@ namespace MAT_NS_BEGIN
     /// </summary>
     static constexpr const char* const CFG_MODULE_OFFLINE_STORAGE = "offlineStorage";
 
+    /// <summary>
+    /// IEvictionPolicy override module
+    /// </summary>
+    static constexpr const char* const CFG_MODULE_EVICTION_POLICY = "evictionPolicy";
+
     /// <summary>
     /// Pointer to the Android app's JavaVM
     /// </summary>
@@ -361,6 +428,68 @@ namespace MAT_NS_BEGIN
     /// </summary>
     static constexpr const char* const CFG_BOOL_TPM_CLOCK_SKEW_ENABLED = "clockSkewEnabled";
 
+    /// <summary>
+    /// TPM configuration: coalescing window in milliseconds for Max latency events. Events
+    /// arriving within the window after the first one share one upload. 0 uploads each event
+    /// right away.
+    /// </summary>
+    static constexpr const char* const CFG_INT_TPM_IMMEDIATE_BATCH_MS = "immediateBatchMs";
+
+    /// <summary>
+    /// TPM configuration: number of Max latency events that closes the coalescing window
+    /// early. 0 waits for the window to elapse.
+    /// </summary>
+    static constexpr const char* const CFG_INT_TPM_IMMEDIATE_BATCH_COUNT = "immediateBatchCount";
+
+    /// <summary>
+    /// TPM configuration: adapt the package size and the number of concurrent uploads to
+    /// the observed request durations and failures. maxBlobSize and maxPendingHTTPRequests
+    /// become upper bounds.
+    /// </summary>
+    static constexpr const char* const CFG_BOOL_TPM_ADAPTIVE_UPLOAD = "adaptiveUpload";
+
+    /// <summary>
+    /// TPM configuration: total size in bytes of the final request bodies kept for the retry
+    /// of uploads that failed temporarily. 0 packages and compresses the events again.
+    /// </summary>
+    static constexpr const char* const CFG_INT_TPM_RETRY_CACHE_SIZE = "retryCacheSize";
+
+    /// <summary>
+    /// TPM configuration: upload rate limit in bytes per second. 0 does not limit the rate.
+    /// </summary>
+    static constexpr const char* const CFG_INT_TPM_MAX_UPLOAD_BPS = "maxUploadBps";
+
+    /// <summary>
+    /// TPM configuration: bytes that may be uploaded at once after an idle period. 0 allows
+    /// one second worth of maxUploadBps.
+    /// </summary>
+    static constexpr const char* const CFG_INT_TPM_UPLOAD_BURST_BYTES = "uploadBurstBytes";
+
+    /// <summary>
+    /// TPM configuration map: upload rate limits in bytes per second by tenant token, applied
+    /// in addition to maxUploadBps.
+    /// </summary>
+    static constexpr const char* const CFG_MAP_TPM_TENANT_UPLOAD_BPS = "tenantUploadBps";
+
+    /// <summary>
+    /// TPM configuration: number of stored events above which the backlog is drained with
+    /// maxPendingHTTPRequests uploads kept in flight until storage is empty. 0 disables draining.
+    /// </summary>
+    static constexpr const char* const CFG_INT_TPM_DRAIN_THRESHOLD = "drainThreshold";
+
+    /// <summary>
+    /// TPM configuration: upload rate limit in bytes per second while draining the backlog.
+    /// 0 does not limit the rate beyond maxUploadBps.
+    /// </summary>
+    static constexpr const char* const CFG_INT_TPM_DRAIN_MAX_BPS = "drainMaxBps";
+
+    /// <summary>
+    /// TPM configuration: schedule uploads earliest deadline first. The transmit profile timers
+    /// become the maximum time Normal and RealTime events wait for their upload, and an upload
+    /// starts at the earliest deadline of the stored events, or once they fill a package.
+    /// </summary>
+    static constexpr const char* const CFG_BOOL_TPM_DEADLINE_SCHEDULING = "deadlineScheduling";
+
     /// <summary>
     /// When enabled, the session timer is reset after session is completed, allowing for several session events in the duration of the SDK lifecycle
     /// </summary>
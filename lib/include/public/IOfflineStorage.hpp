@@ -19,6 +19,7 @@ namespace MAT_NS_BEGIN {
 
     constexpr unsigned int DB_FULL_NOTIFICATION_DEFAULT_PERCENTAGE = 75;
     constexpr uint64_t     DB_FULL_CHECK_INTERVAL_DEFAULT_MS = 5000;
+    constexpr unsigned int DB_TRIM_PAGE_BUDGET_DEFAULT = 256;
 
     using StorageRecordId = std::string;
 
@@ -217,6 +218,25 @@ namespace MAT_NS_BEGIN {
         virtual bool GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs,
             EventLatency minLatency = EventLatency_Unspecified, unsigned maxCount = 0) = 0;
 
+        /// <summary>
+        /// Retrieve the best records to upload, skipping the records of some tenants
+        /// </summary>
+        /// <remarks>
+        /// Same as the method above, except that the records of
+        /// <paramref name="excludedTenants"/>, e.g. tenants over their upload
+        /// rate, are skipped and stay unreserved. The default implementation
+        /// ignores the list: the consumer then ends the retrieval at the first
+        /// record of an excluded tenant.
+        /// </remarks>
+        /// <param name="excludedTenants">Tenants whose records are
+        /// skipped</param>
+        virtual bool GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs,
+            EventLatency minLatency, unsigned maxCount, std::vector<std::string> const& excludedTenants)
+        {
+            UNREFERENCED_PARAMETER(excludedTenants);
+            return GetAndReserveRecords(consumer, leaseTimeMs, minLatency, maxCount);
+        }
+
         /// <summary>
         /// return where the last read was memory or disk
         /// </summary>
@@ -344,6 +364,37 @@ namespace MAT_NS_BEGIN {
     {
     };
 
+    /// <summary>
+    /// Attributes of a stored record considered for eviction when the storage is full.
+    /// </summary>
+    struct EvictionCandidate {
+        std::string      tenantToken;
+        EventLatency     latency = EventLatency_Unspecified;
+        EventPersistence persistence = EventPersistence_Normal;
+        int64_t          timestamp = 0;
+        size_t           size = 0;
+    };
+
+    /// <summary>
+    /// Eviction policy override module. Decides which records the offline storage
+    /// drops first when it exceeds its size limit.
+    /// </summary>
+    class IEvictionPolicy : public IModule
+    {
+    public:
+        /// <summary>
+        /// Returns true if record a should be evicted before record b.
+        /// Must be a strict weak ordering.
+        /// </summary>
+        virtual bool EvictBefore(EvictionCandidate const& a, EvictionCandidate const& b) const = 0;
+
+        /// <summary>
+        /// Returns the number of bytes a tenant may use in a storage of the given capacity,
+        /// or 0 if the tenant has no quota. Tenants over their quota are evicted from first.
+        /// </summary>
+        virtual size_t GetTenantQuota(std::string const& tenantToken, size_t capacity) const = 0;
+    };
+
 
 } MAT_NS_END
 #endif
@@ -0,0 +1,178 @@
+//
+// Copyright (c) 2015-2020 Microsoft Corporation and Contributors.
+// SPDX-License-Identifier: Apache-2.0
+//
+
+#include "EvictionPolicy.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <set>
+#include <unordered_map>
+
+namespace MAT_NS_BEGIN {
+
+    DefaultEvictionPolicy::DefaultEvictionPolicy(unsigned tenantQuotaPercent) :
+        m_tenantQuotaPercent(std::min(tenantQuotaPercent, 100u))
+    {
+    }
+
+    bool DefaultEvictionPolicy::EvictBefore(EvictionCandidate const& a, EvictionCandidate const& b) const
+    {
+        if (a.persistence != b.persistence)
+            return a.persistence < b.persistence;
+        if (a.latency != b.latency)
+            return a.latency < b.latency;
+        return a.timestamp < b.timestamp;
+    }
+
+    size_t DefaultEvictionPolicy::GetTenantQuota(std::string const& tenantToken, size_t capacity) const
+    {
+        UNREFERENCED_PARAMETER(tenantToken);
+        return static_cast<size_t>((static_cast<uint64_t>(capacity) * m_tenantQuotaPercent) / 100);
+    }
+
+    std::shared_ptr<IEvictionPolicy> DefaultEvictionPolicy::Create(ILogManager& logManager, IRuntimeConfig& runtimeConfig)
+    {
+        std::shared_ptr<IModule> module = logManager.GetLogConfiguration().GetModule(CFG_MODULE_EVICTION_POLICY);
+        if (nullptr != module)
+        {
+            return std::static_pointer_cast<IEvictionPolicy>(module);
+        }
+        return std::make_shared<DefaultEvictionPolicy>(runtimeConfig[CFG_INT_TENANT_QUOTA_PCT]);
+    }
+
+    bool DefaultEvictionPolicy::IsDefault(ILogManager& logManager)
+    {
+        return logManager.GetLogConfiguration().GetModule(CFG_MODULE_EVICTION_POLICY) == nullptr;
+    }
+
+    bool DefaultEvictionPolicy::HasTenantQuotas(ILogManager& logManager, IRuntimeConfig& runtimeConfig)
+    {
+        return !IsDefault(logManager) || (static_cast<unsigned>(runtimeConfig[CFG_INT_TENANT_QUOTA_PCT]) != 0);
+    }
+
+    std::vector<size_t> SelectEvictionVictims(IEvictionPolicy const& policy, std::vector<EvictionCandidate> const& candidates, size_t capacity, size_t bytesToFree)
+    {
+        // Heaps keep the next record to evict on top
+        auto evictLater = [&](size_t a, size_t b) { return policy.EvictBefore(candidates[b], candidates[a]); };
+
+        struct TenantUsage
+        {
+            std::vector<size_t> heap;
+            size_t              bytes = 0;
+            size_t              quota = 0;
+        };
+        std::unordered_map<std::string, TenantUsage> tenants;
+        std::vector<size_t> global(candidates.size());
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            global[i] = i;
+            auto& tenant = tenants[candidates[i].tenantToken];
+            tenant.heap.push_back(i);
+            tenant.bytes += candidates[i].size;
+        }
+        std::make_heap(global.begin(), global.end(), evictLater);
+
+        // Tenants over quota ordered by how far they are over it. Usage only
+        // decreases, so no other tenant can join this set later.
+        std::set<std::pair<size_t, std::string const*>> overQuota;
+        for (auto& kv : tenants)
+        {
+            auto& tenant = kv.second;
+            tenant.quota = policy.GetTenantQuota(kv.first, capacity);
+            if ((tenant.quota > 0) && (tenant.bytes > tenant.quota))
+            {
+                std::make_heap(tenant.heap.begin(), tenant.heap.end(), evictLater);
+                overQuota.emplace(tenant.bytes - tenant.quota, &kv.first);
+            }
+        }
+
+        std::vector<size_t> victims;
+        std::vector<bool> evicted(candidates.size(), false);
+        size_t freed = 0;
+        while (freed < bytesToFree)
+        {
+            // Records evicted through another heap are skipped lazily
+            std::vector<size_t>* heap = &global;
+            if (!overQuota.empty())
+            {
+                auto top = std::prev(overQuota.end());
+                heap = &tenants[*top->second].heap;
+                overQuota.erase(top);
+            }
+            size_t victim = candidates.size();
+            while (!heap->empty() && (victim == candidates.size()))
+            {
+                std::pop_heap(heap->begin(), heap->end(), evictLater);
+                if (!evicted[heap->back()])
+                {
+                    victim = heap->back();
+                }
+                heap->pop_back();
+            }
+            if (victim == candidates.size())
+            {
+                if (heap == &global)
+                {
+                    break;
+                }
+                continue;
+            }
+
+            evicted[victim] = true;
+            victims.push_back(victim);
+            freed += candidates[victim].size;
+
+            auto tenantIt = tenants.find(candidates[victim].tenantToken);
+            auto& tenant = tenantIt->second;
+            tenant.bytes -= candidates[victim].size;
+            if ((heap != &global) && (tenant.bytes > tenant.quota))
+            {
+                overQuota.emplace(tenant.bytes - tenant.quota, &tenantIt->first);
+            }
+        }
+        return victims;
+    }
+
+    std::unordered_map<std::string, size_t> SelectTenantTrims(IEvictionPolicy const& policy, std::unordered_map<std::string, size_t> const& tenantBytes, size_t capacity, size_t bytesToFree)
+    {
+        std::vector<std::pair<size_t, std::string const*>> overQuota;
+        for (auto const& kv : tenantBytes)
+        {
+            size_t quota = policy.GetTenantQuota(kv.first, capacity);
+            if ((quota > 0) && (kv.second > quota))
+            {
+                overQuota.emplace_back(kv.second - quota, &kv.first);
+            }
+        }
+        std::sort(overQuota.begin(), overQuota.end(), std::greater<std::pair<size_t, std::string const*>>());
+
+        // Trimming the first k tenants down to the overage of the next one frees their
+        // overage sum minus k times the next one. Stop at the first k where that is enough.
+        size_t level = 0;
+        uint64_t sum = 0;
+        for (size_t k = 0; k < overQuota.size(); k++)
+        {
+            sum += overQuota[k].first;
+            uint64_t next = (k + 1 < overQuota.size()) ? overQuota[k + 1].first : 0;
+            if (sum - (k + 1) * next >= bytesToFree)
+            {
+                level = static_cast<size_t>((sum - bytesToFree) / (k + 1));
+                break;
+            }
+        }
+
+        std::unordered_map<std::string, size_t> trims;
+        for (auto const& item : overQuota)
+        {
+            if (item.first <= level)
+            {
+                break;
+            }
+            trims[*item.second] = item.first - level;
+        }
+        return trims;
+    }
+
+} MAT_NS_END
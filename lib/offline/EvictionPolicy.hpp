@@ -0,0 +1,79 @@
+//
+// Copyright (c) 2015-2020 Microsoft Corporation and Contributors.
+// SPDX-License-Identifier: Apache-2.0
+//
+#ifndef EVICTIONPOLICY_HPP
+#define EVICTIONPOLICY_HPP
+
+#include "IOfflineStorage.hpp"
+#include "api/IRuntimeConfig.hpp"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace MAT_NS_BEGIN {
+
+    /// <summary>
+    /// Built-in eviction policy: drops the least persistent, lowest latency and oldest
+    /// records first, and gives every tenant the same share of the storage size limit.
+    /// </summary>
+    class DefaultEvictionPolicy : public IEvictionPolicy
+    {
+    public:
+        DefaultEvictionPolicy(unsigned tenantQuotaPercent);
+
+        virtual bool EvictBefore(EvictionCandidate const& a, EvictionCandidate const& b) const override;
+        virtual size_t GetTenantQuota(std::string const& tenantToken, size_t capacity) const override;
+
+        /// <summary>
+        /// Get the eviction policy module registered by the application, or the built-in policy.
+        /// </summary>
+        static std::shared_ptr<IEvictionPolicy> Create(ILogManager& logManager, IRuntimeConfig& runtimeConfig);
+
+        /// <summary>
+        /// Whether the built-in policy applies, so that storage may select victims in its
+        /// order with indexed queries instead of comparing every record.
+        /// </summary>
+        static bool IsDefault(ILogManager& logManager);
+
+        /// <summary>
+        /// Whether tenants may have a quota, so that storage has to track their usage.
+        /// Registered policies are assumed to use quotas.
+        /// </summary>
+        static bool HasTenantQuotas(ILogManager& logManager, IRuntimeConfig& runtimeConfig);
+
+    protected:
+        unsigned m_tenantQuotaPercent;
+    };
+
+    /// <summary>
+    /// Select the records to evict until at least bytesToFree bytes are freed. Tenants over
+    /// their quota are trimmed first, the one furthest over its quota at each step, then
+    /// records are taken in policy order regardless of tenant.
+    /// </summary>
+    /// <param name="policy">Eviction policy</param>
+    /// <param name="candidates">All records of the storage</param>
+    /// <param name="capacity">Storage size limit, in the units of the candidate sizes</param>
+    /// <param name="bytesToFree">Amount to free, in the units of the candidate sizes</param>
+    /// <returns>Indices into candidates, in eviction order</returns>
+    /// <remarks>O(n) to build the heaps, then O(log n) per evicted record. Only used with
+    /// registered policies, storage walks the built-in order with SelectTenantTrims.</remarks>
+    std::vector<size_t> SelectEvictionVictims(IEvictionPolicy const& policy, std::vector<EvictionCandidate> const& candidates, size_t capacity, size_t bytesToFree);
+
+    /// <summary>
+    /// Split the amount to free among the tenants over their quota. As in SelectEvictionVictims,
+    /// the tenants furthest over their quota are trimmed down to a common level first.
+    /// </summary>
+    /// <param name="policy">Eviction policy</param>
+    /// <param name="tenantBytes">Storage usage by tenant</param>
+    /// <param name="capacity">Storage size limit, in the units of the usage</param>
+    /// <param name="bytesToFree">Amount to free, in the units of the usage</param>
+    /// <returns>Amount to free by tenant, about bytesToFree in total at most. The rest is
+    /// freed in policy order regardless of tenant.</returns>
+    /// <remarks>O(t log t) for t tenants.</remarks>
+    std::unordered_map<std::string, size_t> SelectTenantTrims(IEvictionPolicy const& policy, std::unordered_map<std::string, size_t> const& tenantBytes, size_t capacity, size_t bytesToFree);
+
+} MAT_NS_END
+
+#endif
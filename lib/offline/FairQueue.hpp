@@ -0,0 +1,177 @@
+//
+// Copyright (c) 2015-2020 Microsoft Corporation and Contributors.
+// SPDX-License-Identifier: Apache-2.0
+//
+#ifndef FAIRQUEUE_HPP
+#define FAIRQUEUE_HPP
+
+#include "pal/PAL.hpp"
+#include "api/IRuntimeConfig.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+namespace MAT_NS_BEGIN {
+
+    /// <summary>
+    /// Weighted fair queueing of records across tenant tokens. Within one latency, the n-th
+    /// record of a tenant is due at virtual time n / weight, and records are handed out in
+    /// order of that time. Each tenant with pending records thus gets at least its weight's
+    /// share of every package, whatever the volume of the other tenants.
+    /// </summary>
+    /// <remarks>
+    /// Configured once when the storage is created and read-only afterwards.
+    /// Tenants without a configured weight have a weight of 1.
+    /// </remarks>
+    class FairQueue
+    {
+    public:
+        FairQueue() = default;
+
+        void Configure(IRuntimeConfig& config)
+        {
+            std::map<std::string, unsigned> weights;
+            if (config.HasConfig(CFG_MAP_TENANT_UPLOAD_WEIGHTS))
+            {
+                Variant& value = config[CFG_MAP_TENANT_UPLOAD_WEIGHTS];
+                if (value.type == Variant::TYPE_OBJ)
+                {
+                    VariantMap& map = value;
+                    for (auto& item : map)
+                    {
+                        weights[item.first] = static_cast<unsigned>(item.second);
+                    }
+                }
+            }
+            Configure(config[CFG_BOOL_ENABLE_FAIR_PACKING], weights);
+        }
+
+        void Configure(bool enabled, std::map<std::string, unsigned> const& weights)
+        {
+            m_enabled = enabled;
+            m_weights.clear();
+            for (auto const& item : weights)
+            {
+                // A weight of 0 would starve the tenant
+                if (item.second > 1)
+                {
+                    m_weights[item.first] = item.second;
+                }
+            }
+        }
+
+        bool IsEnabled() const
+        {
+            return m_enabled;
+        }
+
+        unsigned GetWeight(std::string const& tenantToken) const
+        {
+            auto it = m_weights.find(tenantToken);
+            return (it != m_weights.end()) ? it->second : 1;
+        }
+
+        /// <summary>
+        /// Fair service order of count records, given in their per-tenant order.
+        /// Records of the same virtual time keep their original order.
+        /// </summary>
+        /// <param name="count">Number of records</param>
+        /// <param name="tenantAt">Tenant token of the record at a given position</param>
+        /// <returns>Positions of the records in service order</returns>
+        std::vector<size_t> Order(size_t count, std::function<std::string const&(size_t)> const& tenantAt) const
+        {
+            std::map<std::string, size_t> slots;
+            std::vector<Flow> flows;
+            for (size_t i = 0; i < count; i++)
+            {
+                std::string const& tenantToken = tenantAt(i);
+                auto it = slots.find(tenantToken);
+                if (it == slots.end())
+                {
+                    it = slots.emplace(tenantToken, flows.size()).first;
+                    flows.emplace_back();
+                    flows.back().weight = GetWeight(tenantToken);
+                }
+                flows[it->second].positions.push_back(i);
+            }
+
+            // Heap of (flow, index of its next record), earliest virtual time first
+            auto later = [&flows](std::pair<size_t, size_t> const& a, std::pair<size_t, size_t> const& b)
+            {
+                // (a.second + 1) / wa > (b.second + 1) / wb, then original order
+                uint64_t ta = static_cast<uint64_t>(a.second + 1) * flows[b.first].weight;
+                uint64_t tb = static_cast<uint64_t>(b.second + 1) * flows[a.first].weight;
+                if (ta != tb)
+                {
+                    return ta > tb;
+                }
+                return flows[a.first].positions[a.second] > flows[b.first].positions[b.second];
+            };
+            std::priority_queue<std::pair<size_t, size_t>, std::vector<std::pair<size_t, size_t>>, decltype(later)> heap(later);
+            for (size_t flow = 0; flow < flows.size(); flow++)
+            {
+                heap.emplace(flow, 0);
+            }
+
+            std::vector<size_t> result;
+            result.reserve(count);
+            while (!heap.empty())
+            {
+                auto next = heap.top();
+                heap.pop();
+                result.push_back(flows[next.first].positions[next.second]);
+                if (next.second + 1 < flows[next.first].positions.size())
+                {
+                    heap.emplace(next.first, next.second + 1);
+                }
+            }
+            return result;
+        }
+
+        /// <summary>
+        /// SQL expression evaluating to the weight of the tenant in the given column.
+        /// </summary>
+        std::string GetWeightSql(char const* column) const
+        {
+            if (m_weights.empty())
+            {
+                return "1";
+            }
+            std::string sql = "CASE ";
+            sql += column;
+            for (auto const& item : m_weights)
+            {
+                sql += " WHEN '";
+                for (char c : item.first)
+                {
+                    sql += c;
+                    if (c == '\'')
+                    {
+                        sql += c;
+                    }
+                }
+                sql += "' THEN ";
+                sql += std::to_string(item.second);
+            }
+            sql += " ELSE 1 END";
+            return sql;
+        }
+
+    protected:
+        struct Flow
+        {
+            unsigned            weight {};
+            std::vector<size_t> positions;
+        };
+
+        bool                            m_enabled {};
+        std::map<std::string, unsigned> m_weights;
+    };
+
+} MAT_NS_END
+
+#endif
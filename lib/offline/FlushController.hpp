@@ -0,0 +1,147 @@
+//
+// Copyright (c) 2015-2020 Microsoft Corporation and Contributors.
+// SPDX-License-Identifier: Apache-2.0
+//
+#ifndef FLUSHCONTROLLER_HPP
+#define FLUSHCONTROLLER_HPP
+
+#include "pal/PAL.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+namespace MAT_NS_BEGIN {
+
+    /// <summary>
+    /// Adaptive ram queue flush control. Measures the disk throughput of each flush and
+    /// the incoming event rate between flushes, and lowers the flush threshold so that
+    /// persisting one sealed buffer takes about the target time. Reports backpressure
+    /// while events arrive faster than they can be flushed.
+    /// </summary>
+    /// <remarks>
+    /// Producers only touch atomics. Rates are exponentially smoothed in bytes per second.
+    /// </remarks>
+    class FlushController
+    {
+    public:
+        FlushController() = default;
+
+        /// <summary>
+        /// Reset the controller for a ram queue of memoryLimit bytes. A targetFlushMs of 0
+        /// disables adaptation: the threshold stays at the limit and no backpressure is reported.
+        /// </summary>
+        void Configure(size_t memoryLimit, unsigned targetFlushMs)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_memoryLimit = memoryLimit;
+            m_targetFlushMs = targetFlushMs;
+            m_threshold = memoryLimit;
+            m_diskRate = 0;
+            m_incomingRate = 0;
+            m_incomingBytes = 0;
+            m_lastFlushTime = 0;
+            m_backpressure = false;
+        }
+
+        /// <summary>
+        /// Ram queue size above which a flush is scheduled.
+        /// </summary>
+        size_t GetFlushThreshold() const
+        {
+            return m_threshold;
+        }
+
+        uint64_t GetDiskRate() const
+        {
+            return m_diskRate;
+        }
+
+        uint64_t GetIncomingRate() const
+        {
+            return m_incomingRate;
+        }
+
+        bool IsBackpressured() const
+        {
+            return m_backpressure;
+        }
+
+        void OnRecordStored(size_t size)
+        {
+            if (m_targetFlushMs != 0)
+            {
+                m_incomingBytes += size;
+            }
+        }
+
+        /// <summary>
+        /// Account for a completed flush of bytes that took durationMs, and adjust the threshold.
+        /// </summary>
+        void OnFlushCompleted(size_t bytes, uint64_t durationMs, uint64_t now)
+        {
+            if (m_targetFlushMs == 0)
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(m_lock);
+            size_t incoming = m_incomingBytes.exchange(0);
+            if ((m_lastFlushTime != 0) && (now > m_lastFlushTime))
+            {
+                m_incomingRate = smooth(m_incomingRate, (static_cast<uint64_t>(incoming) * 1000) / (now - m_lastFlushTime));
+            }
+            m_lastFlushTime = now;
+
+            if (bytes > 0)
+            {
+                m_diskRate = smooth(m_diskRate, (static_cast<uint64_t>(bytes) * 1000) / std::max<uint64_t>(durationMs, 1));
+                uint64_t target = (m_diskRate * m_targetFlushMs) / 1000;
+                uint64_t minimum = m_memoryLimit / kMinThresholdDivisor;
+                m_threshold = static_cast<size_t>(std::min<uint64_t>(std::max(target, minimum), m_memoryLimit));
+            }
+        }
+
+        /// <summary>
+        /// Re-evaluate backpressure for a ram queue holding memorySize bytes not yet on disk.
+        /// Backpressure starts above the limit, or above the threshold while events arrive
+        /// faster than the disk takes them, and ends once below half the threshold.
+        /// </summary>
+        /// <returns>true if the state has changed</returns>
+        bool UpdateBackpressure(size_t memorySize)
+        {
+            if (m_targetFlushMs == 0)
+            {
+                return false;
+            }
+
+            size_t threshold = m_threshold;
+            bool backpressure = m_backpressure ?
+                (memorySize > threshold / 2) :
+                ((memorySize > m_memoryLimit) ||
+                 ((memorySize > threshold) && (m_diskRate > 0) && (m_incomingRate > m_diskRate)));
+            return (m_backpressure.exchange(backpressure) != backpressure);
+        }
+
+    protected:
+        static constexpr size_t kMinThresholdDivisor = 8;
+
+        static uint64_t smooth(uint64_t average, uint64_t sample)
+        {
+            return (average == 0) ? sample : (3 * average + sample) / 4;
+        }
+
+        std::mutex            m_lock;
+        size_t                m_memoryLimit {};
+        unsigned              m_targetFlushMs {};
+        std::atomic<size_t>   m_threshold {};
+        std::atomic<uint64_t> m_diskRate {};
+        std::atomic<uint64_t> m_incomingRate {};
+        std::atomic<size_t>   m_incomingBytes {};
+        uint64_t              m_lastFlushTime {};
+        std::atomic<bool>     m_backpressure {};
+    };
+
+} MAT_NS_END
+
+#endif
@@ -4,8 +4,10 @@
 //
 #include "MemoryStorage.hpp"
 
+#include "utils/FileUtils.hpp"
 #include "utils/StringUtils.hpp"
 #include <climits>
+#include <cstring>
 
 namespace MAT_NS_BEGIN {
 
@@ -15,9 +17,17 @@ namespace MAT_NS_BEGIN {
         m_observer(nullptr),
         m_config(runtimeConfig),
         m_logManager(logManager),
+        m_evictionPolicy(DefaultEvictionPolicy::Create(logManager, runtimeConfig)),
         m_size(0),
+        m_trackTenantUsage(DefaultEvictionPolicy::HasTenantQuotas(logManager, runtimeConfig)),
+        m_defaultEviction(DefaultEvictionPolicy::IsDefault(logManager)),
         m_lastReadCount(0)
     {
+        for (auto& count : m_recordCount)
+        {
+            count = 0;
+        }
+        m_fairQueue.Configure(runtimeConfig);
     }
     
     /// <summary>
@@ -104,7 +114,12 @@ namespace MAT_NS_BEGIN {
             LOG_WARN("Vector already contains this element!");
 #endif
 
+        if (m_trackTenantUsage)
+        {
+            m_tenantBytes[record.tenantToken] += record.blob.size() + sizeof(record);
+        }
         m_records[record.latency].push_back(std::move(record));
+        m_recordCount[record.latency]++;
         return true;
     }
 
@@ -119,6 +134,11 @@ namespace MAT_NS_BEGIN {
         return stored;
     }
 
+    bool MemoryStorage::GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs, EventLatency minLatency, unsigned maxCount)
+    {
+        return GetAndReserveRecords(consumer, leaseTimeMs, minLatency, maxCount, std::vector<std::string>());
+    }
+
     /// <summary>
     /// Get records from MemoryStorage.
     /// Getting records automatically deletes them.
@@ -128,8 +148,10 @@ namespace MAT_NS_BEGIN {
     /// <param name="leaseTimeMs">The lease time ms.</param>
     /// <param name="minLatency">The minimum latency.</param>
     /// <param name="maxCount">The maximum count.</param>
+    /// <param name="excludedTenants">Tenants whose records are skipped.</param>
     /// <returns></returns>
-    bool MemoryStorage::GetAndReserveRecords(std::function<bool(StorageRecord&&)> const & consumer, unsigned leaseTimeMs, EventLatency minLatency, unsigned maxCount)
+    bool MemoryStorage::GetAndReserveRecords(std::function<bool(StorageRecord&&)> const & consumer, unsigned leaseTimeMs, EventLatency minLatency, unsigned maxCount,
+        std::vector<std::string> const& excludedTenants)
     {
         UNREFERENCED_PARAMETER(leaseTimeMs);
 
@@ -149,11 +171,18 @@ namespace MAT_NS_BEGIN {
         // Start processing events of critical latency first
         for (int latency = static_cast<int>(EventLatency_Max); (latency >= static_cast<int>(minLatency)) && (maxCount); latency--)
         {
+            if (m_fairQueue.IsEnabled() || !excludedTenants.empty())
+            {
+                if (!getAndReserveOrderedRecords(consumer, leaseTimeMs, latency, maxCount, excludedTenants))
+                {
+                    return true;
+                }
+                continue;
+            }
             while (maxCount && (m_records[latency]).size())
             {
                 StorageRecord & record = m_records[latency].back();
 
-                size_t recordSize = record.blob.size() + sizeof(record);
                 StorageRecord forConsumer(record);
                 if (leaseTimeMs)
                 {
@@ -165,17 +194,105 @@ namespace MAT_NS_BEGIN {
                     return true;
                 }
 
+                releaseRecordUnsafe(latency, record);
                 if (leaseTimeMs) {
                     m_reserved_records[record.id] = std::move(record); // move to reserved
                 }
                 m_records[latency].pop_back();
-                m_size -= std::min(m_size, recordSize);
                 maxCount--;
                 m_lastReadCount++;
             }
         }
         return true;
     }
+
+    /// <summary>
+    /// Hand the records of one latency to the consumer in weighted fair order across tenants
+    /// if fair packing is enabled, skipping those of excluded tenants. Within a tenant, records
+    /// keep the order of GetAndReserveRecords. Called with the locks held.
+    /// </summary>
+    /// <returns>false if the consumer does not want more records</returns>
+    bool MemoryStorage::getAndReserveOrderedRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs, int latency, unsigned& maxCount,
+        std::vector<std::string> const& excludedTenants)
+    {
+        auto& records = m_records[latency];
+        size_t count = records.size();
+        if (count == 0)
+        {
+            return true;
+        }
+
+        // Positions count from the back of the buffer, which is served first
+        std::vector<size_t> order;
+        if (m_fairQueue.IsEnabled())
+        {
+            order = m_fairQueue.Order(count, [&records, count](size_t position) -> std::string const&
+            {
+                return records[count - 1 - position].tenantToken;
+            });
+        }
+        else
+        {
+            order.resize(count);
+            for (size_t position = 0; position < count; position++)
+            {
+                order[position] = position;
+            }
+        }
+
+        std::vector<bool> taken(count, false);
+        bool wantMore = true;
+        for (size_t position : order)
+        {
+            if (maxCount == 0)
+            {
+                break;
+            }
+            size_t index = count - 1 - position;
+            StorageRecord& record = records[index];
+            if (!excludedTenants.empty() &&
+                (std::find(excludedTenants.begin(), excludedTenants.end(), record.tenantToken) != excludedTenants.end()))
+            {
+                continue;
+            }
+
+            StorageRecord forConsumer(record);
+            if (leaseTimeMs)
+            {
+                forConsumer.reservedUntil = PAL::getUtcSystemTimeMs() + leaseTimeMs;
+            }
+
+            wantMore = consumer(std::move(forConsumer));
+            if (!wantMore)
+            {
+                break;
+            }
+
+            releaseRecordUnsafe(latency, record);
+            if (leaseTimeMs) {
+                m_reserved_records[record.id] = std::move(record);
+            }
+            taken[index] = true;
+            maxCount--;
+            m_lastReadCount++;
+        }
+
+        // Drop the consumed records, keeping the others in place
+        size_t kept = 0;
+        for (size_t index = 0; index < count; index++)
+        {
+            if (!taken[index])
+            {
+                if (kept != index)
+                {
+                    records[kept] = std::move(records[index]);
+                }
+                kept++;
+            }
+        }
+        records.resize(kept);
+        return wantMore;
+    }
     
     /// <summary>
     /// Determines whether the records were last read from memory. Always returns true.
@@ -215,31 +332,35 @@ namespace MAT_NS_BEGIN {
                 if (records.size()) {
                     records.clear();
                 }
+                m_recordCount[latency] = 0;
             }
             m_size = 0;
+            m_tenantBytes.clear();
             m_lastReadCount = 0;
         }
 
     }
 
-    void MemoryStorage::DeleteRecords(const std::map<std::string, std::string> & whereFilter)
+    bool MemoryStorage::MatchesFilter(StorageRecord const& r, std::map<std::string, std::string> const& whereFilter)
     {
-        auto matcher = [&](const StorageRecord &r, const std::map<std::string, std::string> & whereFilter)
+        bool matched = true;
+        for (const auto &kv : whereFilter)
         {
-            bool matched = true;
-            for (const auto &kv : whereFilter)
-            {
-                matched &=
-                    (kv.first == "record_id") ? (r.id == kv.second) :
-                    (kv.first == "tenant_token") ? (r.tenantToken == kv.second) :
-                    (kv.first == "latency") ? (std::to_string(r.latency) == kv.second) :
-                    (kv.first == "persistence") ? (std::to_string(r.persistence) == kv.second) :
-                    (kv.first == "retry_count") ? (std::to_string(r.retryCount) == kv.second) : false;
-                if (!matched)
-                    break;
-            }
-            return matched;
-        };
+            matched &=
+                (kv.first == "record_id") ? (r.id == kv.second) :
+                (kv.first == "tenant_token") ? (r.tenantToken == kv.second) :
+                (kv.first == "latency") ? (std::to_string(r.latency) == kv.second) :
+                (kv.first == "persistence") ? (std::to_string(r.persistence) == kv.second) :
+                (kv.first == "retry_count") ? (std::to_string(r.retryCount) == kv.second) : false;
+            if (!matched)
+                break;
+        }
+        return matched;
+    }
+
+    void MemoryStorage::DeleteRecords(const std::map<std::string, std::string> & whereFilter)
+    {
+        auto matcher = MatchesFilter;
 
         // Delete from reserved, which is typically a shorter list
         std::vector<StorageRecordId> m_reserved_ids;
@@ -271,8 +392,7 @@ namespace MAT_NS_BEGIN {
                     auto &v = *it;
                     if (matcher(v, whereFilter))
                     {
-                        size_t recordSize = v.blob.size() + sizeof(v);
-                        m_size -= std::min(m_size, recordSize);
+                        releaseRecordUnsafe(latency, v);
                         it = records.erase(it);
                         continue;
                     }
@@ -336,8 +456,7 @@ namespace MAT_NS_BEGIN {
                         {
                             // record id appears once only, so remove from set
                             idSet.erase(v.id);
-                            size_t recordSize = v.blob.size() + sizeof(v);
-                            m_size -= std::min(m_size, recordSize);
+                            releaseRecordUnsafe(latency, v);
                             it = records.erase(it);
                             continue;
                         }
@@ -449,11 +568,10 @@ namespace MAT_NS_BEGIN {
     /// Approximate ram queue size
     /// </returns>
     /// <remarks>
-    /// Called from the internal worker thread.
+    /// Called from the internal worker thread. Does not take the ram queue lock.
     /// </remarks>
     size_t MemoryStorage::GetSize()
     {
-        LOCKGUARD(m_records_lock);
         return m_size;
     }
 
@@ -462,22 +580,62 @@ namespace MAT_NS_BEGIN {
     /// If latency is unspecified, get the total number of records.
     /// </summary>
     /// <returns></returns>
+    /// <remarks>
+    /// O(1): reads the maintained counters and does not take the ram queue lock.
+    /// </remarks>
     size_t MemoryStorage::GetRecordCount(EventLatency latency) const
     {
-        LOCKGUARD(m_records_lock);
         size_t numRecords = 0;
         if (latency == EventLatency_Unspecified)
         {
             for (unsigned lat = EventLatency_Off; lat <= EventLatency_Max; lat++)
-                numRecords += m_records[lat].size();
+                numRecords += m_recordCount[lat];
         }
-        else
+        else if ((latency >= EventLatency_Off) && (latency <= EventLatency_Max))
         {
-            numRecords = m_records[latency].size();
+            numRecords = m_recordCount[latency];
         }
         return numRecords;
     }
 
+    /// <summary>
+    /// Recalculate per-latency record counters after m_records got replaced.
+    /// Must be called with m_records_lock held.
+    /// </summary>
+    void MemoryStorage::updateRecordCounts()
+    {
+        for (unsigned latency = EventLatency_Off; latency <= EventLatency_Max; latency++)
+        {
+            m_recordCount[latency] = m_records[latency].size();
+        }
+    }
+
+    /// <summary>
+    /// Take a record that leaves the ram queue off the size and counters.
+    /// Must be called with m_records_lock held.
+    /// </summary>
+    void MemoryStorage::releaseRecordUnsafe(int latency, StorageRecord const& record)
+    {
+        size_t recordSize = record.blob.size() + sizeof(record);
+        m_size -= std::min(m_size.load(), recordSize);
+        m_recordCount[latency]--;
+        if (m_trackTenantUsage)
+        {
+            auto it = m_tenantBytes.find(record.tenantToken);
+            if (it != m_tenantBytes.end())
+            {
+                if (it->second > recordSize)
+                {
+                    it->second -= recordSize;
+                }
+                else
+                {
+                    m_tenantBytes.erase(it);
+                }
+            }
+        }
+    }
+
     std::vector<StorageRecord> MemoryStorage::GetRecords(bool shutdown, EventLatency minLatency, unsigned maxCount)
     {
         UNREFERENCED_PARAMETER(shutdown);
@@ -494,16 +652,375 @@ namespace MAT_NS_BEGIN {
     }
     
     /// <summary>
-    /// Resizes the database.
+    /// Trim the ram queue back to its size limit once it has grown past twice the
+    /// limit, i.e. when flushing to disk cannot keep up with incoming events.
     /// </summary>
     /// <returns>If DB has been resized successfully</returns>
-    /// <remarks>This method is not currently implemented</remarks>
+    /// <remarks>
+    /// Records are chosen by the eviction policy. Reserved (in-flight) records are kept.
+    /// With the built-in policy the queue is walked in eviction order only as far as the
+    /// victims reach, a registered policy compares all records.
+    /// </remarks>
     bool MemoryStorage::ResizeDb()
     {
-        LOG_WARN("Not implemented!");
+        size_t sizeLimit = static_cast<uint32_t>(m_config[CFG_INT_RAM_QUEUE_SIZE]);
+        DroppedMap trimmed;
+        {
+            LOCKGUARD(m_records_lock);
+            if ((sizeLimit == 0) || (m_size <= 2 * sizeLimit))
+            {
+                return true;
+            }
+
+            if (m_defaultEviction)
+            {
+                evictInOrderUnsafe(sizeLimit, m_size - sizeLimit, trimmed);
+            }
+            else
+            {
+                evictByPolicyUnsafe(sizeLimit, m_size - sizeLimit, trimmed);
+            }
+        }
+
+        if (!trimmed.empty() && (m_observer != nullptr))
+        {
+            m_observer->OnStorageTrimmed(trimmed);
+        }
         return true;
     }
 
+    /// <summary>
+    /// Evict records in the built-in order: least persistent, then lowest latency, then
+    /// oldest. Tenants over their quota give up their share first. Records of a latency
+    /// are stored oldest first, so each pass stops at the last victim it needs.
+    /// Must be called with m_records_lock held.
+    /// </summary>
+    void MemoryStorage::evictInOrderUnsafe(size_t sizeLimit, size_t bytesToFree, DroppedMap& trimmed)
+    {
+        std::unordered_map<std::string, size_t> tenantTrims;
+        size_t tenantBytesToFree = 0;
+        if (m_trackTenantUsage)
+        {
+            tenantTrims = SelectTenantTrims(*m_evictionPolicy, m_tenantBytes, sizeLimit, bytesToFree);
+            for (auto const& trim : tenantTrims)
+            {
+                tenantBytesToFree += trim.second;
+            }
+        }
+
+        std::array<std::vector<bool>, EventLatency_Max + 1> evicted;
+        size_t freed = 0;
+        // The first pass trims the tenants over quota, the second one frees the rest
+        for (int pass = (tenantBytesToFree > 0) ? 0 : 1; pass < 2; pass++)
+        {
+            for (int persistence = EventPersistence_Normal; persistence <= EventPersistence_DoNotStoreOnDisk; persistence++)
+            {
+                for (size_t latency = 0; latency < m_records.size(); latency++)
+                {
+                    auto& records = m_records[latency];
+                    for (size_t i = 0; i < records.size(); i++)
+                    {
+                        if (((pass == 0) && (tenantBytesToFree == 0)) || ((pass == 1) && (freed >= bytesToFree)))
+                        {
+                            break;
+                        }
+                        auto const& record = records[i];
+                        if ((record.persistence != persistence) || (!evicted[latency].empty() && evicted[latency][i]))
+                        {
+                            continue;
+                        }
+                        size_t recordSize = record.blob.size() + sizeof(record);
+                        if (pass == 0)
+                        {
+                            auto trim = tenantTrims.find(record.tenantToken);
+                            if ((trim == tenantTrims.end()) || (trim->second == 0))
+                            {
+                                continue;
+                            }
+                            size_t tenantFreed = std::min(trim->second, recordSize);
+                            trim->second -= tenantFreed;
+                            tenantBytesToFree -= tenantFreed;
+                        }
+                        if (evicted[latency].empty())
+                        {
+                            evicted[latency].resize(records.size(), false);
+                        }
+                        evicted[latency][i] = true;
+                        freed += recordSize;
+                        trimmed[record.tenantToken]++;
+                        releaseRecordUnsafe(static_cast<int>(latency), record);
+                    }
+                }
+            }
+        }
+
+        // Compact the per-latency vectors from the first victim on, keeping the order of the remaining records
+        for (size_t latency = 0; latency < m_records.size(); latency++)
+        {
+            if (evicted[latency].empty())
+            {
+                continue;
+            }
+            auto& records = m_records[latency];
+            size_t kept = static_cast<size_t>(std::find(evicted[latency].begin(), evicted[latency].end(), true) - evicted[latency].begin());
+            for (size_t i = kept; i < records.size(); i++)
+            {
+                if (!evicted[latency][i])
+                {
+                    records[kept++] = std::move(records[i]);
+                }
+            }
+            records.resize(kept);
+        }
+    }
+
+    /// <summary>
+    /// Let the registered eviction policy choose victims among all records.
+    /// Must be called with m_records_lock held.
+    /// </summary>
+    void MemoryStorage::evictByPolicyUnsafe(size_t sizeLimit, size_t bytesToFree, DroppedMap& trimmed)
+    {
+        std::vector<EvictionCandidate> candidates;
+        for (size_t latency = 0; latency < m_records.size(); latency++)
+        {
+            for (size_t i = 0; i < m_records[latency].size(); i++)
+            {
+                auto const& record = m_records[latency][i];
+                EvictionCandidate candidate;
+                candidate.tenantToken = record.tenantToken;
+                candidate.latency = record.latency;
+                candidate.persistence = record.persistence;
+                candidate.timestamp = record.timestamp;
+                candidate.size = record.blob.size() + sizeof(record);
+                candidates.push_back(std::move(candidate));
+            }
+        }
+
+        auto victims = SelectEvictionVictims(*m_evictionPolicy, candidates, sizeLimit, bytesToFree);
+        std::vector<bool> evicted(candidates.size(), false);
+        for (size_t victim : victims)
+        {
+            evicted[victim] = true;
+            trimmed[candidates[victim].tenantToken]++;
+        }
+
+        // Compact the per-latency vectors, keeping the order of the remaining records
+        size_t index = 0;
+        for (size_t latency = 0; latency < m_records.size(); latency++)
+        {
+            auto& records = m_records[latency];
+            size_t kept = 0;
+            for (size_t i = 0; i < records.size(); i++, index++)
+            {
+                if (evicted[index])
+                {
+                    releaseRecordUnsafe(static_cast<int>(latency), records[i]);
+                }
+                else
+                {
+                    if (kept != i)
+                    {
+                        records[kept] = std::move(records[i]);
+                    }
+                    kept++;
+                }
+            }
+            records.resize(kept);
+        }
+    }
+
+    /// <summary>
+    /// Swap the contents of the ram queue with the buffer provided by the caller.
+    /// </summary>
+    /// <param name="buffer">Buffer that receives all unreserved records.
+    /// Its previous contents become the new ram queue.</param>
+    /// <returns>Approximate size of the records swapped out</returns>
+    /// <remarks>
+    /// The lock is held only for the duration of the per-latency vector swaps,
+    /// so producers calling StoreRecord() never wait on the consumer of the
+    /// sealed buffer. Caller normally passes an empty buffer.
+    /// </remarks>
+    size_t MemoryStorage::SwapRecords(StorageRecordBuffer& buffer)
+    {
+        size_t newSize = 0;
+        std::unordered_map<std::string, size_t> tenantBytes;
+        for (const auto& records : buffer)
+        {
+            for (const auto& record : records)
+            {
+                size_t recordSize = record.blob.size() + sizeof(record);
+                newSize += recordSize;
+                if (m_trackTenantUsage)
+                {
+                    tenantBytes[record.tenantToken] += recordSize;
+                }
+            }
+        }
+
+        LOCKGUARD(m_records_lock);
+        m_records.swap(buffer);
+        size_t sealedSize = m_size;
+        m_size = newSize;
+        m_tenantBytes.swap(tenantBytes);
+        updateRecordCounts();
+        return sealedSize;
+    }
+
+    namespace {
+
+        // Spill files are read back by the same device, so fields use native byte order
+        const char SpillFileMagic[8] = { 'M', 'A', 'T', 'S', 'P', 'I', 'L', '1' };
+
+        template<typename T>
+        void spillPut(std::vector<uint8_t>& out, T value)
+        {
+            auto bytes = reinterpret_cast<const uint8_t*>(&value);
+            out.insert(out.end(), bytes, bytes + sizeof(T));
+        }
+
+        void spillPut(std::vector<uint8_t>& out, const void* data, size_t size)
+        {
+            spillPut(out, static_cast<uint32_t>(size));
+            auto bytes = static_cast<const uint8_t*>(data);
+            out.insert(out.end(), bytes, bytes + size);
+        }
+
+        template<typename T>
+        bool spillGet(uint8_t const*& pos, uint8_t const* end, T& value)
+        {
+            if (static_cast<size_t>(end - pos) < sizeof(T))
+                return false;
+            std::memcpy(&value, pos, sizeof(T));
+            pos += sizeof(T);
+            return true;
+        }
+
+        template<typename C>
+        bool spillGetBytes(uint8_t const*& pos, uint8_t const* end, C& value)
+        {
+            uint32_t size = 0;
+            if (!spillGet(pos, end, size) || (static_cast<size_t>(end - pos) < size))
+                return false;
+            value.assign(pos, pos + size);
+            pos += size;
+            return true;
+        }
+
+    }
+
+    void MemoryStorage::SerializeSpillRecord(StorageRecord const& record, std::vector<uint8_t>& data)
+    {
+        spillPut(data, record.id.data(), record.id.size());
+        spillPut(data, record.tenantToken.data(), record.tenantToken.size());
+        spillPut(data, static_cast<int32_t>(record.latency));
+        spillPut(data, static_cast<int32_t>(record.persistence));
+        spillPut(data, static_cast<int64_t>(record.timestamp));
+        spillPut(data, static_cast<int32_t>(record.retryCount));
+        spillPut(data, record.blob.data(), record.blob.size());
+    }
+
+    std::FILE* MemoryStorage::OpenSpillFile(std::string const& path)
+    {
+        bool append = FileExists(path.c_str()) && (FileGetSize(path.c_str()) >= sizeof(SpillFileMagic));
+        std::FILE* file = FileOpen(path.c_str(), append ? "ab" : "wb");
+        if (file == nullptr)
+        {
+            LOG_ERROR("Failed to open spill file %s", path.c_str());
+            return nullptr;
+        }
+        if (!append && (std::fwrite(SpillFileMagic, 1, sizeof(SpillFileMagic), file) != sizeof(SpillFileMagic)))
+        {
+            LOG_ERROR("Failed to write header of spill file %s", path.c_str());
+            FileClose(file);
+            return nullptr;
+        }
+        return file;
+    }
+
+    bool MemoryStorage::WriteSpillFile(std::string const& path, StorageRecordBuffer const& buffer)
+    {
+        std::vector<uint8_t> data;
+
+        // Most urgent events first, so they are the first to be imported
+        for (auto it = buffer.rbegin(); it != buffer.rend(); ++it)
+        {
+            for (auto const& record : *it)
+            {
+                SerializeSpillRecord(record, data);
+            }
+        }
+
+        std::FILE* file = OpenSpillFile(path);
+        if (file == nullptr)
+        {
+            return false;
+        }
+        bool written = (std::fwrite(data.data(), 1, data.size(), file) == data.size());
+        written &= (std::fflush(file) == 0);
+        FileClose(file);
+        if (!written)
+        {
+            LOG_ERROR("Failed to write %zu bytes to spill file %s", data.size(), path.c_str());
+        }
+        return written;
+    }
+
+    bool MemoryStorage::ReadSpillFile(std::string const& path, std::vector<StorageRecord>& records)
+    {
+        std::FILE* file = FileOpen(path.c_str(), "rb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+
+        std::vector<uint8_t> data(FileGetSize(path.c_str()));
+        data.resize(data.empty() ? 0 : std::fread(data.data(), 1, data.size(), file));
+        FileClose(file);
+
+        bool valid = (data.size() >= sizeof(SpillFileMagic)) &&
+            (std::memcmp(data.data(), SpillFileMagic, sizeof(SpillFileMagic)) == 0);
+        if (!valid)
+        {
+            LOG_ERROR("Ignoring spill file %s: unknown format", path.c_str());
+            return false;
+        }
+        DeserializeSpillRecords(data.data() + sizeof(SpillFileMagic), data.size() - sizeof(SpillFileMagic), records);
+        return true;
+    }
+
+    size_t MemoryStorage::DeserializeSpillRecords(uint8_t const* data, size_t size, std::vector<StorageRecord>& records)
+    {
+        uint8_t const* pos = data;
+        uint8_t const* end = data + size;
+        size_t count = 0;
+        StorageRecord record;
+        int32_t latency;
+        int32_t persistence;
+        int64_t timestamp;
+        int32_t retryCount;
+        while (spillGetBytes(pos, end, record.id) &&
+            spillGetBytes(pos, end, record.tenantToken) &&
+            spillGet(pos, end, latency) &&
+            spillGet(pos, end, persistence) &&
+            spillGet(pos, end, timestamp) &&
+            spillGet(pos, end, retryCount) &&
+            spillGetBytes(pos, end, record.blob))
+        {
+            if (latency < EventLatency_Off || latency > EventLatency_Max)
+            {
+                latency = EventLatency_Normal;
+            }
+            record.latency = static_cast<EventLatency>(latency);
+            record.persistence = static_cast<EventPersistence>(persistence);
+            record.timestamp = timestamp;
+            record.retryCount = retryCount;
+            records.push_back(std::move(record));
+            record = StorageRecord();
+            count++;
+        }
+        return count;
+    }
+
     MemoryStorage::~MemoryStorage()
     {
         // Shutdown();
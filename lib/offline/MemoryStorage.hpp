@@ -12,18 +12,28 @@
 #include "IOfflineStorage.hpp"
 
 #include "api/IRuntimeConfig.hpp"
+#include "EvictionPolicy.hpp"
+#include "FairQueue.hpp"
 
 #include "ILogManager.hpp"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 
 namespace MAT_NS_BEGIN {
 
+    /// <summary>
+    /// Per-latency buffer of unreserved ram queue records.
+    /// </summary>
+    typedef std::array<std::vector<StorageRecord>, EventLatency_Max + 1> StorageRecordBuffer;
+
     class MemoryStorage : public IOfflineStorage
     {
 
@@ -43,6 +53,9 @@ namespace MAT_NS_BEGIN {
         virtual bool GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs,
             EventLatency minLatency = EventLatency_Unspecified, unsigned maxCount = 0) override;
 
+        virtual bool GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs,
+            EventLatency minLatency, unsigned maxCount, std::vector<std::string> const& excludedTenants) override;
+
         virtual bool IsLastReadFromMemory() override;
 
         virtual unsigned LastReadRecordCount() override;
@@ -73,6 +86,41 @@ namespace MAT_NS_BEGIN {
 
         virtual bool ResizeDb() override;
 
+        virtual size_t SwapRecords(StorageRecordBuffer& buffer);
+
+        /// <summary>
+        /// Append the records of a sealed ram queue buffer to a shutdown spill file,
+        /// as one sequential write of length-prefixed fields.
+        /// </summary>
+        static bool WriteSpillFile(std::string const& path, StorageRecordBuffer const& buffer);
+
+        /// <summary>
+        /// Open a spill file for appending, writing the file header if it is new.
+        /// </summary>
+        static std::FILE* OpenSpillFile(std::string const& path);
+
+        /// <summary>
+        /// Append a record in spill file format to a buffer.
+        /// </summary>
+        static void SerializeSpillRecord(StorageRecord const& record, std::vector<uint8_t>& data);
+
+        /// <summary>
+        /// Parse records in spill file format, up to the first incomplete record.
+        /// </summary>
+        /// <returns>Number of records appended</returns>
+        static size_t DeserializeSpillRecords(uint8_t const* data, size_t size, std::vector<StorageRecord>& records);
+
+        /// <summary>
+        /// Read the records of a shutdown spill file. Reading stops at the first
+        /// incomplete record, e.g. if the process was killed while spilling.
+        /// </summary>
+        static bool ReadSpillFile(std::string const& path, std::vector<StorageRecord>& records);
+
+        /// <summary>
+        /// Check a record against the key-value pairs of a DeleteRecords where filter.
+        /// </summary>
+        static bool MatchesFilter(StorageRecord const& record, std::map<std::string, std::string> const& whereFilter);
+
         virtual ~MemoryStorage() override;
 
     protected:
@@ -80,9 +128,11 @@ namespace MAT_NS_BEGIN {
         IOfflineStorageObserver*    m_observer;
         IRuntimeConfig&             m_config;
         ILogManager&                m_logManager;
+        std::shared_ptr<IEvictionPolicy> m_evictionPolicy;
+        FairQueue                   m_fairQueue;
 
         mutable std::mutex          m_records_lock;
-        std::vector<StorageRecord>  m_records[EventLatency_Max+1];
+        StorageRecordBuffer         m_records;
         
         /// <summary>
         /// Contains reserved (aka in-flight) records.
@@ -91,7 +141,36 @@ namespace MAT_NS_BEGIN {
         std::mutex                  m_reserved_lock;
         std::map<StorageRecordId, StorageRecord> m_reserved_records;
 
-        size_t                      m_size;
+        /// <summary>
+        /// Approximate size and per-latency number of unreserved records.
+        /// Updated under m_records_lock, read without it.
+        /// </summary>
+        std::atomic<size_t>         m_size;
+        std::atomic<size_t>         m_recordCount[EventLatency_Max + 1];
+
+        /// <summary>
+        /// Approximate size of the unreserved records by tenant, kept only while tenant
+        /// quotas may apply. Updated under m_records_lock.
+        /// </summary>
+        bool                        m_trackTenantUsage;
+        std::unordered_map<std::string, size_t> m_tenantBytes;
+
+        /// <summary>
+        /// Whether the built-in eviction policy applies, ResizeDb then walks the ram queue
+        /// in eviction order instead of comparing every record.
+        /// </summary>
+        bool                        m_defaultEviction;
+
+        void updateRecordCounts();
+
+        void releaseRecordUnsafe(int latency, StorageRecord const& record);
+
+        void evictInOrderUnsafe(size_t sizeLimit, size_t bytesToFree, DroppedMap& trimmed);
+
+        void evictByPolicyUnsafe(size_t sizeLimit, size_t bytesToFree, DroppedMap& trimmed);
+
+        bool getAndReserveOrderedRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs, int latency, unsigned& maxCount,
+            std::vector<std::string> const& excludedTenants);
 
         MATSDK_LOG_DECL_COMPONENT_CLASS();
 
@@ -7,11 +7,14 @@
 #include "OfflineStorageFactory.hpp"
 
 #include "offline/MemoryStorage.hpp"
+#include "utils/FileUtils.hpp"
+#include "utils/ZlibUtils.hpp"
 
 #include "ILogManager.hpp"
 #include <algorithm>
 #include <numeric>
 #include <set>
+#include <unordered_map>
 
 namespace MAT_NS_BEGIN {
 
@@ -26,10 +29,26 @@ namespace MAT_NS_BEGIN {
         m_killSwitchManager(),
         m_clockSkewManager(),
         m_flushPending(false),
+        m_memoryLimit(0),
+        m_storageIoThread(nullptr),
+        m_sealedCount(),
+        m_sealedSize(0),
+        m_spillOnShutdown(false),
+        m_journalEnabled(false),
+        m_journalSize(0),
+        m_journalSyncPending(false),
+        m_journalFile(nullptr),
+        m_compressedCount(),
+        m_compressedSize(0),
+        m_compressedLimit(0),
+        m_compressionLevel(0),
         m_offlineStorageMemory(nullptr),
         m_offlineStorageDisk(nullptr),
         m_readFromMemory(false),
         m_lastReadCount(0),
+        m_mixedReadNextExpiry(0),
+        m_deleteFlushPending(false),
+        m_deleteBatchInterval(0),
         m_shutdownStarted(false),
         m_memoryDbSize(0),
         m_queryDbSize(0),
@@ -70,6 +89,11 @@ namespace MAT_NS_BEGIN {
     OfflineStorageHandler::~OfflineStorageHandler()
     {
         WaitForFlush();
+        StopStorageIoThread();
+        {
+            LOCKGUARD(m_journalFileLock);
+            closeJournalUnsafe();
+        }
         if (nullptr != m_offlineStorageMemory)
         {
             m_offlineStorageMemory.reset();
@@ -84,10 +108,23 @@ namespace MAT_NS_BEGIN {
     {
         m_observer = &observer;
         uint32_t cacheMemorySizeLimitInBytes = m_config[CFG_INT_RAM_QUEUE_SIZE];
+        m_memoryLimit = cacheMemorySizeLimitInBytes;
+        m_flushController.Configure(m_memoryLimit, m_config[CFG_INT_RAM_QUEUE_FLUSH_TARGET_MS]);
 
         m_offlineStorageDisk = OfflineStorageFactory::Create(m_logManager, m_config);
         m_offlineStorageDisk->Initialize(*this);
 
+        std::string cacheFilePath = (const char *)m_config[CFG_STR_CACHE_FILE_PATH];
+        m_spillFilePath = cacheFilePath.empty() ? "" : cacheFilePath + ".spill";
+        m_spillOnShutdown = m_config[CFG_BOOL_ENABLE_SHUTDOWN_SPILL];
+        m_journalPath = cacheFilePath.empty() ? "" : cacheFilePath + ".journal";
+
+        // Journals left by a crash are handed over to the spill import below
+        if (!m_journalPath.empty())
+        {
+            ReplayJournal();
+        }
+
         // TODO: [MG] - consider passing m_offlineStorageDisk to m_offlineStorageMemory,
         // so that the Flush() op on memory storage leads to saving unflushed events to
         // disk.
@@ -95,6 +132,34 @@ namespace MAT_NS_BEGIN {
         {
             m_offlineStorageMemory.reset(new MemoryStorage(m_logManager, m_config));
             m_offlineStorageMemory->Initialize(*this);
+            if (!m_storageIoThread)
+            {
+                m_storageIoThread = PAL::WorkerThreadFactory::Create();
+            }
+            m_journalEnabled = m_config[CFG_BOOL_ENABLE_RAM_QUEUE_JOURNAL] && !m_journalPath.empty();
+            if (m_journalEnabled && !m_journalThread)
+            {
+                m_journalThread = PAL::WorkerThreadFactory::Create();
+            }
+#ifdef HAVE_MAT_ZLIB
+            m_compressedLimit = m_config[CFG_INT_RAM_COMPRESSED_SIZE];
+            m_compressionLevel = m_config[CFG_INT_DB_COMPRESSION_LEVEL];
+#endif
+        }
+
+        // Import events spilled at the last shutdown without delaying startup
+        if (!m_spillFilePath.empty() && FileExists(m_spillFilePath.c_str()))
+        {
+            if (!m_storageIoThread)
+            {
+                m_storageIoThread = PAL::WorkerThreadFactory::Create();
+            }
+            PAL::scheduleTask(m_storageIoThread.get(), 0, this, &OfflineStorageHandler::ImportSpill);
+        }
+
+        if (static_cast<uint32_t>(m_config[CFG_INT_DB_DELETE_BATCH_SIZE]) > 0)
+        {
+            m_deleteBatchInterval = m_config[CFG_INT_DB_DELETE_BATCH_INTERVAL];
         }
 
         m_shutdownStarted = false;
@@ -105,6 +170,12 @@ namespace MAT_NS_BEGIN {
     {
         LOG_TRACE("Shutting down offline storage handler");
         m_shutdownStarted = true;
+        {
+            // Disk storage deletes the acknowledged records on its own shutdown
+            LOCKGUARD(m_deleteFlushLock);
+            m_deleteFlushHandle.Cancel();
+            m_deleteFlushPending = false;
+        }
         WaitForFlush();
         if (nullptr != m_offlineStorageMemory)
         {
@@ -112,6 +183,20 @@ namespace MAT_NS_BEGIN {
             Flush();
             m_offlineStorageMemory->Shutdown();
         }
+        {
+            // Uploads are no longer deleted or released past this point
+            LOCKGUARD(m_mixedReadLock);
+            m_mixedReadDiskIds.clear();
+        }
+        // Joins the storage I/O thread, no flush can be pending at this point
+        StopStorageIoThread();
+        if (m_journalEnabled)
+        {
+            // The ram queue has been persisted, nothing is left to replay
+            LOCKGUARD(m_journalFileLock);
+            closeJournalUnsafe();
+            FileDelete(m_journalPath.c_str());
+        }
         if (nullptr != m_offlineStorageDisk)
         {
             m_offlineStorageDisk->Shutdown();
@@ -131,7 +216,11 @@ namespace MAT_NS_BEGIN {
     {
         size_t size = 0;
         if (m_offlineStorageMemory != nullptr)
-            size += m_offlineStorageMemory->GetSize();
+        {
+            LOCKGUARD(m_sealedLock);
+            LOCKGUARD(m_compressedLock);
+            size += m_offlineStorageMemory->GetSize() + m_sealedSize + m_compressedSize;
+        }
         if (m_offlineStorageDisk != nullptr)
             size += m_offlineStorageDisk->GetSize();
         return size;
@@ -141,7 +230,21 @@ namespace MAT_NS_BEGIN {
     {
         size_t count = 0;
         if (m_offlineStorageMemory != nullptr)
+        {
+            // Records sealed for flush are counted until they are persisted
+            LOCKGUARD(m_sealedLock);
+            LOCKGUARD(m_compressedLock);
             count += m_offlineStorageMemory->GetRecordCount(latency);
+            if (latency == EventLatency_Unspecified)
+            {
+                for (size_t lat = 0; lat <= EventLatency_Max; lat++)
+                    count += m_sealedCount[lat] + m_compressedCount[lat];
+            }
+            else
+            {
+                count += m_sealedCount[latency] + m_compressedCount[latency];
+            }
+        }
         if (m_offlineStorageDisk != nullptr)
             count += m_offlineStorageDisk->GetRecordCount(latency);
         return count;
@@ -149,8 +252,8 @@ namespace MAT_NS_BEGIN {
 
     void OfflineStorageHandler::Flush()
     {
-        // Flush could be executed from context of worker thread, as well as from TPM and
-        // after HTTP callback. Make sure it is atomic / thread-safe.
+        // Flush could be executed from context of storage I/O thread, as well as from TPM
+        // and after HTTP callback. Make sure it is atomic / thread-safe.
         LOCKGUARD(m_flushLock);
 
         // If item isn't scheduled yet, it gets canceled, so that we don't do two flushes.
@@ -158,41 +261,121 @@ namespace MAT_NS_BEGIN {
         // than the handle gets replaced by nullptr in this DeferredCallbackHandle obj.
         m_flushHandle.Cancel();
 
-        size_t dbSizeBeforeFlush = m_offlineStorageMemory->GetSize();
-        if ((m_offlineStorageMemory) && (dbSizeBeforeFlush > 0) && (m_offlineStorageDisk))
+        if ((m_offlineStorageMemory) && (m_offlineStorageDisk))
         {
-            // This will block on and then take a lock for the duration of this move, and
-            // StoreRecord() will then block until the move completes.
-            auto records = m_offlineStorageMemory->GetRecords(false, EventLatency_Unspecified);
-            std::vector<StorageRecordId> ids;
+            // Seal the ram queue: producers continue appending to a fresh buffer right away,
+            // while the sealed buffer is persisted without holding the ram queue lock.
+            size_t sealedSize = 0;
+            bool journalSealed = false;
+            {
+                // Rotate the journal at the buffer swap, so that the sealed journal
+                // covers exactly the records of the sealed buffer
+                LOCKGUARD(m_journalFileLock);
+                std::vector<uint8_t> sealedJournal;
+                {
+                    LOCKGUARD(m_journalLock);
+                    LOCKGUARD(m_sealedLock);
+                    sealedSize = m_offlineStorageMemory->SwapRecords(m_sealedRecords);
+                    m_sealedSize = sealedSize;
+                    for (size_t latency = 0; latency < m_sealedRecords.size(); latency++)
+                    {
+                        m_sealedCount[latency] = m_sealedRecords[latency].size();
+                    }
+                    sealedJournal.swap(m_journalPending);
+                    m_journaledIds.clear();
+                    m_journalSize = 0;
+                }
+                if (m_journalEnabled && (m_journalFile != nullptr || !sealedJournal.empty()))
+                {
+                    writeJournalUnsafe(sealedJournal);
+                    closeJournalUnsafe();
+                    journalSealed = FileRename(m_journalPath.c_str(), (m_journalPath + ".sealed").c_str());
+                }
+            }
+
+            if (sealedSize > 0)
+            {
+                size_t totalSaved = 0;
+                bool spilled = false;
+                if (m_shutdownStarted && m_spillOnShutdown && !m_spillFilePath.empty())
+                {
+                    // Teardown is bounded by a sequential write instead of one insert per event
+                    LOCKGUARD(m_spillLock);
+                    spilled = MemoryStorage::WriteSpillFile(m_spillFilePath, m_sealedRecords);
+                    if (spilled)
+                    {
+                        for (auto const& records : m_sealedRecords)
+                        {
+                            totalSaved += records.size();
+                        }
+                        LOG_INFO("Spilled %zu events to %s", totalSaved, m_spillFilePath.c_str());
+                    }
+                }
+
+                // Keep the sealed buffer compressed in memory if the tier is enabled,
+                // only critical events go to disk right away
+                if (!spilled && (m_compressedLimit > 0) && !m_shutdownStarted)
+                {
+                    totalSaved += compressRecords(m_sealedRecords);
+                }
 
-            // TODO: [MG] - consider running the batch in transaction
-            //            if (sqlite)
-            //                sqlite->Execute("BEGIN");
+                // Persist the most urgent events first
+                auto persistStart = PAL::getMonotonicTimeMs();
+                for (auto it = m_sealedRecords.rbegin(); !spilled && (it != m_sealedRecords.rend()); ++it)
+                {
+                    if (!it->empty())
+                    {
+                        totalSaved += m_offlineStorageDisk->StoreRecords(*it);
+                    }
+                }
+                auto persistEnd = PAL::getMonotonicTimeMs();
+                if (!spilled)
+                {
+                    m_flushController.OnFlushCompleted(sealedSize, persistEnd - persistStart, persistEnd);
+                }
 
-            size_t totalSaved = m_offlineStorageDisk->StoreRecords(records);
+                // Sealed vectors keep their capacity and get reused as the next fresh buffer
+                {
+                    LOCKGUARD(m_sealedLock);
+                    for (size_t latency = 0; latency < m_sealedRecords.size(); latency++)
+                    {
+                        m_sealedRecords[latency].clear();
+                        m_sealedCount[latency] = 0;
+                    }
+                    m_sealedSize = 0;
+                }
 
-            // TODO: [MG] - consider running the batch in transaction
-            //            if (sqlite)
-            //                sqlite->Execute("END");
+                // Notify event listener about the records cached
+                OnStorageRecordsSaved(totalSaved);
 
-            // Delete records from reserved on flush
-            HttpHeaders dummy;
-            bool fromMemory = true;
-            m_offlineStorageMemory->DeleteRecords(ids, dummy, fromMemory);
+                auto memorySize = m_offlineStorageMemory->GetSize();
+                if (memorySize > sealedSize)
+                {
+                    // We managed to accumulate as much data as we had before the flush,
+                    // means we cannot keep up flushing at the same speed as incoming
+                    // obviously because the disk is slower than ram.
+                    LOG_WARN("Data is arriving too fast!");
+                }
+                updateBackpressure(memorySize);
+            }
 
-            // Notify event listener about the records cached
-            OnStorageRecordsSaved(totalSaved);
+            if (m_compressedLimit > 0)
+            {
+                evictCompressedBatches(m_shutdownStarted ? 0 : m_compressedLimit);
+            }
 
-            if (m_offlineStorageMemory->GetSize() > dbSizeBeforeFlush)
+            if (journalSealed)
             {
-                // We managed to accumulate as much data as we had before the flush,
-                // means we cannot keep up flushing at the same speed as incoming
-                // obviously because the disk is slower than ram.
-                LOG_WARN("Data is arriving too fast!");
+                FileDelete((m_journalPath + ".sealed").c_str());
             }
         }
 
+        if (m_offlineStorageDisk)
+        {
+            // Delete acknowledged records the disk storage may have buffered
+            m_offlineStorageDisk->Flush();
+        }
+
         m_isStorageFullNotificationSend = false;
 
         // Flush is done, notify the waiters
@@ -200,6 +383,433 @@ namespace MAT_NS_BEGIN {
         m_flushPending = false;
     }
 
+    /// <summary>
+    /// Import the shutdown spill file into the disk storage. Runs on the storage I/O thread.
+    /// </summary>
+    void OfflineStorageHandler::ImportSpill()
+    {
+        std::vector<StorageRecord> records;
+        {
+            LOCKGUARD(m_spillLock);
+            MemoryStorage::ReadSpillFile(m_spillFilePath, records);
+            FileDelete(m_spillFilePath.c_str());
+        }
+
+        if (!records.empty() && m_offlineStorageDisk)
+        {
+            size_t imported = m_offlineStorageDisk->StoreRecords(records);
+            LOG_INFO("Imported %zu of %zu spilled events", imported, records.size());
+            OnStorageRecordsSaved(imported);
+        }
+    }
+
+    /// <summary>
+    /// Write the journal records appended since the last sync with a single fsync.
+    /// Runs on the journal thread.
+    /// </summary>
+    void OfflineStorageHandler::SyncJournal()
+    {
+        LOCKGUARD(m_journalFileLock);
+        std::vector<uint8_t> data;
+        {
+            LOCKGUARD(m_journalLock);
+            data.swap(m_journalPending);
+            m_journalSyncPending = false;
+        }
+        if (!data.empty())
+        {
+            writeJournalUnsafe(data);
+        }
+    }
+
+    /// <summary>
+    /// Append delete markers for the journaled records among the ids acknowledged from
+    /// the ram queue, so that a replay after a crash does not upload them again.
+    /// </summary>
+    void OfflineStorageHandler::journalDeletes(std::vector<StorageRecordId> const& ids)
+    {
+        LOCKGUARD(m_journalLock);
+        size_t pendingSize = m_journalPending.size();
+        for (auto const& id : ids)
+        {
+            if (m_journaledIds.erase(id) > 0)
+            {
+                // A record without payload at EventLatency_Off marks the deletion
+                StorageRecord marker;
+                marker.id = id;
+                marker.latency = EventLatency_Off;
+                MemoryStorage::SerializeSpillRecord(marker, m_journalPending);
+            }
+        }
+        m_journalSize += m_journalPending.size() - pendingSize;
+        if ((m_journalPending.size() > pendingSize) && !m_journalSyncPending && m_journalThread)
+        {
+            m_journalSyncPending = true;
+            PAL::scheduleTask(m_journalThread.get(), 0, this, &OfflineStorageHandler::SyncJournal);
+        }
+    }
+
+    bool OfflineStorageHandler::writeJournalUnsafe(std::vector<uint8_t> const& data)
+    {
+        if (m_journalFile == nullptr)
+        {
+            m_journalFile = MemoryStorage::OpenSpillFile(m_journalPath);
+            if (m_journalFile == nullptr)
+            {
+                return false;
+            }
+        }
+        if ((std::fwrite(data.data(), 1, data.size(), m_journalFile) != data.size()) || !FileSync(m_journalFile))
+        {
+            LOG_ERROR("Failed to write %zu bytes to journal %s", data.size(), m_journalPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    void OfflineStorageHandler::closeJournalUnsafe()
+    {
+        if (m_journalFile != nullptr)
+        {
+            FileClose(m_journalFile);
+            m_journalFile = nullptr;
+        }
+    }
+
+    /// <summary>
+    /// Recover the journals of a process that did not shut down cleanly. Their records are
+    /// appended to the spill file, so that they are imported in the background. Records
+    /// with a delete marker were acknowledged before the crash and are skipped.
+    /// </summary>
+    void OfflineStorageHandler::ReplayJournal()
+    {
+        std::string sealedPath = m_journalPath + ".sealed";
+        std::vector<StorageRecord> records;
+        for (auto const& path : { sealedPath, m_journalPath })
+        {
+            if (FileExists(path.c_str()))
+            {
+                MemoryStorage::ReadSpillFile(path, records);
+            }
+        }
+
+        std::unordered_set<StorageRecordId> deletedIds;
+        for (auto const& record : records)
+        {
+            if ((record.latency == EventLatency_Off) && record.blob.empty())
+            {
+                deletedIds.insert(record.id);
+            }
+        }
+
+        StorageRecordBuffer buffer;
+        size_t count = 0;
+        for (auto& record : records)
+        {
+            if ((record.latency != EventLatency_Off) && (deletedIds.count(record.id) == 0))
+            {
+                buffer[record.latency].push_back(std::move(record));
+                count++;
+            }
+        }
+
+        if (count > 0)
+        {
+            LOCKGUARD(m_spillLock);
+            if (!MemoryStorage::WriteSpillFile(m_spillFilePath, buffer))
+            {
+                // Keep the journals for the next start
+                return;
+            }
+            LOG_INFO("Recovered %zu journaled events", count);
+        }
+        FileDelete(sealedPath.c_str());
+        FileDelete(m_journalPath.c_str());
+    }
+
+    /// <summary>
+    /// Move the non-critical records of a sealed buffer into a new compressed batch.
+    /// Thawed batches whose records are all still in the buffer go back to the tier as is.
+    /// </summary>
+    /// <returns>Number of records moved</returns>
+    size_t OfflineStorageHandler::compressRecords(StorageRecordBuffer& buffer)
+    {
+        std::vector<ThawedBatch> thawedBatches;
+        {
+            LOCKGUARD(m_compressedLock);
+            thawedBatches.swap(m_thawedBatches);
+        }
+
+        // Count the records of every thawed batch still queued
+        std::unordered_map<StorageRecordId, size_t> thawedIndex;
+        for (size_t i = 0; i < thawedBatches.size(); i++)
+        {
+            for (auto const& id : thawedBatches[i].ids)
+            {
+                thawedIndex[id] = i;
+            }
+        }
+        std::vector<size_t> queuedCount(thawedBatches.size(), 0);
+        if (!thawedIndex.empty())
+        {
+            for (auto const& records : buffer)
+            {
+                for (auto const& record : records)
+                {
+                    auto it = thawedIndex.find(record.id);
+                    if ((it != thawedIndex.end()) && (record.persistence != EventPersistence_Critical))
+                    {
+                        queuedCount[it->second]++;
+                    }
+                }
+            }
+        }
+        std::vector<bool> intact(thawedBatches.size(), false);
+        size_t intactCount = 0;
+        for (size_t i = 0; i < thawedBatches.size(); i++)
+        {
+            intact[i] = (queuedCount[i] == thawedBatches[i].ids.size());
+            intactCount += intact[i] ? 1 : 0;
+        }
+
+        CompressedBatch batch {};
+        size_t moved[EventLatency_Max + 1] = {};
+        std::vector<uint8_t> raw;
+        size_t total = 0;
+        for (size_t latency = buffer.size(); latency-- > 0;)
+        {
+            for (auto const& record : buffer[latency])
+            {
+                if (record.persistence == EventPersistence_Critical)
+                {
+                    continue;
+                }
+                moved[latency]++;
+                total++;
+                auto it = thawedIndex.find(record.id);
+                if ((it == thawedIndex.end()) || !intact[it->second])
+                {
+                    MemoryStorage::SerializeSpillRecord(record, raw);
+                    batch.count[latency]++;
+                }
+            }
+        }
+        if ((total == 0) || (!raw.empty() && !ZlibUtils::DeflateVector(raw, batch.data, m_compressionLevel)))
+        {
+            return 0;
+        }
+
+        for (auto& records : buffer)
+        {
+            records.erase(std::remove_if(records.begin(), records.end(), [](StorageRecord const& record)
+            {
+                return record.persistence != EventPersistence_Critical;
+            }), records.end());
+        }
+
+        LOG_TRACE("Compressed %zu events from %zu to %zu bytes, %zu thawed batches kept", total, raw.size(), batch.data.size(), intactCount);
+        LOCKGUARD(m_sealedLock);
+        LOCKGUARD(m_compressedLock);
+        for (size_t latency = 0; latency <= EventLatency_Max; latency++)
+        {
+            m_sealedCount[latency] -= moved[latency];
+        }
+        // Thawed batches are older than the sealed buffer, they keep their place at the front
+        for (size_t i = thawedBatches.size(); i-- > 0;)
+        {
+            if (intact[i])
+            {
+                for (size_t latency = 0; latency <= EventLatency_Max; latency++)
+                {
+                    m_compressedCount[latency] += thawedBatches[i].batch.count[latency];
+                }
+                m_compressedSize += thawedBatches[i].batch.data.size();
+                m_compressedBatches.push_front(std::move(thawedBatches[i].batch));
+            }
+        }
+        if (!raw.empty())
+        {
+            for (size_t latency = 0; latency <= EventLatency_Max; latency++)
+            {
+                m_compressedCount[latency] += batch.count[latency];
+            }
+            m_compressedSize += batch.data.size();
+            m_compressedBatches.push_back(std::move(batch));
+        }
+        return total;
+    }
+
+    /// <summary>
+    /// Remove the oldest compressed batch if the tier holds more than limit bytes.
+    /// </summary>
+    /// <param name="batch">The removed batch</param>
+    /// <param name="raw">Records of the batch in spill file format</param>
+    /// <returns>false if no batch was removed</returns>
+    bool OfflineStorageHandler::popCompressedBatch(CompressedBatch& batch, std::vector<uint8_t>& raw, size_t limit)
+    {
+        {
+            LOCKGUARD(m_compressedLock);
+            if (m_compressedBatches.empty() || (m_compressedSize <= limit))
+            {
+                return false;
+            }
+            batch = std::move(m_compressedBatches.front());
+            m_compressedBatches.pop_front();
+            m_compressedSize -= batch.data.size();
+            for (size_t latency = 0; latency <= EventLatency_Max; latency++)
+            {
+                m_compressedCount[latency] -= batch.count[latency];
+            }
+        }
+
+        raw.clear();
+        if (!ZlibUtils::InflateVector(batch.data, raw, false))
+        {
+            LOG_ERROR("Dropping compressed batch of %zu bytes: cannot decompress", batch.data.size());
+            raw.clear();
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Write the oldest compressed batches to disk, or to the spill file on shutdown,
+    /// until the tier holds at most limit bytes.
+    /// </summary>
+    void OfflineStorageHandler::evictCompressedBatches(size_t limit)
+    {
+        CompressedBatch batch;
+        std::vector<uint8_t> raw;
+        while (popCompressedBatch(batch, raw, limit))
+        {
+            if (m_shutdownStarted && m_spillOnShutdown && !m_spillFilePath.empty())
+            {
+                // Batches already are in spill file format
+                LOCKGUARD(m_spillLock);
+                std::FILE* file = MemoryStorage::OpenSpillFile(m_spillFilePath);
+                if (file != nullptr)
+                {
+                    bool written = (std::fwrite(raw.data(), 1, raw.size(), file) == raw.size());
+                    FileClose(file);
+                    if (written)
+                    {
+                        continue;
+                    }
+                }
+            }
+
+            std::vector<StorageRecord> records;
+            MemoryStorage::DeserializeSpillRecords(raw.data(), raw.size(), records);
+            m_offlineStorageDisk->StoreRecords(records);
+        }
+    }
+
+    /// <summary>
+    /// Move the oldest compressed batch back into the ram queue. The batch is kept aside,
+    /// so that the next flush can put it back as is if none of its records got uploaded.
+    /// </summary>
+    /// <remarks>
+    /// The tier holds no critical records, so thawed records need no journal entries.
+    /// </remarks>
+    /// <returns>false if the tier is empty</returns>
+    bool OfflineStorageHandler::thawCompressedBatch()
+    {
+        CompressedBatch batch;
+        std::vector<uint8_t> raw;
+        if (!popCompressedBatch(batch, raw, 0))
+        {
+            return false;
+        }
+        std::vector<StorageRecord> records;
+        MemoryStorage::DeserializeSpillRecords(raw.data(), raw.size(), records);
+        if (!records.empty())
+        {
+            ThawedBatch thawed;
+            for (auto const& record : records)
+            {
+                thawed.ids.insert(record.id);
+            }
+            thawed.batch = std::move(batch);
+            LOCKGUARD(m_compressedLock);
+            m_thawedBatches.push_back(std::move(thawed));
+        }
+        m_offlineStorageMemory->StoreRecords(records);
+        return true;
+    }
+
+    /// <summary>
+    /// Delete the records matching a where filter from the compressed tier, one batch
+    /// at a time, so that at most one batch is decompressed at once.
+    /// </summary>
+    void OfflineStorageHandler::filterCompressedBatches(std::map<std::string, std::string> const& whereFilter)
+    {
+        size_t batchCount = 0;
+        {
+            LOCKGUARD(m_compressedLock);
+            batchCount = m_compressedBatches.size();
+        }
+
+        // Every batch is taken from the front and put back at the end, which keeps their order
+        CompressedBatch batch;
+        std::vector<uint8_t> raw;
+        for (; (batchCount > 0) && popCompressedBatch(batch, raw, 0); batchCount--)
+        {
+            std::vector<StorageRecord> records;
+            MemoryStorage::DeserializeSpillRecords(raw.data(), raw.size(), records);
+            CompressedBatch filtered {};
+            std::vector<uint8_t> kept;
+            size_t dropped = 0;
+            for (auto const& record : records)
+            {
+                if (MemoryStorage::MatchesFilter(record, whereFilter))
+                {
+                    dropped++;
+                    continue;
+                }
+                MemoryStorage::SerializeSpillRecord(record, kept);
+                filtered.count[std::min<size_t>(record.latency, EventLatency_Max)]++;
+            }
+            if (kept.empty())
+            {
+                continue;
+            }
+            if (dropped == 0)
+            {
+                filtered = std::move(batch);
+            }
+            else if (!ZlibUtils::DeflateVector(kept, filtered.data, m_compressionLevel))
+            {
+                LOG_WARN("Cannot compress filtered batch, storing its %zu events", records.size() - dropped);
+                std::vector<StorageRecord> rest;
+                MemoryStorage::DeserializeSpillRecords(kept.data(), kept.size(), rest);
+                m_offlineStorageDisk->StoreRecords(rest);
+                continue;
+            }
+
+            LOCKGUARD(m_compressedLock);
+            for (size_t latency = 0; latency <= EventLatency_Max; latency++)
+            {
+                m_compressedCount[latency] += filtered.count[latency];
+            }
+            m_compressedSize += filtered.data.size();
+            m_compressedBatches.push_back(std::move(filtered));
+        }
+    }
+
+    void OfflineStorageHandler::ScheduleFlush()
+    {
+        if (m_flushLock.try_lock())
+        {
+            if (!m_flushPending && m_storageIoThread)
+            {
+                m_flushPending = true;
+                m_flushComplete.Reset();
+                m_flushHandle = PAL::scheduleTask(m_storageIoThread.get(), 0, this, &OfflineStorageHandler::Flush);
+                LOG_INFO("Requested Flush (%p)", m_flushHandle.m_task);
+            }
+            m_flushLock.unlock();
+        }
+    }
+
     bool OfflineStorageHandler::StoreRecord(StorageRecord const& record)
     {
         // Don't discard on shutdown because the kill-switch may be temporary.
@@ -210,34 +820,48 @@ namespace MAT_NS_BEGIN {
             return false;
         }
 
-        // Check cache size only once at start
-        static uint32_t cacheMemorySizeLimitInBytes = m_config[CFG_INT_RAM_QUEUE_SIZE];
-
         if (nullptr != m_offlineStorageMemory && !m_shutdownStarted)
         {
             auto memDbSize = m_offlineStorageMemory->GetSize();
+            bool journalFull = false;
+            if (m_journalEnabled && (record.persistence == EventPersistence_Critical))
+            {
+                // Journal under m_journalLock so the record and its journal entry
+                // land on the same side of a Flush() buffer swap
+                LOCKGUARD(m_journalLock);
+                m_offlineStorageMemory->StoreRecord(record);
+                size_t pendingSize = m_journalPending.size();
+                MemoryStorage::SerializeSpillRecord(record, m_journalPending);
+                m_journalSize += m_journalPending.size() - pendingSize;
+                m_journaledIds.insert(record.id);
+                if (!m_journalSyncPending && m_journalThread)
+                {
+                    m_journalSyncPending = true;
+                    PAL::scheduleTask(m_journalThread.get(), 0, this, &OfflineStorageHandler::SyncJournal);
+                }
+                // Records and delete markers stay in the journal until the next flush
+                journalFull = (m_journalSize > m_memoryLimit);
+            }
+            else
             {
-                // During flush, this will block on a mutex while records
-                // are selected and removed from the cache (but will
-                // not block for the subsequent handoff to persistent
-                // storage)
+                // During flush, this only waits for the ram queue buffer swap.
+                // Persisting the sealed buffer runs on the storage I/O thread.
                 m_offlineStorageMemory->StoreRecord(record);
             }
 
-            // Perform periodic flush to disk
-            if (memDbSize > cacheMemorySizeLimitInBytes)
+            m_flushController.OnRecordStored(record.blob.size() + sizeof(record));
+
+            // Perform periodic flush to disk, at a threshold adapted to the disk throughput
+            if ((memDbSize > m_flushController.GetFlushThreshold()) || journalFull)
             {
-                if (m_flushLock.try_lock())
-                {
-                    if (!m_flushPending)
-                    {
-                        m_flushPending = true;
-                        m_flushComplete.Reset();
-                        m_flushHandle = PAL::scheduleTask(&m_taskDispatcher, 0, this, &OfflineStorageHandler::Flush);
-                        LOG_INFO("Requested Flush (%p)", m_flushHandle.m_task);
-                    }
-                    m_flushLock.unlock();
-                }
+                ScheduleFlush();
+            }
+            updateBackpressure(memDbSize);
+
+            // Flushing cannot keep up, drop events by the eviction policy
+            if ((memDbSize > 2 * m_memoryLimit) && m_config[CFG_BOOL_ENABLE_DB_DROP_IF_FULL])
+            {
+                m_offlineStorageMemory->ResizeDb();
             }
         }
         else
@@ -254,6 +878,29 @@ namespace MAT_NS_BEGIN {
         return true;
     }
 
+    bool OfflineStorageHandler::IsBackpressured() const
+    {
+        return m_flushController.IsBackpressured();
+    }
+
+    /// <summary>
+    /// Notify producers when the ram queue starts or stops outgrowing the disk.
+    /// </summary>
+    void OfflineStorageHandler::updateBackpressure(size_t memorySize)
+    {
+        if (!m_flushController.UpdateBackpressure(memorySize))
+        {
+            return;
+        }
+        bool backpressure = m_flushController.IsBackpressured();
+        LOG_INFO("Storage backpressure %s: %zu bytes in ram queue, incoming %llu B/s, disk %llu B/s",
+            backpressure ? "on" : "off", memorySize,
+            static_cast<unsigned long long>(m_flushController.GetIncomingRate()),
+            static_cast<unsigned long long>(m_flushController.GetDiskRate()));
+        DebugEvent evt(DebugEventType::EVT_STORAGE_BACKPRESSURE, backpressure ? 1 : 0, memorySize);
+        m_logManager.DispatchEvent(evt);
+    }
+
     size_t OfflineStorageHandler::StoreRecords(std::vector<StorageRecord>& records)
     {
         size_t stored = 0;
@@ -293,34 +940,114 @@ namespace MAT_NS_BEGIN {
     }
 
     bool OfflineStorageHandler::GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs, EventLatency minLatency, unsigned maxCount)
+    {
+        return GetAndReserveRecords(consumer, leaseTimeMs, minLatency, maxCount, std::vector<std::string>());
+    }
+
+    /// <summary>
+    /// Reserve records from both tiers from the highest latency class down, so that urgent
+    /// events flushed to disk are not held back by fresh events in RAM. Within a latency
+    /// class the ram queue is drained first. Backends return every class at or above the
+    /// requested one, so the disk is read once for all classes down to the next one with
+    /// ram queue records, i.e. once per read if the ram queue is empty.
+    /// </summary>
+    bool OfflineStorageHandler::GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs, EventLatency minLatency, unsigned maxCount,
+        std::vector<std::string> const& excludedTenants)
     {
         bool returnValue = false;
 
         m_lastReadCount = 0;
         m_readFromMemory = false;
 
-        if (m_offlineStorageMemory)
+        if (minLatency == EventLatency_Unspecified)
+            minLatency = EventLatency_Off;
+
+        // Refill the ram queue from the compressed tier once uploads have drained it
+        if ((m_compressedLimit > 0) && m_offlineStorageMemory && (m_offlineStorageMemory->GetRecordCount(EventLatency_Unspecified) == 0))
         {
-            returnValue |= m_offlineStorageMemory->GetAndReserveRecords(consumer, leaseTimeMs, minLatency, maxCount);
-            m_lastReadCount += m_offlineStorageMemory->LastReadRecordCount();
-            if (m_lastReadCount <= maxCount)
-                maxCount -= m_lastReadCount;
-            m_readFromMemory = true;
-            // Prefer to send all of in-memory first before going to disk. This also helps in case if in-ram queue
-            // is larger than request size (2MB), we'd exit the function because the consumer no longer wants more
-            // records.
-            if (m_lastReadCount)
-                return returnValue;
+            thawCompressedBatch();
         }
 
-        if (m_offlineStorageDisk)
+        bool wantMore = true;
+        std::vector<StorageRecordId> diskIds;
+        unsigned memoryReadCount = 0;
+        auto readRecords = [&](IOfflineStorage* storagePtr, int latency)
         {
-            returnValue |= m_offlineStorageDisk->GetAndReserveRecords(consumer, leaseTimeMs, minLatency, maxCount);
-            auto lastOfflineReadCount = m_offlineStorageDisk->LastReadRecordCount();
-            if (lastOfflineReadCount)
+            unsigned remaining = 0;
+            if (maxCount > 0)
             {
-                m_lastReadCount += lastOfflineReadCount;
-                m_readFromMemory = false;
+                if (m_lastReadCount >= maxCount)
+                {
+                    wantMore = false;
+                    return;
+                }
+                remaining = maxCount - m_lastReadCount;
+            }
+
+            bool fromDisk = (storagePtr == m_offlineStorageDisk.get());
+            returnValue |= storagePtr->GetAndReserveRecords([&](StorageRecord&& record) -> bool
+            {
+                StorageRecordId id = fromDisk ? record.id : StorageRecordId();
+                wantMore = consumer(std::move(record));
+                if (wantMore && fromDisk)
+                {
+                    diskIds.push_back(std::move(id));
+                }
+                return wantMore;
+            }, leaseTimeMs, static_cast<EventLatency>(latency), remaining, excludedTenants);
+
+            auto readCount = storagePtr->LastReadRecordCount();
+            m_lastReadCount += readCount;
+            if (!fromDisk)
+            {
+                memoryReadCount += readCount;
+            }
+        };
+
+        for (int latency = EventLatency_Max; (latency >= minLatency) && wantMore; )
+        {
+            if (m_offlineStorageMemory && (m_offlineStorageMemory->GetRecordCount(static_cast<EventLatency>(latency)) > 0))
+            {
+                readRecords(m_offlineStorageMemory.get(), latency);
+            }
+
+            // Disk records down to the next class with ram queue records go next, in one read
+            int next = latency - 1;
+            while ((next >= minLatency) && !(m_offlineStorageMemory && (m_offlineStorageMemory->GetRecordCount(static_cast<EventLatency>(next)) > 0)))
+            {
+                next--;
+            }
+            if (m_offlineStorageDisk && wantMore)
+            {
+                bool diskHasRecords = false;
+                for (int diskLatency = latency; (diskLatency > next) && !diskHasRecords; diskLatency--)
+                {
+                    diskHasRecords = (m_offlineStorageDisk->GetRecordCount(static_cast<EventLatency>(diskLatency)) > 0);
+                }
+                if (diskHasRecords)
+                {
+                    readRecords(m_offlineStorageDisk.get(), next + 1);
+                }
+            }
+            latency = next;
+        }
+
+        // Deletes and releases are routed by the single fromMemory flag of the upload,
+        // so remember which records of a mixed read came from disk
+        m_readFromMemory = (memoryReadCount > 0);
+        if (m_readFromMemory && !diskIds.empty())
+        {
+            auto now = PAL::getUtcSystemTimeMs();
+            int64_t expiry = now + leaseTimeMs;
+            LOCKGUARD(m_mixedReadLock);
+            pruneMixedReadIdsUnsafe(now);
+            if (m_mixedReadDiskIds.empty() || (expiry < m_mixedReadNextExpiry))
+            {
+                m_mixedReadNextExpiry = expiry;
+            }
+            for (auto& id : diskIds)
+            {
+                m_mixedReadDiskIds[std::move(id)] = expiry;
             }
         }
 
@@ -334,6 +1061,57 @@ namespace MAT_NS_BEGIN {
         return returnValue;
     }
 
+    /// <summary>
+    /// Forget the disk ids of mixed reads whose lease has expired: their uploads were
+    /// never deleted or released, and the disk storage may lease the records again.
+    /// </summary>
+    void OfflineStorageHandler::pruneMixedReadIdsUnsafe(int64_t now)
+    {
+        if (m_mixedReadDiskIds.empty() || (now < m_mixedReadNextExpiry))
+        {
+            return;
+        }
+        int64_t nextExpiry = INT64_MAX;
+        for (auto it = m_mixedReadDiskIds.begin(); it != m_mixedReadDiskIds.end(); )
+        {
+            if (it->second <= now)
+            {
+                it = m_mixedReadDiskIds.erase(it);
+            }
+            else
+            {
+                nextExpiry = std::min(nextExpiry, it->second);
+                ++it;
+            }
+        }
+        m_mixedReadNextExpiry = nextExpiry;
+    }
+
+    /// <summary>
+    /// Split the ids of an upload read from memory into ram queue ids and ids reserved from disk by a mixed read.
+    /// </summary>
+    /// <returns>false if none of the ids came from disk</returns>
+    bool OfflineStorageHandler::splitMixedReadIds(std::vector<StorageRecordId> const& ids, std::vector<StorageRecordId>& memoryIds, std::vector<StorageRecordId>& diskIds)
+    {
+        LOCKGUARD(m_mixedReadLock);
+        if (m_mixedReadDiskIds.empty())
+        {
+            return false;
+        }
+        for (auto const& id : ids)
+        {
+            if (m_mixedReadDiskIds.erase(id))
+            {
+                diskIds.push_back(id);
+            }
+            else
+            {
+                memoryIds.push_back(id);
+            }
+        }
+        return !diskIds.empty();
+    }
+
     std::vector<StorageRecord> OfflineStorageHandler::GetRecords(bool shutdown, EventLatency minLatency, unsigned maxCount)
     {
         // This method should not be called directly because it's a no-op
@@ -366,7 +1144,7 @@ namespace MAT_NS_BEGIN {
 
     void OfflineStorageHandler::DeleteAllRecords() 
     {
-        for (const auto storagePtr : { m_offlineStorageMemory.get() , m_offlineStorageDisk.get() })
+        for (const auto storagePtr : { static_cast<IOfflineStorage*>(m_offlineStorageMemory.get()), m_offlineStorageDisk.get() })
         {
             if (storagePtr != nullptr)
             {
@@ -374,6 +1152,31 @@ namespace MAT_NS_BEGIN {
             }
         }
 
+        {
+            LOCKGUARD(m_compressedLock);
+            m_compressedBatches.clear();
+            m_compressedSize = 0;
+            for (size_t latency = 0; latency <= EventLatency_Max; latency++)
+            {
+                m_compressedCount[latency] = 0;
+            }
+        }
+
+        if (m_journalEnabled)
+        {
+            LOCKGUARD(m_journalFileLock);
+            {
+                LOCKGUARD(m_journalLock);
+                m_journalPending.clear();
+                m_journaledIds.clear();
+                m_journalSize = 0;
+            }
+            closeJournalUnsafe();
+            FileDelete(m_journalPath.c_str());
+        }
+
+        LOCKGUARD(m_mixedReadLock);
+        m_mixedReadDiskIds.clear();
     }
 
     /**
@@ -389,7 +1192,12 @@ namespace MAT_NS_BEGIN {
     /// </remarks>
     void OfflineStorageHandler::DeleteRecords(const std::map<std::string, std::string>& whereFilter)
     {
-        for (const auto storagePtr : {m_offlineStorageMemory.get(), m_offlineStorageDisk.get()})
+        if (m_compressedLimit > 0)
+        {
+            filterCompressedBatches(whereFilter);
+        }
+
+        for (const auto storagePtr : {static_cast<IOfflineStorage*>(m_offlineStorageMemory.get()), m_offlineStorageDisk.get()})
         {
             if (storagePtr != nullptr)
             {
@@ -426,19 +1234,83 @@ namespace MAT_NS_BEGIN {
 
         LOG_TRACE(" OfflineStorageHandler Deleting %u sent event(s) {%s%s}...",
                   static_cast<unsigned>(ids.size()), ids.front().c_str(), (ids.size() > 1) ? ", ..." : "");
-        if (fromMemory && nullptr != m_offlineStorageMemory)
+        std::vector<StorageRecordId> memoryIds, diskIds;
+        if (fromMemory && nullptr != m_offlineStorageMemory && splitMixedReadIds(ids, memoryIds, diskIds))
+        {
+            bool diskFromMemory = false;
+            m_offlineStorageMemory->DeleteRecords(memoryIds, headers, fromMemory);
+            if (m_journalEnabled)
+            {
+                journalDeletes(memoryIds);
+            }
+            if (nullptr != m_offlineStorageDisk)
+            {
+                m_offlineStorageDisk->DeleteRecords(diskIds, headers, diskFromMemory);
+                ScheduleDeleteFlush();
+            }
+        }
+        else if (fromMemory && nullptr != m_offlineStorageMemory)
         {
             m_offlineStorageMemory->DeleteRecords(ids, headers, fromMemory);
+            if (m_journalEnabled)
+            {
+                journalDeletes(ids);
+            }
         }
         else
         {
             if (nullptr != m_offlineStorageDisk)
             {
                 m_offlineStorageDisk->DeleteRecords(ids, headers, fromMemory);
+                ScheduleDeleteFlush();
             }
         }
     }
 
+    void OfflineStorageHandler::ScheduleDeleteFlush()
+    {
+        if ((m_deleteBatchInterval == 0) || m_shutdownStarted)
+        {
+            return;
+        }
+        LOCKGUARD(m_deleteFlushLock);
+        if (!m_deleteFlushPending && m_storageIoThread)
+        {
+            m_deleteFlushPending = true;
+            m_deleteFlushHandle = PAL::scheduleTask(m_storageIoThread.get(), static_cast<unsigned>(m_deleteBatchInterval), this, &OfflineStorageHandler::FlushDeletes);
+        }
+    }
+
+    void OfflineStorageHandler::StopStorageIoThread()
+    {
+        // Detach the threads under every lock that schedules on them, so that no task
+        // is queued past this point, then join them outside of them: their tasks take
+        // the same locks. Locks follow the order m_flushLock, m_journalLock.
+        std::shared_ptr<ITaskDispatcher> storageIoThread;
+        std::shared_ptr<ITaskDispatcher> journalThread;
+        {
+            LOCKGUARD(m_flushLock);
+            LOCKGUARD(m_journalLock);
+            LOCKGUARD(m_deleteFlushLock);
+            storageIoThread.swap(m_storageIoThread);
+            journalThread.swap(m_journalThread);
+        }
+        storageIoThread.reset();
+        journalThread.reset();
+    }
+
+    void OfflineStorageHandler::FlushDeletes()
+    {
+        {
+            LOCKGUARD(m_deleteFlushLock);
+            m_deleteFlushPending = false;
+        }
+        if (m_offlineStorageDisk)
+        {
+            m_offlineStorageDisk->Flush();
+        }
+    }
+
     void OfflineStorageHandler::ReleaseRecords(std::vector<StorageRecordId> const& ids, bool incrementRetryCount, HttpHeaders headers, bool& fromMemory)
     {
         if (m_clockSkewManager.isWaitingForClockSkew())
@@ -454,7 +1326,17 @@ namespace MAT_NS_BEGIN {
             DeleteRecordsByKeys(m_killSwitchManager.getTokensList());
         }
 
-        if (fromMemory && nullptr != m_offlineStorageMemory)
+        std::vector<StorageRecordId> memoryIds, diskIds;
+        if (fromMemory && nullptr != m_offlineStorageMemory && splitMixedReadIds(ids, memoryIds, diskIds))
+        {
+            bool diskFromMemory = false;
+            m_offlineStorageMemory->ReleaseRecords(memoryIds, incrementRetryCount, headers, fromMemory);
+            if (nullptr != m_offlineStorageDisk)
+            {
+                m_offlineStorageDisk->ReleaseRecords(diskIds, incrementRetryCount, headers, diskFromMemory);
+            }
+        }
+        else if (fromMemory && nullptr != m_offlineStorageMemory)
         {
             m_offlineStorageMemory->ReleaseRecords(ids, incrementRetryCount, headers, fromMemory);
         }
@@ -8,6 +8,8 @@
 
 #include "pal/PAL.hpp"
 #include "IOfflineStorage.hpp"
+#include "MemoryStorage.hpp"
+#include "FlushController.hpp"
 
 #include "api/IRuntimeConfig.hpp"
 #include "ILogManager.hpp"
@@ -15,8 +17,11 @@
 
 #include <memory>
 #include <atomic>
+#include <deque>
 #include <list>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "KillSwitchManager.hpp"
 #include "ClockSkewManager.hpp"
@@ -34,6 +39,8 @@ namespace MAT_NS_BEGIN {
         virtual bool StoreRecord(StorageRecord const& record) override;
         virtual size_t StoreRecords(std::vector<StorageRecord> & records) override;
         virtual bool GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs, EventLatency minLatency = EventLatency_Unspecified, unsigned maxCount = 0) override;
+        virtual bool GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs, EventLatency minLatency, unsigned maxCount,
+            std::vector<std::string> const& excludedTenants) override;
 
         virtual bool IsLastReadFromMemory() override;
         virtual unsigned LastReadRecordCount() override;
@@ -61,6 +68,11 @@ namespace MAT_NS_BEGIN {
         virtual void OnStorageRecordsRejected(std::map<std::string, size_t> const& numRecords) override;
         virtual void OnStorageRecordsSaved(size_t numRecords) override;
 
+        /// <summary>
+        /// True while events arrive faster than the ram queue is flushed to disk.
+        /// </summary>
+        bool IsBackpressured() const;
+
     protected:
         virtual void DeleteRecordsByKeys(const std::list<std::string> & keys);
 
@@ -77,15 +89,111 @@ namespace MAT_NS_BEGIN {
 
         std::mutex                             m_flushLock;
         bool                                   m_flushPending;
+        size_t                                 m_memoryLimit;
+        FlushController                        m_flushController;
         PAL::DeferredCallbackHandle            m_flushHandle;
         PAL::Event                             m_flushComplete;
 
-        std::unique_ptr<IOfflineStorage>       m_offlineStorageMemory;
+        /// <summary>
+        /// Dedicated storage I/O thread that persists sealed ram queue buffers,
+        /// so that disk writes never run on the shared SDK worker thread.
+        /// </summary>
+        std::shared_ptr<ITaskDispatcher>       m_storageIoThread;
+
+        /// <summary>
+        /// Ram queue buffer sealed by Flush() and being persisted to disk.
+        /// Only accessed under m_flushLock; m_sealedLock protects the counters.
+        /// </summary>
+        StorageRecordBuffer                    m_sealedRecords;
+        mutable std::mutex                     m_sealedLock;
+        size_t                                 m_sealedCount[EventLatency_Max + 1];
+        size_t                                 m_sealedSize;
+
+        /// <summary>
+        /// Shutdown spill file of the ram queue, imported on the storage I/O thread
+        /// on next start. m_spillLock serializes spilling and importing.
+        /// </summary>
+        std::string                            m_spillFilePath;
+        bool                                   m_spillOnShutdown;
+        std::mutex                             m_spillLock;
+
+        /// <summary>
+        /// Append-only journal of critical records entering the ram queue. Appends are
+        /// batched in m_journalPending and written with a single fsync by m_journalThread,
+        /// so that syncs never wait behind a flush on the storage I/O thread. Records
+        /// acknowledged from the ram queue get a delete marker that replay honours.
+        /// Flush() rotates the journal at the buffer swap and deletes the sealed journal
+        /// once the sealed buffer is persisted. Locks are taken in the order
+        /// m_journalFileLock, m_journalLock, m_sealedLock.
+        /// </summary>
+        std::string                            m_journalPath;
+        bool                                   m_journalEnabled;
+        std::mutex                             m_journalLock;
+        std::vector<uint8_t>                   m_journalPending;
+        std::unordered_set<StorageRecordId>    m_journaledIds;
+        size_t                                 m_journalSize;
+        bool                                   m_journalSyncPending;
+        std::shared_ptr<ITaskDispatcher>       m_journalThread;
+        std::mutex                             m_journalFileLock;
+        std::FILE*                             m_journalFile;
+
+        /// <summary>
+        /// Compressed tier between the ram queue and disk: sealed buffers deflated into
+        /// batches kept in memory, oldest first. Flush() evicts the oldest batches to disk
+        /// once m_compressedLimit is exceeded, and a batch is thawed back into the ram queue
+        /// whenever uploads have drained it. Locks are taken in the order m_sealedLock,
+        /// m_compressedLock.
+        /// </summary>
+        struct CompressedBatch
+        {
+            std::vector<uint8_t>               data;
+            size_t                             count[EventLatency_Max + 1];
+        };
+        std::deque<CompressedBatch>            m_compressedBatches;
+        mutable std::mutex                     m_compressedLock;
+        size_t                                 m_compressedCount[EventLatency_Max + 1];
+        size_t                                 m_compressedSize;
+        size_t                                 m_compressedLimit;
+        int                                    m_compressionLevel;
+
+        /// <summary>
+        /// Batches thawed into the ram queue since the last flush, with the ids of their
+        /// records. A batch whose records are all still queued at the next flush goes back
+        /// to the tier as is instead of being compressed again. Protected by m_compressedLock.
+        /// </summary>
+        struct ThawedBatch
+        {
+            CompressedBatch                    batch;
+            std::unordered_set<StorageRecordId> ids;
+        };
+        std::vector<ThawedBatch>               m_thawedBatches;
+
+        std::unique_ptr<MemoryStorage>         m_offlineStorageMemory;
         std::shared_ptr<IOfflineStorage>       m_offlineStorageDisk;
 
         bool                                   m_readFromMemory;
         unsigned                               m_lastReadCount;
 
+        /// <summary>
+        /// Ids of records reserved from disk by reads that also returned ram queue
+        /// records, i.e. uploads flagged as read from memory, with their lease expiry.
+        /// Ids are removed once their upload is deleted or released, or once their
+        /// lease has expired.
+        /// </summary>
+        std::mutex                             m_mixedReadLock;
+        std::unordered_map<StorageRecordId, int64_t> m_mixedReadDiskIds;
+        int64_t                                m_mixedReadNextExpiry;
+
+        /// <summary>
+        /// Timer on the storage I/O thread that makes the disk storage delete the
+        /// acknowledged records it buffered, at most m_deleteBatchInterval ms after
+        /// the first of them.
+        /// </summary>
+        std::mutex                             m_deleteFlushLock;
+        bool                                   m_deleteFlushPending;
+        PAL::DeferredCallbackHandle            m_deleteFlushHandle;
+        uint64_t                               m_deleteBatchInterval;
+
         bool                                   m_shutdownStarted;
         unsigned                               m_memoryDbSize;
         unsigned                               m_memoryDbSizeNotificationLimit;
@@ -97,6 +205,24 @@ namespace MAT_NS_BEGIN {
 
     private:
         void WaitForFlush();
+        void ScheduleFlush();
+        void ScheduleDeleteFlush();
+        void StopStorageIoThread();
+        void updateBackpressure(size_t memorySize);
+        void FlushDeletes();
+        void ImportSpill();
+        void SyncJournal();
+        void ReplayJournal();
+        void journalDeletes(std::vector<StorageRecordId> const& ids);
+        bool writeJournalUnsafe(std::vector<uint8_t> const& data);
+        void closeJournalUnsafe();
+        size_t compressRecords(StorageRecordBuffer& buffer);
+        bool popCompressedBatch(CompressedBatch& batch, std::vector<uint8_t>& raw, size_t limit);
+        void filterCompressedBatches(std::map<std::string, std::string> const& whereFilter);
+        void evictCompressedBatches(size_t limit);
+        bool thawCompressedBatch();
+        void pruneMixedReadIdsUnsafe(int64_t now);
+        bool splitMixedReadIds(std::vector<StorageRecordId> const& ids, std::vector<StorageRecordId>& memoryIds, std::vector<StorageRecordId>& diskIds);
 
     };
 
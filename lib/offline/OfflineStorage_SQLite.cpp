@@ -9,13 +9,17 @@
 #include "ILogManager.hpp"
 #include "SQLiteWrapper.hpp"
 #include "utils/StringUtils.hpp"
+#include "utils/ZlibUtils.hpp"
 #include <algorithm>
+#include <cstring>
 #include <numeric>
 #include <set>
+#include <unordered_set>
 
 namespace MAT_NS_BEGIN {
 
     constexpr static size_t kBlockSize = 8192;
+    constexpr static unsigned kReaderScanSize = 500;
 
     class DbTransaction {
         SqliteDB* m_db;
@@ -41,11 +45,57 @@ namespace MAT_NS_BEGIN {
 
     MATSDK_LOG_INST_COMPONENT_CLASS(OfflineStorage_SQLite, "EventsSDK.Storage", "Events telemetry client - OfflineStorage_SQLite class");
 
-    static int const CURRENT_SCHEMA_VERSION = 1;
+    static int const CURRENT_SCHEMA_VERSION = 2;
+
+    /// <summary>
+    /// Values of the payload_encoding column
+    /// </summary>
+    enum PayloadEncoding
+    {
+        PayloadEncoding_None         = 0,
+        PayloadEncoding_Deflate      = 1,
+        // Raw deflate followed by the uncompressed size as uint32_t in native byte order
+        PayloadEncoding_DeflateSized = 2
+    };
 #define TABLE_NAME_EVENTS   "events"
 #define TABLE_NAME_SETTINGS "settings"
 #define TABLE_NAME_PACKAGES "packages"
 
+    /// <summary>
+    /// Unreserved events by priority. The packaged ids are the excluded tenants, the NULL
+    /// that ends the list is left out so that an empty list excludes no one.
+    /// </summary>
+    static char const* const SQL_SELECT_EVENTS =
+        SQL_SUPPLY_PACKAGED_IDS
+        "SELECT record_id,tenant_token,latency,timestamp,retry_count,reserved_until,payload,payload_encoding"
+        " FROM " TABLE_NAME_EVENTS
+        " WHERE latency>=? AND reserved_until=0 AND tenant_token NOT IN (SELECT id FROM ids WHERE id IS NOT NULL)"
+        " ORDER BY latency DESC,persistence DESC, timestamp ASC LIMIT ?";
+
+    /// <summary>
+    /// Weighted fair variant of SQL_SELECT_EVENTS: within each latency, the n-th event of a
+    /// tenant (in the order above) is due at n divided by the tenant weight.
+    /// </summary>
+    /// <remarks>
+    /// Ranking reads and sorts every unreserved row of the requested latencies on each
+    /// retrieval, so it only carries the key columns. Payloads are read by rowid for the
+    /// rows within the limit.
+    /// </remarks>
+    static std::string getFairSelectEventsSql(FairQueue const& fairQueue)
+    {
+        return
+            SQL_SUPPLY_PACKAGED_IDS
+            "SELECT e.record_id,e.tenant_token,e.latency,e.timestamp,e.retry_count,e.reserved_until,e.payload,e.payload_encoding"
+            " FROM (SELECT rowid AS event_rowid,latency,persistence,timestamp,"
+            " CAST(ROW_NUMBER() OVER (PARTITION BY latency,tenant_token ORDER BY persistence DESC, timestamp ASC) AS REAL)"
+            "/(" + fairQueue.GetWeightSql("tenant_token") + ") AS due"
+            " FROM " TABLE_NAME_EVENTS
+            " WHERE latency>=? AND reserved_until=0 AND tenant_token NOT IN (SELECT id FROM ids WHERE id IS NOT NULL)"
+            " ORDER BY latency DESC, due, persistence DESC, timestamp ASC LIMIT ?) AS picked"
+            " JOIN " TABLE_NAME_EVENTS " AS e ON e.rowid=picked.event_rowid"
+            " ORDER BY picked.latency DESC, picked.due, picked.persistence DESC, picked.timestamp ASC";
+    }
+
     bool OfflineStorage_SQLite::isOpen()
     {
         if ((!m_db) || (!m_isOpened))
@@ -76,6 +126,29 @@ namespace MAT_NS_BEGIN {
         uint32_t ramSizeLimit = m_config[CFG_INT_RAM_QUEUE_SIZE];
         m_DbSizeHeapLimit = ramSizeLimit;
 
+        m_trimPageBudget = m_config[CFG_INT_DB_TRIM_PAGE_BUDGET];
+        if (m_trimPageBudget == 0)
+        {
+            m_trimPageBudget = DB_TRIM_PAGE_BUDGET_DEFAULT;
+        }
+        m_evictionPolicy = DefaultEvictionPolicy::Create(logManager, runtimeConfig);
+        m_defaultEviction = DefaultEvictionPolicy::IsDefault(logManager);
+        m_trackTenantUsage = DefaultEvictionPolicy::HasTenantQuotas(logManager, runtimeConfig);
+        m_deleteBatchSize = m_config[CFG_INT_DB_DELETE_BATCH_SIZE];
+        m_deleteBatchInterval = m_config[CFG_INT_DB_DELETE_BATCH_INTERVAL];
+
+#ifdef HAVE_MAT_ZLIB
+        m_compressPayloads = m_config[CFG_BOOL_ENABLE_DB_COMPRESS];
+        m_compressionLevel = m_config[CFG_INT_DB_COMPRESSION_LEVEL];
+#endif
+
+        // A second connection to ":memory:" would open a different, empty database
+        m_useReaderConnection = !inMemory && m_config[CFG_BOOL_ENABLE_DB_READER_CONNECTION];
+
+        FairQueue fairQueue;
+        fairQueue.Configure(m_config);
+        m_selectEventsSql = fairQueue.IsEnabled() ? getFairSelectEventsSql(fairQueue) : SQL_SELECT_EVENTS;
+
         const char* skipSqliteInit = m_config["skipSqliteInitAndShutdown"];
         if (skipSqliteInit != nullptr)
         {
@@ -95,6 +168,10 @@ namespace MAT_NS_BEGIN {
 
         assert(!m_db);
         m_db.reset(new SqliteDB(m_skipInitAndShutdown));
+        {
+            LOCKGUARD(m_resizeLock);
+            m_trimStopped = false;
+        }
 
         LOG_TRACE("Initializing offline storage: %s", m_offlineStorageFileName.c_str());
         auto sqlStartTime = GetUptimeMs();
@@ -120,9 +197,20 @@ namespace MAT_NS_BEGIN {
     void OfflineStorage_SQLite::Shutdown()
     {
         LOG_TRACE("Shutting down offline storage %s", m_offlineStorageFileName.c_str());
+        std::shared_ptr<ITaskDispatcher> trimThread;
+        {
+            LOCKGUARD(m_resizeLock);
+            m_trimStopped = true;
+            trimThread.swap(m_trimThread);
+        }
+        // Joins a pending trim step, which takes m_lock
+        trimThread.reset();
+
         LOCKGUARD(m_lock);
+        closeReaderConnection();
         if (m_db) {
             if (m_isOpened) {
+                flushTombstonesUnsafe();
                 m_db->shutdown();
                 m_db.reset();
             }
@@ -130,12 +218,103 @@ namespace MAT_NS_BEGIN {
         }
     }
 
+    /// <summary>
+    /// Delete the acknowledged records buffered as tombstones.
+    /// </summary>
+    void OfflineStorage_SQLite::Flush()
+    {
+        if (!m_db) {
+            return;
+        }
+
+        LOCKGUARD(m_lock);
+        if (m_tombstones.empty()) {
+            return;
+        }
+#ifdef ENABLE_LOCKING
+        DbTransaction transaction(m_db.get());
+        if (!transaction.locked)
+        {
+            LOG_WARN("Failed to delete acknowledged events: database is busy");
+            return;
+        }
+#endif
+        flushTombstonesUnsafe();
+    }
+
     void OfflineStorage_SQLite::Execute(std::string command)
     {
         if (m_db)
             m_db->execute(command.c_str());
     }
 
+    /// <summary>
+    /// Compress record payload before it is written to the payload column.
+    /// </summary>
+    /// <param name="blob">Original payload</param>
+    /// <param name="encoded">Compressed payload, only valid if the method returns true</param>
+    /// <param name="encoding">PayloadEncoding value to store along with the payload</param>
+    /// <returns>true if the compressed payload should be stored instead of the original</returns>
+    bool OfflineStorage_SQLite::encodePayload(StorageBlob const& blob, StorageBlob& encoded, int& encoding) const
+    {
+        encoding = PayloadEncoding_None;
+        if (!m_compressPayloads || blob.empty())
+        {
+            return false;
+        }
+        // Keep the original if compression does not pay off, e.g. for tiny events
+        if (ZlibUtils::DeflateVector(blob, encoded, m_compressionLevel) && (encoded.size() + sizeof(uint32_t) < blob.size()))
+        {
+            // Decoding sizes its buffer from the trailer instead of growing it
+            uint32_t size = static_cast<uint32_t>(blob.size());
+            auto bytes = reinterpret_cast<const uint8_t*>(&size);
+            encoded.insert(encoded.end(), bytes, bytes + sizeof(size));
+            encoding = PayloadEncoding_DeflateSized;
+            return true;
+        }
+        return false;
+    }
+
+    /// <summary>
+    /// Restore the original payload read from the payload column.
+    /// </summary>
+    /// <param name="blob">Payload as stored, replaced by the original payload</param>
+    /// <param name="encoding">PayloadEncoding value stored along with the payload</param>
+    /// <param name="inflater">Decoder reused for the rows of a scan</param>
+    /// <returns>false if the payload cannot be decoded</returns>
+    bool OfflineStorage_SQLite::decodePayload(StorageBlob& blob, int encoding, ZlibInflater& inflater) const
+    {
+        switch (encoding)
+        {
+        case PayloadEncoding_None:
+            return true;
+        case PayloadEncoding_Deflate:
+        {
+            // Written by earlier versions, without the uncompressed size
+            StorageBlob decoded;
+            if (!ZlibUtils::InflateVector(blob, decoded, false))
+            {
+                return false;
+            }
+            blob.swap(decoded);
+            return true;
+        }
+        case PayloadEncoding_DeflateSized:
+        {
+            uint32_t size = 0;
+            if (blob.size() < sizeof(size))
+            {
+                return false;
+            }
+            size_t deflatedSize = blob.size() - sizeof(size);
+            std::memcpy(&size, blob.data() + deflatedSize, sizeof(size));
+            return inflater.Inflate(blob, deflatedSize, size);
+        }
+        default:
+            return false;
+        }
+    }
+
     bool OfflineStorage_SQLite::StoreRecord(StorageRecord const& record)
     {
         // TODO: [MG] - this works, but may not play nicely with several LogManager instances
@@ -156,6 +335,12 @@ namespace MAT_NS_BEGIN {
         }
 
         {
+            // Tenant usage is reloaded under m_lock, so the insert must not run concurrently
+            std::unique_lock<std::recursive_mutex> usageLock(m_lock, std::defer_lock);
+            if (m_trackTenantUsage)
+            {
+                usageLock.lock();
+            }
 #ifdef ENABLE_LOCKING
             LOCKGUARD(m_lock);
             DbTransaction transaction(m_db.get());
@@ -166,8 +351,34 @@ namespace MAT_NS_BEGIN {
                 return false;
             }
 #endif
-            SqliteStatement(*m_db, m_stmtInsertEvent_id_tenant_prio_ts_data).execute(record.id, record.tenantToken, static_cast<int>(record.latency), static_cast<int>(record.persistence), record.timestamp, record.blob);
-            m_DbSizeEstimate += record.id.size() + record.tenantToken.size() + record.blob.size();
+            StorageBlob encoded;
+            int encoding;
+            StorageBlob const& payload = encodePayload(record.blob, encoded, encoding) ? encoded : record.blob;
+            SqliteStatement insertStmt(*m_db, m_stmtInsertEvent_id_tenant_prio_ts_data);
+            bool inserted = insertStmt.execute(record.id, record.tenantToken, static_cast<int>(record.latency), static_cast<int>(record.persistence), record.timestamp, payload, encoding);
+            if (inserted && (insertStmt.changes() == 0))
+            {
+                // The id is stored already, e.g. replayed from the journal or re-imported
+                // from a spill: keep the stored row and don't count the event twice
+                LOG_TRACE("Event %s:%s is already stored", tenantTokenToId(record.tenantToken).c_str(), record.id.c_str());
+                inserted = false;
+            }
+            if (inserted)
+            {
+                if (record.latency <= EventLatency_Max)
+                {
+                    m_recordCounts[record.latency]++;
+                }
+                else
+                {
+                    invalidateRecordCountsUnsafe();
+                }
+                if (m_trackTenantUsage && m_tenantBytesValid)
+                {
+                    m_tenantBytes[record.tenantToken] += record.id.size() + record.tenantToken.size() + payload.size();
+                }
+                m_DbSizeEstimate += record.id.size() + record.tenantToken.size() + payload.size();
+            }
         }
 
         if ((m_DbSizeNotificationLimit != 0) && (m_DbSizeEstimate>m_DbSizeNotificationLimit))
@@ -185,18 +396,11 @@ namespace MAT_NS_BEGIN {
             }
         }
 
-        if ((m_DbSizeLimit != 0) && (m_DbSizeEstimate > m_DbSizeLimit))
+        if ((m_DbSizeLimit != 0) && (m_DbSizeEstimate > m_DbSizeLimit) && !m_trimPending)
         {
-            auto shouldResize = m_config[CFG_BOOL_ENABLE_DB_DROP_IF_FULL] && !m_resizing;
-            if (shouldResize)
+            if (m_config[CFG_BOOL_ENABLE_DB_DROP_IF_FULL])
             {
-                LOCKGUARD(m_resizeLock); //Serialize resize operations
-                m_resizing = true;
-                if (m_DbSizeEstimate > m_DbSizeLimit)
-                {
-                    ResizeDb();
-                }
-                m_resizing = false;
+                scheduleTrim(true);
             }
         }
 
@@ -228,6 +432,11 @@ namespace MAT_NS_BEGIN {
 #endif
     }
 
+    bool OfflineStorage_SQLite::GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs, EventLatency minLatency, unsigned maxCount)
+    {
+        return GetAndReserveRecords(consumer, leaseTimeMs, minLatency, maxCount, std::vector<std::string>());
+    }
+
     /// <summary>
     /// Gets the and reserve records.
     /// </summary>
@@ -235,8 +444,10 @@ namespace MAT_NS_BEGIN {
     /// <param name="leaseTimeMs">The lease time ms.</param>
     /// <param name="minLatency">The minimum latency.</param>
     /// <param name="maxCount">The maximum count.</param>
+    /// <param name="excludedTenants">Tenants whose records are skipped.</param>
     /// <returns></returns>
-    bool OfflineStorage_SQLite::GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs, EventLatency minLatency, unsigned maxCount)
+    bool OfflineStorage_SQLite::GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs, EventLatency minLatency, unsigned maxCount,
+        std::vector<std::string> const& excludedTenants)
     {
         m_lastReadCount = 0;
 
@@ -248,9 +459,14 @@ namespace MAT_NS_BEGIN {
         LOG_TRACE("Retrieving max. %u%s events of latency at least %d (%s)",
             maxCount, (maxCount > 0) ? "" : " (unlimited)", minLatency, latencyToStr(static_cast<EventLatency>(minLatency)));
 
-        /* ============================================================================================================= */
-        LOCKGUARD(m_lock);
+        SelectedRecords selected;
+        int64_t now = PAL::getUtcSystemTimeMs();
+        std::vector<uint8_t> excludedList = packageIdList(excludedTenants.begin(), excludedTenants.end());
+
+        if (!m_useReaderConnection)
         {
+            /* ============================================================================================================= */
+            LOCKGUARD(m_lock);
 #ifdef ENABLE_LOCKING
             DbTransaction transaction(m_db.get());
             if (!transaction.locked)
@@ -259,76 +475,277 @@ namespace MAT_NS_BEGIN {
                 return false;
             }
 #endif
-            SqliteStatement releaseStmt(*m_db, m_stmtReleaseExpiredEvents);
-
-            if (!releaseStmt.execute(PAL::getUtcSystemTimeMs()))
-                LOG_ERROR("Failed to release expired reserved events: Database error occurred");
-            else {
-                if (releaseStmt.changes() > 0) {
-                    LOG_TRACE("Released %u expired reserved events", static_cast<unsigned>(releaseStmt.changes()));
-                }
+            if (!releaseExpiredLeasesUnsafe(now)) {
+                LOG_ERROR("Failed to release expired reserved events: Database error occurred, recreating database");
+                recreate(206);
+                return false;
+            }
+            unsigned failureCode = selectRecords(*m_db, m_stmtSelectEvents, consumer, minLatency, maxCount, excludedList, selected);
+            if (failureCode != 0) {
+                recreate(failureCode);
+                return false;
             }
+            return reserveRecordsUnsafe(selected, now + leaseTimeMs);
+        }
 
-            SqliteStatement selectStmt(*m_db, m_stmtSelectEvents);
-            if (!selectStmt.select(static_cast<int>(minLatency), maxCount > 0 ? maxCount : -1)) {
-                LOG_ERROR("Failed to retrieve events to send: Database error occurred, recreating database");
-                recreate(204);
+        // Reservations are serialized, but the scan itself runs on the reader connection
+        // without holding m_lock, so it does not block inserts on the writer connection
+        LOCKGUARD(m_reserveLock);
+        {
+            LOCKGUARD(m_lock);
+#ifdef ENABLE_LOCKING
+            DbTransaction transaction(m_db.get());
+            if (!transaction.locked)
+            {
+                LOG_ERROR("Failed to lock");
                 return false;
             }
+#endif
+            if (!releaseExpiredLeasesUnsafe(now)) {
+                LOG_ERROR("Failed to release expired reserved events: Database error occurred, recreating database");
+                recreate(206);
+                return false;
+            }
+        }
 
-            std::vector<StorageRecordId> consumedIds;
-            std::map<std::string, size_t> deletedData;
+        bool scanned = false;
+        bool reserved = false;
+        unsigned readCount = 0;
+        for (;;)
+        {
+            // Scan a chunk on the reader connection without handing it out yet: rows may
+            // be deleted by eviction or a kill switch before m_lock is taken again
+            unsigned limit = (maxCount > 0) ? std::min(maxCount - readCount, kReaderScanSize) : kReaderScanSize;
+            std::vector<StorageRecord> scannedRecords;
+            SelectedRecords scannedChunk;
+            {
+                LOCKGUARD(m_readerLock);
+                if (!m_dbReader) {
+                    break;
+                }
+                auto buffer = [&scannedRecords](StorageRecord&& record) -> bool {
+                    scannedRecords.push_back(std::move(record));
+                    return true;
+                };
+                if (selectRecords(*m_dbReader, m_stmtReaderSelectEvents, buffer, minLatency, limit, excludedList, scannedChunk) != 0) {
+                    LOG_ERROR("Failed to retrieve events to send on the reader connection");
+                    return false;
+                }
+                scanned = true;
+            }
 
-            StorageRecord record;
-            int latency;
+            LOCKGUARD(m_lock);
+            if (!m_db) {
+                return false;
+            }
+#ifdef ENABLE_LOCKING
+            DbTransaction transaction(m_db.get());
+            if (!transaction.locked)
+            {
+                LOG_ERROR("Failed to lock");
+                return false;
+            }
+#endif
+            // Only the rows still stored and unreserved are handed out and reserved
+            std::unordered_set<StorageRecordId> survivors;
+            if (!scannedChunk.ids.empty()) {
+                std::vector<uint8_t> idList = packageIdList(scannedChunk.ids.begin(), scannedChunk.ids.end());
+                SqliteStatement survivorsStmt(*m_db, m_stmtSelectUnreservedEvents_ids);
+                if (!survivorsStmt.select(idList)) {
+                    LOG_ERROR("Failed to retrieve events to send: Database error occurred, recreating database");
+                    recreate(204);
+                    return false;
+                }
+                std::string id;
+                while (survivorsStmt.getRow(id)) {
+                    survivors.insert(id);
+                }
+                survivorsStmt.reset();
+            }
 
-            while (selectStmt.getRow(record.id, record.tenantToken, latency, record.timestamp, record.retryCount, record.reservedUntil, record.blob))
+            SelectedRecords accepted;
+            accepted.corruptIds.swap(scannedChunk.corruptIds);
+            accepted.deletedData.swap(scannedChunk.deletedData);
+            bool consumerDone = false;
+            for (size_t i = 0; i < scannedRecords.size(); i++)
             {
-                if (latency < EventLatency_Off || latency > EventLatency_Max) {
-                    record.latency = EventLatency_Normal;
+                if (survivors.count(scannedChunk.ids[i]) == 0) {
+                    continue;
                 }
-                else {
-                    record.latency = static_cast<EventLatency>(latency);
+                if (!consumer(std::move(scannedRecords[i]))) {
+                    consumerDone = true;
+                    break;
                 }
-                consumedIds.push_back(record.id);
-                if (!consumer(std::move(record)))
+                accepted.ids.push_back(scannedChunk.ids[i]);
+                accepted.latencies.push_back(scannedChunk.latencies[i]);
+                if (m_trackTenantUsage)
                 {
-                    consumedIds.pop_back();
-                    break;
+                    accepted.sizes.push_back(scannedChunk.sizes[i]);
+                    accepted.tenants.push_back(scannedChunk.tenants[i]);
                 }
             }
-
-            selectStmt.reset();
-
-            if (selectStmt.error()) {
-                LOG_ERROR("Failed to search for events to send: Database error has occurred, recreating database");
-                recreate(205);
+            if (reserveRecordsUnsafe(accepted, now + leaseTimeMs)) {
+                reserved = true;
+                readCount += m_lastReadCount;
+            }
+            else if (!m_db) {
                 return false;
             }
 
-            if (consumedIds.empty()) {
-                return false;
+            // A short chunk means the scan reached the end of the unreserved records
+            size_t rowCount = scannedChunk.ids.size() + accepted.corruptIds.size();
+            if (consumerDone || (rowCount < limit) || ((maxCount > 0) && (readCount >= maxCount))) {
+                break;
             }
+        }
+        m_lastReadCount = readCount;
+        if (scanned) {
+            return reserved;
+        }
+
+        LOCKGUARD(m_lock);
+        if (!m_db) {
+            return false;
+        }
+#ifdef ENABLE_LOCKING
+        DbTransaction transaction(m_db.get());
+        if (!transaction.locked)
+        {
+            LOG_ERROR("Failed to lock");
+            return false;
+        }
+#endif
+        // The reader connection could not be opened, scan on the writer instead
+        unsigned failureCode = selectRecords(*m_db, m_stmtSelectEvents, consumer, minLatency, maxCount, excludedList, selected);
+        if (failureCode != 0) {
+            recreate(failureCode);
+            return false;
+        }
+        return reserveRecordsUnsafe(selected, now + leaseTimeMs);
+    }
+
+    /// <summary>
+    /// Scan unreserved records with the given select statement and hand them to the consumer.
+    /// </summary>
+    /// <returns>0 on success, or the failure code to recreate the database with</returns>
+    unsigned OfflineStorage_SQLite::selectRecords(SqliteDB& db, size_t stmtSelect, std::function<bool(StorageRecord&&)> const& consumer, EventLatency minLatency, unsigned maxCount,
+        std::vector<uint8_t> const& excludedList, SelectedRecords& selected)
+    {
+        SqliteStatement selectStmt(db, stmtSelect);
+        if (!selectStmt.select(excludedList, static_cast<int>(minLatency), maxCount > 0 ? maxCount : -1)) {
+            LOG_ERROR("Failed to retrieve events to send: Database error occurred, recreating database");
+            return 204;
+        }
 
-            LOG_TRACE("Reserving %u event(s) {%s%s} for %u milliseconds",
-                static_cast<unsigned>(consumedIds.size()), consumedIds.front().c_str(), (consumedIds.size() > 1) ? ", ..." : "", leaseTimeMs);
+        StorageRecord record;
+        int latency;
+        int encoding;
+        ZlibInflater inflater;
 
-            for (size_t i = 0; i < consumedIds.size(); i += kBlockSize)
+        while (selectStmt.getRow(record.id, record.tenantToken, latency, record.timestamp, record.retryCount, record.reservedUntil, record.blob, encoding))
+        {
+            size_t storedSize = record.id.size() + record.tenantToken.size() + record.blob.size();
+            if (latency < EventLatency_Off || latency > EventLatency_Max) {
+                record.latency = EventLatency_Normal;
+            }
+            else {
+                record.latency = static_cast<EventLatency>(latency);
+            }
+            if (!decodePayload(record.blob, encoding, inflater)) {
+                LOG_ERROR("Failed to decode payload of event %s, dropping it", record.id.c_str());
+                selected.corruptIds.push_back(record.id);
+                selected.deletedData[record.tenantToken]++;
+                continue;
+            }
+            selected.ids.push_back(record.id);
+            selected.latencies.push_back(record.latency);
+            if (m_trackTenantUsage)
+            {
+                selected.sizes.push_back(storedSize);
+                selected.tenants.push_back(record.tenantToken);
+            }
+            if (!consumer(std::move(record)))
             {
-                auto count = std::min(kBlockSize, consumedIds.size() - i);
-                std::vector<uint8_t> idList = packageIdList(consumedIds.begin() + i, consumedIds.begin() + i + count);
-                if (!SqliteStatement(*m_db, m_stmtReserveEvents).execute(idList, PAL::getUtcSystemTimeMs() + leaseTimeMs))
+                selected.ids.pop_back();
+                selected.latencies.pop_back();
+                if (m_trackTenantUsage)
                 {
-                    LOG_ERROR("Failed to reserve events to send: Database error occurred, recreating database");
-                    recreate(207);
-                    return false;
+                    selected.sizes.pop_back();
+                    selected.tenants.pop_back();
                 }
+                break;
             }
-            m_lastReadCount = static_cast<unsigned>(consumedIds.size());
         }
+
+        selectStmt.reset();
+
+        if (selectStmt.error()) {
+            LOG_ERROR("Failed to search for events to send: Database error has occurred, recreating database");
+            return 205;
+        }
+        return 0;
+    }
+
+    /// <summary>
+    /// Drop the corrupt records found by a scan and lease the consumed ones until leaseUntil.
+    /// Must be called with m_lock held.
+    /// </summary>
+    bool OfflineStorage_SQLite::reserveRecordsUnsafe(SelectedRecords const& selected, int64_t leaseUntil)
+    {
+        dropCorruptRecordsUnsafe(selected);
+
+        auto const& consumedIds = selected.ids;
+        if (consumedIds.empty()) {
+            return false;
+        }
+
+        LOG_TRACE("Reserving %u event(s) {%s%s} until %lld",
+            static_cast<unsigned>(consumedIds.size()), consumedIds.front().c_str(), (consumedIds.size() > 1) ? ", ..." : "", static_cast<long long>(leaseUntil));
+
+        for (size_t i = 0; i < consumedIds.size(); i += kBlockSize)
+        {
+            auto count = std::min(kBlockSize, consumedIds.size() - i);
+            std::vector<uint8_t> idList = packageIdList(consumedIds.begin() + i, consumedIds.begin() + i + count);
+            if (!SqliteStatement(*m_db, m_stmtReserveEvents).execute(idList, leaseUntil))
+            {
+                LOG_ERROR("Failed to reserve events to send: Database error occurred, recreating database");
+                recreate(207);
+                return false;
+            }
+        }
+        if (m_leases.empty() || leaseUntil < m_nextLeaseExpiry)
+        {
+            m_nextLeaseExpiry = leaseUntil;
+        }
+        for (size_t i = 0; i < consumedIds.size(); i++)
+        {
+            if (m_trackTenantUsage)
+            {
+                m_leases[consumedIds[i]] = { selected.latencies[i], leaseUntil, selected.sizes[i], selected.tenants[i] };
+            }
+            else
+            {
+                m_leases[consumedIds[i]] = { selected.latencies[i], leaseUntil, 0, std::string() };
+            }
+        }
+        m_lastReadCount = static_cast<unsigned>(consumedIds.size());
         return true;
     }
 
+    /// <summary>
+    /// Delete the records whose payload failed to decode and report them as dropped.
+    /// Must be called with m_lock held.
+    /// </summary>
+    void OfflineStorage_SQLite::dropCorruptRecordsUnsafe(SelectedRecords const& selected)
+    {
+        if (!selected.corruptIds.empty()) {
+            std::vector<uint8_t> idList = packageIdList(selected.corruptIds.begin(), selected.corruptIds.end());
+            SqliteStatement(*m_db, m_stmtDeleteEvents_ids).execute(idList);
+            invalidateRecordCountsUnsafe();
+            m_observer->OnStorageRecordsDropped(selected.deletedData);
+        }
+    }
+
     bool OfflineStorage_SQLite::IsLastReadFromMemory()
     {
         return false;
@@ -350,40 +767,51 @@ namespace MAT_NS_BEGIN {
 
         if (shutdown)
         {
-            SqliteStatement selectStmt(*m_db, m_stmtSelectEventAtShutdown);
-            if (selectStmt.select(static_cast<int>(minLatency), maxCount > 0 ? maxCount : -1))
-            {
-                int latency;
-                while (selectStmt.getRow(record.id, record.tenantToken, latency, record.timestamp, record.retryCount, record.reservedUntil, record.blob))
-                {
-                    record.latency = static_cast<EventLatency>(latency);
-                    records.push_back(record);
-                }
-                selectStmt.reset();
-            }
+            // Reserved records are returned too, acknowledged ones must be gone
+            Flush();
         }
-        else
+
+        SelectedRecords corrupt;
         {
-            SqliteStatement selectStmt(*m_db, m_stmtSelectEventsMinlatency);
+            SqliteStatement selectStmt(*m_db, shutdown ? m_stmtSelectEventAtShutdown : m_stmtSelectEventsMinlatency);
             if (selectStmt.select(static_cast<int>(minLatency), maxCount > 0 ? maxCount : -1))
             {
                 int latency;
-                while (selectStmt.getRow(record.id, record.tenantToken, latency, record.timestamp, record.retryCount, record.reservedUntil, record.blob))
+                int encoding;
+                ZlibInflater inflater;
+                while (selectStmt.getRow(record.id, record.tenantToken, latency, record.timestamp, record.retryCount, record.reservedUntil, record.blob, encoding))
                 {
                     record.latency = static_cast<EventLatency>(latency);
-                    records.push_back(record);
+                    if (!decodePayload(record.blob, encoding, inflater))
+                    {
+                        LOG_ERROR("Failed to decode payload of event %s, dropping it", record.id.c_str());
+                        corrupt.corruptIds.push_back(record.id);
+                        corrupt.deletedData[record.tenantToken]++;
+                        continue;
+                    }
+                    records.push_back(std::move(record));
+                    record = StorageRecord();
                 }
                 selectStmt.reset();
             }
         }
+
+        if (!corrupt.corruptIds.empty())
+        {
+            LOCKGUARD(m_lock);
+            dropCorruptRecordsUnsafe(corrupt);
+        }
         return records;
     }
 
     void OfflineStorage_SQLite::DeleteAllRecords()
     {
+        LOCKGUARD(m_lock);
         std::string sql = "DELETE FROM "  TABLE_NAME_EVENTS ;
         Execute(sql);
-
+        invalidateRecordCountsUnsafe();
+        m_leases.clear();
+        clearTombstonesUnsafe();
     }
 
     void OfflineStorage_SQLite::DeleteRecords(const std::map<std::string, std::string> & whereFilter)
@@ -403,6 +831,7 @@ namespace MAT_NS_BEGIN {
                 return;
             }
 #endif
+            flushTombstonesUnsafe();
             auto formatter = [&](const std::map<std::string, std::string> & whereFilter)
             {
                 std::string clause;
@@ -437,6 +866,7 @@ namespace MAT_NS_BEGIN {
             };
             std::string sql = "DELETE FROM " TABLE_NAME_EVENTS " WHERE ";
             Execute(sql + formatter(whereFilter));
+            invalidateRecordCountsUnsafe();
         }
     }
 
@@ -466,20 +896,64 @@ namespace MAT_NS_BEGIN {
                 return;
             }
 #endif
-            LOG_TRACE("Deleting %u sent event(s) {%s%s}...", static_cast<unsigned>(ids.size()), ids.front().c_str(), (ids.size() > 1) ? ", ..." : "");
-
-            for (size_t i = 0; i < ids.size(); i += kBlockSize) {
-                size_t count = std::min(kBlockSize, ids.size() - i);
-                std::vector<uint8_t> idList = packageIdList(ids.begin() + i,
-                                                            ids.begin() + i + count);
-                if (!SqliteStatement(*m_db, m_stmtDeleteEvents_ids).execute(idList)) {
-                    LOG_ERROR(
-                            "Failed to delete %u sent event(s) {%s%s}: Database error occurred, recreating database",
-                            static_cast<unsigned>(ids.size()), ids.front().c_str(),
-                            (ids.size() > 1) ? ", ..." : "");
-                    recreate(302);
+            std::vector<StorageRecordId> untracked;
+            std::vector<StorageRecordId> const* toDelete = &ids;
+            if (m_deleteBatchSize > 0) {
+                // Acknowledged records are normally leased, so their lease turns into a
+                // tombstone and the delete is deferred. Others are deleted right away.
+                for (auto const& id : ids) {
+                    auto it = m_leases.find(id);
+                    if (it == m_leases.end()) {
+                        untracked.push_back(id);
+                        continue;
+                    }
+                    int latency = it->second.latency;
+                    if (m_tombstones.emplace(id, latency).second) {
+                        m_tombstoneCounts[latency]++;
+                        m_recordCounts[latency] -= std::min<size_t>(m_recordCounts[latency].load(), 1);
+                        releaseTenantBytesUnsafe(it->second.tenantToken, it->second.size);
+                    }
+                    m_leases.erase(it);
+                }
+                if (m_tombstonesSince == 0 && !m_tombstones.empty()) {
+                    m_tombstonesSince = GetUptimeMs();
+                }
+                if ((m_tombstones.size() >= m_deleteBatchSize) ||
+                    (GetUptimeMs() - m_tombstonesSince >= m_deleteBatchInterval)) {
+                    // On failure the tombstones are kept for the next flush
+                    flushTombstonesUnsafe();
+                }
+                if (untracked.empty()) {
                     return;
                 }
+                toDelete = &untracked;
+            }
+
+            LOG_TRACE("Deleting %u sent event(s) {%s%s}...", static_cast<unsigned>(toDelete->size()), toDelete->front().c_str(), (toDelete->size() > 1) ? ", ..." : "");
+
+            size_t deleted = 0;
+            if (!deleteRecordsUnsafe(*toDelete, deleted)) {
+                return;
+            }
+
+            // Deleted records are normally the ones reserved for upload, so their latency is known
+            size_t attributed = 0;
+            size_t decrements[EventLatency_Max + 1] = {};
+            for (auto const& id : *toDelete) {
+                auto it = m_leases.find(id);
+                if (it != m_leases.end()) {
+                    decrements[it->second.latency]++;
+                    attributed++;
+                    releaseTenantBytesUnsafe(it->second.tenantToken, it->second.size);
+                    m_leases.erase(it);
+                }
+            }
+            if (attributed == deleted) {
+                for (unsigned latency = EventLatency_Off; latency <= EventLatency_Max; latency++) {
+                    m_recordCounts[latency] -= std::min(m_recordCounts[latency].load(), decrements[latency]);
+                }
+            } else {
+                invalidateRecordCountsUnsafe();
             }
         }
     }
@@ -511,6 +985,10 @@ namespace MAT_NS_BEGIN {
             LOG_TRACE("Releasing %u event(s) {%s%s}, retry count %s...",
                 static_cast<unsigned>(ids.size()), ids.front().c_str(), (ids.size() > 1) ? ", ..." : "", incrementRetryCount ? "+1" : "not changed");
 
+            for (auto const& id : ids) {
+                m_leases.erase(id);
+            }
+
             SqliteStatement releaseStmt(*m_db, m_stmtReleaseEvents_ids_retryCountDelta);
             for (size_t i = 0; i < ids.size(); i += kBlockSize) {
                 size_t count = std::min(kBlockSize, ids.size() - i);
@@ -558,6 +1036,7 @@ namespace MAT_NS_BEGIN {
                 unsigned droppedCount = deleteStmt.changes();
                 if (droppedCount > 0)
                 {
+                    invalidateRecordCountsUnsafe();
                     LOG_ERROR("Deleted %u events over maximum retry count %u",
                         droppedCount, maxRetryCount);
                     m_observer->OnStorageRecordsDropped(deletedData);
@@ -658,8 +1137,11 @@ namespace MAT_NS_BEGIN {
 
     bool OfflineStorage_SQLite::recreate(unsigned failureCode)
     {
+        invalidateRecordCountsUnsafe();
         m_observer->OnStorageFailed(toString(failureCode));
 
+        // The file cannot be deleted while the reader still has it open
+        closeReaderConnection();
         if (m_db)
         {
             m_db->shutdown();
@@ -683,7 +1165,9 @@ namespace MAT_NS_BEGIN {
 
     bool OfflineStorage_SQLite::initializeDatabase()
     {
-        SqliteStatement(*m_db, "PRAGMA auto_vacuum=FULL").select();
+        // Freed pages are reused by inserts and returned to the file system in
+        // budgeted steps by ResizeDb(), instead of on every commit
+        SqliteStatement(*m_db, "PRAGMA auto_vacuum=INCREMENTAL").select();
         SqliteStatement(*m_db, "PRAGMA journal_mode=WAL").select();
         SqliteStatement(*m_db, "PRAGMA synchronous=NORMAL").select();
         {
@@ -712,6 +1196,14 @@ namespace MAT_NS_BEGIN {
                     openedDbVersion, CURRENT_SCHEMA_VERSION);
                 return false;
             }
+            if (openedDbVersion == 1) {
+                // v2 adds payload_encoding, existing payloads are stored as-is
+                if (!SqliteStatement(*m_db,
+                    "ALTER TABLE " TABLE_NAME_EVENTS " ADD COLUMN payload_encoding INTEGER DEFAULT 0"
+                ).execute()) {
+                    return false;
+                }
+            }
             if (!SqliteStatement(*m_db,
                 ("PRAGMA user_version=" + toString(CURRENT_SCHEMA_VERSION)).c_str()
             ).execute()) {
@@ -728,7 +1220,8 @@ namespace MAT_NS_BEGIN {
             "timestamp"      " INTEGER,"
             "retry_count"    " INTEGER DEFAULT 0,"
             "reserved_until" " INTEGER DEFAULT 0,"
-            "payload"        " BLOB"
+            "payload"        " BLOB,"
+            "payload_encoding" " INTEGER DEFAULT 0"
             ")"
         ).execute()) {
             return false;
@@ -741,6 +1234,26 @@ namespace MAT_NS_BEGIN {
             return false;
         }
 
+        // Reservations, releases and deletes look events up by id
+        if (!SqliteStatement(*m_db,
+            "CREATE INDEX IF NOT EXISTS k_record_id ON " TABLE_NAME_EVENTS " (record_id)"
+        ).execute()) {
+            return false;
+        }
+
+        // Trimming walks the events in eviction order, overall and for tenants over quota
+        if (!SqliteStatement(*m_db,
+            "CREATE INDEX IF NOT EXISTS k_eviction ON " TABLE_NAME_EVENTS " (persistence, latency, timestamp)"
+        ).execute()) {
+            return false;
+        }
+        if (!SqliteStatement(*m_db, m_trackTenantUsage ?
+            "CREATE INDEX IF NOT EXISTS k_tenant_eviction ON " TABLE_NAME_EVENTS " (tenant_token, persistence, latency, timestamp)" :
+            "DROP INDEX IF EXISTS k_tenant_eviction"
+        ).execute()) {
+            return false;
+        }
+
         if (!SqliteStatement(*m_db,
             "CREATE TABLE IF NOT EXISTS " TABLE_NAME_SETTINGS " ("
             "name"  " TEXT,"
@@ -772,21 +1285,28 @@ namespace MAT_NS_BEGIN {
         PREPARE_SQL(m_stmtGetPageCount,
             "PRAGMA page_count");
 
-        PREPARE_SQL(m_stmtGetRecordCount,
-            "SELECT count(*) FROM " TABLE_NAME_EVENTS);
-        PREPARE_SQL(m_stmtGetRecordCountBylatency,
-            "SELECT count(*) FROM " TABLE_NAME_EVENTS " WHERE latency=?");
-
-        PREPARE_SQL(m_stmtPerTenantTrimCount,
-            "SELECT tenant_token FROM " TABLE_NAME_EVENTS " ORDER BY persistence ASC, timestamp ASC LIMIT MAX(1,"
-            "(SELECT COUNT(record_id) FROM " TABLE_NAME_EVENTS ")"
-            "* ? / 100)");
-        PREPARE_SQL(m_stmtTrimEvents_percent,
-                    "DELETE FROM " TABLE_NAME_EVENTS " WHERE record_id IN ("
-                                                     "SELECT record_id FROM " TABLE_NAME_EVENTS " ORDER BY persistence ASC, timestamp ASC LIMIT MAX(1,"
-                                                                                                "(SELECT COUNT(record_id) FROM " TABLE_NAME_EVENTS ")"
-                                                                                                                                                   "* ? / 100)"
-                                                                                                                                                   ")");
+        PREPARE_SQL(m_stmtGetRecordCountsByLatency,
+            "SELECT latency,count(*) FROM " TABLE_NAME_EVENTS " GROUP BY latency");
+
+        PREPARE_SQL(m_stmtGetFreelistCount,
+            "PRAGMA freelist_count");
+        PREPARE_SQL(m_stmtSelectEvictionCandidates,
+            "SELECT record_id,tenant_token,latency,persistence,timestamp,"
+            "length(record_id)+length(tenant_token)+length(payload) FROM " TABLE_NAME_EVENTS);
+        // Victims in the built-in eviction order, stepped only as far as needed
+        PREPARE_SQL(m_stmtSelectEvictionVictims,
+            "SELECT record_id,tenant_token,latency,"
+            "length(record_id)+length(tenant_token)+length(payload) FROM " TABLE_NAME_EVENTS
+            " ORDER BY persistence ASC, latency ASC, timestamp ASC");
+        if (m_trackTenantUsage) {
+            PREPARE_SQL(m_stmtSelectTenantEvictionVictims,
+                "SELECT record_id,tenant_token,latency,"
+                "length(record_id)+length(tenant_token)+length(payload) FROM " TABLE_NAME_EVENTS
+                " WHERE tenant_token=? ORDER BY persistence ASC, latency ASC, timestamp ASC");
+            PREPARE_SQL(m_stmtGetTenantBytes,
+                "SELECT tenant_token,sum(length(record_id)+length(tenant_token)+length(payload)) FROM " TABLE_NAME_EVENTS
+                " GROUP BY tenant_token");
+        }
 
         PREPARE_SQL(m_stmtDeleteEvents_tenants,
                 SQL_SUPPLY_PACKAGED_IDS
@@ -794,22 +1314,21 @@ namespace MAT_NS_BEGIN {
         PREPARE_SQL(m_stmtDeleteEvents_ids,
             SQL_SUPPLY_PACKAGED_IDS
             "DELETE FROM " TABLE_NAME_EVENTS " WHERE record_id IN ids");
-        PREPARE_SQL(m_stmtReleaseExpiredEvents,
-            "UPDATE " TABLE_NAME_EVENTS
-            " SET reserved_until=0, retry_count=retry_count+1"
-            " WHERE reserved_until<>0 AND reserved_until<=?");
-        PREPARE_SQL(m_stmtSelectEvents,
-            "SELECT record_id,tenant_token,latency,timestamp,retry_count,reserved_until,payload"
-            " FROM " TABLE_NAME_EVENTS
-            " WHERE latency>=? AND reserved_until=0"
-            " ORDER BY latency DESC,persistence DESC, timestamp ASC LIMIT ?");
+        m_stmtSelectEvents = m_db->prepare(m_selectEventsSql.c_str());
+        if ((m_stmtSelectEvents == 0) && (m_selectEventsSql != SQL_SELECT_EVENTS))
+        {
+            // SQLite before 3.25 has no window functions
+            LOG_WARN("Fair packing is not supported by this SQLite version, events are retrieved oldest first");
+            m_selectEventsSql = SQL_SELECT_EVENTS;
+            PREPARE_SQL(m_stmtSelectEvents, SQL_SELECT_EVENTS);
+        }
         PREPARE_SQL(m_stmtSelectEventAtShutdown,
-            "SELECT record_id,tenant_token,latency,timestamp,retry_count,reserved_until,payload"
+            "SELECT record_id,tenant_token,latency,timestamp,retry_count,reserved_until,payload,payload_encoding"
             " FROM " TABLE_NAME_EVENTS
             " WHERE latency>=?"
             " ORDER BY latency DESC,persistence DESC, timestamp ASC LIMIT ?");
         PREPARE_SQL(m_stmtSelectEventsMinlatency,
-            "SELECT record_id,tenant_token,latency,timestamp,retry_count,reserved_until,payload"
+            "SELECT record_id,tenant_token,latency,timestamp,retry_count,reserved_until,payload,payload_encoding"
             " FROM " TABLE_NAME_EVENTS
             " WHERE latency=(SELECT MIN(latency) FROM " TABLE_NAME_EVENTS " WHERE reserved_until=0 AND latency>=?) AND reserved_until=0"
             " ORDER BY timestamp ASC LIMIT ?");
@@ -819,6 +1338,10 @@ namespace MAT_NS_BEGIN {
             "UPDATE " TABLE_NAME_EVENTS
             " SET reserved_until=?"
             " WHERE record_id IN ids");
+        PREPARE_SQL(m_stmtSelectUnreservedEvents_ids,
+            SQL_SUPPLY_PACKAGED_IDS
+            "SELECT record_id FROM " TABLE_NAME_EVENTS
+            " WHERE record_id IN ids AND reserved_until=0");
         PREPARE_SQL(m_stmtReleaseEvents_ids_retryCountDelta,
             SQL_SUPPLY_PACKAGED_IDS
             "UPDATE " TABLE_NAME_EVENTS
@@ -831,7 +1354,9 @@ namespace MAT_NS_BEGIN {
             "DELETE FROM " TABLE_NAME_EVENTS
             " WHERE retry_count>?");
         PREPARE_SQL(m_stmtInsertEvent_id_tenant_prio_ts_data,
-            "REPLACE INTO " TABLE_NAME_EVENTS " (record_id,tenant_token,latency,persistence,timestamp,payload) VALUES (?,?,?,?,?,?)");
+            "INSERT INTO " TABLE_NAME_EVENTS " (record_id,tenant_token,latency,persistence,timestamp,payload,payload_encoding)"
+            " SELECT ?1,?2,?3,?4,?5,?6,?7"
+            " WHERE NOT EXISTS (SELECT 1 FROM " TABLE_NAME_EVENTS " WHERE record_id=?1)");
         PREPARE_SQL(m_stmtInsertSetting_name_value,
             "REPLACE INTO " TABLE_NAME_SETTINGS " (name,value) VALUES (?,?)");
         PREPARE_SQL(m_stmtDeleteSetting_name,
@@ -842,13 +1367,70 @@ namespace MAT_NS_BEGIN {
         /* Delete v1 records */
         Execute("DELETE FROM " TABLE_NAME_PACKAGES);
 
+        /* Leases are tracked in memory, so reservations left by a previous session have expired */
+        Execute("UPDATE " TABLE_NAME_EVENTS " SET reserved_until=0, retry_count=retry_count+1 WHERE reserved_until<>0");
+        m_leases.clear();
+        clearTombstonesUnsafe();
+
 #undef PREPARE_SQL
 #pragma warning(pop)
 
+        invalidateRecordCountsUnsafe();
         ResizeDb();
+        openReaderConnection();
         return true;
 }
 
+    /// <summary>
+    /// Open the reader connection if enabled. Failure is not fatal: scans then run on the writer connection.
+    /// </summary>
+    void OfflineStorage_SQLite::openReaderConnection()
+    {
+        if (!m_useReaderConnection)
+        {
+            return;
+        }
+
+        LOCKGUARD(m_readerLock);
+        if (m_dbReader)
+        {
+            return;
+        }
+        // SQLite library init and shutdown are owned by the writer connection
+        std::unique_ptr<SqliteDB> reader(new SqliteDB(true));
+        if (!reader->initialize(m_offlineStorageFileName, false))
+        {
+            LOG_WARN("Failed to open the reader connection, scanning on the writer connection");
+            return;
+        }
+        SqliteStatement(*reader, "PRAGMA query_only=1").select();
+        m_stmtReaderSelectEvents = reader->prepare(m_selectEventsSql.c_str());
+        if (m_stmtReaderSelectEvents == 0)
+        {
+            reader->shutdown();
+            return;
+        }
+        m_dbReader = std::move(reader);
+        LOG_INFO("Opened the reader connection");
+    }
+
+    void OfflineStorage_SQLite::closeReaderConnection()
+    {
+        LOCKGUARD(m_readerLock);
+        if (m_dbReader)
+        {
+            m_dbReader->shutdown();
+            m_dbReader.reset();
+        }
+    }
+
+    /// <summary>
+    /// Get the size of the pages in use by the database.
+    /// </summary>
+    /// <remarks>
+    /// Pages on the freelist are reused by subsequent inserts and returned to the
+    /// file system by incremental vacuum, so they are not counted.
+    /// </remarks>
     size_t OfflineStorage_SQLite::GetSize()
     {
         if (!m_db) {
@@ -857,6 +1439,11 @@ namespace MAT_NS_BEGIN {
         }
 
         LOCKGUARD(m_lock);
+        return GetSizeUnsafe();
+    }
+
+    size_t OfflineStorage_SQLite::GetSizeUnsafe()
+    {
         unsigned pageCount = 0;
         SqliteStatement pageCountStmt(*m_db, m_stmtGetPageCount);
         if (!pageCountStmt.select())
@@ -866,29 +1453,249 @@ namespace MAT_NS_BEGIN {
         }
         pageCountStmt.getRow(pageCount);
         pageCountStmt.reset();
-        return size_t(pageCount) * size_t(m_pageSize);
+        unsigned freelistCount = getFreelistCountUnsafe();
+        return size_t(pageCount - std::min(pageCount, freelistCount)) * size_t(m_pageSize);
     }
 
-    size_t OfflineStorage_SQLite::GetRecordCountUnsafe(EventLatency latency) const
+    unsigned OfflineStorage_SQLite::getFreelistCountUnsafe()
+    {
+        unsigned freelistCount = 0;
+        SqliteStatement freelistCountStmt(*m_db, m_stmtGetFreelistCount);
+        if (freelistCountStmt.select())
+        {
+            freelistCountStmt.getRow(freelistCount);
+            freelistCountStmt.reset();
+        }
+        return freelistCount;
+    }
+
+    /// <summary>
+    /// Reload per-latency record counters from the database. Must be called with m_lock held.
+    /// </summary>
+    void OfflineStorage_SQLite::loadRecordCountsUnsafe() const
     {
+        size_t counts[EventLatency_Max + 1] = {};
+        SqliteStatement recordCounts(*m_db, m_stmtGetRecordCountsByLatency);
+        if (!recordCounts.select())
+        {
+            LOG_WARN("Failed to get record count: database is busy");
+            return;
+        }
+        int latency = 0;
         int count = 0;
+        while (recordCounts.getRow(latency, count))
+        {
+            // Out of range latencies are retrieved as EventLatency_Normal
+            if (latency < EventLatency_Off || latency > EventLatency_Max)
+            {
+                latency = EventLatency_Normal;
+            }
+            counts[latency] += count;
+        }
+        recordCounts.reset();
+
+        // Tombstoned records are still in the table but no longer counted
+        for (unsigned lat = EventLatency_Off; lat <= EventLatency_Max; lat++)
+        {
+            m_recordCounts[lat] = counts[lat] - std::min(counts[lat], m_tombstoneCounts[lat]);
+        }
+        m_recordCountsValid = true;
+    }
+
+    /// <summary>
+    /// Invalidate per-latency record counters and the tenant usage after a bulk delete.
+    /// Must be called with m_lock held.
+    /// </summary>
+    void OfflineStorage_SQLite::invalidateRecordCountsUnsafe()
+    {
+        m_recordCountsValid = false;
+        m_tenantBytesValid = false;
+    }
+
+    /// <summary>
+    /// Reload the stored bytes by tenant. Must be called with m_lock held and no tombstones
+    /// pending, since tombstoned records are no longer accounted to their tenant.
+    /// </summary>
+    void OfflineStorage_SQLite::loadTenantBytesUnsafe()
+    {
+        m_tenantBytes.clear();
+        SqliteStatement tenantBytes(*m_db, m_stmtGetTenantBytes);
+        if (!tenantBytes.select())
+        {
+            LOG_WARN("Failed to get tenant usage: database is busy");
+            return;
+        }
+        std::string tenantToken;
+        int64_t bytes = 0;
+        while (tenantBytes.getRow(tenantToken, bytes))
+        {
+            m_tenantBytes[tenantToken] = static_cast<size_t>(bytes);
+        }
+        tenantBytes.reset();
+        m_tenantBytesValid = true;
+    }
+
+    void OfflineStorage_SQLite::releaseTenantBytesUnsafe(std::string const& tenantToken, size_t size)
+    {
+        if (!m_trackTenantUsage || !m_tenantBytesValid)
+        {
+            return;
+        }
+        auto it = m_tenantBytes.find(tenantToken);
+        if (it != m_tenantBytes.end())
+        {
+            it->second -= std::min(it->second, size);
+        }
+    }
+
+    /// <summary>
+    /// Release reserved records whose lease has expired, incrementing their retry count.
+    /// Must be called with m_lock held. Cost is proportional to the number of in-flight
+    /// records, and nothing is done before the earliest lease expires.
+    /// </summary>
+    bool OfflineStorage_SQLite::releaseExpiredLeasesUnsafe(int64_t now)
+    {
+        if (m_leases.empty() || now < m_nextLeaseExpiry)
+        {
+            return true;
+        }
+
+        std::vector<StorageRecordId> expiredIds;
+        int64_t nextExpiry = 0;
+        for (auto it = m_leases.begin(); it != m_leases.end(); )
+        {
+            if (it->second.expiry <= now)
+            {
+                expiredIds.push_back(it->first);
+                it = m_leases.erase(it);
+                continue;
+            }
+            if (nextExpiry == 0 || it->second.expiry < nextExpiry)
+            {
+                nextExpiry = it->second.expiry;
+            }
+            ++it;
+        }
+        m_nextLeaseExpiry = nextExpiry;
+
+        SqliteStatement releaseStmt(*m_db, m_stmtReleaseEvents_ids_retryCountDelta);
+        for (size_t i = 0; i < expiredIds.size(); i += kBlockSize)
+        {
+            size_t count = std::min(kBlockSize, expiredIds.size() - i);
+            std::vector<uint8_t> idList = packageIdList(expiredIds.begin() + i, expiredIds.begin() + i + count);
+            if (!releaseStmt.execute(idList, 1))
+            {
+                return false;
+            }
+        }
+        if (!expiredIds.empty())
+        {
+            LOG_TRACE("Released %u expired reserved events", static_cast<unsigned>(expiredIds.size()));
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Delete records by id in blocks of kBlockSize. Must be called with m_lock held.
+    /// On failure the database is recreated and false is returned.
+    /// </summary>
+    bool OfflineStorage_SQLite::deleteRecordsUnsafe(std::vector<StorageRecordId> const& ids, size_t& deleted)
+    {
+        deleted = 0;
+        for (size_t i = 0; i < ids.size(); i += kBlockSize) {
+            size_t count = std::min(kBlockSize, ids.size() - i);
+            std::vector<uint8_t> idList = packageIdList(ids.begin() + i,
+                                                        ids.begin() + i + count);
+            SqliteStatement deleteStmt(*m_db, m_stmtDeleteEvents_ids);
+            if (!deleteStmt.execute(idList)) {
+                LOG_ERROR(
+                        "Failed to delete %u sent event(s) {%s%s}: Database error occurred, recreating database",
+                        static_cast<unsigned>(ids.size()), ids.front().c_str(),
+                        (ids.size() > 1) ? ", ..." : "");
+                recreate(302);
+                return false;
+            }
+            deleted += deleteStmt.changes();
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Delete all tombstoned records in one batch. Must be called with m_lock held
+    /// and the database locked. Their record counts were already decremented.
+    /// The tombstones are kept if the delete fails, since their records are no
+    /// longer leased and would otherwise stay reserved until the next restart.
+    /// </summary>
+    bool OfflineStorage_SQLite::flushTombstonesUnsafe()
+    {
+        if (m_tombstones.empty()) {
+            return true;
+        }
+
+        std::vector<StorageRecordId> ids;
+        ids.reserve(m_tombstones.size());
+        for (auto const& kv : m_tombstones) {
+            ids.push_back(kv.first);
+        }
+
+        LOG_TRACE("Deleting %u acknowledged event(s) {%s%s}...", static_cast<unsigned>(ids.size()), ids.front().c_str(), (ids.size() > 1) ? ", ..." : "");
+        size_t deleted = 0;
+        if (!deleteRecordsUnsafe(ids, deleted)) {
+            LOG_WARN("Failed to delete %u acknowledged event(s), will retry", static_cast<unsigned>(ids.size()));
+            return false;
+        }
+        clearTombstonesUnsafe();
+        if (deleted != ids.size()) {
+            invalidateRecordCountsUnsafe();
+        }
+        return true;
+    }
+
+    void OfflineStorage_SQLite::clearTombstonesUnsafe()
+    {
+        m_tombstones.clear();
+        for (auto& count : m_tombstoneCounts) {
+            count = 0;
+        }
+        m_tombstonesSince = 0;
+    }
+
+    size_t OfflineStorage_SQLite::GetRecordCountUnsafe(EventLatency latency) const
+    {
+        if (!m_recordCountsValid)
+        {
+            loadRecordCountsUnsafe();
+        }
+        return readRecordCounts(latency);
+    }
+
+    /// <summary>
+    /// Sum the maintained counters without reloading them.
+    /// </summary>
+    size_t OfflineStorage_SQLite::readRecordCounts(EventLatency latency) const
+    {
+        size_t count = 0;
         if (latency == EventLatency_Unspecified)
         {
-            SqliteStatement recordCount(*m_db, m_stmtGetRecordCount);
-            recordCount.select();
-            recordCount.getOneValue(count);
-            recordCount.reset();
+            for (unsigned lat = EventLatency_Off; lat <= EventLatency_Max; lat++)
+            {
+                count += m_recordCounts[lat];
+            }
         }
-        else
+        else if ((latency >= EventLatency_Off) && (latency <= EventLatency_Max))
         {
-            SqliteStatement recordCount(*m_db, m_stmtGetRecordCountBylatency);
-            recordCount.select(latency);
-            recordCount.getOneValue(count);
-            recordCount.reset();
+            count = m_recordCounts[latency];
         }
         return count;
     }
 
+    /// <summary>
+    /// Gets the number of records of specific latency in the DB.
+    /// If latency is unspecified, get the total number of records.
+    /// </summary>
+    /// <remarks>
+    /// O(1) and lock-free while the maintained counters are valid.
+    /// </remarks>
     size_t OfflineStorage_SQLite::GetRecordCount(EventLatency latency = EventLatency_Unspecified) const
     {
         if (!m_db) {
@@ -896,11 +1703,71 @@ namespace MAT_NS_BEGIN {
             return 0;
         }
 
+        if (m_recordCountsValid)
+        {
+            // Only the atomics are read here, a reload needs m_lock
+            return readRecordCounts(latency);
+        }
+
         LOCKGUARD(m_lock);
         return OfflineStorage_SQLite::GetRecordCountUnsafe(latency);
     }
 
+    /// <summary>
+    /// Perform one budgeted trim step if the database exceeds its size limit.
+    /// </summary>
+    /// <returns>true if events have been dropped</returns>
+    /// <remarks>
+    /// Each step deletes events worth of at most m_trimPageBudget pages, then returns at
+    /// most that many free pages to the file system with incremental vacuum. StoreRecord
+    /// posts the steps to the trim thread until the database is back under its limit,
+    /// so producers never stall on a trim, and no step on a full-table delete or a full VACUUM.
+    /// With the built-in eviction policy, victims are read in eviction order from an
+    /// index, first for each tenant over its quota, then overall, so a step only reads
+    /// the rows it deletes. A registered policy compares all records, which takes a full scan.
+    /// </remarks>
     bool OfflineStorage_SQLite::ResizeDb()
+    {
+        return resizeDb(true);
+    }
+
+    /// <summary>
+    /// Post a trim step to the trim thread, unless one is pending already.
+    /// </summary>
+    void OfflineStorage_SQLite::scheduleTrim(bool syncSize)
+    {
+        if (m_trimPending.exchange(true))
+        {
+            return;
+        }
+        LOCKGUARD(m_resizeLock);
+        if (m_trimStopped)
+        {
+            m_trimPending = false;
+            return;
+        }
+        if (!m_trimThread)
+        {
+            m_trimThread = PAL::WorkerThreadFactory::Create();
+        }
+        PAL::scheduleTask(m_trimThread.get(), 0, this, &OfflineStorage_SQLite::trimStep, syncSize);
+    }
+
+    /// <summary>
+    /// Run a trim step on the trim thread, and post the next one while the database
+    /// is still over its limit. Only the first step of a run queries the page count.
+    /// </summary>
+    void OfflineStorage_SQLite::trimStep(bool syncSize)
+    {
+        bool dropped = resizeDb(syncSize);
+        m_trimPending = false;
+        if (dropped && (m_DbSizeEstimate > m_DbSizeLimit))
+        {
+            scheduleTrim(false);
+        }
+    }
+
+    bool OfflineStorage_SQLite::resizeDb(bool syncSize)
     {
         if (!m_db) {
             LOG_ERROR("Failed to resize DB: database is not open");
@@ -908,10 +1775,7 @@ namespace MAT_NS_BEGIN {
         }
 
         size_t eventsDropped = 0;
-        m_DbSizeEstimate = GetSize();
-        if (m_DbSizeEstimate <= m_DbSizeLimit)
-            return false;
-
+        DroppedMap trimmed;
         LOCKGUARD(m_lock);
         {
 #ifdef ENABLE_LOCKING
@@ -922,33 +1786,225 @@ namespace MAT_NS_BEGIN {
                 return false;
             }
 #endif
+            if (!flushTombstonesUnsafe())
+                return false;
+            if (syncSize)
+            {
+                m_DbSizeEstimate = GetSizeUnsafe();
+                m_trimFreelistCount = getFreelistCountUnsafe();
+            }
+            if (m_DbSizeEstimate <= m_DbSizeLimit)
+                return false;
+
             auto count = GetRecordCountUnsafe(EventLatency::EventLatency_Unspecified);
-            if (m_DbSizeEstimate > 2 * m_DbSizeLimit)
+            if (count == 0)
+                return false;
+
+            // Aim 25% below the limit to avoid trimming on every insert, but free
+            // no more than the page budget in one step.
+            size_t bytesToFree = (m_DbSizeEstimate - m_DbSizeLimit) + (m_DbSizeLimit / 4);
+            bytesToFree = std::min(bytesToFree, size_t(m_trimPageBudget) * size_t(m_pageSize));
+
+            std::vector<EvictionVictim> victims;
+            if (m_defaultEviction)
             {
-                LOG_TRACE("DB is too big, deleting...");
-                Execute("DELETE FROM " TABLE_NAME_EVENTS);
-                Execute("VACUUM");
-                return true;
+                size_t freed = 0;
+                if (m_trackTenantUsage)
+                {
+                    if (!m_tenantBytesValid)
+                    {
+                        loadTenantBytesUnsafe();
+                    }
+                    // Record sizes leave out the page overhead, scale the limit and the amount to free accordingly
+                    uint64_t recordBytes = 0;
+                    for (auto const& item : m_tenantBytes)
+                    {
+                        recordBytes += item.second;
+                    }
+                    size_t capacity = static_cast<size_t>((static_cast<uint64_t>(m_DbSizeLimit) * recordBytes) / m_DbSizeEstimate);
+                    bytesToFree = std::max(size_t(1), static_cast<size_t>((static_cast<uint64_t>(bytesToFree) * recordBytes) / m_DbSizeEstimate));
+
+                    for (auto const& trim : SelectTenantTrims(*m_evictionPolicy, m_tenantBytes, capacity, bytesToFree))
+                    {
+                        std::vector<EvictionVictim> tenantVictims;
+                        size_t tenantFreed = selectVictimsInOrderUnsafe(&trim.first, trim.second, tenantVictims);
+                        if (tenantFreed == 0)
+                        {
+                            // Usage is out of sync with the table
+                            invalidateRecordCountsUnsafe();
+                            continue;
+                        }
+                        if (!deleteVictimsUnsafe(tenantVictims, trimmed))
+                        {
+                            break;
+                        }
+                        freed += tenantFreed;
+                        eventsDropped += tenantVictims.size();
+                    }
+                }
+                if (freed < bytesToFree)
+                {
+                    selectVictimsInOrderUnsafe(nullptr, bytesToFree - freed, victims);
+                }
+            }
+            else
+            {
+                selectVictimsByPolicyUnsafe(bytesToFree, victims);
+            }
+            if (deleteVictimsUnsafe(victims, trimmed))
+            {
+                eventsDropped += victims.size();
             }
 
-            SqliteStatement trimStmt(*m_db, m_stmtTrimEvents_percent);
-            if (!trimStmt.execute(25))
+            // Deleted rows move their pages to the freelist, incremental vacuum then
+            // returns up to the page budget of them to the file system
+            unsigned freelistCount = getFreelistCountUnsafe();
+            size_t freedBytes = size_t(freelistCount - std::min(freelistCount, m_trimFreelistCount)) * size_t(m_pageSize);
+            m_DbSizeEstimate -= std::min(size_t(m_DbSizeEstimate), freedBytes);
+            Execute("PRAGMA incremental_vacuum(" + toString(m_trimPageBudget) + ")");
+            m_trimFreelistCount = freelistCount - std::min(freelistCount, m_trimPageBudget);
+
+            LOG_TRACE("Db trim step, events dropped: %u, size estimate: %u", static_cast<unsigned>(eventsDropped), static_cast<unsigned>(m_DbSizeEstimate));
+        }
+
+        if (!trimmed.empty() && (m_observer != nullptr))
+        {
+            m_observer->OnStorageTrimmed(trimmed);
+        }
+        else
+        {
+            DebugEvent evt(DebugEventType::EVT_DROPPED);
+            evt.param1 = eventsDropped;
+            evt.size = eventsDropped;
+            m_logManager.DispatchEvent(evt);
+        }
+
+        return true;
+    }
+
+    /// <summary>
+    /// Read victims in the built-in eviction order until their size reaches bytesToFree.
+    /// Must be called with m_lock held. The indexed query is only stepped that far.
+    /// </summary>
+    /// <param name="tenantToken">Tenant to evict from, nullptr for all of them</param>
+    /// <returns>Size of the victims found</returns>
+    size_t OfflineStorage_SQLite::selectVictimsInOrderUnsafe(std::string const* tenantToken, size_t bytesToFree, std::vector<EvictionVictim>& victims)
+    {
+        SqliteStatement selectStmt(*m_db, (tenantToken != nullptr) ? m_stmtSelectTenantEvictionVictims : m_stmtSelectEvictionVictims);
+        bool selected = (tenantToken != nullptr) ? selectStmt.select(*tenantToken) : selectStmt.select();
+        size_t freed = 0;
+        if (selected)
+        {
+            EvictionVictim victim;
+            int64_t size = 0;
+            while ((freed < bytesToFree) && selectStmt.getRow(victim.id, victim.tenantToken, victim.latency, size))
             {
-                // If something went wrong with trimming 25%, try more radical measure
+                victim.size = static_cast<size_t>(size);
+                freed += victim.size;
+                victims.push_back(std::move(victim));
+                victim = EvictionVictim();
+            }
+        }
+        selectStmt.reset();
+        return freed;
+    }
+
+    /// <summary>
+    /// Let the registered eviction policy choose victims among all records.
+    /// Must be called with m_lock held.
+    /// </summary>
+    /// <returns>Size of the victims found</returns>
+    size_t OfflineStorage_SQLite::selectVictimsByPolicyUnsafe(size_t bytesToFree, std::vector<EvictionVictim>& victims)
+    {
+        std::vector<StorageRecordId> ids;
+        std::vector<EvictionCandidate> candidates;
+        uint64_t candidatesSize = 0;
+        {
+            SqliteStatement selectStmt(*m_db, m_stmtSelectEvictionCandidates);
+            StorageRecordId id;
+            EvictionCandidate candidate;
+            int latency = 0;
+            int persistence = 0;
+            int64_t size = 0;
+            if (selectStmt.select())
+            {
+                while (selectStmt.getRow(id, candidate.tenantToken, latency, persistence, candidate.timestamp, size))
+                {
+                    candidate.latency = static_cast<EventLatency>(latency);
+                    candidate.persistence = static_cast<EventPersistence>(persistence);
+                    candidate.size = static_cast<size_t>(size);
+                    candidatesSize += candidate.size;
+                    ids.push_back(std::move(id));
+                    candidates.push_back(std::move(candidate));
+                    id = StorageRecordId();
+                    candidate = EvictionCandidate();
+                }
+            }
+        }
+        if (candidates.empty())
+        {
+            return 0;
+        }
+
+        // Candidate sizes leave out the page overhead, scale the limit and the amount to free accordingly
+        size_t capacity = static_cast<size_t>((static_cast<uint64_t>(m_DbSizeLimit) * candidatesSize) / m_DbSizeEstimate);
+        size_t sizeToFree = std::max(size_t(1), static_cast<size_t>((static_cast<uint64_t>(bytesToFree) * candidatesSize) / m_DbSizeEstimate));
+        size_t freed = 0;
+        for (size_t index : SelectEvictionVictims(*m_evictionPolicy, candidates, capacity, sizeToFree))
+        {
+            EvictionVictim victim;
+            victim.id = std::move(ids[index]);
+            victim.tenantToken = std::move(candidates[index].tenantToken);
+            victim.latency = candidates[index].latency;
+            victim.size = candidates[index].size;
+            freed += victim.size;
+            victims.push_back(std::move(victim));
+        }
+        return freed;
+    }
+
+    /// <summary>
+    /// Delete the victims and take them off the counters. Must be called with m_lock held.
+    /// </summary>
+    /// <returns>false if the deletion failed, the counters are invalidated then</returns>
+    bool OfflineStorage_SQLite::deleteVictimsUnsafe(std::vector<EvictionVictim> const& victims, DroppedMap& trimmed)
+    {
+        std::vector<StorageRecordId> victimIds;
+        victimIds.reserve(victims.size());
+        for (auto const& victim : victims)
+        {
+            victimIds.push_back(victim.id);
+        }
+        size_t deleted = 0;
+        for (size_t i = 0; i < victimIds.size(); i += kBlockSize)
+        {
+            size_t blockCount = std::min(kBlockSize, victimIds.size() - i);
+            std::vector<uint8_t> idList = packageIdList(victimIds.begin() + i, victimIds.begin() + i + blockCount);
+            SqliteStatement deleteStmt(*m_db, m_stmtDeleteEvents_ids);
+            if (!deleteStmt.execute(idList))
+            {
+                // If something went wrong with trimming, try more radical measure
                 LOG_TRACE("Evict all non-critical");
                 Execute("DELETE FROM " TABLE_NAME_EVENTS " WHERE persistence=1");
+                trimmed.clear();
+                invalidateRecordCountsUnsafe();
+                return false;
             }
-            eventsDropped = count - GetRecordCountUnsafe(EventLatency::EventLatency_Unspecified);
-            LOG_TRACE("Db resized, events dropeed: %d", eventsDropped);
-            trimStmt.reset();
+            deleted += deleteStmt.changes();
         }
 
-        m_DbSizeEstimate = GetSize();
-        DebugEvent evt(DebugEventType::EVT_DROPPED);
-        evt.param1 = eventsDropped;
-        evt.size = eventsDropped;
-        m_logManager.DispatchEvent(evt);
-
+        for (auto const& victim : victims)
+        {
+            int latency = ((victim.latency < EventLatency_Off) || (victim.latency > EventLatency_Max)) ? EventLatency_Normal : victim.latency;
+            m_recordCounts[latency] -= std::min<size_t>(m_recordCounts[latency].load(), 1);
+            releaseTenantBytesUnsafe(victim.tenantToken, victim.size);
+            m_leases.erase(victim.id);
+            trimmed[victim.tenantToken]++;
+        }
+        if (deleted != victims.size())
+        {
+            invalidateRecordCountsUnsafe();
+        }
         return true;
     }
 
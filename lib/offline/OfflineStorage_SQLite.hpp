@@ -7,15 +7,20 @@
 
 #pragma once
 #include "pal/PAL.hpp"
+#include "pal/TaskDispatcher.hpp"
 #include "IOfflineStorage.hpp"
 
 #include "api/IRuntimeConfig.hpp"
+#include "EvictionPolicy.hpp"
+#include "FairQueue.hpp"
+#include "utils/ZlibUtils.hpp"
 
 #include "ILogManager.hpp"
 
 #include <memory>
 #include <atomic>
 #include <mutex>
+#include <unordered_map>
 
 #define ENABLE_LOCKING      // Enable DB locking for flush
 
@@ -31,11 +36,13 @@ namespace MAT_NS_BEGIN {
         virtual ~OfflineStorage_SQLite() override;
         virtual void Initialize(IOfflineStorageObserver& observer) override;
         virtual void Shutdown() override;
-        virtual void Flush() override {};
+        virtual void Flush() override;
         virtual void Execute(std::string command);
         virtual bool StoreRecord(StorageRecord const& record) override;
         virtual size_t StoreRecords(std::vector<StorageRecord> & records) override;
         virtual bool GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs, EventLatency minLatency = EventLatency_Normal, unsigned maxCount = 0) override;
+        virtual bool GetAndReserveRecords(std::function<bool(StorageRecord&&)> const& consumer, unsigned leaseTimeMs, EventLatency minLatency, unsigned maxCount,
+            std::vector<std::string> const& excludedTenants) override;
         virtual bool IsLastReadFromMemory() override;
         virtual unsigned LastReadRecordCount() override;
 
@@ -56,6 +63,30 @@ namespace MAT_NS_BEGIN {
         bool initializeDatabase();
         bool recreate(unsigned failureCode);
 
+        /// <summary>
+        /// Records found by a scan of unreserved events.
+        /// </summary>
+        struct SelectedRecords
+        {
+            std::vector<StorageRecordId>  ids;
+            std::vector<int>              latencies;
+            std::vector<size_t>           sizes;        // Only while tracking tenant usage
+            std::vector<std::string>      tenants;      // Only while tracking tenant usage
+            std::vector<StorageRecordId>  corruptIds;
+            std::map<std::string, size_t> deletedData;
+        };
+
+        unsigned selectRecords(SqliteDB& db, size_t stmtSelect, std::function<bool(StorageRecord&&)> const& consumer, EventLatency minLatency, unsigned maxCount,
+            std::vector<uint8_t> const& excludedList, SelectedRecords& selected);
+        bool reserveRecordsUnsafe(SelectedRecords const& selected, int64_t leaseUntil);
+
+        void openReaderConnection();
+        void closeReaderConnection();
+
+        bool encodePayload(StorageBlob const& blob, StorageBlob& encoded, int& encoding) const;
+        bool decodePayload(StorageBlob& blob, int encoding, ZlibInflater& inflater) const;
+        void dropCorruptRecordsUnsafe(SelectedRecords const& selected);
+
         std::vector<uint8_t> packageIdList(
             std::vector<std::string>::const_iterator const & begin,
             std::vector<std::string>::const_iterator const & end) const;
@@ -70,31 +101,59 @@ namespace MAT_NS_BEGIN {
         ILogManager&                m_logManager;
         std::unique_ptr<SqliteDB>   m_db;
 
+        /// <summary>
+        /// Optional second connection used only to scan events for upload. In WAL
+        /// mode it reads a snapshot without blocking inserts on m_db. Guarded by
+        /// m_readerLock; locks are taken in the order m_reserveLock, m_lock, m_readerLock,
+        /// and the scan holds m_readerLock without m_lock.
+        /// </summary>
+        std::unique_ptr<SqliteDB>   m_dbReader;
+        std::mutex                  m_readerLock;
+        std::mutex                  m_reserveLock;
+        bool                        m_useReaderConnection {};
+        size_t                      m_stmtReaderSelectEvents {};
+
+        /// <summary>
+        /// Statement selecting events to upload, in weighted fair order across tenants if enabled.
+        /// </summary>
+        std::string                 m_selectEventsSql;
+
         bool                        isOpen();
 
         int                         m_pageSize {};
 
         bool                        m_skipInitAndShutdown {};
+        bool                        m_compressPayloads {};
+        int                         m_compressionLevel {};
         bool                        m_isOpened {};
 
+        /// <summary>
+        /// Worker thread running the trim steps posted by StoreRecord(), so that producers
+        /// never trim the database themselves. At most one step is pending at a time;
+        /// m_resizeLock guards the thread, which Shutdown() joins before closing the database.
+        /// </summary>
         std::mutex                  m_resizeLock{};
-        std::atomic<bool>           m_resizing{false};
+        std::atomic<bool>           m_trimPending{false};
+        bool                        m_trimStopped {};
+        std::shared_ptr<ITaskDispatcher> m_trimThread;
 
         size_t                      m_stmtBeginTransaction {};
         size_t                      m_stmtCommitTransaction {};
         size_t                      m_stmtRollbackTransaction {};
         size_t                      m_stmtGetPageCount {};
-        size_t                      m_stmtGetRecordCount {};
-        size_t                      m_stmtGetRecordCountBylatency {};
-        size_t                      m_stmtPerTenantTrimCount {};
-        size_t                      m_stmtTrimEvents_percent {};
+        size_t                      m_stmtGetRecordCountsByLatency {};
+        size_t                      m_stmtGetFreelistCount {};
+        size_t                      m_stmtSelectEvictionCandidates {};
+        size_t                      m_stmtSelectEvictionVictims {};
+        size_t                      m_stmtSelectTenantEvictionVictims {};
+        size_t                      m_stmtGetTenantBytes {};
         size_t                      m_stmtDeleteEvents_ids {};
-        size_t                      m_stmtReleaseExpiredEvents {};
         size_t                      m_stmtDeleteEvents_tenants {};
         size_t                      m_stmtSelectEvents {};
         size_t                      m_stmtSelectEventAtShutdown {};
         size_t                      m_stmtSelectEventsMinlatency {};
         size_t                      m_stmtReserveEvents {};
+        size_t                      m_stmtSelectUnreservedEvents_ids {};
         size_t                      m_stmtReleaseEvents_ids_retryCountDelta {};
         size_t                      m_stmtDeleteEventsRetried_maxRetryCount {};
         size_t                      m_stmtSelectEventsRetried_maxRetryCount {};
@@ -108,7 +167,77 @@ namespace MAT_NS_BEGIN {
         uint64_t                    m_DbSizeNotificationInterval {};
         size_t                      m_DbSizeHeapLimit {};
         size_t                      m_DbSizeLimit {};
+        unsigned                    m_trimPageBudget {};
+        std::shared_ptr<IEvictionPolicy> m_evictionPolicy;
+        bool                        m_defaultEviction {};
+        /// <summary>
+        /// Running estimate of the database size. Grows with every insert and is
+        /// synchronized with the page count only by ResizeDb() and the storage
+        /// full notification, so the hot path never queries the page count.
+        /// Trim steps following a synchronized one subtract the pages they free,
+        /// tracked by the freelist count seen by the last step.
+        /// </summary>
         std::atomic<size_t>         m_DbSizeEstimate {};
+        unsigned                    m_trimFreelistCount {};
+
+        /// <summary>
+        /// Per-latency record counters maintained on insert and delete. Bulk deletes
+        /// that cannot attribute rows to a latency invalidate them, and the next
+        /// GetRecordCount() reloads them with a single GROUP BY query.
+        /// </summary>
+        mutable std::atomic<size_t> m_recordCounts[EventLatency_Max + 1] {};
+        mutable std::atomic<bool>   m_recordCountsValid {};
+
+        /// <summary>
+        /// Stored bytes by tenant token, guarded by m_lock and only tracked while tenants may
+        /// have a quota. Maintained and invalidated along with the record counters, and
+        /// reloaded by ResizeDb() with a single GROUP BY query when invalid.
+        /// </summary>
+        bool                        m_trackTenantUsage {};
+        bool                        m_tenantBytesValid {};
+        std::unordered_map<std::string, size_t> m_tenantBytes;
+
+        /// <summary>
+        /// Lease of a reserved (in-flight) record: its latency, size and tenant, used to
+        /// update the counters when the record is deleted after upload, and its expiry time.
+        /// </summary>
+        struct StorageLease
+        {
+            int         latency;
+            int64_t     expiry;
+            size_t      size;
+            std::string tenantToken;
+        };
+
+        /// <summary>
+        /// Record chosen by ResizeDb() for eviction.
+        /// </summary>
+        struct EvictionVictim
+        {
+            StorageRecordId id;
+            std::string     tenantToken;
+            int             latency;
+            size_t          size;
+        };
+
+        /// <summary>
+        /// Leases of in-flight records, guarded by m_lock. Expired leases are found
+        /// here instead of scanning the events table on every read.
+        /// </summary>
+        std::unordered_map<StorageRecordId, StorageLease> m_leases;
+        int64_t                     m_nextLeaseExpiry {};
+
+        /// <summary>
+        /// Acknowledged records not deleted yet and their latency, guarded by m_lock.
+        /// Tombstoned rows keep their reservation, so scans skip them, and they are no
+        /// longer counted. flushTombstonesUnsafe() deletes them in one batch once
+        /// m_deleteBatchSize of them accumulated or m_deleteBatchInterval elapsed.
+        /// </summary>
+        std::unordered_map<StorageRecordId, int> m_tombstones;
+        size_t                      m_tombstoneCounts[EventLatency_Max + 1] {};
+        uint64_t                    m_tombstonesSince {};
+        size_t                      m_deleteBatchSize {};
+        uint64_t                    m_deleteBatchInterval {};
         uint64_t                    m_isStorageFullNotificationSendTime {};
 
     protected:
@@ -116,6 +245,23 @@ namespace MAT_NS_BEGIN {
 
     private:
         size_t GetRecordCountUnsafe(EventLatency latency) const;
+        size_t readRecordCounts(EventLatency latency) const;
+        size_t GetSizeUnsafe();
+        unsigned getFreelistCountUnsafe();
+        bool resizeDb(bool syncSize);
+        void scheduleTrim(bool syncSize);
+        void trimStep(bool syncSize);
+        void loadRecordCountsUnsafe() const;
+        void invalidateRecordCountsUnsafe();
+        void loadTenantBytesUnsafe();
+        void releaseTenantBytesUnsafe(std::string const& tenantToken, size_t size);
+        size_t selectVictimsInOrderUnsafe(std::string const* tenantToken, size_t bytesToFree, std::vector<EvictionVictim>& victims);
+        size_t selectVictimsByPolicyUnsafe(size_t bytesToFree, std::vector<EvictionVictim>& victims);
+        bool deleteVictimsUnsafe(std::vector<EvictionVictim> const& victims, DroppedMap& trimmed);
+        bool releaseExpiredLeasesUnsafe(int64_t now);
+        bool deleteRecordsUnsafe(std::vector<StorageRecordId> const& ids, size_t& deleted);
+        bool flushTombstonesUnsafe();
+        void clearTombstonesUnsafe();
     };
 
 
@@ -10,7 +10,8 @@ namespace MAT_NS_BEGIN {
     StorageObserver::StorageObserver(ITelemetrySystem& system, IOfflineStorage& offlineStorage)
         :
         m_system(system),
-        m_offlineStorage(offlineStorage)
+        m_offlineStorage(offlineStorage),
+        m_countStoredRecords(false)
     {
     }
 
@@ -20,6 +21,7 @@ namespace MAT_NS_BEGIN {
 
     bool StorageObserver::handleStart()
     {
+        m_countStoredRecords = (static_cast<size_t>(m_system.getConfig()[CFG_MAP_TPM][CFG_INT_TPM_DRAIN_THRESHOLD]) != 0);
         m_offlineStorage.Initialize(*this);
         return true;
     }
@@ -50,7 +52,8 @@ namespace MAT_NS_BEGIN {
         };
 
         // TODO: [MG] - expose 120000 as a configuration parameter
-        if (!m_offlineStorage.GetAndReserveRecords(consumer, 120000, ctx->requestedMinLatency, ctx->requestedMaxCount))
+        // Events of tenants over their upload rate stay in storage for a later upload
+        if (!m_offlineStorage.GetAndReserveRecords(consumer, 120000, ctx->requestedMinLatency, ctx->requestedMaxCount, ctx->deferredTenants))
         {
             ctx->fromMemory = m_offlineStorage.IsLastReadFromMemory();
             retrievalFailed(ctx);
@@ -58,6 +61,10 @@ namespace MAT_NS_BEGIN {
         else
         {
             ctx->fromMemory = m_offlineStorage.IsLastReadFromMemory();
+            if (m_countStoredRecords)
+            {
+                ctx->storedRecordCount = m_offlineStorage.GetRecordCount();
+            }
             retrievalFinished(ctx);
         }
     }
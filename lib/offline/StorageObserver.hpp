@@ -49,6 +49,10 @@ namespace MAT_NS_BEGIN {
     protected:
         ITelemetrySystem & m_system;
         IOfflineStorage  & m_offlineStorage;
+        /// <summary>
+        /// Count the stored records after each retrieval, only needed by the drain mode of the TPM.
+        /// </summary>
+        bool               m_countStoredRecords;
 
     public:
 
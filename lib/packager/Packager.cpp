@@ -18,6 +18,7 @@ namespace MAT_NS_BEGIN {
         {
             m_forcedTenantToken = forcedTenantToken;
         }
+        m_retryCache.Configure(runtimeConfig[CFG_MAP_TPM][CFG_INT_TPM_RETRY_CACHE_SIZE]);
     }
 
     void Packager::handleAddEventToPackage(EventsUploadContextPtr const& ctx, StorageRecord const& record, bool& wantMore)
@@ -26,8 +27,19 @@ namespace MAT_NS_BEGIN {
             if (ctx->maxUploadSize == 0) {
                 ctx->maxUploadSize = m_config.GetMaximumUploadSizeBytes();
             }
+            if (!ctx->deferredTenants.empty() &&
+                std::find(ctx->deferredTenants.begin(), ctx->deferredTenants.end(), record.tenantToken) != ctx->deferredTenants.end()) {
+                // Storage skips these events, except where it cannot skip without reserving them.
+                // The event stays unreserved then, and goes with a later upload once the tenant is below its rate.
+                LOG_TRACE("Tenant %s is over its upload rate, not adding the next event (ID %s)",
+                    tenantTokenToId(record.tenantToken).c_str(), record.id.c_str());
+                wantMore = false;
+                return;
+            }
+
             if (ctx->splicer->getSizeEstimate() + record.blob.size() > ctx->maxUploadSize) {
                 wantMore = false;
+                ctx->packageFull = true;
                 if (!ctx->recordIdsAndTenantIds.empty()) {
                     LOG_TRACE("Maximum upload size %u bytes exceeded, not adding the next event (ID %s, size %u bytes)",
                         ctx->maxUploadSize, record.id.c_str(), static_cast<unsigned>(record.blob.size()));
@@ -53,11 +65,21 @@ namespace MAT_NS_BEGIN {
             if (it == ctx->packageIds.end() || it->first != tenantToken)
             {
                 it = ctx->packageIds.insert(it, { tenantToken, ctx->splicer->addTenantToken(tenantToken) });
+                // Interned once per tenant and package, the records of the package share the handle
+                if (ctx->packageTenantHandles.size() <= it->second) {
+                    ctx->packageTenantHandles.resize(it->second + 1);
+                }
+                ctx->packageTenantHandles[it->second] = internTenantToken(tenantToken);
             }
 
             ctx->splicer->addRecord(it->second, record.blob);
+            if (ctx->packageSizes.size() <= it->second) {
+                ctx->packageSizes.resize(it->second + 1);
+            }
+            ctx->packageSizes[it->second] += record.blob.size();
 
-            ctx->recordIdsAndTenantIds[record.id] = record.tenantToken;
+            // A forced token packages all tenants together, their records keep their own token
+            ctx->recordIdsAndTenantIds[record.id] = m_forcedTenantToken.empty() ? ctx->packageTenantHandles[it->second] : internTenantToken(record.tenantToken);
             ctx->recordTimestamps.push_back(record.timestamp);
             ctx->maxRetryCountSeen = std::max<int>(ctx->maxRetryCountSeen, record.retryCount);
         }
@@ -74,12 +96,41 @@ namespace MAT_NS_BEGIN {
             return;
         }
 
-        ctx->body = ctx->splicer->splice();
+        if (m_retryCache.Take(ctx->recordIdsAndTenantIds, ctx->body, ctx->compressed, PAL::getMonotonicTimeMs())) {
+            LOG_TRACE("Resending the cached body of %u events, size %u bytes",
+                static_cast<unsigned>(ctx->recordIdsAndTenantIds.size()), static_cast<unsigned>(ctx->body.size()));
+            ctx->fromRetryCache = true;
+        }
+        else {
+            ctx->body = ctx->splicer->splice();
+        }
         ctx->splicer->clear();
 
         packagedEvents(ctx);
     }
 
+    /// <summary>
+    /// Keep the final body of an upload that failed temporarily, so that the retry of the
+    /// same records does not splice and compress them again. Must run before the records
+    /// are released.
+    /// </summary>
+    bool Packager::handleRetainPackage(EventsUploadContextPtr const& ctx)
+    {
+        if (ctx->httpRequest != nullptr && m_retryCache.IsEnabled()) {
+            m_retryCache.Store(ctx->recordIdsAndTenantIds, ctx->httpRequest->GetBody(), ctx->compressed, PAL::getMonotonicTimeMs());
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Drop the cached bodies that include records being deleted.
+    /// </summary>
+    bool Packager::handleForgetPackage(EventsUploadContextPtr const& ctx)
+    {
+        m_retryCache.Invalidate(ctx->recordIdsAndTenantIds);
+        return true;
+    }
+
 
 } MAT_NS_END
 
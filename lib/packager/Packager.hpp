@@ -8,6 +8,7 @@
 
 #include "system/Route.hpp"
 #include "system/Contexts.hpp"
+#include "UploadRetryCache.hpp"
 
 namespace MAT_NS_BEGIN {
 
@@ -15,17 +16,30 @@ namespace MAT_NS_BEGIN {
     public:
         Packager(IRuntimeConfig& runtimeConfig);
 
+        /// <summary>
+        /// Drop all cached bodies of failed uploads.
+        /// </summary>
+        void clearRetryCache()
+        {
+            m_retryCache.Clear();
+        }
+
     protected:
         void handleAddEventToPackage(EventsUploadContextPtr const& ctx, StorageRecord const& record, bool& wantMore);
         void handleFinalizePackage(EventsUploadContextPtr const& ctx);
+        bool handleRetainPackage(EventsUploadContextPtr const& ctx);
+        bool handleForgetPackage(EventsUploadContextPtr const& ctx);
 
     protected:
         IRuntimeConfig & m_config;
         std::string      m_forcedTenantToken;
+        UploadRetryCache m_retryCache;
 
     public:
         RouteSink<Packager, EventsUploadContextPtr const&, StorageRecord const&, bool&> addEventToPackage{ this, &Packager::handleAddEventToPackage };
         RouteSink<Packager, EventsUploadContextPtr const&>                              finalizePackage{ this, &Packager::handleFinalizePackage };
+        RoutePassThrough<Packager, EventsUploadContextPtr const&>                       retainPackage{ this, &Packager::handleRetainPackage };
+        RoutePassThrough<Packager, EventsUploadContextPtr const&>                       forgetPackage{ this, &Packager::handleForgetPackage };
 
         RouteSource<EventsUploadContextPtr const&>                                      emptyPackage;
         RouteSource<EventsUploadContextPtr const&>                                      packagedEvents;
@@ -0,0 +1,199 @@
+//
+// Copyright (c) 2015-2020 Microsoft Corporation and Contributors.
+// SPDX-License-Identifier: Apache-2.0
+//
+#ifndef UPLOADRETRYCACHE_HPP
+#define UPLOADRETRYCACHE_HPP
+
+#include "pal/PAL.hpp"
+#include "utils/Utils.hpp"
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace MAT_NS_BEGIN {
+
+    /// <summary>
+    /// Bounded cache of the final (spliced and possibly compressed) bodies of uploads that
+    /// failed temporarily, keyed by their exact set of record ids. Stored records never
+    /// change, so a retry that packages the same set of records can resend the cached body.
+    /// </summary>
+    /// <remarks>
+    /// Entries are dropped once their records are deleted, when taken for a retry, when older
+    /// than the maximum age (records that expired, were evicted or exceeded the retry count
+    /// are never packaged as the same set again), and oldest first when above the size limit.
+    /// </remarks>
+    class UploadRetryCache
+    {
+    public:
+        UploadRetryCache() = default;
+
+        /// <summary>
+        /// Set the total body size limit in bytes, 0 disables the cache.
+        /// </summary>
+        void Configure(size_t maxSize, uint64_t maxAgeMs = kDefaultMaxAgeMs)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_maxSize = maxSize;
+            m_maxAgeMs = maxAgeMs;
+            trimUnsafe(0);
+        }
+
+        bool IsEnabled() const
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_maxSize != 0;
+        }
+
+        /// <summary>
+        /// Remember the body of a failed upload of the records in recordIds.
+        /// </summary>
+        /// <returns>true if the body has been cached</returns>
+        bool Store(std::map<std::string, TenantTokenHandle> const& recordIds, std::vector<uint8_t> const& body, bool compressed, uint64_t now)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (recordIds.empty() || body.size() > m_maxSize)
+            {
+                return false;
+            }
+
+            eraseUnsafe(find(recordIds));
+            trimUnsafe(now);
+            while (!m_entries.empty() && (m_size + body.size() > m_maxSize))
+            {
+                eraseUnsafe(m_entries.begin());
+            }
+
+            Entry entry;
+            entry.recordIds.reserve(recordIds.size());
+            for (auto const& item : recordIds)
+            {
+                entry.recordIds.push_back(item.first);
+            }
+            entry.body = body;
+            entry.compressed = compressed;
+            entry.time = now;
+            m_size += entry.body.size();
+            m_entries.push_back(std::move(entry));
+            return true;
+        }
+
+        /// <summary>
+        /// Move out the body cached for exactly the records in recordIds.
+        /// </summary>
+        /// <returns>true on a cache hit</returns>
+        bool Take(std::map<std::string, TenantTokenHandle> const& recordIds, std::vector<uint8_t>& body, bool& compressed, uint64_t now)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            trimUnsafe(now);
+            auto it = find(recordIds);
+            if (it == m_entries.end())
+            {
+                return false;
+            }
+            m_size -= it->body.size();
+            body = std::move(it->body);
+            compressed = it->compressed;
+            m_entries.erase(it);
+            return true;
+        }
+
+        /// <summary>
+        /// Drop every entry that includes any of the records in recordIds.
+        /// </summary>
+        void Invalidate(std::map<std::string, TenantTokenHandle> const& recordIds)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            for (auto it = m_entries.begin(); it != m_entries.end();)
+            {
+                auto current = it++;
+                for (auto const& item : recordIds)
+                {
+                    if (std::binary_search(current->recordIds.begin(), current->recordIds.end(), item.first))
+                    {
+                        eraseUnsafe(current);
+                        break;
+                    }
+                }
+            }
+        }
+
+        void Clear()
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_entries.clear();
+            m_size = 0;
+        }
+
+        size_t GetSize() const
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_size;
+        }
+
+        size_t GetCount() const
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_entries.size();
+        }
+
+        /// <summary>
+        /// Longer than the longest default retry backoff (5 minutes).
+        /// </summary>
+        static constexpr uint64_t kDefaultMaxAgeMs = 600000;
+
+    protected:
+        struct Entry
+        {
+            std::vector<std::string> recordIds;     // Sorted
+            std::vector<uint8_t>     body;
+            bool                     compressed;
+            uint64_t                 time;
+        };
+
+        std::list<Entry>::iterator find(std::map<std::string, TenantTokenHandle> const& recordIds)
+        {
+            return std::find_if(m_entries.begin(), m_entries.end(), [&recordIds](Entry const& entry)
+            {
+                return (entry.recordIds.size() == recordIds.size()) &&
+                    std::equal(entry.recordIds.begin(), entry.recordIds.end(), recordIds.begin(),
+                        [](std::string const& id, std::pair<const std::string, TenantTokenHandle> const& item) { return id == item.first; });
+            });
+        }
+
+        void eraseUnsafe(std::list<Entry>::iterator it)
+        {
+            if (it != m_entries.end())
+            {
+                m_size -= it->body.size();
+                m_entries.erase(it);
+            }
+        }
+
+        /// <summary>
+        /// Drop entries older than the maximum age, and all of them above the size limit.
+        /// Entries are ordered by time, oldest first.
+        /// </summary>
+        void trimUnsafe(uint64_t now)
+        {
+            while (!m_entries.empty() &&
+                ((m_size > m_maxSize) || ((now > m_maxAgeMs) && (m_entries.front().time < now - m_maxAgeMs))))
+            {
+                eraseUnsafe(m_entries.begin());
+            }
+        }
+
+        mutable std::mutex m_lock;
+        std::list<Entry>   m_entries;
+        size_t             m_size {};
+        size_t             m_maxSize {};
+        uint64_t           m_maxAgeMs { kDefaultMaxAgeMs };
+    };
+
+} MAT_NS_END
+
+#endif
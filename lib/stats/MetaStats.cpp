@@ -410,12 +410,13 @@ namespace MAT_NS_BEGIN {
     /// <summary>
     /// Updates stats on incoming event.
     /// </summary>
-    /// <param name="tenanttoken">The tenanttoken.</param>
+    /// <param name="tenantHandle">The interned tenant token.</param>
     /// <param name="size">The size.</param>
     /// <param name="latency">The latency.</param>
     /// <param name="metastats">if set to <c>true</c> [metastats].</param>
-    void MetaStats::updateOnEventIncoming(std::string const& tenanttoken, unsigned size, EventLatency latency, bool metastats)
+    void MetaStats::updateOnEventIncoming(TenantTokenHandle tenantHandle, unsigned size, EventLatency latency, bool metastats)
     {
+        TelemetryStats& tenantStats = m_telemetryTenantStats[tenantHandle];
         auto updateRecordStats = [&](RecordStats& recordStats)
         {
             recordStats.received++;
@@ -427,7 +428,7 @@ namespace MAT_NS_BEGIN {
             recordStats.minOfRecordSizeInBytes = std::min<unsigned>(recordStats.minOfRecordSizeInBytes, size);
             recordStats.totalRecordsSizeInBytes += size;
             if (latency >= 0) {
-                RecordStats& recordStatsPerPriority = m_telemetryTenantStats[tenanttoken].recordStatsPerLatency[latency];
+                RecordStats& recordStatsPerPriority = tenantStats.recordStatsPerLatency[latency];
                 recordStatsPerPriority.received++;
                 recordStatsPerPriority.totalRecordsSizeInBytes += size;
             }
@@ -439,11 +440,12 @@ namespace MAT_NS_BEGIN {
         // Per-tenant
         if (m_enableTenantStats)
         {
-            if (m_telemetryTenantStats[tenanttoken].tenantId.empty())
+            if (tenantStats.tenantId.empty())
             {
-                m_telemetryTenantStats[tenanttoken].tenantId = tenanttoken.substr(0, tenanttoken.find('-'));
+                std::string const& tenanttoken = resolveTenantToken(tenantHandle);
+                tenantStats.tenantId = tenanttoken.substr(0, tenanttoken.find('-'));
             }
-            updateRecordStats(m_telemetryTenantStats[tenanttoken].recordStats);
+            updateRecordStats(tenantStats.recordStats);
         }
     }
 
@@ -471,7 +473,7 @@ namespace MAT_NS_BEGIN {
     /// <param name="durationMs">The duration ms.</param>
     /// <param name="latencyToSendMs">The latency to send ms.</param>
     /// <param name="metastatsOnly">if set to <c>true</c> [metastats only].</param>
-    void MetaStats::updateOnPackageSentSucceeded(std::map<std::string, std::string> const& recordIdsAndTenantids, EventLatency eventLatency, unsigned retryFailedTimes, unsigned durationMs, std::vector<unsigned> const& /*latencyToSendMs*/, bool metastatsOnly)
+    void MetaStats::updateOnPackageSentSucceeded(std::map<std::string, TenantTokenHandle> const& recordIdsAndTenantids, EventLatency eventLatency, unsigned retryFailedTimes, unsigned durationMs, std::vector<unsigned> const& /*latencyToSendMs*/, bool metastatsOnly)
     {
         // Package summary stats
         PackageStats& packageStats = m_telemetryStats.packageStats;
@@ -554,7 +556,7 @@ namespace MAT_NS_BEGIN {
             // Per-tenant
             if (m_enableTenantStats)
             {
-                auto& temp = m_telemetryTenantStats[dropcouttenant.first];
+                auto& temp = m_telemetryTenantStats[internTenantToken(dropcouttenant.first)];
                 temp.recordStats.droppedByReason[reason] += static_cast<unsigned int>(dropcouttenant.second);
                 temp.recordStats.dropped += static_cast<unsigned int>(dropcouttenant.second);
             }
@@ -577,7 +579,7 @@ namespace MAT_NS_BEGIN {
             // Per-tenant
             if (m_enableTenantStats)
             {
-                auto& temp = m_telemetryTenantStats[overflowntenant.first];
+                auto& temp = m_telemetryTenantStats[internTenantToken(overflowntenant.first)];
                 temp.recordStats.overflown += static_cast<unsigned int>(overflowntenant.second);
             }
             overallCount += static_cast<unsigned int>(overflowntenant.second);
@@ -599,7 +601,7 @@ namespace MAT_NS_BEGIN {
             // Per-tenant
             if (m_enableTenantStats)
             {
-                TelemetryStats& temp = m_telemetryTenantStats[rejecttenant.first];
+                TelemetryStats& temp = m_telemetryTenantStats[internTenantToken(rejecttenant.first)];
                 temp.recordStats.rejectedByReason[reason] += static_cast<unsigned int>(rejecttenant.second);
                 temp.recordStats.rejected += static_cast<unsigned int>(rejecttenant.second);
             }
@@ -524,9 +524,9 @@ namespace MAT_NS_BEGIN {
 
         std::vector< ::CsProtocol::Record> generateStatsEvent(RollUpKind rollupKind);
 
-        void updateOnEventIncoming(std::string const& tenanttoken, unsigned size, EventLatency latency, bool metastats);
+        void updateOnEventIncoming(TenantTokenHandle tenantHandle, unsigned size, EventLatency latency, bool metastats);
         void updateOnPostData(unsigned postDataLength, bool metastatsOnly);
-        void updateOnPackageSentSucceeded(std::map<std::string, std::string> const& recordIdsAndTenantids, EventLatency eventLatency, unsigned retryFailedTimes, unsigned durationMs, std::vector<unsigned> const& latencyToSendMs, bool metastatsOnly);
+        void updateOnPackageSentSucceeded(std::map<std::string, TenantTokenHandle> const& recordIdsAndTenantids, EventLatency eventLatency, unsigned retryFailedTimes, unsigned durationMs, std::vector<unsigned> const& latencyToSendMs, bool metastatsOnly);
         void updateOnPackageFailed(int statusCode);
         void updateOnPackageRetry(int statusCode, unsigned retryFailedTimes);
         void updateOnRecordsDropped(EventDroppedReason reason, std::map<std::string, size_t> const& droppedCount);
@@ -581,9 +581,9 @@ namespace MAT_NS_BEGIN {
         bool                            m_enableTenantStats;
 
         /// <summary>
-        /// Per-tenant stats
+        /// Per-tenant stats, by interned tenant token
         /// </summary>
-        std::map<std::string, TelemetryStats>  m_telemetryTenantStats;
+        std::map<TenantTokenHandle, TelemetryStats>  m_telemetryTenantStats;
 
         const std::map<EventLatency, std::string> m_latency_pfx =
         {
@@ -23,6 +23,7 @@ namespace MAT_NS_BEGIN {
         m_isStarted(false)
     {
         m_intervalMs = m_config.GetMetaStatsSendIntervalSec() * 1000;
+        m_metaStatsTenantHandle = internTenantToken(m_config.GetMetaStatsTenantToken());
     }
 
     Statistics::~Statistics()
@@ -76,7 +77,7 @@ namespace MAT_NS_BEGIN {
             result &= m_semanticContextDecorator.decorate(record, true);
             if (result)
             {
-                IncomingEventContext evt(PAL::generateUuidString(), tenantToken, EventLatency_Normal, EventPersistence_Normal, &record);
+                IncomingEventContext evt(PAL::generateUuidString(), tenantToken, m_metaStatsTenantHandle, EventLatency_Normal, EventPersistence_Normal, &record);
                 m_iTelemetrySystem.sendEvent(&evt);
             }
             else
@@ -122,10 +123,10 @@ namespace MAT_NS_BEGIN {
 
     bool Statistics::handleOnIncomingEventAccepted(IncomingEventContextPtr const& ctx)
     {
-        bool metastats = (ctx->record.tenantToken == m_config.GetMetaStatsTenantToken());
+        bool metastats = (ctx->tenantHandle == m_metaStatsTenantHandle);
         {
             LOCKGUARD(m_metaStats_mtx);
-            m_metaStats.updateOnEventIncoming(ctx->record.tenantToken, static_cast<unsigned>(ctx->record.blob.size()), ctx->record.latency, metastats);
+            m_metaStats.updateOnEventIncoming(ctx->tenantHandle, static_cast<unsigned>(ctx->record.blob.size()), ctx->record.latency, metastats);
         }
         scheduleSend();
 
@@ -205,10 +206,15 @@ namespace MAT_NS_BEGIN {
         {
             LOCKGUARD(m_metaStats_mtx);
             m_metaStats.updateOnPackageFailed(status);
-            std::map<std::string, size_t> countOnTenant;
+            std::map<TenantTokenHandle, size_t> countOnHandle;
             for (const auto& recordAndTenant : ctx->recordIdsAndTenantIds)
             {
-                countOnTenant[recordAndTenant.second]++;
+                countOnHandle[recordAndTenant.second]++;
+            }
+            std::map<std::string, size_t> countOnTenant;
+            for (const auto& handleAndCount : countOnHandle)
+            {
+                countOnTenant[resolveTenantToken(handleAndCount.first)] = handleAndCount.second;
             }
             m_metaStats.updateOnRecordsRejected(REJECTED_REASON_SERVER_DECLINED, countOnTenant);
         }
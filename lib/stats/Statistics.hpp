@@ -74,6 +74,7 @@ namespace MAT_NS_BEGIN {
 
         std::int64_t                m_statEventSentTime;
         unsigned                    m_intervalMs;
+        TenantTokenHandle           m_metaStatsTenantHandle;
 
     public:
 
@@ -24,18 +24,29 @@ namespace MAT_NS_BEGIN {
         ::CsProtocol::Record*  source;
         StorageRecord          record;
         std::uint64_t          policyBitFlags;
+        TenantTokenHandle      tenantHandle;
 
     public:
         IncomingEventContext() :
             source(nullptr),
-            policyBitFlags(0)
+            policyBitFlags(0),
+            tenantHandle(0)
         {
         }
 
         IncomingEventContext(std::string const& id, std::string const& tenantToken, EventLatency latency, EventPersistence persistence, ::CsProtocol::Record* source)
+            : IncomingEventContext(id, tenantToken, internTenantToken(tenantToken), latency, persistence, source)
+        {
+        }
+
+        /// <summary>
+        /// Create the context of an event whose tenant token has already been interned.
+        /// </summary>
+        IncomingEventContext(std::string const& id, std::string const& tenantToken, TenantTokenHandle tenantHandle, EventLatency latency, EventPersistence persistence, ::CsProtocol::Record* source)
             : source(source),
             record{ id, tenantToken, latency, persistence },
-	    policyBitFlags(0)
+	    policyBitFlags(0),
+            tenantHandle(tenantHandle)
         {
         }
 
@@ -82,15 +93,21 @@ namespace MAT_NS_BEGIN {
         // Retrieving
         EventLatency                         requestedMinLatency = EventLatency_Unspecified;
         unsigned                             requestedMaxCount = 0;
+        size_t                               storedRecordCount = 0;     // In storage after retrieval, including reserved
 
         // Packaging
         std::unique_ptr<ISplicer>            splicer;
         unsigned                             maxUploadSize = 0;
         EventLatency                         latency = EventLatency_Unspecified;
         std::map<std::string, size_t>        packageIds;
-        std::map<std::string, std::string>   recordIdsAndTenantIds;
+        std::map<std::string, TenantTokenHandle> recordIdsAndTenantIds;
         std::vector<int64_t>                 recordTimestamps;
         unsigned                             maxRetryCountSeen = 0;
+        bool                                 packageFull = false;
+        std::vector<size_t>                  packageSizes;       // Record bytes per packageIds index
+        std::vector<TenantTokenHandle>       packageTenantHandles; // Interned token per packageIds index
+        std::vector<std::string>             deferredTenants;    // Over their upload rate, not retrieved
+        bool                                 fromRetryCache = false;
 
         // Encoding
         std::vector<uint8_t>                 body;
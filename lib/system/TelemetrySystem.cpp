@@ -143,6 +143,7 @@ namespace MAT_NS_BEGIN {
             bool result = true;
             hcm.cancelAllRequests();
             result &= tpm.cleanup();
+            packager.clearRetryCache();
             return result;
         };
 
@@ -169,7 +170,7 @@ namespace MAT_NS_BEGIN {
 #ifdef HAVE_MAT_ZLIB
         compression.compress >>
 #endif
-        httpEncoder.encode >> clockSkewDelta.encode >> stats.onUploadStarted >> hcm.sendRequest;
+        httpEncoder.encode >> clockSkewDelta.encode >> stats.onUploadStarted >> tpm.uploadDispatched >> hcm.sendRequest;
 
 #ifdef HAVE_MAT_ZLIB
         compression.compressionFailed >> storage.releaseRecords >> stats.onPackagingFailed >> tpm.packagingFailed;
@@ -177,10 +178,10 @@ namespace MAT_NS_BEGIN {
 
         hcm.requestDone >> clockSkewDelta.decode >> httpDecoder.decode;
 
-        httpDecoder.eventsAccepted >> storage.deleteRecords >> stats.onUploadSuccessful >> tpm.eventsUploadSuccessful;
-        httpDecoder.eventsRejected >> storage.deleteRecords >> stats.onUploadRejected >> tpm.eventsUploadRejected;
-        httpDecoder.temporaryNetworkFailure >> storage.releaseRecords >> stats.onUploadFailed >> tpm.eventsUploadFailed;
-        httpDecoder.temporaryServerFailure >> storage.releaseRecordsIncRetryCount >> stats.onUploadFailed >> tpm.eventsUploadFailed;
+        httpDecoder.eventsAccepted >> packager.forgetPackage >> storage.deleteRecords >> stats.onUploadSuccessful >> tpm.eventsUploadSuccessful;
+        httpDecoder.eventsRejected >> packager.forgetPackage >> storage.deleteRecords >> stats.onUploadRejected >> tpm.eventsUploadRejected;
+        httpDecoder.temporaryNetworkFailure >> packager.retainPackage >> storage.releaseRecords >> stats.onUploadFailed >> tpm.eventsUploadFailed;
+        httpDecoder.temporaryServerFailure >> packager.retainPackage >> storage.releaseRecordsIncRetryCount >> stats.onUploadFailed >> tpm.eventsUploadFailed;
         httpDecoder.requestAborted >> storage.releaseRecords >> stats.onUploadFailed >> tpm.eventsUploadAborted;
 
 
@@ -0,0 +1,148 @@
+//
+// Copyright (c) 2015-2020 Microsoft Corporation and Contributors.
+// SPDX-License-Identifier: Apache-2.0
+//
+#ifndef DEADLINESCHEDULER_HPP
+#define DEADLINESCHEDULER_HPP
+
+#include "pal/PAL.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+namespace MAT_NS_BEGIN {
+
+    /// <summary>
+    /// Earliest-deadline-first upload scheduling. Every stored event gets a deadline from its
+    /// latency, and the next upload is due at the earliest deadline of the events not uploaded
+    /// yet, or right away once they fill a package. The upload then takes every pending latency
+    /// at once, so events of lower latencies ride along instead of waiting for their own timer.
+    /// </summary>
+    /// <remarks>
+    /// Only Normal and RealTime events are tracked, Max latency events are uploaded right away.
+    /// Times are monotonic milliseconds, passed in so that the scheduling can be tested.
+    /// </remarks>
+    class DeadlineScheduler
+    {
+    public:
+        DeadlineScheduler() = default;
+
+        void Configure(bool enabled)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_enabled = enabled;
+            m_pending.fill(Pending());
+        }
+
+        bool IsEnabled() const
+        {
+            return m_enabled;
+        }
+
+        /// <summary>
+        /// Set the maximum time events wait for their upload by latency. Events of a latency
+        /// with a negative wait are not tracked.
+        /// </summary>
+        void SetDeadlines(int normalMs, int realTimeMs)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_maxWaitMs[EventLatency_Normal] = normalMs;
+            m_maxWaitMs[EventLatency_RealTime] = realTimeMs;
+        }
+
+        /// <summary>
+        /// Account for an event stored for upload.
+        /// </summary>
+        void OnEventStored(EventLatency latency, size_t bytes, uint64_t now = PAL::getMonotonicTimeMs())
+        {
+            if ((latency != EventLatency_Normal) && (latency != EventLatency_RealTime))
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (m_maxWaitMs[latency] < 0)
+            {
+                return;
+            }
+            Pending& pending = m_pending[latency];
+            uint64_t deadline = now + static_cast<uint64_t>(m_maxWaitMs[latency]);
+            if ((pending.count == 0) || (deadline < pending.deadline))
+            {
+                pending.deadline = deadline;
+            }
+            pending.count++;
+            pending.bytes += bytes;
+        }
+
+        /// <summary>
+        /// Forget the events an upload of minLatency and above is about to retrieve.
+        /// </summary>
+        void OnUploadStarted(EventLatency minLatency)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            for (int latency = (minLatency < EventLatency_Normal) ? EventLatency_Normal : minLatency; latency <= EventLatency_RealTime; latency++)
+            {
+                m_pending[latency] = Pending();
+            }
+        }
+
+        /// <summary>
+        /// Time and minimum latency of the next upload.
+        /// </summary>
+        /// <param name="maxUploadSize">Package size that triggers the upload right away</param>
+        /// <param name="latency">Lowest latency with pending events</param>
+        /// <param name="dueTime">Earliest deadline, or now if a package is full</param>
+        /// <returns>false if no events are pending</returns>
+        bool GetNextUpload(size_t maxUploadSize, EventLatency& latency, uint64_t& dueTime, uint64_t now = PAL::getMonotonicTimeMs()) const
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            size_t bytes = 0;
+            bool found = false;
+            for (int i = EventLatency_RealTime; i >= EventLatency_Normal; i--)
+            {
+                Pending const& pending = m_pending[i];
+                if (pending.count == 0)
+                {
+                    continue;
+                }
+                if (!found || (pending.deadline < dueTime))
+                {
+                    dueTime = pending.deadline;
+                }
+                latency = static_cast<EventLatency>(i);
+                bytes += pending.bytes;
+                found = true;
+            }
+            if (found && ((bytes >= maxUploadSize) || (dueTime < now)))
+            {
+                dueTime = now;
+            }
+            return found;
+        }
+
+        size_t GetPendingCount() const
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_pending[EventLatency_Normal].count + m_pending[EventLatency_RealTime].count;
+        }
+
+    protected:
+        struct Pending
+        {
+            uint64_t deadline {};
+            size_t   count {};
+            size_t   bytes {};
+        };
+
+        mutable std::mutex                             m_lock;
+        std::atomic<bool>                              m_enabled {};
+        std::array<int, EventLatency_Max + 1>          m_maxWaitMs {};
+        std::array<Pending, EventLatency_Max + 1>      m_pending {};
+    };
+
+} MAT_NS_END
+
+#endif
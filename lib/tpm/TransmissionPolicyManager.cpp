@@ -89,7 +89,12 @@ namespace MAT_NS_BEGIN {
             LOG_TRACE("Scheduled upload aborted, no upload.");
             return;
         }
-        if (uploadCount() >= static_cast<uint32_t>(m_config[CFG_INT_MAX_PENDING_REQ]) )
+        uint32_t maxPendingRequests = m_config[CFG_INT_MAX_PENDING_REQ];
+        if (m_uploadController.IsEnabled())
+        {
+            maxPendingRequests = std::min(maxPendingRequests, m_uploadController.GetMaxPendingRequests());
+        }
+        if (uploadCount() >= maxPendingRequests)
         {
             LOG_TRACE("Maximum number of HTTP requests reached");
             return;
@@ -161,6 +166,21 @@ namespace MAT_NS_BEGIN {
             }
         }
 
+        if (m_bandwidthLimiter.IsEnabled() || (m_draining && m_drainLimiter.IsEnabled()))
+        {
+            uint64_t delayMs = m_bandwidthLimiter.GetDelayMs();
+            if (m_draining)
+            {
+                delayMs = std::max(delayMs, m_drainLimiter.GetDelayMs());
+            }
+            if (delayMs != 0)
+            {
+                LOG_TRACE("Upload rate limit reached, will retry %u ms later", static_cast<unsigned>(delayMs));
+                scheduleUpload(std::chrono::milliseconds(delayMs), latency);
+                return;
+            }
+        }
+
 #ifdef ENABLE_BW_CONTROLLER   /* Bandwidth controller is not currently supported */
         if (m_bandwidthController) {
             unsigned proposedBandwidthBps = m_bandwidthController->GetProposedBandwidthBps();
@@ -179,8 +199,26 @@ namespace MAT_NS_BEGIN {
         }
 #endif
 
+        startUpload(m_runningLatency);
+    }
+
+    void TransmissionPolicyManager::startUpload(EventLatency latency)
+    {
         auto ctx = m_system.createEventsUploadContext();
-        ctx->requestedMinLatency = m_runningLatency;
+        ctx->requestedMinLatency = latency;
+        if (m_deadlineScheduler.IsEnabled())
+        {
+            // Cleared before the retrieval, so that no event stored meanwhile is missed
+            m_deadlineScheduler.OnUploadStarted(latency);
+        }
+        if (m_uploadController.IsEnabled())
+        {
+            ctx->maxUploadSize = m_uploadController.GetUploadSize();
+        }
+        if (m_bandwidthLimiter.IsEnabled())
+        {
+            ctx->deferredTenants = m_bandwidthLimiter.GetDeferredTenants();
+        }
         addUpload(ctx);
         initiateUpload(ctx);
     }
@@ -215,6 +253,12 @@ namespace MAT_NS_BEGIN {
 
     bool TransmissionPolicyManager::handleStart()
     {
+        m_uploadController.Configure(m_config[CFG_MAP_TPM][CFG_BOOL_TPM_ADAPTIVE_UPLOAD],
+            m_config.GetMaximumUploadSizeBytes(), m_config[CFG_INT_MAX_PENDING_REQ]);
+        configureBandwidthLimiter();
+        configureDrainMode();
+        configureImmediateBatch();
+        m_deadlineScheduler.Configure(m_config[CFG_MAP_TPM][CFG_BOOL_TPM_DEADLINE_SCHEDULING]);
         m_isPaused = false;
         scheduleUpload(std::chrono::seconds{1}, calculateNewPriority());
         return true;
@@ -246,6 +290,7 @@ namespace MAT_NS_BEGIN {
             // Make sure we wait for completion of the upload scheduling task that may be running
             cancelUploadTask();
         }
+        cancelImmediateBatch();
 
         // Make sure we wait for all active upload callbacks to finish
         while (uploadCount() > 0)
@@ -265,6 +310,7 @@ namespace MAT_NS_BEGIN {
      bool TransmissionPolicyManager::handleCleanup()
      {
         cancelUploadTask();
+        cancelImmediateBatch();
         // Make sure ongoing uploads are finished.
         while (uploadCount() > 0)
         {
@@ -290,13 +336,23 @@ namespace MAT_NS_BEGIN {
         }
         bool forceTimerRestart = false;
 
-        /* This logic needs to be revised: one event in a dedicated HTTP post is wasteful! */
-        // Initiate upload right away
+        // Initiate upload right away, or once the coalescing window closes
         if (event->record.latency > EventLatency_RealTime) {
-            auto ctx = m_system.createEventsUploadContext();
-            ctx->requestedMinLatency = event->record.latency;
-            addUpload(ctx);
-            initiateUpload(ctx);
+            if (!batchImmediateEvent()) {
+                uploadImmediateEvents();
+            }
+            return;
+        }
+
+        if (m_deadlineScheduler.IsEnabled())
+        {
+            if (updateTimersIfNecessary())
+            {
+                m_timerdelay = std::chrono::milliseconds { m_timers[1] };
+            }
+            m_deadlineScheduler.SetDeadlines(m_timers[0], m_timers[1]);
+            m_deadlineScheduler.OnEventStored(event->record.latency, event->record.blob.size());
+            scheduleDeadlineUpload();
             return;
         }
 
@@ -316,6 +372,72 @@ namespace MAT_NS_BEGIN {
         }
     }
 
+    /// <summary>
+    /// Add a Max latency event to the coalescing window. The first event opens the window,
+    /// which closes after CFG_INT_TPM_IMMEDIATE_BATCH_MS or at CFG_INT_TPM_IMMEDIATE_BATCH_COUNT
+    /// events, whichever comes first, so no event waits longer than the window.
+    /// </summary>
+    /// <returns>false if the events should be uploaded now</returns>
+    bool TransmissionPolicyManager::batchImmediateEvent()
+    {
+        if (m_immediateBatchMs == 0)
+        {
+            return false;
+        }
+
+        LOCKGUARD(m_immediateBatchMutex);
+        m_immediateBatchCount++;
+        if ((m_immediateBatchMaxCount != 0) && (m_immediateBatchCount >= m_immediateBatchMaxCount))
+        {
+            LOG_TRACE("Immediate batch of %u event(s) is full", m_immediateBatchCount);
+            m_immediateBatchCount = 0;
+            m_immediateBatchUpload.Cancel();
+            return false;
+        }
+        if (m_immediateBatchCount == 1)
+        {
+            m_immediateBatchUpload = PAL::scheduleTask(&m_taskDispatcher, m_immediateBatchMs, this, &TransmissionPolicyManager::flushImmediateBatch);
+        }
+        return true;
+    }
+
+    void TransmissionPolicyManager::flushImmediateBatch()
+    {
+        {
+            LOCKGUARD(m_immediateBatchMutex);
+            if (m_immediateBatchCount == 0)
+            {
+                return;
+            }
+            LOG_TRACE("Immediate batch window closed with %u event(s)", m_immediateBatchCount);
+            m_immediateBatchCount = 0;
+        }
+        if (!m_isPaused)
+        {
+            uploadImmediateEvents();
+        }
+    }
+
+    /// <summary>
+    /// Drop the coalescing window. Its events stay in storage and go with the next upload.
+    /// </summary>
+    void TransmissionPolicyManager::cancelImmediateBatch()
+    {
+        PAL::DeferredCallbackHandle batchUpload;
+        {
+            LOCKGUARD(m_immediateBatchMutex);
+            batchUpload = std::move(m_immediateBatchUpload);
+            m_immediateBatchCount = 0;
+        }
+        // The task takes the lock, so wait for it without holding the lock
+        batchUpload.Cancel(getCancelWaitTime().count());
+    }
+
+    void TransmissionPolicyManager::uploadImmediateEvents()
+    {
+        startUpload(EventLatency_Max);
+    }
+
     // We do only Normal if too few values or timers[0] == timers[2]
     // We do only RealTime if timers[0] < 0 (do not transmit)
     // We alternate RealTime and Normal otherwise (timers differ)
@@ -323,6 +445,12 @@ namespace MAT_NS_BEGIN {
     {
         updateTimersIfNecessary();
 
+        if ((m_draining || m_deadlineScheduler.IsEnabled()) && (m_timers[0] >= 0))
+        {
+            // Drain or take along every latency the profile uploads, instead of alternating
+            return EventLatency_Normal;
+        }
+
         if (m_timers[0] == m_timers[1])
         {
             return EventLatency_Normal;
@@ -345,6 +473,28 @@ namespace MAT_NS_BEGIN {
     {
         LOG_TRACE("No stored events to send at the moment");
         resetBackoff();
+        if (!ctx->deferredTenants.empty())
+        {
+            // Events may be waiting for their tenant to get below its upload rate, look again once the first one is
+            uint64_t delayMs = std::numeric_limits<uint64_t>::max();
+            for (auto const& tenantToken : ctx->deferredTenants)
+            {
+                delayMs = std::min(delayMs, m_bandwidthLimiter.GetTenantDelayMs(tenantToken));
+            }
+            finishUpload(ctx, std::chrono::milliseconds(delayMs));
+            return;
+        }
+        if (ctx->requestedMinLatency < EventLatency_Max)
+        {
+            // The backlog has been cleared, immediate uploads only look at Max latency events
+            stopDraining();
+        }
+        if (m_deadlineScheduler.IsEnabled())
+        {
+            finishUpload(ctx, std::chrono::milliseconds{ -1 });
+            scheduleDeadlineUpload();
+            return;
+        }
         if (ctx->requestedMinLatency == EventLatency_Normal)
         {
             finishUpload(ctx, std::chrono::milliseconds{ -1 });
@@ -362,17 +512,33 @@ namespace MAT_NS_BEGIN {
 
     void TransmissionPolicyManager::handleEventsUploadSuccessful(EventsUploadContextPtr const& ctx)
     {
+        if (ctx->durationMs >= 0)
+        {
+            // Full packages are accounted at the size limit they were packed to
+            size_t bytes = (ctx->packageFull && (ctx->maxUploadSize != 0)) ? ctx->maxUploadSize : ctx->body.size();
+            m_uploadController.OnUploadSucceeded(bytes, static_cast<unsigned>(ctx->durationMs), ctx->packageFull);
+        }
         resetBackoff();
+        if (m_deadlineScheduler.IsEnabled() && !ctx->packageFull)
+        {
+            // Storage has been emptied up to the package limit, wait for the next deadline
+            finishUpload(ctx, std::chrono::milliseconds{ -1 });
+            scheduleDeadlineUpload();
+            return;
+        }
         finishUpload(ctx, std::chrono::milliseconds{});
     }
 
     void TransmissionPolicyManager::handleEventsUploadRejected(EventsUploadContextPtr const& ctx)
     {
+        stopDraining();
         finishUpload(ctx, increaseBackoff());
     }
 
     void TransmissionPolicyManager::handleEventsUploadFailed(EventsUploadContextPtr const& ctx)
     {
+        stopDraining();
+        m_uploadController.OnUploadFailed();
         finishUpload(ctx, increaseBackoff());
     }
 
@@ -381,6 +547,157 @@ namespace MAT_NS_BEGIN {
         finishUpload(ctx, std::chrono::milliseconds{ -1 });
     }
 
+    /// <summary>
+    /// Read ahead while a full package is being sent, or while draining the backlog: the
+    /// next package gets reserved, spliced and compressed while this request is in flight,
+    /// instead of after it finishes. scheduleUpload bounds the pipeline depth by
+    /// CFG_INT_MAX_PENDING_REQ.
+    /// </summary>
+    bool TransmissionPolicyManager::handleUploadDispatched(EventsUploadContextPtr const& ctx)
+    {
+        if (m_bandwidthLimiter.IsEnabled())
+        {
+            accountUploadBandwidth(ctx);
+        }
+        updateDrainMode(ctx);
+        if (m_draining)
+        {
+            m_drainLimiter.OnBytesSent(ctx->body.size());
+        }
+        if ((ctx->packageFull || m_draining) && !m_isPaused)
+        {
+            bool lowerLatencyScheduled = false;
+            {
+                LOCKGUARD(m_scheduledUploadMutex);
+                lowerLatencyScheduled = m_isUploadScheduled && (m_runningLatency < ctx->requestedMinLatency);
+            }
+            if (lowerLatencyScheduled)
+            {
+                // The scheduled upload retrieves these latencies as well, rescheduling it
+                // for the prefetch would drop the lower latency events from its timer
+                LOG_TRACE("Not prefetching past ctx=%p, upload of lat=%d is scheduled", ctx.get(), m_runningLatency);
+            }
+            else
+            {
+                LOG_TRACE("Prefetching next package while ctx=%p is in flight", ctx.get());
+                scheduleUpload(std::chrono::milliseconds {}, ctx->requestedMinLatency);
+            }
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Read the upload rate limits. The global limit paces uploadAsync, tenant limits keep
+    /// the events of tenants over their rate out of packages.
+    /// </summary>
+    void TransmissionPolicyManager::configureBandwidthLimiter()
+    {
+        m_bandwidthLimiter.Configure(m_config[CFG_MAP_TPM][CFG_INT_TPM_MAX_UPLOAD_BPS], m_config[CFG_MAP_TPM][CFG_INT_TPM_UPLOAD_BURST_BYTES]);
+        VariantMap& tpmConfig = m_config[CFG_MAP_TPM];
+        auto tenantLimits = tpmConfig.find(CFG_MAP_TPM_TENANT_UPLOAD_BPS);
+        if ((tenantLimits != tpmConfig.end()) && (tenantLimits->second.type == Variant::TYPE_OBJ))
+        {
+            VariantMap& limits = tenantLimits->second;
+            for (auto& limit : limits)
+            {
+                m_bandwidthLimiter.SetTenantLimit(limit.first, limit.second, 0);
+            }
+        }
+    }
+
+    void TransmissionPolicyManager::configureDrainMode()
+    {
+        m_drainThreshold = static_cast<size_t>(m_config[CFG_MAP_TPM][CFG_INT_TPM_DRAIN_THRESHOLD]);
+        m_drainLimiter.Configure(m_config[CFG_MAP_TPM][CFG_INT_TPM_DRAIN_MAX_BPS], 0);
+        m_draining = false;
+    }
+
+    void TransmissionPolicyManager::configureImmediateBatch()
+    {
+        m_immediateBatchMs = m_config[CFG_MAP_TPM][CFG_INT_TPM_IMMEDIATE_BATCH_MS];
+        m_immediateBatchMaxCount = m_config[CFG_MAP_TPM][CFG_INT_TPM_IMMEDIATE_BATCH_COUNT];
+    }
+
+    /// <summary>
+    /// Start draining once the events left in storage after a retrieval exceed the threshold.
+    /// Normal latency uploads no longer wait for the transmit profile timer in between.
+    /// </summary>
+    void TransmissionPolicyManager::updateDrainMode(EventsUploadContextPtr const& ctx)
+    {
+        if ((m_drainThreshold != 0) && (ctx->storedRecordCount >= m_drainThreshold) && !m_draining.exchange(true))
+        {
+            LOG_INFO("Draining a backlog of %u stored events", static_cast<unsigned>(ctx->storedRecordCount));
+            // Start over at the drain rate rather than with a debt from before
+            m_drainLimiter.Configure(m_config[CFG_MAP_TPM][CFG_INT_TPM_DRAIN_MAX_BPS], 0);
+        }
+    }
+
+    /// <summary>
+    /// Stop draining once storage is empty, or on failure to let the backoff apply.
+    /// </summary>
+    void TransmissionPolicyManager::stopDraining()
+    {
+        if (m_draining.exchange(false))
+        {
+            LOG_INFO("Stopped draining the backlog");
+        }
+    }
+
+    /// <summary>
+    /// Schedule an upload of every pending latency at the earliest deadline of the stored events,
+    /// or right away once they fill a package. An upload scheduled later is moved forward.
+    /// </summary>
+    void TransmissionPolicyManager::scheduleDeadlineUpload()
+    {
+        size_t maxUploadSize = m_uploadController.IsEnabled() ? m_uploadController.GetUploadSize() : m_config.GetMaximumUploadSizeBytes();
+        uint64_t now = PAL::getMonotonicTimeMs();
+        EventLatency latency = EventLatency_Normal;
+        uint64_t dueTime = now;
+        if (!m_deadlineScheduler.GetNextUpload(maxUploadSize, latency, dueTime, now))
+        {
+            return;
+        }
+
+        bool reschedule = false;
+        if (m_isUploadScheduled)
+        {
+            // The task is bound to its latency, so it has to be rescheduled to take lower ones along
+            reschedule = (dueTime < m_scheduledUploadTime) || (latency < m_runningLatency);
+            latency = std::min(latency, m_runningLatency);
+        }
+        LOG_TRACE("Next deadline in %u ms for lat=%d", static_cast<unsigned>(dueTime - now), latency);
+        scheduleUpload(std::chrono::milliseconds(dueTime - now), latency, reschedule);
+    }
+
+    /// <summary>
+    /// Take the request body from the global rate, and the share of each tenant from its own.
+    /// Max latency uploads are not delayed, but are accounted as well.
+    /// </summary>
+    void TransmissionPolicyManager::accountUploadBandwidth(EventsUploadContextPtr const& ctx)
+    {
+        uint64_t now = PAL::getMonotonicTimeMs();
+        m_bandwidthLimiter.OnBytesSent(ctx->body.size(), now);
+
+        size_t recordBytes = 0;
+        for (size_t size : ctx->packageSizes)
+        {
+            recordBytes += size;
+        }
+        if (recordBytes == 0)
+        {
+            return;
+        }
+        for (auto const& package : ctx->packageIds)
+        {
+            if (package.second < ctx->packageSizes.size())
+            {
+                // Compression applies to all tenants alike
+                uint64_t bytes = (static_cast<uint64_t>(ctx->packageSizes[package.second]) * ctx->body.size()) / recordBytes;
+                m_bandwidthLimiter.OnTenantBytesSent(package.first, static_cast<size_t>(bytes), now);
+            }
+        }
+    }
+
     void TransmissionPolicyManager::addUpload(EventsUploadContextPtr const& ctx)
     {
         LOCKGUARD(m_activeUploads_lock);
@@ -404,6 +721,7 @@ namespace MAT_NS_BEGIN {
     {
         m_isPaused = true;
         cancelUploadTask();
+        cancelImmediateBatch();
     }
 
     std::chrono::milliseconds TransmissionPolicyManager::getCancelWaitTime() const noexcept
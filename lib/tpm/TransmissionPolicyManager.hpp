@@ -6,6 +6,7 @@
 #define TRANSMISSIONPOLICYMANAGER_HPP
 
 #include "IBandwidthController.hpp"
+#include "bwcontrol/BandwidthController_TokenBucket.hpp"
 
 #include "api/IRuntimeConfig.hpp"
 #include "backoff/IBackoff.hpp"
@@ -18,7 +19,9 @@
 #include "DeviceStateHandler.hpp"
 #include "pal/TaskDispatcher.hpp"
 
+#include "DeadlineScheduler.hpp"
 #include "TransmitProfiles.hpp"
+#include "UploadController.hpp"
 
 #include <atomic>
 #include <chrono>
@@ -68,12 +71,26 @@ constexpr const char* const DefaultBackoffConfig = "E,3000,300000,2,1";
 
         void handleEventArrived(IncomingEventContextPtr const& event);
 
+        bool batchImmediateEvent();
+        void flushImmediateBatch();
+        void cancelImmediateBatch();
+        void uploadImmediateEvents();
+        void startUpload(EventLatency latency);
+        void configureBandwidthLimiter();
+        void accountUploadBandwidth(EventsUploadContextPtr const& ctx);
+        void configureDrainMode();
+        void configureImmediateBatch();
+        void updateDrainMode(EventsUploadContextPtr const& ctx);
+        void stopDraining();
+        void scheduleDeadlineUpload();
+
         void handleNothingToUpload(EventsUploadContextPtr const& ctx);
         void handlePackagingFailed(EventsUploadContextPtr const& ctx);
         void handleEventsUploadSuccessful(EventsUploadContextPtr const& ctx);
         void handleEventsUploadRejected(EventsUploadContextPtr const& ctx);
         void handleEventsUploadFailed(EventsUploadContextPtr const& ctx);
         void handleEventsUploadAborted(EventsUploadContextPtr const& ctx);
+        bool handleUploadDispatched(EventsUploadContextPtr const& ctx);
 
         EventLatency calculateNewPriority();
 
@@ -96,6 +113,34 @@ constexpr const char* const DefaultBackoffConfig = "E,3000,300000,2,1";
         PAL::DeferredCallbackHandle      m_scheduledUpload;
         bool                             m_scheduledUploadAborted { false };
 
+        /// <summary>
+        /// Max latency events waiting in the coalescing window and the task closing it.
+        /// The window length and event count are read at start.
+        /// </summary>
+        unsigned                         m_immediateBatchMs { 0 };
+        unsigned                         m_immediateBatchMaxCount { 0 };
+        std::mutex                       m_immediateBatchMutex;
+        unsigned                         m_immediateBatchCount { 0 };
+        PAL::DeferredCallbackHandle      m_immediateBatchUpload;
+
+        UploadController                 m_uploadController;
+
+        /// <summary>
+        /// Upload rate limits from the TPM configuration, independent of the optional
+        /// external IBandwidthController.
+        /// </summary>
+        BandwidthController_TokenBucket  m_bandwidthLimiter;
+
+        /// <summary>
+        /// Backlog drain mode: above the threshold of stored events, uploads follow each other
+        /// without timer pauses, up to the pending request limit, until storage is empty.
+        /// </summary>
+        size_t                           m_drainThreshold { 0 };
+        std::atomic<bool>                m_draining { false };
+        BandwidthController_TokenBucket  m_drainLimiter;
+
+        DeadlineScheduler                m_deadlineScheduler;
+
         mutable std::mutex               m_activeUploads_lock;
         std::set<EventsUploadContextPtr> m_activeUploads;
         
@@ -151,6 +196,7 @@ constexpr const char* const DefaultBackoffConfig = "E,3000,300000,2,1";
         RouteSink<TransmissionPolicyManager, EventsUploadContextPtr const&>  eventsUploadRejected{ this, &TransmissionPolicyManager::handleEventsUploadRejected };
         RouteSink<TransmissionPolicyManager, EventsUploadContextPtr const&>  eventsUploadFailed{ this, &TransmissionPolicyManager::handleEventsUploadFailed };
         RouteSink<TransmissionPolicyManager, EventsUploadContextPtr const&>  eventsUploadAborted{ this, &TransmissionPolicyManager::handleEventsUploadAborted };
+        RoutePassThrough<TransmissionPolicyManager, EventsUploadContextPtr const&> uploadDispatched{ this, &TransmissionPolicyManager::handleUploadDispatched };
 
         virtual bool isUploadInProgress() const noexcept;
 
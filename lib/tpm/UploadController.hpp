@@ -0,0 +1,150 @@
+//
+// Copyright (c) 2015-2020 Microsoft Corporation and Contributors.
+// SPDX-License-Identifier: Apache-2.0
+//
+#ifndef UPLOADCONTROLLER_HPP
+#define UPLOADCONTROLLER_HPP
+
+#include "pal/PAL.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+namespace MAT_NS_BEGIN {
+
+    /// <summary>
+    /// Adaptive upload window. The number of bytes in flight is grown like a TCP congestion
+    /// window and split into a package size and a number of concurrent requests. The window
+    /// doubles per round trip until the first congestion signal, then grows by the smallest
+    /// package size per round trip while request durations stay within 4x the shortest one
+    /// seen. It shrinks by as much per round trip beyond 8x, and halves on failure.
+    /// </summary>
+    /// <remarks>
+    /// Getters only read atomics. The configured package size and request count are ceilings.
+    /// </remarks>
+    class UploadController
+    {
+    public:
+        UploadController() = default;
+
+        /// <summary>
+        /// Reset the controller. A disabled controller always proposes the ceilings.
+        /// </summary>
+        void Configure(bool enabled, unsigned maxUploadSize, unsigned maxPendingRequests)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_enabled = enabled;
+            m_maxUploadSize = std::max(maxUploadSize, 1u);
+            m_maxPendingRequests = std::max(maxPendingRequests, 1u);
+            m_minUploadSize = std::max(m_maxUploadSize / kMinUploadSizeDivisor, 1u);
+            m_window = enabled ? m_minUploadSize : static_cast<uint64_t>(m_maxUploadSize) * m_maxPendingRequests;
+            m_slowStart = true;
+            m_baseDurationMs = 0;
+            update();
+        }
+
+        bool IsEnabled() const
+        {
+            return m_enabled;
+        }
+
+        /// <summary>
+        /// Package size limit for the next upload.
+        /// </summary>
+        unsigned GetUploadSize() const
+        {
+            return m_uploadSize;
+        }
+
+        /// <summary>
+        /// Number of uploads allowed in flight.
+        /// </summary>
+        unsigned GetMaxPendingRequests() const
+        {
+            return m_pendingRequests;
+        }
+
+        /// <summary>
+        /// Account for an upload of bytes acknowledged after durationMs. The window only
+        /// grows when the package was full, i.e. when the window limited the upload.
+        /// </summary>
+        void OnUploadSucceeded(size_t bytes, unsigned durationMs, bool windowLimited)
+        {
+            if (!m_enabled)
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(m_lock);
+            durationMs = std::max(durationMs, 1u);
+            if ((m_baseDurationMs == 0) || (durationMs < m_baseDurationMs) ||
+                ((durationMs > kShrinkInflation * m_baseDurationMs) && (m_window <= m_minUploadSize)))
+            {
+                // Shortest duration seen, re-learned once even the smallest window is slow
+                m_baseDurationMs = durationMs;
+            }
+
+            uint64_t acked = std::max<uint64_t>(bytes, 1);
+            // One smallest package per round trip
+            uint64_t step = std::max<uint64_t>((acked * m_minUploadSize) / m_window, 1);
+            if (durationMs > kShrinkInflation * m_baseDurationMs)
+            {
+                m_slowStart = false;
+                m_window = (m_window > step) ? (m_window - step) : 0;
+            }
+            else if (durationMs > kGrowInflation * m_baseDurationMs)
+            {
+                m_slowStart = false;
+            }
+            else if (windowLimited)
+            {
+                m_window += m_slowStart ? acked : step;
+            }
+            update();
+        }
+
+        /// <summary>
+        /// Account for an upload that failed or was throttled.
+        /// </summary>
+        void OnUploadFailed()
+        {
+            if (!m_enabled)
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_slowStart = false;
+            m_window /= 2;
+            update();
+        }
+
+    protected:
+        static constexpr unsigned kMinUploadSizeDivisor = 16;
+        static constexpr unsigned kGrowInflation = 4;
+        static constexpr unsigned kShrinkInflation = 8;
+
+        void update()
+        {
+            uint64_t maxWindow = static_cast<uint64_t>(m_maxUploadSize) * m_maxPendingRequests;
+            m_window = std::min(std::max<uint64_t>(m_window, m_minUploadSize), maxWindow);
+            m_uploadSize = static_cast<unsigned>(std::min<uint64_t>(m_window, m_maxUploadSize));
+            m_pendingRequests = static_cast<unsigned>((m_window + m_maxUploadSize - 1) / m_maxUploadSize);
+        }
+
+        std::mutex            m_lock;
+        std::atomic<bool>     m_enabled {};
+        unsigned              m_maxUploadSize { 1 };
+        unsigned              m_maxPendingRequests { 1 };
+        unsigned              m_minUploadSize { 1 };
+        uint64_t              m_window {};
+        bool                  m_slowStart { true };
+        unsigned              m_baseDurationMs {};
+        std::atomic<unsigned> m_uploadSize { 1 };
+        std::atomic<unsigned> m_pendingRequests { 1 };
+    };
+
+} MAT_NS_END
+
+#endif
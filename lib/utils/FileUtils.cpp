@@ -9,6 +9,12 @@
 #include <fstream>
 #include <streambuf>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 namespace MAT_NS_BEGIN
 {
 
@@ -93,6 +99,43 @@ namespace MAT_NS_BEGIN
         return std::fclose(_Stream);
     }
 
+    /**
+     * Flush file stream and commit its contents to the storage device.
+     *
+     * @param       _Stream    File stream
+     * @return      true on success, false on failure
+     */
+    bool FileSync(std::FILE* _Stream)
+    {
+        if (std::fflush(_Stream) != 0)
+        {
+            return false;
+        }
+#ifdef _WIN32
+        return (_commit(_fileno(_Stream)) == 0);
+#else
+        return (fsync(fileno(_Stream)) == 0);
+#endif
+    }
+
+    /**
+     * Rename file, replacing the destination file if it exists.
+     *
+     * @param       from    UTF-8 filename
+     * @param       to      UTF-8 filename
+     * @return      true on success, false on failure
+     */
+    bool FileRename(const char* from, const char* to)
+    {
+#ifdef _WIN32
+        std::wstring from_w = to_utf16_string(from);
+        std::wstring to_w = to_utf16_string(to);
+        return (::MoveFileExW(from_w.c_str(), to_w.c_str(), MOVEFILE_REPLACE_EXISTING) != 0);
+#else
+        return (std::rename(from, to) == 0);
+#endif
+    }
+
     /**
      * Read file contents into std::string.
      *
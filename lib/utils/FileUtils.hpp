@@ -15,6 +15,8 @@ namespace MAT_NS_BEGIN
     int         FileDelete(const char* filename);
     std::FILE*  FileOpen(const char* filename, const char *mode);
     int         FileClose(std::FILE* handle);
+    bool        FileSync(std::FILE* handle);
+    bool        FileRename(const char* from, const char* to);
     std::string FileGetContents(const char *filename);
     bool        FileWrite(const char* filename, const char* contents);
     bool        FileExists(const char* name);
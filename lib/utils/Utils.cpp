@@ -10,7 +10,11 @@
 #endif
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -288,6 +292,98 @@ namespace MAT_NS_BEGIN {
     }
 #endif
 
+    namespace {
+        /// <summary>
+        /// Interned tenant tokens. Tokens are appended to chunks that never move, and
+        /// published by the release store of the size, so that lookups take no lock. Chunk
+        /// k holds ChunkSize << k tokens and is allocated when the first of them is interned,
+        /// so MaxChunks chunks cover the whole handle range. The table is never destroyed so
+        /// that handles outlive static destruction.
+        /// </summary>
+        struct TenantTokenTable
+        {
+            static constexpr size_t ChunkSize = 256;
+            static constexpr size_t MaxChunks = 24;
+            static constexpr size_t MaxSize = ChunkSize * ((size_t(1) << MaxChunks) - 1);
+
+            std::mutex lock;    // Serializes interning
+            std::unordered_map<std::string, TenantTokenHandle> handles;
+            std::array<std::atomic<std::string*>, MaxChunks> chunks;
+            std::atomic<size_t> size;
+
+            TenantTokenTable() : size(1)
+            {
+                for (auto& chunk : chunks)
+                {
+                    chunk = nullptr;
+                }
+                chunks[0] = new std::string[ChunkSize];
+                handles.emplace(std::string(), 0);
+            }
+
+            /// <summary>
+            /// Find the chunk holding a handle and the handle's offset in it.
+            /// </summary>
+            static void locate(size_t handle, size_t& chunk, size_t& offset)
+            {
+                size_t blocks = handle / ChunkSize + 1;
+                chunk = 0;
+                while ((blocks >> (chunk + 1)) != 0)
+                {
+                    chunk++;
+                }
+                offset = handle - ChunkSize * ((size_t(1) << chunk) - 1);
+            }
+        };
+
+        TenantTokenTable& tenantTokenTable()
+        {
+            static TenantTokenTable* table = new TenantTokenTable();
+            return *table;
+        }
+    }
+
+    TenantTokenHandle internTenantToken(std::string const& tenantToken)
+    {
+        TenantTokenTable& table = tenantTokenTable();
+        std::lock_guard<std::mutex> guard(table.lock);
+        auto it = table.handles.find(tenantToken);
+        if (it != table.handles.end())
+        {
+            return it->second;
+        }
+        size_t handle = table.size.load(std::memory_order_relaxed);
+        if (handle >= TenantTokenTable::MaxSize)
+        {
+            LOG_ERROR("Tenant token table is full, %u tokens interned", static_cast<unsigned>(handle));
+            return 0;
+        }
+        size_t index, offset;
+        TenantTokenTable::locate(handle, index, offset);
+        std::string* chunk = table.chunks[index].load(std::memory_order_relaxed);
+        if (chunk == nullptr)
+        {
+            chunk = new std::string[TenantTokenTable::ChunkSize << index];
+            table.chunks[index].store(chunk, std::memory_order_relaxed);
+        }
+        chunk[offset] = tenantToken;
+        table.handles.emplace(tenantToken, static_cast<TenantTokenHandle>(handle));
+        table.size.store(handle + 1, std::memory_order_release);
+        return static_cast<TenantTokenHandle>(handle);
+    }
+
+    std::string const& resolveTenantToken(TenantTokenHandle handle)
+    {
+        TenantTokenTable& table = tenantTokenTable();
+        if (handle >= table.size.load(std::memory_order_acquire))
+        {
+            handle = 0;
+        }
+        size_t index, offset;
+        TenantTokenTable::locate(handle, index, offset);
+        return table.chunks[index].load(std::memory_order_relaxed)[offset];
+    }
+
     unsigned hashCode(const char* str, int h)
     {
         return (unsigned)(!str[h] ? 5381 : ((unsigned long long)hashCode(str, h + 1) * (unsigned)33) ^ str[h]);
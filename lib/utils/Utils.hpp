@@ -78,6 +78,24 @@ namespace MAT_NS_BEGIN {
         return tenantToken.substr(0, tenantToken.find('-'));
     }
 
+    /// <summary>
+    /// Handle of a tenant token in the process-wide interning table. Equal tokens
+    /// have equal handles, and the empty token is always 0.
+    /// </summary>
+    typedef uint32_t TenantTokenHandle;
+
+    /// <summary>
+    /// Intern a tenant token and return its handle. Tokens are never removed. Takes a
+    /// process-wide lock, so intern once per tenant and carry the handle.
+    /// </summary>
+    TenantTokenHandle internTenantToken(std::string const& tenantToken);
+
+    /// <summary>
+    /// Get the tenant token of a handle without locking. The reference stays valid for
+    /// the lifetime of the process.
+    /// </summary>
+    std::string const& resolveTenantToken(TenantTokenHandle handle);
+
     inline uint64_t GetUptimeMs()
     {
         return std::chrono::system_clock::now().time_since_epoch() / std::chrono::milliseconds(1);
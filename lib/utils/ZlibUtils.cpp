@@ -62,4 +62,109 @@ namespace MAT_NS_BEGIN
 #endif
     }
 
+    ZlibInflater::ZlibInflater() :
+        m_stream(nullptr)
+    {
+    }
+
+    ZlibInflater::~ZlibInflater()
+    {
+#ifdef HAVE_MAT_ZLIB
+        if (m_stream != nullptr)
+        {
+            z_stream* zs = static_cast<z_stream*>(m_stream);
+            inflateEnd(zs);
+            delete zs;
+        }
+#endif
+    }
+
+    bool ZlibInflater::Inflate(std::vector<uint8_t>& data, size_t inSize, size_t outSize)
+    {
+#ifdef HAVE_MAT_ZLIB
+        z_stream* zs = static_cast<z_stream*>(m_stream);
+        if (zs == nullptr)
+        {
+            zs = new z_stream();
+            if (inflateInit2(zs, -MAX_WBITS) != Z_OK)
+            {
+                delete zs;
+                return false;
+            }
+            m_stream = zs;
+        }
+        else if (inflateReset(zs) != Z_OK)
+        {
+            return false;
+        }
+
+        m_buffer.resize(outSize);
+        zs->next_in = data.data();
+        zs->avail_in = static_cast<uInt>(std::min(inSize, data.size()));
+        zs->next_out = m_buffer.data();
+        zs->avail_out = static_cast<uInt>(outSize);
+        int ret = inflate(zs, Z_FINISH);
+        if ((ret != Z_STREAM_END) || (zs->avail_out != 0))
+        {
+            LOG_WARN("Inflate failed, error=%u/%u (%s)", 3, ret, zs->msg);
+            return false;
+        }
+        // The input buffer keeps its capacity for the next payload
+        data.swap(m_buffer);
+        return true;
+#else
+        UNREFERENCED_PARAMETER(data);
+        UNREFERENCED_PARAMETER(inSize);
+        UNREFERENCED_PARAMETER(outSize);
+        return false;
+#endif
+    }
+
+    /// <summary>
+    /// Compress a buffer into raw deflate format understood by InflateVector(in, out, false).
+    /// </summary>
+    /// <param name="in">Uncompressed input.</param>
+    /// <param name="out">Compressed output, replaced on success.</param>
+    /// <param name="level">zlib compression level (1..9), Z_DEFAULT_COMPRESSION if out of range.</param>
+    /// <returns>true if compression succeeded.</returns>
+    bool ZlibUtils::DeflateVector(const std::vector<uint8_t>& in, std::vector<uint8_t>& out, int level)
+    {
+#ifdef HAVE_MAT_ZLIB
+        if ((level < Z_BEST_SPEED) || (level > Z_BEST_COMPRESSION))
+        {
+            level = Z_DEFAULT_COMPRESSION;
+        }
+
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8 /*DEF_MEM_LEVEL*/, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            return false;
+        }
+
+        // Single pass: deflateBound guarantees the output fits
+        out.resize(deflateBound(&zs, static_cast<uLong>(in.size())));
+        zs.next_in = (Bytef *)in.data();
+        zs.avail_in = static_cast<uInt>(in.size());
+        zs.next_out = out.data();
+        zs.avail_out = static_cast<uInt>(out.size());
+
+        int ret = deflate(&zs, Z_FINISH);
+        deflateEnd(&zs);
+        if (ret != Z_STREAM_END)
+        {
+            LOG_WARN("Deflate failed, error=%u/%u (%s)", 1, ret, zs.msg);
+            out.clear();
+            return false;
+        }
+        out.resize(zs.total_out);
+        return true;
+#else
+        UNREFERENCED_PARAMETER(in);
+        UNREFERENCED_PARAMETER(out);
+        UNREFERENCED_PARAMETER(level);
+        return false;
+#endif
+    }
+
 } MAT_NS_END
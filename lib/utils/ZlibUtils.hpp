@@ -6,6 +6,7 @@
 #define LIB_ZLIB_UTILS_HPP
 
 #include "ctmacros.hpp"
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 
@@ -15,6 +16,30 @@ namespace MAT_NS_BEGIN
     {
         public:
             static bool InflateVector(const std::vector<uint8_t>& in, std::vector<uint8_t>& out, bool isGzip);
+            static bool DeflateVector(const std::vector<uint8_t>& in, std::vector<uint8_t>& out, int level);
+    };
+
+    /// <summary>
+    /// Raw deflate decoder reused across payloads, e.g. the rows of a storage scan:
+    /// each payload costs an inflateReset instead of an inflateInit, and is decoded
+    /// in one pass into a buffer kept across calls.
+    /// </summary>
+    class ZlibInflater
+    {
+        public:
+            ZlibInflater();
+            ~ZlibInflater();
+            ZlibInflater(ZlibInflater const&) = delete;
+            ZlibInflater& operator=(ZlibInflater const&) = delete;
+
+            /// <summary>
+            /// Replace the first inSize bytes of data, in raw deflate format, by their outSize decoded bytes.
+            /// </summary>
+            bool Inflate(std::vector<uint8_t>& data, size_t inSize, size_t outSize);
+
+        private:
+            void*                m_stream;
+            std::vector<uint8_t> m_buffer;
     };
 
 } MAT_NS_END
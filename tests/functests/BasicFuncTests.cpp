@@ -806,6 +806,138 @@ TEST_F(BasicFuncTests, restartRecoversEventsFromStorage)
         */
 }
 
+TEST_F(BasicFuncTests, drainModeEmptiesBacklog)
+{
+    constexpr unsigned eventCount = 20000;
+    CleanStorage();
+    auto& configuration = LogManager::GetLogConfiguration();
+    configuration[CFG_INT_CACHE_FILE_SIZE] = 64 * 1024 * 1024;
+    configuration[CFG_MAP_TPM][CFG_INT_TPM_MAX_BLOB_BYTES] = 64 * 1024;
+    configuration[CFG_MAP_TPM][CFG_INT_TPM_DRAIN_THRESHOLD] = 1000;
+    Initialize();
+    // Uploads alternate between RealTime and Normal latency, and an upload that finds
+    // no events waits for the 5 minute timer: the backlog has to go out without one
+    LogManager::LoadTransmitProfiles(R"([{ "name": "Slow", "rules": [ { "timers": [ 600, 300, 300 ] } ] }])");
+    LogManager::SetTransmitProfile("Slow");
+
+    // Build up a backlog as if the device had been offline
+    LogManager::PauseTransmission();
+    for (unsigned i = 0; i < eventCount; i++)
+    {
+        EventProperties event("drain_event");
+        event.SetLatency(EventLatency_Normal);
+        event.SetProperty("index", static_cast<int64_t>(i));
+        logger->LogEvent(event);
+    }
+    LogManager::Flush();
+
+    auto start = PAL::getMonotonicTimeMs();
+    LogManager::ResumeTransmission();
+    LogManager::UploadNow();
+    unsigned receivedEvents = 0;
+    size_t lastIdx = 0;
+    while ((receivedEvents < eventCount) && (PAL::getMonotonicTimeMs() - start < 120000))
+    {
+        PAL::sleep(10);
+        // Decode without blocking the server
+        std::vector<HttpServer::Request> requests;
+        {
+            LOCKGUARD(mtx_requests);
+            requests.assign(receivedRequests.begin() + lastIdx, receivedRequests.end());
+            lastIdx = receivedRequests.size();
+        }
+        for (auto const& request : requests)
+        {
+            for (auto const& record : decodeRequest(request, false))
+            {
+                receivedEvents += (record.name == "drain_event") ? 1 : 0;
+            }
+        }
+    }
+    printf("Drained %u events in %u requests\n", receivedEvents, static_cast<unsigned>(lastIdx));
+    // Every package of the backlog followed the first one without waiting for the timer
+    EXPECT_EQ(eventCount, receivedEvents);
+    EXPECT_LT(1u, lastIdx);
+
+    LogManager::SetTransmitProfile(TransmitProfile_RealTime);
+    FlushAndTeardown();
+    configuration[CFG_INT_CACHE_FILE_SIZE] = 3145728;
+    configuration[CFG_MAP_TPM][CFG_INT_TPM_MAX_BLOB_BYTES] = 2097152;
+    configuration[CFG_MAP_TPM][CFG_INT_TPM_DRAIN_THRESHOLD] = 0;
+}
+
+TEST_F(BasicFuncTests, deadlineSchedulingBoundsLatencyWithFewerRequests)
+{
+    constexpr unsigned eventCount = 100;
+    CleanStorage();
+    auto& configuration = LogManager::GetLogConfiguration();
+    configuration[CFG_MAP_TPM][CFG_BOOL_TPM_DEADLINE_SCHEDULING] = true;
+    Initialize();
+    // Normal events wait up to 4 seconds, RealTime events up to 2 seconds
+    LogManager::LoadTransmitProfiles(R"([{ "name": "Deadlines", "rules": [ { "timers": [ 4, 2, 2 ] } ] }])");
+    LogManager::SetTransmitProfile("Deadlines");
+
+    auto start = PAL::getMonotonicTimeMs();
+    unsigned receivedEvents = 0;
+    size_t lastIdx = 0;
+    uint64_t maxLatencyMs[EventLatency_Max + 1] = {};
+    auto receive = [&]()
+    {
+        std::vector<HttpServer::Request> requests;
+        {
+            LOCKGUARD(mtx_requests);
+            requests.assign(receivedRequests.begin() + lastIdx, receivedRequests.end());
+            lastIdx = receivedRequests.size();
+        }
+        uint64_t now = PAL::getMonotonicTimeMs() - start;
+        for (auto const& request : requests)
+        {
+            for (auto& record : decodeRequest(request, false))
+            {
+                if (record.name != "deadline_event")
+                {
+                    continue;
+                }
+                receivedEvents++;
+                auto& properties = record.data[0].properties;
+                uint64_t latencyMs = now - static_cast<uint64_t>(properties["loggedAt"].longValue);
+                auto& maxMs = maxLatencyMs[(properties["index"].longValue % 2 != 0) ? EventLatency_RealTime : EventLatency_Normal];
+                maxMs = std::max(maxMs, latencyMs);
+            }
+        }
+    };
+
+    // A steady trickle of Normal and RealTime events
+    for (unsigned i = 0; i < eventCount; i++)
+    {
+        EventProperties event("deadline_event");
+        event.SetLatency((i % 2 != 0) ? EventLatency_RealTime : EventLatency_Normal);
+        event.SetProperty("index", static_cast<int64_t>(i));
+        event.SetProperty("loggedAt", static_cast<int64_t>(PAL::getMonotonicTimeMs() - start));
+        logger->LogEvent(event);
+        for (int j = 0; j < 5; j++)
+        {
+            PAL::sleep(10);
+            receive();
+        }
+    }
+    while ((receivedEvents < eventCount) && (PAL::getMonotonicTimeMs() - start < 60000))
+    {
+        PAL::sleep(10);
+        receive();
+    }
+    printf("Received %u events in %u requests, max latency Normal %u ms, RealTime %u ms\n", receivedEvents, static_cast<unsigned>(lastIdx),
+        static_cast<unsigned>(maxLatencyMs[EventLatency_Normal]), static_cast<unsigned>(maxLatencyMs[EventLatency_RealTime]));
+    EXPECT_EQ(eventCount, receivedEvents);
+    // Normal events ride along with the RealTime ones, both well within the profile timers
+    EXPECT_LT(maxLatencyMs[EventLatency_RealTime], 3000u);
+    EXPECT_LT(maxLatencyMs[EventLatency_Normal], 3000u);
+
+    LogManager::SetTransmitProfile(TransmitProfile_RealTime);
+    FlushAndTeardown();
+    configuration[CFG_MAP_TPM][CFG_BOOL_TPM_DEADLINE_SCHEDULING] = false;
+}
+
 #if 0 // FIXME: 1445871 [v3][1DS] Offline storage size may exceed configured limit
 TEST_F(BasicFuncTests, storageFileSizeDoesntExceedConfiguredSize)
 {
@@ -0,0 +1,83 @@
+//
+// Copyright (c) 2015-2020 Microsoft Corporation and Contributors.
+// SPDX-License-Identifier: Apache-2.0
+//
+#include "common/Common.hpp"
+#include "offline/EvictionPolicy.hpp"
+
+#include <vector>
+
+using namespace testing;
+using namespace MAT;
+
+namespace {
+
+    EvictionCandidate candidate(std::string const& tenantToken, EventPersistence persistence, EventLatency latency, int64_t timestamp, size_t size = 10)
+    {
+        EvictionCandidate result;
+        result.tenantToken = tenantToken;
+        result.persistence = persistence;
+        result.latency = latency;
+        result.timestamp = timestamp;
+        result.size = size;
+        return result;
+    }
+
+}
+
+TEST(EvictionPolicyTests, DefaultOrderIsPersistenceLatencyAge)
+{
+    DefaultEvictionPolicy policy(0);
+    std::vector<EvictionCandidate> candidates {
+        candidate("a", EventPersistence_Critical, EventLatency_Normal, 1),
+        candidate("a", EventPersistence_Normal, EventLatency_RealTime, 2),
+        candidate("a", EventPersistence_Normal, EventLatency_Normal, 4),
+        candidate("a", EventPersistence_Normal, EventLatency_Normal, 3),
+    };
+    EXPECT_THAT(SelectEvictionVictims(policy, candidates, 1000, 1000), ElementsAre(3, 2, 1, 0));
+    EXPECT_THAT(SelectEvictionVictims(policy, candidates, 1000, 15), ElementsAre(3, 2));
+}
+
+TEST(EvictionPolicyTests, TenantOverQuotaIsTrimmedFirst)
+{
+    DefaultEvictionPolicy policy(50);
+    std::vector<EvictionCandidate> candidates;
+    // Quiet tenant with the oldest events
+    candidates.push_back(candidate("quiet", EventPersistence_Normal, EventLatency_Normal, 1));
+    candidates.push_back(candidate("quiet", EventPersistence_Normal, EventLatency_Normal, 2));
+    for (int i = 0; i < 8; i++)
+    {
+        candidates.push_back(candidate("chatty", EventPersistence_Normal, EventLatency_Normal, 10 + i));
+    }
+
+    // 80 of 100 bytes used by the chatty tenant, 30 over its quota
+    auto victims = SelectEvictionVictims(policy, candidates, 100, 30);
+    EXPECT_THAT(victims, ElementsAre(2, 3, 4));
+
+    // Once every tenant is within its quota, eviction falls back to policy order
+    victims = SelectEvictionVictims(policy, candidates, 100, 50);
+    EXPECT_THAT(victims, ElementsAre(2, 3, 4, 0, 1));
+}
+
+TEST(EvictionPolicyTests, EvictsEverythingAtMost)
+{
+    DefaultEvictionPolicy policy(10);
+    std::vector<EvictionCandidate> candidates {
+        candidate("a", EventPersistence_Normal, EventLatency_Normal, 1),
+        candidate("b", EventPersistence_Normal, EventLatency_Normal, 2),
+    };
+    EXPECT_THAT(SelectEvictionVictims(policy, candidates, 10, 1000), UnorderedElementsAre(0, 1));
+    EXPECT_THAT(SelectEvictionVictims(policy, std::vector<EvictionCandidate>(), 10, 1000), IsEmpty());
+}
+
+TEST(EvictionPolicyTests, TenantTrimsLevelTheFurthestOverQuota)
+{
+    DefaultEvictionPolicy policy(20);
+    std::unordered_map<std::string, size_t> tenantBytes { { "a", 60 }, { "b", 35 }, { "c", 5 } };
+
+    // Quota of 20: a is 40 over, b 15 over, c within quota
+    EXPECT_THAT(SelectTenantTrims(policy, tenantBytes, 100, 10), UnorderedElementsAre(Pair("a", 10)));
+    EXPECT_THAT(SelectTenantTrims(policy, tenantBytes, 100, 35), UnorderedElementsAre(Pair("a", 30), Pair("b", 5)));
+    EXPECT_THAT(SelectTenantTrims(policy, tenantBytes, 100, 1000), UnorderedElementsAre(Pair("a", 40), Pair("b", 15)));
+    EXPECT_THAT(SelectTenantTrims(DefaultEvictionPolicy(0), tenantBytes, 100, 1000), IsEmpty());
+}
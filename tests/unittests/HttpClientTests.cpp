@@ -2,6 +2,7 @@
 // Copyright (c) 2015-2020 Microsoft Corporation and Contributors.
 // SPDX-License-Identifier: Apache-2.0
 //
+#include "mat/config.h"
 #ifdef HAVE_MAT_DEFAULT_HTTP_CLIENT
 #ifndef WIN32_LEAN_AND_MEAN
 #define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
@@ -9,6 +10,10 @@
 #include "common/Common.hpp"
 #include "common/HttpServer.hpp"
 #include "http/HttpClientFactory.hpp"
+#include "bwcontrol/BandwidthController_TokenBucket.hpp"
+#if defined(MATSDK_PAL_CPP11) && !defined(_MSC_VER) && !defined(__APPLE__) && !defined(ANDROID)
+#include "http/HttpClient_Curl.hpp"
+#endif
 
 using namespace testing;
 using namespace MAT;
@@ -345,5 +350,104 @@ TEST_F(HttpClientTests, SurvivesManyRequests)
     EXPECT_THAT(it, _countedRequests.end());
 
 }
+TEST_F(HttpClientTests, TokenBucketPacesUploadsToTargetRate)
+{
+    Clear();
+    unsigned const RateBps = 200000;
+    size_t const Size = 20000;
+    size_t const Count = 10;
+    BandwidthController_TokenBucket limiter(RateBps, static_cast<unsigned>(Size));
+
+    uint64_t start = 0;
+    uint64_t last = 0;
+    for (size_t i = 0; i < Count; i++) {
+        uint64_t delayMs;
+        while ((delayMs = limiter.GetDelayMs()) != 0)
+            PAL::sleep(static_cast<unsigned>(delayMs));
+        last = PAL::getMonotonicTimeMs();
+        if (i == 0)
+            start = last;
+        limiter.OnBytesSent(Size);
+
+        std::unique_ptr<IHttpRequest> request(_client->CreateRequest());
+        request->SetMethod("POST");
+        request->GetHeaders().set("Content-Type", "application/octet-stream");
+        request->SetUrl("http://" + _hostname + "/echo/");
+        std::vector<uint8_t> body(Size, 'x');
+        request->SetBody(body);
+        _client->SendRequestAsync(request.release(), this);
+        while (_responses.size() <= i)
+            PAL::sleep(1);
+    }
+
+    for (auto &v : _responses)
+    {
+        EXPECT_THAT(v->GetResult(), HttpResult_OK);
+        EXPECT_THAT(v->GetBody(), SizeIs(Size));
+    }
+    // All packages sent before the last one, except for the burst, have been paced
+    uint64_t achievedBps = (static_cast<uint64_t>(Count - 2) * Size * 1000) / std::max<uint64_t>(last - start, 1);
+    EXPECT_THAT(achievedBps, Le(RateBps * 105 / 100));
+    EXPECT_THAT(achievedBps, Ge(RateBps * 70 / 100));
+}
+
+#if defined(MATSDK_PAL_CPP11) && !defined(_MSC_VER) && !defined(__APPLE__) && !defined(ANDROID)
+TEST_F(HttpClientTests, CurlReusesConnections)
+{
+    Clear();
+    auto client = std::make_shared<HttpClient_Curl>();
+
+    size_t Count = 10;
+    for (size_t i = 0; i < Count; i++) {
+        IHttpRequest* request = client->CreateRequest();
+        request->SetMethod("POST");
+        request->GetHeaders().set("content-type", "application/octet-stream");
+        std::ostringstream url;
+        url << "http://" << _hostname << "/count/" << i;
+        request->SetUrl(url.str());
+        auto body = Binary("content");
+        request->SetBody(body);
+        _countedRequests.push_back(Sent);
+        client->SendRequestAsync(request, this);
+
+        // Sequential requests share one keep-alive connection
+        while (_responses.size() <= i)
+            PAL::sleep(10);
+        delete request;
+    }
+
+    for (auto &v : _responses)
+    {
+        EXPECT_THAT(v->GetResult(), HttpResult_OK);
+        EXPECT_THAT(v->GetStatusCode(), 200u);
+    }
+    EXPECT_THAT(client->GetConnectionCount(), 1u);
+}
+
+TEST(CurlHttpOperationTests, ParsesHeaderLines)
+{
+    HttpHeaders headers;
+    auto parse = [&headers](std::string const& line) { CurlHttpOperation::ParseHeaderLine(line.data(), line.size(), headers); };
+
+    parse("HTTP/1.1 100 Continue\r\n");
+    parse("Stale: value\r\n");
+    parse("HTTP/1.1 200 OK\r\n");
+    parse("Content-Type: application/json\r\n");
+    parse("Kill-Duration:  3600 \r\n");
+    parse("Time-Delta-Millis:\r\n");
+    parse("Date: Mon, 19 Oct 2026 10:00:00 GMT\n");
+    parse("not a header\r\n");
+    parse(": no name\r\n");
+    parse("\r\n");
+
+    EXPECT_THAT(headers.size(), 4u);
+    EXPECT_THAT(headers.get("Stale"), Eq(""));
+    EXPECT_THAT(headers.get("Content-Type"), Eq("application/json"));
+    EXPECT_THAT(headers.get("Kill-Duration"), Eq("3600"));
+    EXPECT_THAT(headers.get("Time-Delta-Millis"), Eq(""));
+    EXPECT_THAT(headers.get("Date"), Eq("Mon, 19 Oct 2026 10:00:00 GMT"));
+}
+#endif
+
 #endif // HAVE_MAT_DEFAULT_HTTP_CLIENT
 
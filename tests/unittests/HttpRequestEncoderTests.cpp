@@ -4,6 +4,7 @@
 #include "common/MockIHttpClient.hpp"
 #include "http/HttpRequestEncoder.hpp"
 #include "config/RuntimeConfig_Default.hpp"
+#include "api/AuthTokensController.hpp"
 
 using namespace testing;
 using namespace MAT;
@@ -25,6 +26,20 @@ public:
     StorageBlob dataPacket;
 };
 
+class AuthHttpRequestEncoder : public HttpRequestEncoder
+{
+public:
+    AuthHttpRequestEncoder(ITelemetrySystem& system, IHttpClient& httpClient)
+        : HttpRequestEncoder(system, httpClient) { }
+
+    IAuthTokensController* GetAuthTokensController() override
+    {
+        return &tokens;
+    }
+
+    AuthTokensController tokens;
+};
+
 class HttpRequestEncoderTests : public Test {
 
 public:
@@ -126,3 +141,38 @@ TEST_F(HttpRequestEncoderTests, DispatchDataViewerEventCorrectly)
 
     EXPECT_THAT(mockEncoder.dataPacket, Eq(std::vector<uint8_t>{1, 127, 255}));
 }
+
+TEST_F(HttpRequestEncoderTests, RebuildsAuthHeadersWhenTokensChange)
+{
+    AuthHttpRequestEncoder authEncoder(system, mockHttpClient);
+    auto encode = [&authEncoder]()
+    {
+        EventsUploadContextPtr ctx = std::make_shared<EventsUploadContext>();
+        authEncoder.encode(ctx);
+        return ctx;
+    };
+
+    auto ctx = encode();
+    EXPECT_THAT(ctx->httpRequest->GetHeaders().has("Tickets"), false);
+    EXPECT_THAT(ctx->httpRequest->GetHeaders().has("Aad-Token"), false);
+    EXPECT_THAT(ctx->httpRequest->GetHeaders(), Contains(Pair("Client-Id", "NO_AUTH")));
+
+    authEncoder.tokens.SetTicketToken(TicketType::TicketType_MSA_User, "user");
+    authEncoder.tokens.SetTicketToken(TicketType::TicketType_AAD, "device");
+    ctx = encode();
+    EXPECT_THAT(ctx->httpRequest->GetHeaders().get("Tickets"), Eq("\"" + std::string(TICKETS_PREPEND_STRING) + std::to_string(TicketType::TicketType_MSA_User) + "\"=\"p:user\""));
+    EXPECT_THAT(ctx->httpRequest->GetHeaders().get("Aad-Token"), Eq("device"));
+    EXPECT_THAT(ctx->httpRequest->GetHeaders().has("Strict"), false);
+
+    authEncoder.tokens.SetStrictMode(true);
+    ctx = encode();
+    EXPECT_THAT(ctx->httpRequest->GetHeaders().get("Strict"), Eq("true"));
+
+    authEncoder.tokens.Clear();
+    authEncoder.tokens.SetStrictMode(false);
+    ctx = encode();
+    EXPECT_THAT(ctx->httpRequest->GetHeaders().has("Tickets"), false);
+    EXPECT_THAT(ctx->httpRequest->GetHeaders().has("Aad-Token"), false);
+    EXPECT_THAT(ctx->httpRequest->GetHeaders().has("Strict"), false);
+    EXPECT_THAT(ctx->httpRequest->GetHeaders(), Contains(Pair("SDK-Version", PAL::getSdkVersion())));
+}
@@ -6,6 +6,7 @@
 #include "utils/Utils.hpp"
 
 #include "offline/MemoryStorage.hpp"
+#include "utils/FileUtils.hpp"
 #include "config/RuntimeConfig_Default.hpp"
 #include "NullObjects.hpp"
 
@@ -270,6 +271,145 @@ TEST(MemoryStorageTests, GetAndReserveSome)
     EXPECT_EQ(totalCount - howMany, storage.GetRecordCount());
 }
 
+TEST(MemoryStorageTests, SwapRecords)
+{
+    MemoryStorage storage(testLogManager, testConfig);
+    storage.Initialize(testObserver);
+    auto total_db_size = addEvents(storage);
+
+    // Seal the ram queue into the caller buffer
+    StorageRecordBuffer sealed;
+    EXPECT_EQ(total_db_size, storage.SwapRecords(sealed));
+    EXPECT_THAT(storage.GetSize(), 0);
+    EXPECT_THAT(storage.GetRecordCount(), 0);
+    for (const EventLatency &lat : latencies)
+    {
+        EXPECT_EQ(num_iterations, sealed[lat].size());
+    }
+
+    // Producers keep appending to the fresh buffer
+    StorageRecord record{ PAL::generateUuidString(), "token", EventLatency_Normal, EventPersistence_Normal, 1, { 1, 2, 3 }, 0, 0 };
+    EXPECT_TRUE(storage.StoreRecord(record));
+    EXPECT_THAT(storage.GetRecordCount(), 1);
+    EXPECT_THAT(storage.GetSize(), record.blob.size() + sizeof(record));
+
+    // Swapping the sealed buffer back puts its records into the ram queue
+    EXPECT_EQ(record.blob.size() + sizeof(record), storage.SwapRecords(sealed));
+    EXPECT_EQ(total_db_size, storage.GetSize());
+    EXPECT_EQ(num_iterations * latencies.size(), storage.GetRecordCount());
+    EXPECT_EQ(1u, sealed[EventLatency_Normal].size());
+}
+
+TEST(MemoryStorageTests, ResizeDbTrimsTenantOverQuota)
+{
+    ILogConfiguration config;
+    RuntimeConfig_Default runtimeConfig(config);
+    const size_t recordSize = 100 + sizeof(StorageRecord);
+    runtimeConfig[CFG_INT_RAM_QUEUE_SIZE] = static_cast<int>(5 * recordSize);
+    runtimeConfig[CFG_INT_TENANT_QUOTA_PCT] = 50;
+    NiceMock<MockIOfflineStorageObserver> observerMock;
+    MemoryStorage storage(testLogManager, runtimeConfig);
+    storage.Initialize(observerMock);
+
+    storage.StoreRecord(StorageRecord("quiet", "quiet", EventLatency_Normal, EventPersistence_Normal, 1, StorageBlob(100)));
+    for (int i = 0; i < 11; i++)
+    {
+        storage.StoreRecord(StorageRecord("chatty" + std::to_string(i), "chatty", EventLatency_Normal, EventPersistence_Normal, 10 + i, StorageBlob(100)));
+    }
+
+    // Twelve records are over twice the limit of five, the chatty tenant gets trimmed back to the limit
+    std::map<std::string, size_t> trimmed { { "chatty", 7 } };
+    EXPECT_CALL(observerMock, OnStorageTrimmed(trimmed)).Times(1);
+    EXPECT_TRUE(storage.ResizeDb());
+    EXPECT_EQ(5u, storage.GetRecordCount());
+    EXPECT_EQ(5 * recordSize, storage.GetSize());
+
+    std::vector<StorageRecordId> ids;
+    storage.GetAndReserveRecords([&](StorageRecord&& record) { ids.push_back(record.id); return true; }, 0);
+    EXPECT_THAT(ids, UnorderedElementsAre("quiet", "chatty7", "chatty8", "chatty9", "chatty10"));
+
+    // Within twice the limit nothing is dropped
+    EXPECT_TRUE(storage.ResizeDb());
+}
+
+TEST(MemoryStorageTests, FairPackingInterleavesTenantsByWeight)
+{
+    ILogConfiguration config;
+    RuntimeConfig_Default runtimeConfig(config);
+    runtimeConfig[CFG_BOOL_ENABLE_FAIR_PACKING] = true;
+    runtimeConfig[CFG_MAP_TENANT_UPLOAD_WEIGHTS] = { { "quiet", 2 } };
+    MemoryStorage storage(testLogManager, runtimeConfig);
+    storage.Initialize(testObserver);
+
+    // The newest records are served first, so the chatty tenant would fill the first package
+    for (int i = 0; i < 4; i++)
+    {
+        storage.StoreRecord(StorageRecord("quiet" + std::to_string(i), "quiet", EventLatency_Normal, EventPersistence_Normal, 1 + i, StorageBlob(10)));
+    }
+    for (int i = 0; i < 20; i++)
+    {
+        storage.StoreRecord(StorageRecord("chatty" + std::to_string(i), "chatty", EventLatency_Normal, EventPersistence_Normal, 10 + i, StorageBlob(10)));
+    }
+
+    std::vector<std::string> tenants;
+    storage.GetAndReserveRecords([&](StorageRecord&& record) { tenants.push_back(record.tenantToken); return tenants.size() < 6; }, 0);
+    EXPECT_THAT(tenants, ElementsAre("quiet", "chatty", "quiet", "quiet", "chatty", "quiet"));
+    EXPECT_EQ(19u, storage.GetRecordCount());
+
+    // Records left over by a consumer that stopped early are still all there
+    std::set<std::string> ids;
+    storage.GetAndReserveRecords([&](StorageRecord&& record) { ids.insert(record.id); return true; }, 0);
+    EXPECT_EQ(19u, ids.size());
+    EXPECT_EQ(1u, ids.count("quiet0"));
+    EXPECT_EQ(0u, ids.count("chatty19"));
+    EXPECT_EQ(0u, storage.GetRecordCount());
+}
+
+TEST(MemoryStorageTests, SpillFileRoundTrip)
+{
+    std::string path = GetTempDirectory() + "MemoryStorageTests.spill";
+    std::remove(path.c_str());
+
+    StorageRecordBuffer buffer;
+    buffer[EventLatency_Normal].emplace_back("normal", "token1", EventLatency_Normal, EventPersistence_Normal, 100, StorageBlob { 1, 2, 3 }, 2);
+    buffer[EventLatency_Max].emplace_back("max", "token2", EventLatency_Max, EventPersistence_Critical, 200, StorageBlob {}, 0);
+    EXPECT_TRUE(MemoryStorage::WriteSpillFile(path, buffer));
+
+    // A second spill appends to a file that has not been imported yet
+    StorageRecordBuffer more;
+    more[EventLatency_Normal].emplace_back("later", "token1", EventLatency_Normal, EventPersistence_Normal, 300, StorageBlob { 4 }, 0);
+    EXPECT_TRUE(MemoryStorage::WriteSpillFile(path, more));
+
+    std::vector<StorageRecord> records;
+    EXPECT_TRUE(MemoryStorage::ReadSpillFile(path, records));
+    ASSERT_EQ(3u, records.size());
+    EXPECT_EQ("max", records[0].id);
+    EXPECT_EQ(EventPersistence_Critical, records[0].persistence);
+    EXPECT_TRUE(records[0].blob.empty());
+    EXPECT_EQ("normal", records[1].id);
+    EXPECT_EQ("token1", records[1].tenantToken);
+    EXPECT_EQ(EventLatency_Normal, records[1].latency);
+    EXPECT_EQ(100, records[1].timestamp);
+    EXPECT_EQ(2, records[1].retryCount);
+    EXPECT_THAT(records[1].blob, ElementsAre(1, 2, 3));
+    EXPECT_EQ("later", records[2].id);
+
+    // A spill cut short keeps its complete records
+    std::vector<char> contents(FileGetSize(path.c_str()));
+    auto file = FileOpen(path.c_str(), "rb");
+    ASSERT_NE(nullptr, file);
+    EXPECT_EQ(contents.size(), fread(contents.data(), 1, contents.size(), file));
+    FileClose(file);
+    file = FileOpen(path.c_str(), "wb");
+    ASSERT_NE(nullptr, file);
+    fwrite(contents.data(), 1, contents.size() - 1, file);
+    FileClose(file);
+    records.clear();
+    EXPECT_TRUE(MemoryStorage::ReadSpillFile(path, records));
+    EXPECT_EQ(2u, records.size());
+    std::remove(path.c_str());
+}
+
 // This method is not implemented for RAM storage
 TEST(MemoryStorageTests, StoreSetting)
 {
@@ -0,0 +1,381 @@
+//
+// Copyright (c) 2015-2020 Microsoft Corporation and Contributors.
+// SPDX-License-Identifier: Apache-2.0
+//
+
+#include "common/Common.hpp"
+#include "common/MockIOfflineStorageObserver.hpp"
+#include "common/MockIRuntimeConfig.hpp"
+#include "offline/OfflineStorageHandler.hpp"
+#include "utils/FileUtils.hpp"
+#include "NullObjects.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <set>
+#include <vector>
+
+namespace MAE = ::Microsoft::Applications::Events;
+using namespace testing;
+
+class OfflineStorageHandlerTests : public ::testing::Test
+{
+public:
+    NullLogManager logManager;
+    NiceMock<MockIOfflineStorageObserver> observerMock;
+    ILogConfiguration config;
+    MockIRuntimeConfig configMock { config };
+    std::unique_ptr<OfflineStorageHandler> storage;
+    std::string name;
+
+    virtual void SetUp() override
+    {
+        EXPECT_CALL(configMock, GetOfflineStorageMaximumSizeBytes()).WillRepeatedly(Return(1024 * 1024));
+        EXPECT_CALL(configMock, GetMaximumRetryCount()).WillRepeatedly(Return(5));
+        EXPECT_CALL(configMock, IsClockSkewEnabled()).WillRepeatedly(Return(false));
+        name = MAE::GetTempDirectory() + "OfflineStorageHandlerTests.db";
+        removeFiles();
+        configMock[CFG_STR_CACHE_FILE_PATH] = name;
+        configMock[CFG_INT_RAM_QUEUE_SIZE] = 512 * 1024;
+        configMock[CFG_INT_RAMCACHE_FULL_PCT] = 75;
+    }
+
+    virtual void TearDown() override
+    {
+        if (storage)
+        {
+            storage->Shutdown();
+            storage.reset();
+        }
+        removeFiles();
+    }
+
+    void removeFiles()
+    {
+        for (auto const& suffix : { "", ".spill", ".journal", ".journal.sealed" })
+        {
+            std::remove((name + suffix).c_str());
+        }
+    }
+
+    void open()
+    {
+        storage.reset(new OfflineStorageHandler(logManager, configMock, *PAL::getDefaultTaskDispatcher()));
+        storage->Initialize(observerMock);
+    }
+
+    void store(std::string const& id, EventLatency latency)
+    {
+        storage->StoreRecord(StorageRecord(id, "tenant", latency, EventPersistence_Normal, PAL::getUtcSystemTimeMs(), StorageBlob { 1, 2, 3 }));
+    }
+
+    std::vector<StorageRecordId> reserve(size_t maxRecords)
+    {
+        std::vector<StorageRecordId> ids;
+        storage->GetAndReserveRecords([&](StorageRecord&& record) -> bool {
+            if (ids.size() >= maxRecords)
+            {
+                return false;
+            }
+            ids.push_back(record.id);
+            return true;
+        }, 60000);
+        return ids;
+    }
+};
+
+TEST_F(OfflineStorageHandlerTests, UrgentDiskRecordsGoBeforeRamQueue)
+{
+    open();
+    store("realtime", EventLatency_RealTime);
+    storage->Flush();
+    store("normal1", EventLatency_Normal);
+    store("normal2", EventLatency_Normal);
+    EXPECT_EQ(1u, storage->GetRecordCount(EventLatency_RealTime));
+    EXPECT_EQ(2u, storage->GetRecordCount(EventLatency_Normal));
+
+    auto ids = reserve(1);
+    ASSERT_EQ(1u, ids.size());
+    EXPECT_EQ("realtime", ids[0]);
+    EXPECT_FALSE(storage->IsLastReadFromMemory());
+}
+
+TEST_F(OfflineStorageHandlerTests, DiskIsReadAroundRamQueueClasses)
+{
+    open();
+    store("disk-realtime", EventLatency_RealTime);
+    store("disk-deferred", EventLatency_CostDeferred);
+    store("disk-normal", EventLatency_Normal);
+    storage->Flush();
+
+    // Without ram queue records every class comes from a single disk read
+    EXPECT_THAT(reserve(10), ElementsAre("disk-realtime", "disk-deferred", "disk-normal"));
+    EXPECT_FALSE(storage->IsLastReadFromMemory());
+
+    store("disk-realtime2", EventLatency_RealTime);
+    store("disk-normal2", EventLatency_Normal);
+    storage->Flush();
+    store("ram-deferred", EventLatency_CostDeferred);
+    EXPECT_THAT(reserve(10), ElementsAre("disk-realtime2", "ram-deferred", "disk-normal2"));
+    EXPECT_TRUE(storage->IsLastReadFromMemory());
+}
+
+TEST_F(OfflineStorageHandlerTests, MixedReadIsDeletedFromBothTiers)
+{
+    open();
+    store("realtime", EventLatency_RealTime);
+    storage->Flush();
+    store("normal", EventLatency_Normal);
+
+    auto ids = reserve(10);
+    EXPECT_THAT(ids, ElementsAre("realtime", "normal"));
+    bool fromMemory = storage->IsLastReadFromMemory();
+    EXPECT_TRUE(fromMemory);
+
+    storage->DeleteRecords(ids, HttpHeaders(), fromMemory);
+    EXPECT_EQ(0u, storage->GetRecordCount(EventLatency_Unspecified));
+}
+
+TEST_F(OfflineStorageHandlerTests, MixedReadIsReleasedToBothTiers)
+{
+    open();
+    store("realtime", EventLatency_RealTime);
+    storage->Flush();
+    store("normal", EventLatency_Normal);
+
+    auto ids = reserve(10);
+    bool fromMemory = storage->IsLastReadFromMemory();
+    storage->ReleaseRecords(ids, false, HttpHeaders(), fromMemory);
+    EXPECT_THAT(reserve(10), ElementsAre("realtime", "normal"));
+}
+
+TEST_F(OfflineStorageHandlerTests, JournalHoldsCriticalRecordsUntilFlush)
+{
+    configMock[CFG_BOOL_ENABLE_RAM_QUEUE_JOURNAL] = true;
+    open();
+    storage->StoreRecord(StorageRecord("critical", "tenant", EventLatency_Normal, EventPersistence_Critical, PAL::getUtcSystemTimeMs(), StorageBlob { 1, 2, 3 }));
+    store("normal", EventLatency_Normal);
+
+    std::vector<StorageRecord> journaled;
+    for (int i = 0; (i < 200) && journaled.empty(); i++)
+    {
+        PAL::sleep(10);
+        MemoryStorage::ReadSpillFile(name + ".journal", journaled);
+    }
+    ASSERT_EQ(1u, journaled.size());
+    EXPECT_EQ("critical", journaled[0].id);
+    EXPECT_EQ(EventPersistence_Critical, journaled[0].persistence);
+
+    storage->Flush();
+    EXPECT_FALSE(FileExists((name + ".journal").c_str()));
+    EXPECT_FALSE(FileExists((name + ".journal.sealed").c_str()));
+    EXPECT_EQ(2u, storage->GetRecordCount(EventLatency_Normal));
+}
+
+TEST_F(OfflineStorageHandlerTests, JournalIsReplayedOnStart)
+{
+    // Journal left by a process that crashed before flushing its ram queue
+    std::FILE* journal = MemoryStorage::OpenSpillFile(name + ".journal");
+    ASSERT_NE(nullptr, journal);
+    std::vector<uint8_t> data;
+    MemoryStorage::SerializeSpillRecord(StorageRecord("critical", "tenant", EventLatency_Normal, EventPersistence_Critical, PAL::getUtcSystemTimeMs(), StorageBlob { 1, 2, 3 }), data);
+    std::fwrite(data.data(), 1, data.size(), journal);
+    FileClose(journal);
+
+    configMock[CFG_BOOL_ENABLE_RAM_QUEUE_JOURNAL] = true;
+    open();
+    EXPECT_FALSE(FileExists((name + ".journal").c_str()));
+    for (int i = 0; (i < 200) && (storage->GetRecordCount(EventLatency_Normal) == 0); i++)
+    {
+        PAL::sleep(10);
+    }
+    EXPECT_THAT(reserve(10), ElementsAre("critical"));
+
+    storage->Shutdown();
+    storage.reset();
+    EXPECT_FALSE(FileExists((name + ".journal").c_str()));
+}
+
+TEST_F(OfflineStorageHandlerTests, JournalSkipsAcknowledgedRecordsOnReplay)
+{
+    configMock[CFG_BOOL_ENABLE_RAM_QUEUE_JOURNAL] = true;
+    open();
+    storage->StoreRecord(StorageRecord("acked", "tenant", EventLatency_RealTime, EventPersistence_Critical, PAL::getUtcSystemTimeMs(), StorageBlob { 1, 2, 3 }));
+    storage->StoreRecord(StorageRecord("pending", "tenant", EventLatency_Normal, EventPersistence_Critical, PAL::getUtcSystemTimeMs(), StorageBlob { 1, 2, 3 }));
+    auto ids = reserve(1);
+    ASSERT_THAT(ids, ElementsAre("acked"));
+    bool fromMemory = storage->IsLastReadFromMemory();
+    storage->DeleteRecords(ids, HttpHeaders(), fromMemory);
+
+    // The record and its delete marker are both journaled
+    std::vector<StorageRecord> journaled;
+    for (int i = 0; (i < 200) && (journaled.size() < 3); i++)
+    {
+        PAL::sleep(10);
+        journaled.clear();
+        MemoryStorage::ReadSpillFile(name + ".journal", journaled);
+    }
+    ASSERT_EQ(3u, journaled.size());
+
+    // Crash: the journal is left behind
+    storage->Shutdown();
+    storage.reset();
+    std::FILE* journal = MemoryStorage::OpenSpillFile(name + ".journal");
+    ASSERT_NE(nullptr, journal);
+    std::vector<uint8_t> data;
+    for (auto const& record : journaled)
+    {
+        MemoryStorage::SerializeSpillRecord(record, data);
+    }
+    std::fwrite(data.data(), 1, data.size(), journal);
+    FileClose(journal);
+
+    open();
+    EXPECT_FALSE(FileExists((name + ".journal").c_str()));
+    for (int i = 0; (i < 200) && (storage->GetRecordCount(EventLatency_Normal) == 0); i++)
+    {
+        PAL::sleep(10);
+    }
+    EXPECT_THAT(reserve(10), ElementsAre("pending"));
+}
+
+#ifdef HAVE_MAT_ZLIB
+TEST_F(OfflineStorageHandlerTests, FlushKeepsRecordsCompressedInMemory)
+{
+    configMock[CFG_INT_RAM_COMPRESSED_SIZE] = 256 * 1024;
+    open();
+    // Telemetry payloads are highly redundant
+    StorageBlob payload(1000);
+    for (size_t i = 0; i < payload.size(); i++)
+    {
+        payload[i] = static_cast<uint8_t>("event"[i % 5]);
+    }
+    for (int i = 0; i < 100; i++)
+    {
+        storage->StoreRecord(StorageRecord("r" + std::to_string(i), "tenant", EventLatency_Normal, EventPersistence_Normal, PAL::getUtcSystemTimeMs(), StorageBlob(payload)));
+    }
+    storage->StoreRecord(StorageRecord("critical", "tenant", EventLatency_Normal, EventPersistence_Critical, PAL::getUtcSystemTimeMs(), StorageBlob(payload)));
+    size_t rawSize = storage->GetSize();
+
+    storage->Flush();
+    EXPECT_EQ(101u, storage->GetRecordCount(EventLatency_Normal));
+    EXPECT_LT(storage->GetSize(), rawSize);
+
+    // Only the critical record was written to disk, the rest is thawed for upload
+    auto ids = reserve(1000);
+    EXPECT_EQ(101u, ids.size());
+    EXPECT_EQ(1u, std::count(ids.begin(), ids.end(), "critical"));
+    bool fromMemory = storage->IsLastReadFromMemory();
+    storage->DeleteRecords(ids, HttpHeaders(), fromMemory);
+    EXPECT_EQ(0u, storage->GetRecordCount(EventLatency_Unspecified));
+}
+
+TEST_F(OfflineStorageHandlerTests, ThawedBatchNotUploadedGoesBackToTier)
+{
+    configMock[CFG_INT_RAM_COMPRESSED_SIZE] = 256 * 1024;
+    open();
+    for (int i = 0; i < 10; i++)
+    {
+        store("r" + std::to_string(i), EventLatency_Normal);
+    }
+    storage->Flush();
+    size_t compressedSize = storage->GetSize();
+
+    // A retrieval thaws the batch but takes none of its records
+    EXPECT_TRUE(reserve(0).empty());
+    storage->Flush();
+    EXPECT_EQ(10u, storage->GetRecordCount(EventLatency_Normal));
+    EXPECT_EQ(compressedSize, storage->GetSize());
+
+    auto ids = reserve(1000);
+    EXPECT_EQ(10u, std::set<StorageRecordId>(ids.begin(), ids.end()).size());
+}
+
+TEST_F(OfflineStorageHandlerTests, KillSwitchFiltersCompressedBatches)
+{
+    configMock[CFG_INT_RAM_COMPRESSED_SIZE] = 256 * 1024;
+    open();
+    for (int batch = 0; batch < 2; batch++)
+    {
+        for (int i = 0; i < 5; i++)
+        {
+            auto id = std::to_string(batch) + "-" + std::to_string(i);
+            storage->StoreRecord(StorageRecord("killed" + id, "killed", EventLatency_Normal, EventPersistence_Normal, PAL::getUtcSystemTimeMs(), StorageBlob { 1, 2, 3 }));
+            storage->StoreRecord(StorageRecord("kept" + id, "kept", EventLatency_Normal, EventPersistence_Normal, PAL::getUtcSystemTimeMs(), StorageBlob { 1, 2, 3 }));
+        }
+        storage->Flush();
+    }
+    EXPECT_EQ(20u, storage->GetRecordCount(EventLatency_Normal));
+
+    storage->DeleteRecords({ { "tenant_token", "killed" } });
+    EXPECT_EQ(10u, storage->GetRecordCount(EventLatency_Normal));
+    // Uploads thaw one batch at a time
+    auto ids = reserve(1000);
+    auto more = reserve(1000);
+    ids.insert(ids.end(), more.begin(), more.end());
+    EXPECT_EQ(10u, ids.size());
+    EXPECT_TRUE(std::all_of(ids.begin(), ids.end(), [](StorageRecordId const& id) { return id.compare(0, 4, "kept") == 0; }));
+}
+
+TEST_F(OfflineStorageHandlerTests, FullCompressedTierEvictsOldestBatchToDisk)
+{
+    configMock[CFG_INT_RAM_COMPRESSED_SIZE] = 1;
+    open();
+    store("first", EventLatency_Normal);
+    storage->Flush();
+    store("second", EventLatency_Normal);
+    storage->Flush();
+    EXPECT_EQ(2u, storage->GetRecordCount(EventLatency_Normal));
+
+    storage->Shutdown();
+    storage.reset();
+    open();
+    EXPECT_EQ(2u, storage->GetRecordCount(EventLatency_Normal));
+}
+#endif
+
+TEST(FlushControllerTests, ThresholdFollowsDiskThroughput)
+{
+    FlushController controller;
+    controller.Configure(1000, 100);
+    EXPECT_EQ(1000u, controller.GetFlushThreshold());
+
+    // 1000 B/s flushes 100 bytes in the target time, below the floor of 1/8 of the limit
+    controller.OnFlushCompleted(1000, 1000, 1000);
+    EXPECT_EQ(1000u, controller.GetDiskRate());
+    EXPECT_EQ(125u, controller.GetFlushThreshold());
+
+    // A fast disk takes the whole ram queue within the target time
+    controller.OnFlushCompleted(1000, 1, 2000);
+    EXPECT_EQ(1000u, controller.GetFlushThreshold());
+
+    // Disabled, the threshold stays at the limit
+    controller.Configure(1000, 0);
+    controller.OnFlushCompleted(1000, 1000, 3000);
+    EXPECT_EQ(1000u, controller.GetFlushThreshold());
+    EXPECT_FALSE(controller.UpdateBackpressure(5000));
+}
+
+TEST(FlushControllerTests, BackpressureWhileIncomingOutpacesDisk)
+{
+    FlushController controller;
+    controller.Configure(1000, 100);
+    controller.OnFlushCompleted(1000, 1000, 1000);
+    EXPECT_FALSE(controller.UpdateBackpressure(500));
+
+    // 5000 B/s arrive while the disk takes 1000 B/s
+    controller.OnRecordStored(5000);
+    controller.OnFlushCompleted(100, 100, 2000);
+    EXPECT_EQ(5000u, controller.GetIncomingRate());
+    EXPECT_TRUE(controller.UpdateBackpressure(200));
+    EXPECT_TRUE(controller.IsBackpressured());
+
+    // Released only once the ram queue is below half the threshold
+    EXPECT_FALSE(controller.UpdateBackpressure(100));
+    EXPECT_TRUE(controller.UpdateBackpressure(50));
+    EXPECT_FALSE(controller.IsBackpressured());
+
+    // Above the limit is backpressure regardless of the rates
+    controller.Configure(1000, 100);
+    EXPECT_TRUE(controller.UpdateBackpressure(1001));
+}
@@ -20,6 +20,8 @@
 #include <functional>
 #include <string>
 #include <fstream>
+#include <set>
+#include <thread>
 #ifdef ANDROID
 #include <http/HttpClient_Android.hpp>
 #endif
@@ -513,6 +515,76 @@ TEST_P(OfflineStorageTestsRoom, ReleaseActuallyReleases) {
             );
 }
 
+TEST_P(OfflineStorageTestsRoom, RecordCountsTrackMutations)
+{
+    PopulateRecords();
+    EXPECT_EQ(10, offlineStorage->GetRecordCount(EventLatency_Normal));
+    EXPECT_EQ(10, offlineStorage->GetRecordCount(EventLatency_RealTime));
+
+    // Upload and delete half of the RealTime records
+    std::vector<StorageRecordId> ids;
+    offlineStorage->GetAndReserveRecords(
+            [&ids] (StorageRecord && record)->bool
+            {
+                if (ids.size() >= 5) {
+                    return false;
+                }
+                ids.push_back(record.id);
+                return true;
+            }, 5000, EventLatency_RealTime
+            );
+    ASSERT_EQ(5, ids.size());
+    HttpHeaders h;
+    bool fromMemory = (implementation == StorageImplementation::Memory);
+    offlineStorage->DeleteRecords(ids, h, fromMemory);
+    EXPECT_EQ(10, offlineStorage->GetRecordCount(EventLatency_Normal));
+    EXPECT_EQ(5, offlineStorage->GetRecordCount(EventLatency_RealTime));
+    EXPECT_EQ(15, offlineStorage->GetRecordCount(EventLatency_Unspecified));
+
+    // Failed upload puts records back
+    ids.clear();
+    offlineStorage->GetAndReserveRecords(
+            [&ids] (StorageRecord && record)->bool
+            {
+                ids.push_back(record.id);
+                return ids.size() < 2;
+            }, 5000, EventLatency_RealTime
+            );
+    offlineStorage->ReleaseRecords(ids, false, h, fromMemory);
+    EXPECT_EQ(5, offlineStorage->GetRecordCount(EventLatency_RealTime));
+
+    offlineStorage->DeleteRecords({{ "latency", std::to_string(EventLatency_Normal) }});
+    EXPECT_EQ(0, offlineStorage->GetRecordCount(EventLatency_Normal));
+    EXPECT_EQ(5, offlineStorage->GetRecordCount(EventLatency_Unspecified));
+
+    offlineStorage->DeleteAllRecords();
+    EXPECT_EQ(0, offlineStorage->GetRecordCount(EventLatency_Unspecified));
+}
+
+TEST_P(OfflineStorageTestsRoom, StoringStoredRecordAgainKeepsItOnce)
+{
+    if (implementation != StorageImplementation::SQLite) {
+        return;
+    }
+    auto now = PAL::getUtcSystemTimeMs();
+    offlineStorage->StoreRecord(StorageRecord("Fred-0", "Fred", EventLatency_Normal, EventPersistence_Normal, now, StorageBlob {1}));
+    offlineStorage->StoreRecord(StorageRecord("Fred-1", "Fred", EventLatency_Normal, EventPersistence_Normal, now, StorageBlob {2}));
+    // Journal replay and spill re-import store ids that may be on disk already
+    offlineStorage->StoreRecord(StorageRecord("Fred-0", "Fred", EventLatency_RealTime, EventPersistence_Normal, now, StorageBlob {3}));
+    EXPECT_EQ(2, offlineStorage->GetRecordCount(EventLatency_Unspecified));
+    EXPECT_EQ(2, offlineStorage->GetRecordCount(EventLatency_Normal));
+
+    // The stored event is kept and uploaded once
+    std::vector<StorageRecord> records;
+    offlineStorage->GetAndReserveRecords([&records](StorageRecord&& record)->bool {
+        records.push_back(std::move(record));
+        return true;
+    }, 5000);
+    ASSERT_EQ(2u, records.size());
+    EXPECT_EQ("Fred-0", records[0].id);
+    EXPECT_EQ(StorageBlob {1}, records[0].blob);
+}
+
 TEST_P(OfflineStorageTestsRoom, DeleteByToken)
 {
     StorageRecordVector records;
@@ -535,6 +607,38 @@ TEST_P(OfflineStorageTestsRoom, DeleteByToken)
     EXPECT_EQ(800, offlineStorage->GetRecordCount());
 }
 
+TEST_P(OfflineStorageTestsRoom, ExcludedTenantsAreSkippedWithoutReserving)
+{
+    if (implementation == StorageImplementation::Room) {
+        // Room reserves what it selects, the packager ends the package instead
+        return;
+    }
+    StorageRecordVector records;
+    auto now = PAL::getUtcSystemTimeMs();
+    // The events of the tenant over its upload rate are the oldest ones
+    for (int i = 0; i < 3; ++i) {
+        records.emplace_back("Limited-" + std::to_string(i), "limited", EventLatency_Normal, EventPersistence_Normal, now + i, StorageBlob {1, 2, 3});
+    }
+    for (int i = 0; i < 3; ++i) {
+        records.emplace_back("Unlimited-" + std::to_string(i), "unlimited", EventLatency_Normal, EventPersistence_Normal, now + 10 + i, StorageBlob {1, 2, 3});
+    }
+    offlineStorage->StoreRecords(records);
+
+    std::vector<std::string> ids;
+    auto consumer = [&ids](StorageRecord&& record)->bool {
+        ids.push_back(record.id);
+        return true;
+    };
+    // The other tenant keeps uploading while the limited one is in debt
+    EXPECT_TRUE(offlineStorage->GetAndReserveRecords(consumer, 5000, EventLatency_Unspecified, 0, { "limited" }));
+    EXPECT_THAT(ids, UnorderedElementsAre("Unlimited-0", "Unlimited-1", "Unlimited-2"));
+
+    // Skipped events were not reserved
+    ids.clear();
+    EXPECT_TRUE(offlineStorage->GetAndReserveRecords(consumer, 5000));
+    EXPECT_THAT(ids, UnorderedElementsAre("Limited-0", "Limited-1", "Limited-2"));
+}
+
 TEST_P(OfflineStorageTestsRoom, ResizeDB)
 {
     if (implementation == StorageImplementation::Memory) {
@@ -558,6 +662,10 @@ TEST_P(OfflineStorageTestsRoom, ResizeDB)
         index += 1;
     }
     auto preCount = offlineStorage->GetRecordCount();
+    if (implementation == StorageImplementation::SQLite) {
+        EXPECT_CALL(observerMock, OnStorageTrimmed(Contains(Key("TenantFred"))))
+            .Times(1);
+    }
     offlineStorage->ResizeDb();
     auto postCount = offlineStorage->GetRecordCount();
     EXPECT_GT(preCount, postCount);
@@ -604,6 +712,544 @@ TEST_P(OfflineStorageTestsRoom, StoreManyRecords)
     EXPECT_EQ(blocks * blockSize, offlineStorage->GetRecordCount());
 }
 
+TEST(OfflineStorageTestsSQLite, ResizeDbTrimsInBudgetedSteps)
+{
+    NullLogManager nullLogManager;
+    NiceMock<MockIOfflineStorageObserver> observerMock;
+    ILogConfiguration config;
+    MockIRuntimeConfig configMock(config);
+    constexpr unsigned sizeLimit = 64 * 4096;
+    EXPECT_CALL(configMock, GetOfflineStorageMaximumSizeBytes()).WillRepeatedly(Return(sizeLimit));
+    std::ostringstream name;
+    name << MAE::GetTempDirectory() << "OfflineStorageTestsSQLiteTrim.db";
+    std::remove(name.str().c_str());
+    configMock[CFG_STR_CACHE_FILE_PATH] = name.str();
+    configMock[CFG_INT_DB_TRIM_PAGE_BUDGET] = 4;
+
+    MAE::OfflineStorage_SQLite storage(nullLogManager, configMock);
+    storage.Initialize(observerMock);
+
+    auto now = PAL::getUtcSystemTimeMs();
+    StorageRecord record("", "TenantFred", EventLatency_Normal, EventPersistence_Normal, now, StorageBlob(200, 7));
+    size_t index = 1;
+    while (storage.GetSize() <= 2 * sizeLimit) {
+        record.id = std::to_string(index++);
+        storage.StoreRecord(record);
+    }
+
+    // A single step frees no more than the page budget
+    auto preSize = storage.GetSize();
+    auto preCount = storage.GetRecordCount(EventLatency_Unspecified);
+    EXPECT_TRUE(storage.ResizeDb());
+    EXPECT_GT(preCount, storage.GetRecordCount(EventLatency_Unspecified));
+    EXPECT_GT(storage.GetSize(), sizeLimit);
+    EXPECT_LT(preSize - storage.GetSize(), 2 * 4 * 4096u);
+
+    // Repeated steps bring the database back under its limit
+    size_t steps = 1;
+    while (storage.ResizeDb()) {
+        ASSERT_LT(++steps, 1000u);
+    }
+    EXPECT_LE(storage.GetSize(), sizeLimit);
+    EXPECT_LT(0u, storage.GetRecordCount(EventLatency_Unspecified));
+
+    storage.Shutdown();
+    std::remove(name.str().c_str());
+}
+
+TEST(OfflineStorageTestsSQLite, StoreRecordTrimsOnTrimThread)
+{
+    NullLogManager nullLogManager;
+    NiceMock<MockIOfflineStorageObserver> observerMock;
+    ILogConfiguration config;
+    MockIRuntimeConfig configMock(config);
+    constexpr unsigned sizeLimit = 64 * 4096;
+    EXPECT_CALL(configMock, GetOfflineStorageMaximumSizeBytes()).WillRepeatedly(Return(sizeLimit));
+    std::ostringstream name;
+    name << MAE::GetTempDirectory() << "OfflineStorageTestsSQLiteTrimThread.db";
+    std::remove(name.str().c_str());
+    configMock[CFG_STR_CACHE_FILE_PATH] = name.str();
+    configMock[CFG_INT_DB_TRIM_PAGE_BUDGET] = 4;
+    configMock[CFG_BOOL_ENABLE_DB_DROP_IF_FULL] = true;
+
+    std::atomic<size_t> trimmedCount(0);
+    auto testThread = std::this_thread::get_id();
+    EXPECT_CALL(observerMock, OnStorageTrimmed(_))
+        .WillRepeatedly(Invoke([&](std::map<std::string, size_t> const& numRecords) {
+            EXPECT_NE(testThread, std::this_thread::get_id());
+            for (auto const& kv : numRecords) {
+                trimmedCount += kv.second;
+            }
+        }));
+
+    MAE::OfflineStorage_SQLite storage(nullLogManager, configMock);
+    storage.Initialize(observerMock);
+
+    auto now = PAL::getUtcSystemTimeMs();
+    StorageRecord record("", "TenantFred", EventLatency_Normal, EventPersistence_Normal, now, StorageBlob(200, 7));
+    for (size_t index = 1; index <= 4000; index++) {
+        record.id = std::to_string(index);
+        EXPECT_TRUE(storage.StoreRecord(record));
+    }
+
+    // The trim steps posted by the producer bring the database back under its limit
+    for (int i = 0; (i < 500) && (storage.GetSize() > sizeLimit); i++) {
+        PAL::sleep(10);
+    }
+    EXPECT_LE(storage.GetSize(), sizeLimit);
+    EXPECT_LT(0u, trimmedCount.load());
+
+    storage.Shutdown();
+    std::remove(name.str().c_str());
+}
+
+TEST(OfflineStorageTestsSQLite, ResizeDbTrimsTenantOverQuotaFirst)
+{
+    NullLogManager nullLogManager;
+    NiceMock<MockIOfflineStorageObserver> observerMock;
+    ILogConfiguration config;
+    MockIRuntimeConfig configMock(config);
+    constexpr unsigned sizeLimit = 64 * 4096;
+    EXPECT_CALL(configMock, GetOfflineStorageMaximumSizeBytes()).WillRepeatedly(Return(sizeLimit));
+    std::ostringstream name;
+    name << MAE::GetTempDirectory() << "OfflineStorageTestsSQLiteQuota.db";
+    std::remove(name.str().c_str());
+    configMock[CFG_STR_CACHE_FILE_PATH] = name.str();
+    configMock[CFG_INT_TENANT_QUOTA_PCT] = 50;
+
+    std::map<std::string, size_t> trimmed;
+    EXPECT_CALL(observerMock, OnStorageTrimmed(_))
+        .WillRepeatedly(Invoke([&](std::map<std::string, size_t> const& numRecords) {
+            for (auto const& kv : numRecords) {
+                trimmed[kv.first] += kv.second;
+            }
+        }));
+
+    MAE::OfflineStorage_SQLite storage(nullLogManager, configMock);
+    storage.Initialize(observerMock);
+
+    // The quiet tenant owns the oldest events, which default order would evict first
+    auto now = PAL::getUtcSystemTimeMs();
+    StorageRecord record("", "TenantQuiet", EventLatency_Normal, EventPersistence_Normal, now, StorageBlob(200, 7));
+    size_t index = 1;
+    for (int i = 0; i < 20; i++) {
+        record.id = std::to_string(index++);
+        storage.StoreRecord(record);
+    }
+    record.tenantToken = "TenantChatty";
+    while (storage.GetSize() <= 2 * sizeLimit) {
+        record.id = std::to_string(index++);
+        record.timestamp++;
+        storage.StoreRecord(record);
+    }
+
+    size_t steps = 0;
+    while (storage.ResizeDb()) {
+        ASSERT_LT(++steps, 1000u);
+    }
+    EXPECT_LE(storage.GetSize(), sizeLimit);
+    EXPECT_LT(0u, trimmed["TenantChatty"]);
+    EXPECT_EQ(0u, trimmed.count("TenantQuiet"));
+    // Counters are kept up to date by the trim steps
+    EXPECT_EQ(index - 1 - trimmed["TenantChatty"], storage.GetRecordCount(EventLatency_Unspecified));
+
+    storage.Shutdown();
+    std::remove(name.str().c_str());
+}
+
+TEST(OfflineStorageTestsSQLite, LeasesExpireWithoutTableScan)
+{
+    NullLogManager nullLogManager;
+    NiceMock<MockIOfflineStorageObserver> observerMock;
+    ILogConfiguration config;
+    MockIRuntimeConfig configMock(config);
+    EXPECT_CALL(configMock, GetOfflineStorageMaximumSizeBytes()).WillRepeatedly(Return(1024 * 1024));
+    std::ostringstream name;
+    name << MAE::GetTempDirectory() << "OfflineStorageTestsSQLiteLeases.db";
+    std::remove(name.str().c_str());
+    configMock[CFG_STR_CACHE_FILE_PATH] = name.str();
+
+    auto now = PAL::getUtcSystemTimeMs();
+    std::vector<StorageRecord> reserved;
+    auto reserve = [&reserved](MAE::OfflineStorage_SQLite& storage, unsigned leaseTimeMs)
+    {
+        reserved.clear();
+        storage.GetAndReserveRecords([&reserved](StorageRecord&& record)->bool {
+            reserved.push_back(std::move(record));
+            return true;
+        }, leaseTimeMs);
+    };
+
+    {
+        MAE::OfflineStorage_SQLite storage(nullLogManager, configMock);
+        storage.Initialize(observerMock);
+        storage.StoreRecord(StorageRecord("Fred", "George", EventLatency_Normal, EventPersistence_Normal, now, StorageBlob {1, 2, 3}));
+
+        // An expired lease is released with its retry count incremented
+        reserve(storage, 0);
+        ASSERT_EQ(1u, reserved.size());
+        EXPECT_EQ(0, reserved[0].retryCount);
+        reserve(storage, 60000);
+        ASSERT_EQ(1u, reserved.size());
+        EXPECT_EQ(1, reserved[0].retryCount);
+
+        // A live lease keeps the record reserved
+        reserve(storage, 60000);
+        EXPECT_EQ(0u, reserved.size());
+        storage.Shutdown();
+    }
+
+    {
+        // Leases do not survive the session that took them
+        MAE::OfflineStorage_SQLite storage(nullLogManager, configMock);
+        storage.Initialize(observerMock);
+        reserve(storage, 60000);
+        ASSERT_EQ(1u, reserved.size());
+        EXPECT_EQ(2, reserved[0].retryCount);
+        storage.Shutdown();
+    }
+    std::remove(name.str().c_str());
+}
+
+TEST(OfflineStorageTestsSQLite, AcknowledgedRecordsAreDeletedInBatches)
+{
+    NullLogManager nullLogManager;
+    NiceMock<MockIOfflineStorageObserver> observerMock;
+    ILogConfiguration config;
+    MockIRuntimeConfig configMock(config);
+    EXPECT_CALL(configMock, GetOfflineStorageMaximumSizeBytes()).WillRepeatedly(Return(1024 * 1024));
+    std::ostringstream name;
+    name << MAE::GetTempDirectory() << "OfflineStorageTestsSQLiteTombstones.db";
+    std::remove(name.str().c_str());
+    configMock[CFG_STR_CACHE_FILE_PATH] = name.str();
+    configMock[CFG_INT_DB_DELETE_BATCH_SIZE] = 4;
+    configMock[CFG_INT_DB_DELETE_BATCH_INTERVAL] = 60000;
+
+    auto now = PAL::getUtcSystemTimeMs();
+    std::vector<StorageRecordId> reserved;
+    auto reserve = [&reserved](MAE::OfflineStorage_SQLite& storage, unsigned leaseTimeMs)
+    {
+        reserved.clear();
+        storage.GetAndReserveRecords([&reserved](StorageRecord&& record)->bool {
+            reserved.push_back(record.id);
+            return true;
+        }, leaseTimeMs);
+    };
+    HttpHeaders headers;
+    bool fromMemory = false;
+
+    {
+        MAE::OfflineStorage_SQLite storage(nullLogManager, configMock);
+        storage.Initialize(observerMock);
+        for (int i = 1; i <= 6; i++) {
+            storage.StoreRecord(StorageRecord(std::to_string(i), "George", EventLatency_Normal, EventPersistence_Normal, now + i, StorageBlob {1, 2, 3}));
+        }
+
+        // Tombstones are neither counted nor uploaded again once their lease expires
+        reserve(storage, 0);
+        ASSERT_EQ(6u, reserved.size());
+        storage.DeleteRecords({ "1", "2" }, headers, fromMemory);
+        EXPECT_EQ(4u, storage.GetRecordCount(EventLatency_Unspecified));
+        reserve(storage, 60000);
+        EXPECT_THAT(reserved, ElementsAre("3", "4", "5", "6"));
+
+        // Reaching the batch size deletes all of them at once
+        storage.DeleteRecords({ "3", "4", "5" }, headers, fromMemory);
+        EXPECT_EQ(1u, storage.GetRecordCount(EventLatency_Unspecified));
+        storage.Shutdown();
+    }
+
+    {
+        MAE::OfflineStorage_SQLite storage(nullLogManager, configMock);
+        storage.Initialize(observerMock);
+        EXPECT_EQ(1u, storage.GetRecordCount(EventLatency_Unspecified));
+        reserve(storage, 60000);
+        EXPECT_THAT(reserved, ElementsAre("6"));
+
+        // Pending tombstones are deleted on shutdown
+        storage.DeleteRecords({ "6" }, headers, fromMemory);
+        storage.Shutdown();
+    }
+
+    {
+        MAE::OfflineStorage_SQLite storage(nullLogManager, configMock);
+        storage.Initialize(observerMock);
+        EXPECT_EQ(0u, storage.GetRecordCount(EventLatency_Unspecified));
+        storage.Shutdown();
+    }
+    std::remove(name.str().c_str());
+}
+
+TEST(OfflineStorageTestsSQLite, ConcurrentIngestAndDrain)
+{
+    // Ingestion and upload-side scans race each other on one or two connections,
+    // every event must be drained exactly once either way
+    for (bool readerConnection : { false, true })
+    {
+        NullLogManager nullLogManager;
+        NiceMock<MockIOfflineStorageObserver> observerMock;
+        ILogConfiguration config;
+        MockIRuntimeConfig configMock(config);
+        EXPECT_CALL(configMock, GetOfflineStorageMaximumSizeBytes()).WillRepeatedly(Return(64 * 1024 * 1024));
+        std::ostringstream name;
+        name << MAE::GetTempDirectory() << "OfflineStorageTestsSQLiteContention.db";
+        std::remove(name.str().c_str());
+        configMock[CFG_STR_CACHE_FILE_PATH] = name.str();
+        configMock[CFG_BOOL_ENABLE_DB_READER_CONNECTION] = readerConnection;
+
+        MAE::OfflineStorage_SQLite storage(nullLogManager, configMock);
+        storage.Initialize(observerMock);
+
+        constexpr size_t count = 2000;
+        std::atomic<bool> ingesting(true);
+        std::thread producer([&]() {
+            auto now = PAL::getUtcSystemTimeMs();
+            for (size_t i = 0; i < count; i++)
+            {
+                storage.StoreRecord(StorageRecord(std::to_string(i), "TenantFred", EventLatency_Normal, EventPersistence_Normal, now, StorageBlob(100, 1)));
+            }
+            ingesting = false;
+        });
+
+        std::set<std::string> drained;
+        size_t duplicates = 0;
+        auto drain = [&]() {
+            std::vector<StorageRecordId> ids;
+            storage.GetAndReserveRecords([&](StorageRecord&& record)->bool {
+                ids.push_back(record.id);
+                return ids.size() < 50;
+            }, 60000);
+            for (auto const& id : ids)
+            {
+                duplicates += drained.count(id);
+                drained.insert(id);
+            }
+            bool fromMemory = false;
+            storage.DeleteRecords(ids, HttpHeaders(), fromMemory);
+            return !ids.empty();
+        };
+        while (ingesting)
+        {
+            drain();
+        }
+        producer.join();
+        while (drain())
+        {
+        }
+
+        EXPECT_EQ(0u, duplicates);
+        EXPECT_EQ(count, drained.size());
+        EXPECT_EQ(0u, storage.GetRecordCount(EventLatency_Unspecified));
+        storage.Shutdown();
+        std::remove(name.str().c_str());
+    }
+}
+
+TEST(OfflineStorageTestsSQLite, KillSwitchDuringReaderScanDoesNotLeaseDeletedRecords)
+{
+    // Records deleted between the reader scan and the reservation are never handed out,
+    // so their acknowledgement cannot take them off the record counts a second time
+    NullLogManager nullLogManager;
+    NiceMock<MockIOfflineStorageObserver> observerMock;
+    ILogConfiguration config;
+    MockIRuntimeConfig configMock(config);
+    EXPECT_CALL(configMock, GetOfflineStorageMaximumSizeBytes()).WillRepeatedly(Return(64 * 1024 * 1024));
+    std::ostringstream name;
+    name << MAE::GetTempDirectory() << "OfflineStorageTestsSQLiteKillSwitch.db";
+    std::remove(name.str().c_str());
+    configMock[CFG_STR_CACHE_FILE_PATH] = name.str();
+    configMock[CFG_BOOL_ENABLE_DB_READER_CONNECTION] = true;
+
+    MAE::OfflineStorage_SQLite storage(nullLogManager, configMock);
+    storage.Initialize(observerMock);
+
+    constexpr size_t count = 2000;
+    auto now = PAL::getUtcSystemTimeMs();
+    for (size_t i = 0; i < count; i++)
+    {
+        storage.StoreRecord(StorageRecord(std::to_string(i), (i % 2) ? "TenantFred" : "TenantKilled", EventLatency_Normal, EventPersistence_Normal, now + i, StorageBlob(100, 1)));
+    }
+
+    std::atomic<bool> draining(true);
+    std::thread killer([&]() {
+        while (draining)
+        {
+            storage.DeleteRecords({ { "tenant_token", "TenantKilled" } });
+        }
+    });
+
+    std::set<std::string> drained;
+    for (;;)
+    {
+        std::vector<StorageRecordId> ids;
+        storage.GetAndReserveRecords([&](StorageRecord&& record)->bool {
+            ids.push_back(record.id);
+            return ids.size() < 50;
+        }, 60000);
+        if (ids.empty())
+        {
+            break;
+        }
+        drained.insert(ids.begin(), ids.end());
+        bool fromMemory = false;
+        storage.DeleteRecords(ids, HttpHeaders(), fromMemory);
+    }
+    draining = false;
+    killer.join();
+
+    for (size_t i = 1; i < count; i += 2)
+    {
+        EXPECT_EQ(1u, drained.count(std::to_string(i)));
+    }
+    EXPECT_EQ(0u, storage.GetRecordCount(EventLatency_Unspecified));
+    EXPECT_EQ(0u, storage.GetRecords(false, EventLatency_Unspecified).size());
+    storage.Shutdown();
+    std::remove(name.str().c_str());
+}
+
+#ifdef HAVE_MAT_ZLIB
+TEST(OfflineStorageTestsSQLite, CompressedPayloads)
+{
+    NullLogManager nullLogManager;
+    NiceMock<MockIOfflineStorageObserver> observerMock;
+    auto now = PAL::getUtcSystemTimeMs();
+
+    // Bond-like payload: repeated field names with a few varying bytes
+    StorageBlob blob;
+    for (size_t i = 0; blob.size() < 4096; i++) {
+        for (char c : std::string("ext.app.name=TestApp;ext.device.id=")) {
+            blob.push_back(static_cast<uint8_t>(c));
+        }
+        blob.push_back(static_cast<uint8_t>(i));
+    }
+
+    size_t sizes[2] = {};
+    for (bool compress : {false, true}) {
+        ILogConfiguration config;
+        MockIRuntimeConfig configMock(config);
+        EXPECT_CALL(configMock, GetOfflineStorageMaximumSizeBytes()).WillRepeatedly(Return(32 * 1024 * 1024));
+        std::ostringstream name;
+        name << MAE::GetTempDirectory() << "OfflineStorageTestsSQLiteCompressed.db";
+        std::remove(name.str().c_str());
+        configMock[CFG_STR_CACHE_FILE_PATH] = name.str();
+        configMock[CFG_BOOL_ENABLE_DB_COMPRESS] = compress;
+
+        MAE::OfflineStorage_SQLite storage(nullLogManager, configMock);
+        storage.Initialize(observerMock);
+
+        StorageRecordVector records;
+        for (size_t i = 0; i < 256; ++i) {
+            records.emplace_back("Compressed-" + std::to_string(i), "Fred-Doom-Token23",
+                EventLatency_Normal, EventPersistence_Normal, now, StorageBlob(blob));
+        }
+        EXPECT_EQ(records.size(), storage.StoreRecords(records));
+        sizes[compress] = storage.GetSize();
+
+        // Payloads are restored transparently on read
+        size_t count = 0;
+        storage.GetAndReserveRecords([&](StorageRecord&& record)->bool {
+            EXPECT_EQ(blob, record.blob);
+            ++count;
+            return true;
+        }, 1000);
+        EXPECT_EQ(records.size(), count);
+        for (auto const& record : storage.GetRecords(true, EventLatency_Unspecified, 0)) {
+            EXPECT_EQ(blob, record.blob);
+        }
+
+        storage.Shutdown();
+        std::remove(name.str().c_str());
+    }
+    EXPECT_LT(sizes[true] * 4, sizes[false]);
+}
+
+TEST(OfflineStorageTestsSQLite, GetRecordsDropsUndecodablePayloads)
+{
+    NullLogManager nullLogManager;
+    NiceMock<MockIOfflineStorageObserver> observerMock;
+    ILogConfiguration config;
+    MockIRuntimeConfig configMock(config);
+    EXPECT_CALL(configMock, GetOfflineStorageMaximumSizeBytes()).WillRepeatedly(Return(32 * 1024 * 1024));
+    std::ostringstream name;
+    name << MAE::GetTempDirectory() << "OfflineStorageTestsSQLiteCorrupt.db";
+    std::remove(name.str().c_str());
+    configMock[CFG_STR_CACHE_FILE_PATH] = name.str();
+    configMock[CFG_BOOL_ENABLE_DB_COMPRESS] = true;
+
+    MAE::OfflineStorage_SQLite storage(nullLogManager, configMock);
+    storage.Initialize(observerMock);
+
+    auto now = PAL::getUtcSystemTimeMs();
+    StorageBlob blob(4096, 'x');
+    StorageRecordVector records;
+    for (size_t i = 0; i < 3; ++i) {
+        records.emplace_back("Compressed-" + std::to_string(i), "Fred-Doom-Token23",
+            EventLatency_Normal, EventPersistence_Normal, now, StorageBlob(blob));
+    }
+    EXPECT_EQ(records.size(), storage.StoreRecords(records));
+    storage.Execute("UPDATE events SET payload=x'01020304050607' WHERE record_id='Compressed-1'");
+
+    std::map<std::string, size_t> dropped = { { "Fred-Doom-Token23", 1 } };
+    EXPECT_CALL(observerMock, OnStorageRecordsDropped(dropped)).Times(1);
+    auto read = storage.GetRecords(false, EventLatency_Unspecified, 0);
+    ASSERT_EQ(2u, read.size());
+    for (auto const& record : read) {
+        EXPECT_NE("Compressed-1", record.id);
+        EXPECT_EQ(blob, record.blob);
+    }
+    EXPECT_EQ(2u, storage.GetRecordCount(EventLatency_Unspecified));
+
+    storage.Shutdown();
+    std::remove(name.str().c_str());
+}
+#endif
+
+TEST(OfflineStorageTestsSQLite, FairPackingInterleavesTenantsByWeight)
+{
+    NullLogManager nullLogManager;
+    NiceMock<MockIOfflineStorageObserver> observerMock;
+    auto now = PAL::getUtcSystemTimeMs();
+
+    for (bool fair : {false, true}) {
+        ILogConfiguration config;
+        MockIRuntimeConfig configMock(config);
+        EXPECT_CALL(configMock, GetOfflineStorageMaximumSizeBytes()).WillRepeatedly(Return(32 * 1024 * 1024));
+        std::ostringstream name;
+        name << MAE::GetTempDirectory() << "OfflineStorageTestsSQLiteFair.db";
+        std::remove(name.str().c_str());
+        configMock[CFG_STR_CACHE_FILE_PATH] = name.str();
+        configMock[CFG_BOOL_ENABLE_FAIR_PACKING] = fair;
+        configMock[CFG_MAP_TENANT_UPLOAD_WEIGHTS] = { { "Quiet'Tenant", 2 } };
+
+        MAE::OfflineStorage_SQLite storage(nullLogManager, configMock);
+        storage.Initialize(observerMock);
+
+        // The chatty tenant owns the oldest events, which default order would send first
+        StorageRecordVector records;
+        for (int i = 0; i < 20; ++i) {
+            records.emplace_back("Chatty-" + std::to_string(i), "ChattyTenant", EventLatency_Normal, EventPersistence_Normal, now + i, StorageBlob(16));
+        }
+        for (int i = 0; i < 4; ++i) {
+            records.emplace_back("Quiet-" + std::to_string(i), "Quiet'Tenant", EventLatency_Normal, EventPersistence_Normal, now + 100 + i, StorageBlob(16));
+        }
+        EXPECT_EQ(records.size(), storage.StoreRecords(records));
+
+        std::vector<std::string> ids;
+        storage.GetAndReserveRecords([&](StorageRecord&& record)->bool {
+            ids.push_back(record.id);
+            return true;
+        }, 1000, EventLatency_Unspecified, 6);
+        if (fair) {
+            EXPECT_THAT(ids, ElementsAre("Quiet-0", "Chatty-0", "Quiet-1", "Quiet-2", "Chatty-1", "Quiet-3"));
+        } else {
+            EXPECT_THAT(ids, ElementsAre("Chatty-0", "Chatty-1", "Chatty-2", "Chatty-3", "Chatty-4", "Chatty-5"));
+        }
+
+        storage.Shutdown();
+        std::remove(name.str().c_str());
+    }
+}
+
 #ifdef ANDROID
 auto values = Values(StorageImplementation::Room, StorageImplementation::SQLite, StorageImplementation::Memory);
 #else
@@ -95,6 +95,8 @@ TEST_F(PackagerTests, PackagesEventsByTenant)
     EXPECT_THAT(ctx->packageIds, SizeIs(2));
     EXPECT_THAT(ctx->packageIds, Contains(Key("tenant1-token")));
     EXPECT_THAT(ctx->packageIds, Contains(Key("tenant2-token")));
+    EXPECT_THAT(ctx->recordIdsAndTenantIds, Contains(Pair("r1", internTenantToken("tenant1-token"))));
+    EXPECT_THAT(ctx->recordIdsAndTenantIds, Contains(Pair("r2", internTenantToken("tenant2-token"))));
 }
 
 TEST_F(PackagerTests, UsesPriorityOfTheFirstEvent)
@@ -130,6 +132,7 @@ TEST_F(PackagerTests, HonorsMaximumPackageSize)
     }
     EXPECT_THAT(i, 4);
     EXPECT_THAT(wantMore, false);
+    EXPECT_THAT(ctx->packageFull, true);
 
     EXPECT_CALL(*this, resultPackagedEvents(ctx))
         .WillOnce(Return());
@@ -238,3 +241,103 @@ TEST_F(PackagerTests, ForcedTenantIsForced)
     ASSERT_THAT(r.TokenToDataPackagesMap["forced-tenant-token"][0].Records, SizeIs(3));
 */
 }
+
+TEST_F(PackagerTests, RetryOfSameRecordsResendsCachedBody)
+{
+    // The retry cache is off by default
+    runtimeConfigMock[CFG_MAP_TPM][CFG_INT_TPM_RETRY_CACHE_SIZE] = 1048576;
+    Packager cachingPackager(runtimeConfigMock);
+    cachingPackager.packagedEvents >> packagedEvents;
+    runtimeConfigMock[CFG_MAP_TPM][CFG_INT_TPM_RETRY_CACHE_SIZE] = 0;
+
+    StorageRecord record1("r1", "tenant1-token", EventLatency_Normal, EventPersistence_Normal, 1234567890, std::vector<uint8_t>{1, 1, 1, 0});
+    StorageRecord record2("r2", "tenant2-token", EventLatency_Normal, EventPersistence_Normal, 1234567891, std::vector<uint8_t>{2, 2, 2, 0});
+    auto package = [this, &cachingPackager](std::vector<StorageRecord> const& records)
+    {
+        auto ctx = std::make_shared<EventsUploadContext>();
+        ctx->maxUploadSize = 100000;
+        bool wantMore = true;
+        for (auto const& record : records)
+        {
+            cachingPackager.addEventToPackage(ctx, record, wantMore);
+        }
+        EXPECT_CALL(*this, resultPackagedEvents(ctx))
+            .WillOnce(Return());
+        cachingPackager.finalizePackage(ctx);
+        return ctx;
+    };
+    std::vector<uint8_t> const sentBody{ 9, 8, 7 };
+    auto fail = [&cachingPackager, &sentBody](EventsUploadContextPtr const& ctx)
+    {
+        ctx->compressed = true;
+        ctx->httpRequest = new SimpleHttpRequest("failed");
+        ctx->httpRequest->GetBody() = sentBody;
+        cachingPackager.retainPackage(ctx);
+    };
+
+    auto ctx = package({ record1, record2 });
+    EXPECT_THAT(ctx->fromRetryCache, false);
+    fail(ctx);
+
+    // A different set of records is packaged again
+    auto other = package({ record1 });
+    EXPECT_THAT(other->fromRetryCache, false);
+    EXPECT_THAT(other->body, Ne(sentBody));
+
+    // The same set resends the body of the failed upload as is
+    auto retry = package({ record2, record1 });
+    EXPECT_THAT(retry->fromRetryCache, true);
+    EXPECT_THAT(retry->compressed, true);
+    EXPECT_THAT(retry->body, Eq(sentBody));
+
+    // Taken by the retry
+    EXPECT_THAT(package({ record1, record2 })->fromRetryCache, false);
+
+    // Deleting any of the records drops the body
+    fail(retry);
+    cachingPackager.forgetPackage(other);
+    EXPECT_THAT(package({ record1, record2 })->fromRetryCache, false);
+}
+
+TEST_F(PackagerTests, DeferredTenantEndsPackage)
+{
+    auto ctx = std::make_shared<EventsUploadContext>();
+    ctx->maxUploadSize = 100000;
+    ctx->deferredTenants = { "tenant2-token" };
+
+    bool wantMore = true;
+    StorageRecord record1("r1", "tenant1-token", EventLatency_Normal, EventPersistence_Normal, 1234567890, std::vector<uint8_t>{1, 1, 1, 0});
+    packager.addEventToPackage(ctx, record1, wantMore);
+    EXPECT_THAT(wantMore, true);
+    StorageRecord record2("r2", "tenant2-token", EventLatency_Normal, EventPersistence_Normal, 1234567891, std::vector<uint8_t>{2, 2, 2, 0});
+    packager.addEventToPackage(ctx, record2, wantMore);
+    EXPECT_THAT(wantMore, false);
+
+    EXPECT_THAT(ctx->recordIdsAndTenantIds, SizeIs(1));
+    EXPECT_THAT(ctx->packageIds, SizeIs(1));
+    EXPECT_THAT(ctx->packageSizes, ElementsAre(4u));
+}
+
+TEST(UploadRetryCacheTests, EvictsOldestAndExpiredBodies)
+{
+    UploadRetryCache cache;
+    cache.Configure(10, 1000);
+    std::map<std::string, TenantTokenHandle> a{ { "a", 0 } }, b{ { "b", 0 } }, c{ { "c", 0 } };
+    std::vector<uint8_t> body;
+    bool compressed = false;
+
+    EXPECT_THAT(cache.Store(a, std::vector<uint8_t>(4), false, 100), true);
+    EXPECT_THAT(cache.Store(b, std::vector<uint8_t>(4), false, 200), true);
+    EXPECT_THAT(cache.Store(c, std::vector<uint8_t>(11), false, 300), false);
+    EXPECT_THAT(cache.Store(c, std::vector<uint8_t>(4), true, 300), true);
+    EXPECT_THAT(cache.GetCount(), 2u);
+    EXPECT_THAT(cache.GetSize(), 8u);
+    EXPECT_THAT(cache.Take(a, body, compressed, 400), false);
+
+    // b is too old at 1201
+    EXPECT_THAT(cache.Take(b, body, compressed, 1201), false);
+    EXPECT_THAT(cache.Take(c, body, compressed, 1201), true);
+    EXPECT_THAT(body, SizeIs(4));
+    EXPECT_THAT(compressed, true);
+    EXPECT_THAT(cache.GetSize(), 0u);
+}
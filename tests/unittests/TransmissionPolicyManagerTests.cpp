@@ -37,6 +37,9 @@ class TransmissionPolicyManager4Test : public TransmissionPolicyManager {
     using TransmissionPolicyManager::removeUpload;
     using TransmissionPolicyManager::getCancelWaitTime;
     using TransmissionPolicyManager::cancelUploadTask;
+    using TransmissionPolicyManager::configureBandwidthLimiter;
+    using TransmissionPolicyManager::configureDrainMode;
+    using TransmissionPolicyManager::configureImmediateBatch;
 
     using TransmissionPolicyManager::m_backoff;
     using TransmissionPolicyManager::m_isPaused;
@@ -46,6 +49,7 @@ class TransmissionPolicyManager4Test : public TransmissionPolicyManager {
     using TransmissionPolicyManager::m_timerdelay;
     using TransmissionPolicyManager::m_runningLatency;
     using TransmissionPolicyManager::m_backoffConfig;
+    using TransmissionPolicyManager::m_deadlineScheduler;
 
     MOCK_METHOD3(scheduleUpload, void(const std::chrono::milliseconds&, EventLatency,bool));
     MOCK_METHOD1(uploadAsync, void(EventLatency));
@@ -248,6 +252,62 @@ TEST_F(TransmissionPolicyManagerTests, ImmediateIncomingEventStartsUploadImmedia
     EXPECT_THAT(upload->requestedMinLatency, EventLatency_Max);
 }
 
+TEST_F(TransmissionPolicyManagerTests, ImmediateIncomingEventsAreCoalescedWithinWindow)
+{
+    tpm.paused(false);
+    auto& config = testing::getSystem().getConfig();
+    config[CFG_MAP_TPM][CFG_INT_TPM_IMMEDIATE_BATCH_MS] = 50;
+    tpm.configureImmediateBatch();
+
+    std::atomic<int> uploads(0);
+    EventsUploadContextPtr upload;
+    EXPECT_CALL(*this, resultInitiateUpload(_))
+        .WillOnce(DoAll(SaveArg<0>(&upload), InvokeWithoutArgs([&uploads]() { uploads++; })));
+    for (int i = 0; i < 3; i++)
+    {
+        auto event = new IncomingEventContext();
+        event->record.latency = EventLatency_Max;
+        tpm.eventArrived(event);
+    }
+    EXPECT_THAT(uploads.load(), 0);
+
+    for (int i = 0; (i < 100) && (uploads == 0); i++)
+    {
+        PAL::sleep(10);
+    }
+    EXPECT_THAT(uploads.load(), 1);
+    ASSERT_THAT(upload, NotNull());
+    EXPECT_THAT(upload->requestedMinLatency, EventLatency_Max);
+    config[CFG_MAP_TPM][CFG_INT_TPM_IMMEDIATE_BATCH_MS] = 0;
+    tpm.configureImmediateBatch();
+}
+
+TEST_F(TransmissionPolicyManagerTests, FullImmediateBatchStartsUploadImmediately)
+{
+    tpm.paused(false);
+    auto& config = testing::getSystem().getConfig();
+    config[CFG_MAP_TPM][CFG_INT_TPM_IMMEDIATE_BATCH_MS] = 60000;
+    config[CFG_MAP_TPM][CFG_INT_TPM_IMMEDIATE_BATCH_COUNT] = 3;
+    tpm.configureImmediateBatch();
+
+    for (int i = 0; i < 2; i++)
+    {
+        auto event = new IncomingEventContext();
+        event->record.latency = EventLatency_Max;
+        tpm.eventArrived(event);
+    }
+
+    EXPECT_CALL(*this, resultInitiateUpload(_))
+        .WillOnce(Return());
+    auto event = new IncomingEventContext();
+    event->record.latency = EventLatency_Max;
+    tpm.eventArrived(event);
+
+    config[CFG_MAP_TPM][CFG_INT_TPM_IMMEDIATE_BATCH_MS] = 0;
+    config[CFG_MAP_TPM][CFG_INT_TPM_IMMEDIATE_BATCH_COUNT] = 0;
+    tpm.configureImmediateBatch();
+}
+
 TEST_F(TransmissionPolicyManagerTests, UploadDoesNothingWhenPaused)
 {
     tpm.uploadScheduled(true);
@@ -330,6 +390,52 @@ TEST_F(TransmissionPolicyManagerTests, SuccessfulUploadSchedulesNextOneImmediate
     tpm.eventsUploadSuccessful(upload);
 }
 
+TEST_F(TransmissionPolicyManagerTests, DispatchedFullPackagePrefetchesNextOne)
+{
+    tpm.paused(false);
+    auto upload = tpm.fakeActiveUpload(EventLatency_Normal);
+    upload->packageFull = true;
+    EXPECT_CALL(tpm, scheduleUpload(std::chrono::milliseconds{ 0 }, EventLatency_Normal, false))
+        .WillOnce(Return());
+    EXPECT_THAT(tpm.uploadDispatched(upload), true);
+}
+
+TEST_F(TransmissionPolicyManagerTests, DispatchedFullPackageKeepsScheduledLowerLatencyUpload)
+{
+    tpm.paused(false);
+    tpm.uploadScheduled(true);
+    tpm.runningLatency(EventLatency_Normal);
+    auto upload = tpm.fakeActiveUpload(EventLatency_Max);
+    upload->packageFull = true;
+    EXPECT_CALL(tpm, scheduleUpload(_, _, _))
+        .Times(0);
+    EXPECT_THAT(tpm.uploadDispatched(upload), true);
+    EXPECT_THAT(tpm.uploadScheduled(), true);
+    tpm.uploadScheduled(false);
+}
+
+TEST_F(TransmissionPolicyManagerTests, DispatchedFullPackagePrefetchesOverScheduledHigherLatencyUpload)
+{
+    tpm.paused(false);
+    tpm.uploadScheduled(true);
+    tpm.runningLatency(EventLatency_RealTime);
+    auto upload = tpm.fakeActiveUpload(EventLatency_Normal);
+    upload->packageFull = true;
+    EXPECT_CALL(tpm, scheduleUpload(std::chrono::milliseconds{ 0 }, EventLatency_Normal, false))
+        .WillOnce(Return());
+    EXPECT_THAT(tpm.uploadDispatched(upload), true);
+    tpm.uploadScheduled(false);
+}
+
+TEST_F(TransmissionPolicyManagerTests, DispatchedPartialPackageDoesNotPrefetch)
+{
+    tpm.paused(false);
+    auto upload = tpm.fakeActiveUpload(EventLatency_Normal);
+    EXPECT_CALL(tpm, scheduleUpload(_, _, _))
+        .Times(0);
+    EXPECT_THAT(tpm.uploadDispatched(upload), true);
+}
+
 #if 0
 TEST_F(TransmissionPolicyManagerTests, RejectedUploadSchedulesNextOneWithLargerDelay)
 {
@@ -624,3 +730,353 @@ TEST_F(TransmissionPolicyManagerTests, increaseBackoff_CalledTwice_ReturnsHigher
     auto first = tpm.increaseBackoff();
     ASSERT_GT(tpm.increaseBackoff(), first);
 }
+
+TEST_F(TransmissionPolicyManagerTests, UploadWaitsForTheRateLimit)
+{
+    auto& config = testing::getSystem().getConfig();
+    config[CFG_MAP_TPM][CFG_INT_TPM_MAX_UPLOAD_BPS] = 1000;
+    tpm.configureBandwidthLimiter();
+    tpm.uploadScheduled(true);
+    tpm.paused(false);
+
+    EventsUploadContextPtr upload;
+    EXPECT_CALL(*this, resultInitiateUpload(_))
+        .WillOnce(SaveArg<0>(&upload));
+    tpm.uploadAsyncParent(EventLatency_Normal);
+    ASSERT_THAT(upload, NotNull());
+
+    // 3000 bytes leave the bucket 2000 bytes in debt, i.e. 2 seconds
+    upload->body.resize(3000);
+    tpm.uploadDispatched(upload);
+    EXPECT_CALL(tpm, scheduleUpload(AllOf(Ge(std::chrono::milliseconds { 1900 }), Le(std::chrono::milliseconds { 2001 })), EventLatency_Normal, false))
+        .WillOnce(Return());
+    tpm.uploadAsyncParent(EventLatency_Normal);
+
+    config[CFG_MAP_TPM][CFG_INT_TPM_MAX_UPLOAD_BPS] = 0;
+    tpm.configureBandwidthLimiter();
+}
+
+TEST_F(TransmissionPolicyManagerTests, TenantOverItsRateIsDeferred)
+{
+    auto& config = testing::getSystem().getConfig();
+    config[CFG_MAP_TPM][CFG_MAP_TPM_TENANT_UPLOAD_BPS] = { { "tenant1-token", 1000 } };
+    tpm.configureBandwidthLimiter();
+    tpm.uploadScheduled(true);
+    tpm.paused(false);
+
+    EventsUploadContextPtr upload;
+    EXPECT_CALL(*this, resultInitiateUpload(_))
+        .WillOnce(SaveArg<0>(&upload));
+    tpm.uploadAsyncParent(EventLatency_Normal);
+    ASSERT_THAT(upload, NotNull());
+    EXPECT_THAT(upload->deferredTenants, IsEmpty());
+
+    // tenant1 sent 3/4 of a compressed body of 2000 bytes
+    upload->packageIds = { { "tenant1-token", 0 }, { "tenant2-token", 1 } };
+    upload->packageSizes = { 3000, 1000 };
+    upload->body.resize(2000);
+    tpm.uploadDispatched(upload);
+
+    EXPECT_CALL(*this, resultInitiateUpload(_))
+        .WillOnce(SaveArg<0>(&upload));
+    tpm.uploadAsyncParent(EventLatency_Normal);
+    EXPECT_THAT(upload->deferredTenants, ElementsAre("tenant1-token"));
+
+    // Nothing else to upload: look again once the debt of 500 bytes of tenant1 is repaid
+    EXPECT_CALL(tpm, scheduleUpload(AllOf(Ge(std::chrono::milliseconds { 400 }), Le(std::chrono::milliseconds { 501 })), _, false))
+        .WillOnce(Return());
+    tpm.nothingToUpload(upload);
+
+    VariantMap& tpmConfig = config[CFG_MAP_TPM];
+    tpmConfig.erase(CFG_MAP_TPM_TENANT_UPLOAD_BPS);
+    tpm.configureBandwidthLimiter();
+}
+
+TEST_F(TransmissionPolicyManagerTests, BacklogIsDrainedWithoutTimerPauses)
+{
+    auto& config = testing::getSystem().getConfig();
+    config[CFG_MAP_TPM][CFG_INT_TPM_DRAIN_THRESHOLD] = 1000;
+    tpm.configureDrainMode();
+    tpm.paused(false);
+
+    // Below the threshold, a partial package does not start the next one
+    auto upload = tpm.fakeActiveUpload(EventLatency_Normal);
+    upload->storedRecordCount = 999;
+    EXPECT_CALL(tpm, scheduleUpload(_, _, _))
+        .Times(0);
+    EXPECT_THAT(tpm.uploadDispatched(upload), true);
+    Mock::VerifyAndClearExpectations(&tpm);
+
+    // Above it, every upload starts the next one, and Normal latency is not skipped
+    upload->storedRecordCount = 1000;
+    EXPECT_CALL(tpm, scheduleUpload(std::chrono::milliseconds{ 0 }, EventLatency_Normal, false))
+        .Times(2);
+    EXPECT_THAT(tpm.uploadDispatched(upload), true);
+    tpm.runningLatency(EventLatency_Normal);
+    tpm.eventsUploadSuccessful(upload);
+    Mock::VerifyAndClearExpectations(&tpm);
+
+    // Drained
+    upload = tpm.fakeActiveUpload(EventLatency_Normal);
+    EXPECT_CALL(tpm, scheduleUpload(_, _, _))
+        .Times(0);
+    tpm.nothingToUpload(upload);
+    upload = tpm.fakeActiveUpload(EventLatency_Normal);
+    EXPECT_THAT(tpm.uploadDispatched(upload), true);
+
+    config[CFG_MAP_TPM][CFG_INT_TPM_DRAIN_THRESHOLD] = 0;
+    tpm.configureDrainMode();
+}
+
+TEST_F(TransmissionPolicyManagerTests, DrainingWaitsForTheDrainRate)
+{
+    auto& config = testing::getSystem().getConfig();
+    config[CFG_MAP_TPM][CFG_INT_TPM_DRAIN_THRESHOLD] = 1000;
+    config[CFG_MAP_TPM][CFG_INT_TPM_DRAIN_MAX_BPS] = 1000;
+    tpm.configureDrainMode();
+    tpm.uploadScheduled(true);
+    tpm.paused(false);
+
+    EventsUploadContextPtr upload;
+    EXPECT_CALL(*this, resultInitiateUpload(_))
+        .WillOnce(SaveArg<0>(&upload));
+    tpm.uploadAsyncParent(EventLatency_Normal);
+    ASSERT_THAT(upload, NotNull());
+
+    // 3000 bytes leave the drain bucket 2000 bytes in debt, i.e. 2 seconds
+    upload->storedRecordCount = 5000;
+    upload->body.resize(3000);
+    EXPECT_CALL(tpm, scheduleUpload(std::chrono::milliseconds{ 0 }, EventLatency_Normal, false))
+        .WillOnce(Return());
+    tpm.uploadDispatched(upload);
+    EXPECT_CALL(tpm, scheduleUpload(AllOf(Ge(std::chrono::milliseconds { 1900 }), Le(std::chrono::milliseconds { 2001 })), EventLatency_Normal, false))
+        .WillOnce(Return());
+    tpm.uploadAsyncParent(EventLatency_Normal);
+
+    config[CFG_MAP_TPM][CFG_INT_TPM_DRAIN_THRESHOLD] = 0;
+    config[CFG_MAP_TPM][CFG_INT_TPM_DRAIN_MAX_BPS] = 0;
+    tpm.configureDrainMode();
+}
+
+TEST_F(TransmissionPolicyManagerTests, DeadlineSchedulingUploadsAtTheEarliestDeadline)
+{
+    std::string customProfile = R"(
+        [
+            {
+                "name": "Fred",
+                "rules": [
+                    {"timers": [ 4, 2, 1 ]}
+                ]
+            }
+        ]
+    )";
+    EXPECT_TRUE(TransmitProfiles::load(customProfile));
+    EXPECT_TRUE(TransmitProfiles::setProfile("Fred"));
+    tpm.m_deadlineScheduler.Configure(true);
+    tpm.paused(false);
+
+    // Normal events wait up to 4 seconds
+    auto event = new IncomingEventContext();
+    event->record.latency = EventLatency_Normal;
+    EXPECT_CALL(tpm, scheduleUpload(AllOf(Ge(std::chrono::milliseconds { 3900 }), Le(std::chrono::milliseconds { 4000 })), EventLatency_Normal, false))
+        .WillOnce(Return());
+    tpm.eventArrived(event);
+    Mock::VerifyAndClearExpectations(&tpm);
+
+    // A RealTime event moves the upload forward to its 1 second deadline, Normal events ride along
+    tpm.uploadScheduled(true);
+    tpm.runningLatency(EventLatency_Normal);
+    tpm.m_scheduledUploadTime = PAL::getMonotonicTimeMs() + 4000;
+    event = new IncomingEventContext();
+    event->record.latency = EventLatency_RealTime;
+    EXPECT_CALL(tpm, scheduleUpload(AllOf(Ge(std::chrono::milliseconds { 900 }), Le(std::chrono::milliseconds { 1000 })), EventLatency_Normal, true))
+        .WillOnce(Return());
+    tpm.eventArrived(event);
+    Mock::VerifyAndClearExpectations(&tpm);
+
+    // An upload scheduled for RealTime only is rescheduled to take Normal events along
+    tpm.runningLatency(EventLatency_RealTime);
+    event = new IncomingEventContext();
+    event->record.latency = EventLatency_Normal;
+    EXPECT_CALL(tpm, scheduleUpload(Le(std::chrono::milliseconds { 1000 }), EventLatency_Normal, true))
+        .WillOnce(Return());
+    tpm.eventArrived(event);
+    Mock::VerifyAndClearExpectations(&tpm);
+
+    // The upload takes every pending event, a partial package leaves nothing to schedule
+    EventsUploadContextPtr upload;
+    EXPECT_CALL(*this, resultInitiateUpload(_))
+        .WillOnce(SaveArg<0>(&upload));
+    tpm.uploadAsyncParent(EventLatency_Normal);
+    ASSERT_THAT(upload, NotNull());
+    EXPECT_THAT(tpm.m_deadlineScheduler.GetPendingCount(), 0u);
+    EXPECT_CALL(tpm, scheduleUpload(_, _, _))
+        .Times(0);
+    tpm.eventsUploadSuccessful(upload);
+    Mock::VerifyAndClearExpectations(&tpm);
+
+    // Events filling a package are uploaded right away
+    event = new IncomingEventContext();
+    event->record.latency = EventLatency_RealTime;
+    event->record.blob.resize(testing::getSystem().getConfig().GetMaximumUploadSizeBytes());
+    EXPECT_CALL(tpm, scheduleUpload(std::chrono::milliseconds { 0 }, EventLatency_RealTime, false))
+        .WillOnce(Return());
+    tpm.eventArrived(event);
+
+    tpm.m_deadlineScheduler.Configure(false);
+    TransmitProfiles::reset();
+}
+
+namespace {
+
+    // Request durations on a link of capacityBytesPerMs shared by all requests in flight
+    unsigned simulateRound(UploadController& controller, unsigned baseDurationMs, unsigned capacityBytesPerMs)
+    {
+        unsigned pending = controller.GetMaxPendingRequests();
+        unsigned size = controller.GetUploadSize();
+        unsigned durationMs = baseDurationMs + static_cast<unsigned>((static_cast<uint64_t>(pending) * size) / capacityBytesPerMs);
+        for (unsigned i = 0; i < pending; i++)
+        {
+            controller.OnUploadSucceeded(size, durationMs, true);
+        }
+        return durationMs;
+    }
+
+}
+
+TEST(UploadControllerTests, DisabledProposesConfiguredLimits)
+{
+    UploadController controller;
+    controller.Configure(false, 1000000, 4);
+    controller.OnUploadFailed();
+    controller.OnUploadSucceeded(1000000, 100000, true);
+    EXPECT_THAT(controller.GetUploadSize(), 1000000u);
+    EXPECT_THAT(controller.GetMaxPendingRequests(), 4u);
+}
+
+TEST(UploadControllerTests, ApproachesLinkCapacityAndBacksOff)
+{
+    UploadController controller;
+    controller.Configure(true, 1000000, 4);
+    EXPECT_THAT(controller.GetUploadSize(), 62500u);
+    EXPECT_THAT(controller.GetMaxPendingRequests(), 1u);
+
+    // 100 ms round trip, 2 MB/s: the bandwidth-delay product is 200 KB
+    unsigned durationMs = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        durationMs = simulateRound(controller, 100, 2000);
+    }
+    uint64_t window = static_cast<uint64_t>(controller.GetMaxPendingRequests()) * controller.GetUploadSize();
+    uint64_t throughput = window / durationMs;
+    EXPECT_THAT(throughput, Ge(1400u));
+    EXPECT_THAT(durationMs, Le(1100u));
+
+    // Injected latency inflates durations far beyond the baseline
+    for (int i = 0; i < 10; i++)
+    {
+        simulateRound(controller, 2000, 2000);
+    }
+    uint64_t congested = static_cast<uint64_t>(controller.GetMaxPendingRequests()) * controller.GetUploadSize();
+    EXPECT_THAT(congested, Lt(window));
+
+    // Failures halve the window, down to the smallest package
+    for (int i = 0; i < 10; i++)
+    {
+        controller.OnUploadFailed();
+    }
+    EXPECT_THAT(controller.GetUploadSize(), 62500u);
+    EXPECT_THAT(controller.GetMaxPendingRequests(), 1u);
+}
+
+TEST(BandwidthControllerTokenBucketTests, PacesToTheConfiguredRate)
+{
+    BandwidthController_TokenBucket limiter;
+    EXPECT_THAT(limiter.IsEnabled(), false);
+    EXPECT_THAT(limiter.GetDelayMs(0), 0u);
+
+    // 100 KB/s with a 20 KB burst, fed with 30 KB packages for a minute
+    limiter.Configure(100000, 20000, 0);
+    uint64_t now = 0;
+    uint64_t sent = 0;
+    while (now < 60000)
+    {
+        uint64_t delayMs = limiter.GetDelayMs(now);
+        if (delayMs != 0)
+        {
+            now += delayMs;
+            continue;
+        }
+        limiter.OnBytesSent(30000, now);
+        sent += 30000;
+        now += 5;
+    }
+    // The burst and the last package may exceed the rate, nothing else
+    EXPECT_THAT(sent, Le(100000u * 60 + 20000 + 30000));
+    EXPECT_THAT(sent, Ge(100000u * 59));
+}
+
+TEST(BandwidthControllerTokenBucketTests, LimitsTenantsSeparately)
+{
+    BandwidthController_TokenBucket limiter;
+    limiter.SetTenantLimit("tenant1-token", 1000, 0, 0);
+    EXPECT_THAT(limiter.IsEnabled(), true);
+    EXPECT_THAT(limiter.GetProposedBandwidthBps(), std::numeric_limits<unsigned>::max());
+
+    limiter.OnTenantBytesSent("tenant1-token", 1500, 0);
+    limiter.OnTenantBytesSent("tenant2-token", 100000, 0);
+    EXPECT_THAT(limiter.GetDelayMs(0), 0u);
+    EXPECT_THAT(limiter.GetTenantDelayMs("tenant1-token", 0), 501u);
+    EXPECT_THAT(limiter.GetTenantDelayMs("tenant2-token", 0), 0u);
+    EXPECT_THAT(limiter.GetDeferredTenants(250), ElementsAre("tenant1-token"));
+    EXPECT_THAT(limiter.GetDeferredTenants(501), IsEmpty());
+
+    // A full bucket does not grow beyond the burst
+    EXPECT_THAT(limiter.GetTenantDelayMs("tenant1-token", 100000), 0u);
+    limiter.OnTenantBytesSent("tenant1-token", 1001, 100000);
+    EXPECT_THAT(limiter.GetTenantDelayMs("tenant1-token", 100000), 2u);
+}
+
+TEST(DeadlineSchedulerTests, EarliestDeadlineOrFullPackageComesFirst)
+{
+    DeadlineScheduler scheduler;
+    scheduler.Configure(true);
+    scheduler.SetDeadlines(10000, 2000);
+    EventLatency latency = EventLatency_Off;
+    uint64_t dueTime = 0;
+    EXPECT_THAT(scheduler.GetNextUpload(1000, latency, dueTime, 0), false);
+
+    // The first event of a latency sets its deadline
+    scheduler.OnEventStored(EventLatency_Normal, 100, 0);
+    scheduler.OnEventStored(EventLatency_Normal, 100, 5000);
+    EXPECT_THAT(scheduler.GetNextUpload(1000, latency, dueTime, 5000), true);
+    EXPECT_THAT(dueTime, 10000u);
+    EXPECT_THAT(latency, EventLatency_Normal);
+
+    // An earlier RealTime deadline takes the Normal events along
+    scheduler.OnEventStored(EventLatency_RealTime, 100, 6000);
+    EXPECT_THAT(scheduler.GetNextUpload(1000, latency, dueTime, 6000), true);
+    EXPECT_THAT(dueTime, 8000u);
+    EXPECT_THAT(latency, EventLatency_Normal);
+
+    // A full package is due now, and so are missed deadlines
+    scheduler.OnEventStored(EventLatency_RealTime, 700, 7000);
+    EXPECT_THAT(scheduler.GetNextUpload(1000, latency, dueTime, 7000), true);
+    EXPECT_THAT(dueTime, 7000u);
+    EXPECT_THAT(scheduler.GetNextUpload(2000, latency, dueTime, 9000), true);
+    EXPECT_THAT(dueTime, 9000u);
+
+    // A RealTime upload leaves the Normal events pending
+    scheduler.OnUploadStarted(EventLatency_RealTime);
+    EXPECT_THAT(scheduler.GetPendingCount(), 2u);
+    EXPECT_THAT(scheduler.GetNextUpload(1000, latency, dueTime, 9000), true);
+    EXPECT_THAT(dueTime, 10000u);
+    scheduler.OnUploadStarted(EventLatency_Normal);
+    EXPECT_THAT(scheduler.GetNextUpload(1000, latency, dueTime, 9000), false);
+
+    // Latencies without a deadline and Max latency events are not tracked
+    scheduler.SetDeadlines(-1, 2000);
+    scheduler.OnEventStored(EventLatency_Normal, 100, 9000);
+    scheduler.OnEventStored(EventLatency_Max, 100, 9000);
+    EXPECT_THAT(scheduler.GetPendingCount(), 0u);
+}
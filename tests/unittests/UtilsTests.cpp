@@ -7,6 +7,9 @@
 #include <utils/Utils.hpp>
 #include "CorrelationVector.hpp"
 
+#include <atomic>
+#include <thread>
+
 using namespace testing;
 using namespace MAT;
 
@@ -69,3 +72,68 @@ TEST(UtilsTests, TestValidatePropertyName)
 	EXPECT_TRUE(validatePropertyName(CorrelationVector::PropertyName));
 }
 
+
+TEST(UtilsTests, InternTenantToken)
+{
+	EXPECT_EQ(0u, internTenantToken(""));
+	EXPECT_EQ("", resolveTenantToken(0));
+
+	auto handle = internTenantToken("6d084bbf6a9644ef83f40a77c9e34580-c2d379e0-4408-4325-9b4d-2a7d78131e14-7322");
+	EXPECT_NE(0u, handle);
+	EXPECT_EQ(handle, internTenantToken(std::string("6d084bbf6a9644ef83f40a77c9e34580-c2d379e0-4408-4325-9b4d-2a7d78131e14-7322")));
+	EXPECT_NE(handle, internTenantToken("another-tenant-token"));
+	EXPECT_EQ("6d084bbf6a9644ef83f40a77c9e34580-c2d379e0-4408-4325-9b4d-2a7d78131e14-7322", resolveTenantToken(handle));
+
+	// Unknown handles resolve to the empty token
+	EXPECT_EQ("", resolveTenantToken(0xFFFFFFFF));
+}
+
+TEST(UtilsTests, ResolveTenantTokenWhileInterning)
+{
+	std::atomic<bool> done(false);
+	std::atomic<unsigned> mismatches(0);
+	TenantTokenHandle first = internTenantToken("concurrent-tenant-0");
+
+	// Lookups take no lock, the tokens interned so far resolve while the table grows
+	std::thread reader([&]() {
+		while (!done)
+		{
+			for (TenantTokenHandle handle = first; handle < first + 1000; handle++)
+			{
+				std::string const& token = resolveTenantToken(handle);
+				if (!token.empty() && (token.compare(0, 18, "concurrent-tenant-") != 0))
+				{
+					mismatches++;
+				}
+			}
+		}
+	});
+	for (int i = 1; i < 1000; i++)
+	{
+		internTenantToken("concurrent-tenant-" + std::to_string(i));
+	}
+	done = true;
+	reader.join();
+
+	EXPECT_EQ(0u, mismatches.load());
+	for (int i = 0; i < 1000; i++)
+	{
+		EXPECT_EQ("concurrent-tenant-" + std::to_string(i), resolveTenantToken(internTenantToken("concurrent-tenant-" + std::to_string(i))));
+	}
+}
+
+TEST(UtilsTests, InternTenantTokenGrowsPastFirstChunks)
+{
+	// More tokens than 1024 chunks of 256 held before, each still gets its own handle
+	TenantTokenHandle last = 0;
+	for (int i = 0; i < 300000; i++)
+	{
+		TenantTokenHandle handle = internTenantToken("many-tenant-" + std::to_string(i));
+		ASSERT_NE(0u, handle);
+		ASSERT_NE(last, handle);
+		last = handle;
+	}
+	EXPECT_EQ("many-tenant-299999", resolveTenantToken(last));
+	EXPECT_EQ("many-tenant-0", resolveTenantToken(internTenantToken("many-tenant-0")));
+	EXPECT_EQ("many-tenant-262144", resolveTenantToken(internTenantToken("many-tenant-262144")));
+}
@@ -14,3 +14,45 @@ TEST(ZlibUtilsTests, InflateVector)
     ZlibUtils::InflateVector(compressed, inflated, true);
     ASSERT_EQ(uncompressed, inflated);
 }
+
+TEST(ZlibUtilsTests, DeflateVectorRoundTrip)
+{
+    std::vector<uint8_t> uncompressed;
+    for (size_t i = 0; i < 65536; i++)
+    {
+        uncompressed.push_back(static_cast<uint8_t>(i % 17));
+    }
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(ZlibUtils::DeflateVector(uncompressed, compressed, Z_BEST_SPEED));
+    EXPECT_LT(compressed.size(), uncompressed.size());
+
+    std::vector<uint8_t> inflated;
+    ASSERT_TRUE(ZlibUtils::InflateVector(compressed, inflated, false));
+    ASSERT_EQ(uncompressed, inflated);
+}
+
+TEST(ZlibUtilsTests, InflaterIsReusedAcrossPayloads)
+{
+    ZlibInflater inflater;
+    for (size_t size : { 65536u, 100u, 4096u })
+    {
+        std::vector<uint8_t> uncompressed;
+        for (size_t i = 0; i < size; i++)
+        {
+            uncompressed.push_back(static_cast<uint8_t>(i % 13));
+        }
+        std::vector<uint8_t> data;
+        ASSERT_TRUE(ZlibUtils::DeflateVector(uncompressed, data, Z_BEST_SPEED));
+        size_t deflatedSize = data.size();
+        // Trailing bytes after the deflate stream are left out
+        data.push_back(42);
+        ASSERT_TRUE(inflater.Inflate(data, deflatedSize, uncompressed.size()));
+        ASSERT_EQ(uncompressed, data);
+    }
+
+    // A wrong size fails instead of truncating the payload
+    std::vector<uint8_t> uncompressed(1000, 7);
+    std::vector<uint8_t> data;
+    ASSERT_TRUE(ZlibUtils::DeflateVector(uncompressed, data, Z_BEST_SPEED));
+    EXPECT_FALSE(inflater.Inflate(data, data.size(), 999));
+}